@@ -13,11 +13,33 @@
 #define MEMORY_TRACKING_SETUP 1
 #endif
 
+// live heap statistics (Memory_GetStats) are cheap enough to leave on in
+// production, set MEMORY_STATS to 0 to remove them entirely
+#ifndef MEMORY_STATS
+#define MEMORY_STATS 1
+#endif
+
 typedef void* (*Memory_MallocFunc)(size_t size);
 typedef void* (*Memory_AallocFunc)(size_t size, size_t align);
 typedef void* (*Memory_CallocFunc)(size_t count, size_t size);
 typedef void* (*Memory_ReallocFunc)(void* memory, size_t size);
 typedef void (*Memory_Free)(void* memory);
+// size must be the size the block was allocated (or last realloced/expanded) with
+typedef void (*Memory_FreeSizedFunc)(void* memory, size_t size);
+// how many bytes the block can really hold, 0 if the allocator can't tell
+typedef size_t (*Memory_UsableSizeFunc)(void const* memory);
+// grows the block to at least size without moving it, false if it can't
+typedef bool (*Memory_TryExpandInPlaceFunc)(void* memory, size_t size);
+// realloc that keeps align, memory must have come from aalloc/arealloc with the same align
+// (or malloc/realloc if align <= 16)
+typedef void* (*Memory_AreallocFunc)(void* memory, size_t size, size_t align);
+// count blocks of the same size into outPtrs, all or nothing (outPtrs is all NULL on failure)
+typedef bool (*Memory_MallocBatchFunc)(size_t count, size_t size, void** outPtrs);
+// NULLs in ptrs are skipped
+typedef void (*Memory_FreeBatchFunc)(size_t count, void** ptrs);
+// true if memory is one of the allocators blocks. Any thread can ask about any
+// pointer, so it must be thread safe and must not allocate
+typedef bool (*Memory_OwnsFunc)(void const* memory);
 
 typedef struct Memory_Allocator {
 	Memory_MallocFunc malloc;
@@ -25,31 +47,154 @@ typedef struct Memory_Allocator {
 	Memory_CallocFunc calloc;
 	Memory_ReallocFunc realloc;
 	Memory_Free free;
+	// optional, can be left NULL by custom allocators
+	Memory_FreeSizedFunc freeSized;
+	Memory_UsableSizeFunc usableSize;
+	Memory_TryExpandInPlaceFunc tryExpandInPlace;
+	Memory_AreallocFunc arealloc;
+	Memory_MallocBatchFunc mallocBatch;
+	Memory_FreeBatchFunc freeBatch;
+	// needed to push it on the allocator stack
+	Memory_OwnsFunc owns;
 } Memory_Allocator;
 
-// always returns true
+AL2O3_FORCE_INLINE void Memory_AllocatorFreeSized(Memory_Allocator const* allocator, void* memory, size_t size) {
+	if (allocator->freeSized) {
+		allocator->freeSized(memory, size);
+	} else {
+		allocator->free(memory);
+	}
+}
+AL2O3_FORCE_INLINE size_t Memory_AllocatorUsableSize(Memory_Allocator const* allocator, void const* memory) {
+	return allocator->usableSize ? allocator->usableSize(memory) : 0;
+}
+AL2O3_FORCE_INLINE bool Memory_AllocatorTryExpandInPlace(Memory_Allocator const* allocator, void* memory, size_t size) {
+	return allocator->tryExpandInPlace ? allocator->tryExpandInPlace(memory, size) : false;
+}
+// without an arealloc we need the usable size to know how much to copy
+AL2O3_FORCE_INLINE void* Memory_AllocatorArealloc(Memory_Allocator const* allocator, void* memory, size_t size, size_t align) {
+	if (allocator->arealloc) {
+		return allocator->arealloc(memory, size, align);
+	}
+	if (memory == NULL) {
+		return allocator->aalloc(size, align);
+	}
+	size_t const oldSize = Memory_AllocatorUsableSize(allocator, memory);
+	if (oldSize == 0) {
+		return NULL;
+	}
+	if (size <= oldSize || Memory_AllocatorTryExpandInPlace(allocator, memory, size)) {
+		return memory;
+	}
+	void* mem = allocator->aalloc(size, align);
+	if (mem) {
+		memcpy(mem, memory, oldSize);
+		allocator->free(memory);
+	}
+	return mem;
+}
+
+// many blocks of one size for the cost of a few allocations, the allocators
+// batch functions are used if it has them otherwise one block at a time.
+// Every block has the same source location. Blocks can be freed singly or in
+// batches of any mix
+AL2O3_EXTERN_C bool Memory_MallocBatch(Memory_Allocator const* allocator, size_t count, size_t size, void** outPtrs);
+AL2O3_EXTERN_C void Memory_FreeBatch(Memory_Allocator const* allocator, size_t count, void** ptrs);
+
+// where an allocation came from. The MEMORY_ALLOCATOR_ macros give every call
+// site its own static one, so telling the tracker is a single thread local
+// store. The tracker hands out a small dense id the first time it sees one.
+typedef struct Memory_SrcLoc {
+	char const *sourceFile;
+	char const *sourceFunc;
+	uint32_t sourceLine;
+	uint32_t id; // 0 until first used, Memory_SrcLocNoId if the loc isn't static
+} Memory_SrcLoc;
+
+// for a loc that is reused or on the stack, it is matched by its strings instead
+#define Memory_SrcLocNoId 0xFFFFFFFFu
+
+// always returns true, the loc is used by the next allocation on this thread
+AL2O3_EXTERN_C bool Memory_TrackerPushSrcLoc(Memory_SrcLoc *loc);
+// always returns true, slower than Memory_TrackerPushSrcLoc as the loc has no id
 AL2O3_EXTERN_C bool Memory_TrackerPushNextSrcLoc(const char *sourceFile, const unsigned int sourceLine, const char *sourceFunc);
 
 // call this at exit, when tracking is on will log all non freed items, if no tracking does nothing
 AL2O3_EXTERN_C void Memory_TrackerDestroyAndLogLeaks();
 AL2O3_EXTERN_C uint64_t Memory_TrackerBreakOnAllocNumber; // set before the allocation occurs to break in memory tracking (0 disables)
 
+// how much work a tracking build does per allocation, can be changed at any
+// time. Blocks keep whatever was done for them when they were allocated, so
+// anything can be freed whatever the level is now.
+// Off: just the tracking header. Stats: adds Memory_GetStats counts.
+// Sampled: adds tracking of roughly one allocation per sample rate bytes.
+// Full: every allocation is tracked (the default).
+// Without tracking the level is fixed at Stats (or Off if MEMORY_STATS is 0)
+typedef enum Memory_TrackingLevel {
+	Memory_TrackingLevel_Off,
+	Memory_TrackingLevel_Stats,
+	Memory_TrackingLevel_Sampled,
+	Memory_TrackingLevel_Full,
+} Memory_TrackingLevel;
+
+AL2O3_EXTERN_C void Memory_TrackerSetLevel(Memory_TrackingLevel level);
+AL2O3_EXTERN_C Memory_TrackingLevel Memory_TrackerGetLevel();
+
+// the mean bytes between tracked allocations at Memory_TrackingLevel_Sampled,
+// 0 restores the default of 512KiB. Untracked allocations only get a header.
+// Callsite counts and sizes are scaled up to unbiased estimates of the whole
+// heap, leak reports only show the sampled allocations. Always 0 without tracking
+AL2O3_EXTERN_C void Memory_TrackerSetSampleRate(size_t sampleBytes);
+AL2O3_EXTERN_C size_t Memory_TrackerGetSampleRate();
+
+// 0 (the default) turns stack capture off, otherwise each tracked allocation
+// records up to depth return addresses (capped at Memory_TrackerMaxStackDepth).
+// Callsites are split by stack and the leak report and profile exports show
+// the stacks. Capture is costly, it is best combined with sampling
+#define Memory_TrackerMaxStackDepth 64
+AL2O3_EXTERN_C void Memory_TrackerSetStackDepth(uint32_t depth);
+// copies up to maxFrames return addresses innermost first, returns the depth of the stack
+AL2O3_EXTERN_C uint32_t Memory_TrackerGetStack(uint32_t stackId, void **frames, uint32_t maxFrames);
+// symbol+offset when the symbol is known, else module+offset or the raw address
+AL2O3_EXTERN_C size_t Memory_TrackerSymbolizeFrame(void const *frame, char *buffer, size_t size);
+
 AL2O3_EXTERN_C Memory_Allocator Memory_GlobalAllocator;
+// the platform heap (and large block mapping) with no tracking, stats or
+// tracing, for comparing allocators and for tools
+AL2O3_EXTERN_C Memory_Allocator Memory_PlatformAllocator;
 
 #if MEMORY_TRACKING_SETUP == 1
 
 #define Memory_TrackingPaddingSize 4
-#define MEMORY_ALLOCATOR_MALLOC(allocator, size) ((Memory_TrackerPushNextSrcLoc(__FILE__, __LINE__, __FUNCTION__)) ? (allocator)->malloc(size) : NULL)
-#define MEMORY_ALLOCATOR_AALLOC(allocator, size, align) ((Memory_TrackerPushNextSrcLoc(__FILE__, __LINE__, __FUNCTION__)) ? (allocator)->aalloc(size, align) : NULL)
-#define MEMORY_ALLOCATOR_CALLOC(allocator, count, size) ((Memory_TrackerPushNextSrcLoc(__FILE__, __LINE__, __FUNCTION__)) ? (allocator)->calloc(count, size) : NULL)
-#define MEMORY_ALLOCATOR_REALLOC(allocator, orig, size) ((Memory_TrackerPushNextSrcLoc(__FILE__, __LINE__, __FUNCTION__)) ? (allocator)->realloc(orig, size) : NULL)
+
+// a constant static Memory_SrcLoc for the enclosing call site
+#if defined(__GNUC__) || defined(__clang__)
+#define MEMORY_PUSH_SRC_LOC() Memory_TrackerPushSrcLoc(__extension__ ({ static Memory_SrcLoc memorySrcLoc_ = { __FILE__, __FUNCTION__, __LINE__, 0 }; &memorySrcLoc_; }))
+#elif defined(__cplusplus)
+#define MEMORY_PUSH_SRC_LOC() Memory_TrackerPushSrcLoc([](char const *func) { static Memory_SrcLoc memorySrcLoc_ = { __FILE__, func, __LINE__, 0 }; return &memorySrcLoc_; }(__FUNCTION__))
+#else
+#define MEMORY_PUSH_SRC_LOC() Memory_TrackerPushNextSrcLoc(__FILE__, __LINE__, __FUNCTION__)
+#endif
+#define MEMORY_ALLOCATOR_MALLOC(allocator, size) (MEMORY_PUSH_SRC_LOC() ? (allocator)->malloc(size) : NULL)
+#define MEMORY_ALLOCATOR_AALLOC(allocator, size, align) (MEMORY_PUSH_SRC_LOC() ? (allocator)->aalloc(size, align) : NULL)
+#define MEMORY_ALLOCATOR_CALLOC(allocator, count, size) (MEMORY_PUSH_SRC_LOC() ? (allocator)->calloc(count, size) : NULL)
+#define MEMORY_ALLOCATOR_REALLOC(allocator, orig, size) (MEMORY_PUSH_SRC_LOC() ? (allocator)->realloc(orig, size) : NULL)
+#define MEMORY_ALLOCATOR_AREALLOC(allocator, orig, size, align) (MEMORY_PUSH_SRC_LOC() ? Memory_AllocatorArealloc(allocator, orig, size, align) : NULL)
+#define MEMORY_ALLOCATOR_MALLOC_BATCH(allocator, count, size, outPtrs) (MEMORY_PUSH_SRC_LOC() ? Memory_MallocBatch(allocator, count, size, outPtrs) : false)
 #define MEMORY_ALLOCATOR_FREE(allocator, ptr) (allocator)->free(ptr)
 
 // to use tracking on custom allocated, add these in the same way trackedMalloc etc in memory.c does for the
-// default platform allocator (e.g. adjust size of alloc except aligned alloc and call tracked after ur custom alloc)
+// default platform allocator (e.g. adjust size of alloc and call tracked after ur custom alloc).
+// The tracker keeps a header in front of the reported address, so the memory handed back to your
+// free must be the one returned by Memory_TrackedFree (NULL means don't free it)
 AL2O3_FORCE_INLINE size_t Memory_TrackerCalculateActualSize(const size_t reportedSize) {
 	return reportedSize + Memory_TrackingPaddingSize * sizeof(uint32_t) * 2;
 }
+// aligned allocations put the header in the alignment gap, so need align bytes at the front
+AL2O3_FORCE_INLINE size_t Memory_TrackerCalculateActualAlignedSize(const size_t reportedSize, const size_t align) {
+	size_t const padding = Memory_TrackingPaddingSize * sizeof(uint32_t) * 2;
+	return reportedSize + ((align > padding) ? align : padding);
+}
 
 AL2O3_EXTERN_C void *Memory_TrackedAlloc(const char *sourceFile,
 																				 const unsigned int sourceLine,
@@ -60,14 +205,26 @@ AL2O3_EXTERN_C void *Memory_TrackedAAlloc(const char *sourceFile,
 																					const unsigned int sourceLine,
 																					const char *sourceFunc,
 																					const size_t reportedSize,
+																					const size_t align,
 																					void *actualSizedAllocation);
+// only for allocations from Memory_TrackedAlloc, actualSizedAllocation must hold the contents of the old
+// actual allocation (as realloc does)
 AL2O3_EXTERN_C void *Memory_TrackedRealloc(const char *sourceFile,
 																					 const unsigned int sourceLine,
 																					 const char *sourceFunc,
 																					 const size_t reportedSize,
 																					 void *reportedAddress,
 																					 void *actualSizedAllocation);
-AL2O3_EXTERN_C bool Memory_TrackedFree(const void *reportedAddress);
+// for allocations from Memory_TrackedAAlloc, align must be the same
+AL2O3_EXTERN_C void *Memory_TrackedARealloc(const char *sourceFile,
+																						const unsigned int sourceLine,
+																						const char *sourceFunc,
+																						const size_t reportedSize,
+																						const size_t align,
+																						void *reportedAddress,
+																						void *actualSizedAllocation);
+// returns the actual allocation to free
+AL2O3_EXTERN_C void *Memory_TrackedFree(const void *reportedAddress);
 
 #else
 
@@ -75,27 +232,351 @@ AL2O3_EXTERN_C bool Memory_TrackedFree(const void *reportedAddress);
 #define MEMORY_ALLOCATOR_AALLOC(allocator, size, align) (allocator)->aalloc(size, align)
 #define MEMORY_ALLOCATOR_CALLOC(allocator, count, size) (allocator)->calloc(count, size)
 #define MEMORY_ALLOCATOR_REALLOC(allocator, orig, size) (allocator)->realloc(orig, size)
+#define MEMORY_ALLOCATOR_AREALLOC(allocator, orig, size, align) Memory_AllocatorArealloc(allocator, orig, size, align)
+#define MEMORY_ALLOCATOR_MALLOC_BATCH(allocator, count, size, outPtrs) Memory_MallocBatch(allocator, count, size, outPtrs)
 #define MEMORY_ALLOCATOR_FREE(allocator, ptr) (allocator)->free(ptr)
 
 #define Memory_TrackerCalculateActualSize(reportedSize) (reportedSize)
+#define Memory_TrackerCalculateActualAlignedSize(reportedSize, align) (reportedSize)
 AL2O3_EXTERN_C void *Memory_TrackedAlloc(const char * a,const unsigned int b, const char * c, const size_t d, void * e);
-AL2O3_EXTERN_C void *Memory_TrackedAAlloc(const char * a, const unsigned int b, const char * c, const size_t d, void * e);
+AL2O3_EXTERN_C void *Memory_TrackedAAlloc(const char * a, const unsigned int b, const char * c, const size_t d, const size_t e, void * f);
 AL2O3_EXTERN_C void *Memory_TrackedRealloc(const char *a ,const unsigned int b, const char * c,const size_t d,void * e,void *f);
+AL2O3_EXTERN_C void *Memory_TrackedARealloc(const char *a ,const unsigned int b, const char * c,const size_t d,const size_t e,void * f,void *g);
+AL2O3_EXTERN_C void *Memory_TrackedFree(const void *a);
 
 #endif
 
-#define MEMORY_MALLOC(size) MEMORY_ALLOCATOR_MALLOC(&Memory_GlobalAllocator, size)
-#define MEMORY_AALLOC(size, align) MEMORY_ALLOCATOR_AALLOC(&Memory_GlobalAllocator, size, align)
-#define MEMORY_CALLOC(count, size) MEMORY_ALLOCATOR_CALLOC(&Memory_GlobalAllocator, count, size)
-#define MEMORY_REALLOC(orig, size) MEMORY_ALLOCATOR_REALLOC(&Memory_GlobalAllocator, orig, size)
-#define MEMORY_FREE(ptr) MEMORY_ALLOCATOR_FREE(&Memory_GlobalAllocator, ptr)
+// these never allocate so don't need a source location
+#define MEMORY_ALLOCATOR_FREE_SIZED(allocator, ptr, size) Memory_AllocatorFreeSized(allocator, ptr, size)
+#define MEMORY_ALLOCATOR_USABLE_SIZE(allocator, ptr) Memory_AllocatorUsableSize(allocator, ptr)
+#define MEMORY_ALLOCATOR_TRY_EXPAND_IN_PLACE(allocator, ptr, size) Memory_AllocatorTryExpandInPlace(allocator, ptr, size)
+#define MEMORY_ALLOCATOR_FREE_BATCH(allocator, count, ptrs) Memory_FreeBatch(allocator, count, ptrs)
+
+// each thread has a stack of allocators, the allocating MEMORY_ macros below
+// use the top one (the global allocator when nothing is pushed), so a subsystem
+// can be sent to an arena or pool without changing its call sites.
+// MEMORY_FREE, MEMORY_REALLOC etc. go to the blocks owner wherever they are
+// called. Every allocator pushed (bar the global one) must have an owns
+// function, it is remembered from its first push and asked about each block
+// freed or resized through these macros. Anything no pushed allocator claims
+// belongs to the global allocator
+#define Memory_AllocatorStackMaxDepth 16
+// how many different allocators can ever be pushed
+#define Memory_AllocatorMaxOwners 32
+// the top of the calling threads stack, read only (use push and pop)
+AL2O3_EXTERN_C AL2O3_THREAD_LOCAL Memory_Allocator const *Memory_CurrentAllocator;
+// false if the stack is full, the allocator has no owns or there are too many
+// owners. The current allocator is then unchanged.
+// Every push takes a stack entry whatever it returns, so every push (failed or
+// not) must be matched by a pop, e.g.
+//   Memory_PushAllocator(&Memory_TempAllocator); // checking the result is optional
+//   ...
+//   Memory_PopAllocator();
+AL2O3_EXTERN_C bool Memory_PushAllocator(Memory_Allocator const *allocator);
+AL2O3_EXTERN_C void Memory_PopAllocator();
+// the allocator a block came from, the current one for NULL. The most recently
+// remembered allocator is asked first, so a pool made from another pushed
+// allocators blocks claims its own. May be a copy of what was pushed
+AL2O3_EXTERN_C Memory_Allocator const *Memory_OwnerOf(void const *memory);
+AL2O3_EXTERN_C void Memory_OwnerFreeBatch(size_t count, void **ptrs);
+
+AL2O3_FORCE_INLINE void Memory_OwnerFree(void *memory) {
+	Memory_OwnerOf(memory)->free(memory);
+}
+AL2O3_FORCE_INLINE void Memory_OwnerFreeSized(void *memory, size_t size) {
+	Memory_AllocatorFreeSized(Memory_OwnerOf(memory), memory, size);
+}
+AL2O3_FORCE_INLINE size_t Memory_OwnerUsableSize(void const *memory) {
+	return Memory_AllocatorUsableSize(Memory_OwnerOf(memory), memory);
+}
+AL2O3_FORCE_INLINE bool Memory_OwnerTryExpandInPlace(void *memory, size_t size) {
+	return Memory_AllocatorTryExpandInPlace(Memory_OwnerOf(memory), memory, size);
+}
+AL2O3_FORCE_INLINE void *Memory_OwnerRealloc(void *memory, size_t size) {
+	return Memory_OwnerOf(memory)->realloc(memory, size);
+}
+AL2O3_FORCE_INLINE void *Memory_OwnerArealloc(void *memory, size_t size, size_t align) {
+	return Memory_AllocatorArealloc(Memory_OwnerOf(memory), memory, size, align);
+}
+
+// sorted address ranges that any thread can look up without a lock, for owns
+// functions. Adds, removes and clears must be serialised by the caller.
+// Zero initialised is an empty set
+typedef struct Memory_RangeSet {
+	void *volatile ranges;
+	uint64_t volatile version; // odd while a change is being made
+} Memory_RangeSet;
+
+// false if out of memory
+AL2O3_EXTERN_C bool Memory_RangeSetAdd(Memory_RangeSet *set, void const *start, size_t size);
+// start must be the start of a range that was added
+AL2O3_EXTERN_C void Memory_RangeSetRemove(Memory_RangeSet *set, void const *start);
+// keeps the sets memory, so it is safe with lookups still going on
+AL2O3_EXTERN_C void Memory_RangeSetClear(Memory_RangeSet *set);
+AL2O3_EXTERN_C bool Memory_RangeSetContains(Memory_RangeSet const *set, void const *address);
+// frees the sets memory, nothing may be looking anything up
+AL2O3_EXTERN_C void Memory_RangeSetDestroy(Memory_RangeSet *set);
+
+#define MEMORY_MALLOC(size) MEMORY_ALLOCATOR_MALLOC(Memory_CurrentAllocator, size)
+#define MEMORY_AALLOC(size, align) MEMORY_ALLOCATOR_AALLOC(Memory_CurrentAllocator, size, align)
+#define MEMORY_CALLOC(count, size) MEMORY_ALLOCATOR_CALLOC(Memory_CurrentAllocator, count, size)
+#if MEMORY_TRACKING_SETUP == 1
+#define MEMORY_REALLOC(orig, size) (MEMORY_PUSH_SRC_LOC() ? Memory_OwnerRealloc(orig, size) : NULL)
+#define MEMORY_AREALLOC(orig, size, align) (MEMORY_PUSH_SRC_LOC() ? Memory_OwnerArealloc(orig, size, align) : NULL)
+#else
+#define MEMORY_REALLOC(orig, size) Memory_OwnerRealloc(orig, size)
+#define MEMORY_AREALLOC(orig, size, align) Memory_OwnerArealloc(orig, size, align)
+#endif
+#define MEMORY_FREE(ptr) Memory_OwnerFree(ptr)
+#define MEMORY_FREE_SIZED(ptr, size) Memory_OwnerFreeSized(ptr, size)
+#define MEMORY_USABLE_SIZE(ptr) Memory_OwnerUsableSize(ptr)
+#define MEMORY_TRY_EXPAND_IN_PLACE(ptr, size) Memory_OwnerTryExpandInPlace(ptr, size)
+#define MEMORY_MALLOC_BATCH(count, size, outPtrs) MEMORY_ALLOCATOR_MALLOC_BATCH(Memory_CurrentAllocator, count, size, outPtrs)
+#define MEMORY_FREE_BATCH(count, ptrs) Memory_OwnerFreeBatch(count, ptrs)
+
+// on unix blocks of at least the large threshold are mapped straight from the
+// OS rather than the heap. calloc doesn't have to clear them, realloc remaps
+// rather than copies and free gives the pages straight back. 0 turns it off,
+// blocks already mapped stay mapped until they are freed or shrink below half
+// the threshold. Not supported elsewhere (the threshold is always 0)
+#define Memory_DefaultLargeAllocThreshold (1024 * 1024)
+AL2O3_EXTERN_C void Memory_SetLargeAllocThreshold(size_t threshold);
+AL2O3_EXTERN_C size_t Memory_GetLargeAllocThreshold();
+// asks for transparent huge pages for large blocks of 2MiB or more (linux only)
+AL2O3_EXTERN_C void Memory_SetLargeAllocHugePages(bool enable);
+AL2O3_EXTERN_C bool Memory_GetLargeAllocHugePages();
+
+// address space can be reserved once and backed with memory as needed, so
+// things can grow without ever moving. Commit and decommit work in whole
+// pages, address and size should be page aligned
+AL2O3_EXTERN_C size_t Memory_VirtualPageSize();
+// NULL if the address space isn't available, nothing is accessible until committed
+AL2O3_EXTERN_C void *Memory_VirtualReserve(size_t size);
+// makes the pages readable and writable, new pages read as zero
+AL2O3_EXTERN_C bool Memory_VirtualCommit(void *address, size_t size);
+// gives the pages back to the OS but keeps them reserved, the contents are lost
+AL2O3_EXTERN_C void Memory_VirtualDecommit(void *address, size_t size);
+// size must be the size it was reserved with
+AL2O3_EXTERN_C void Memory_VirtualRelease(void *address, size_t size);
+
+// a buffer that grows inside a reservation, base never changes so pointers into
+// it stay valid and growing never copies
+typedef struct Memory_VirtualBuffer {
+	uint8_t *base;
+	size_t size; // bytes in use
+	size_t committed;
+	size_t reserved; // the most it can ever hold
+} Memory_VirtualBuffer;
+
+AL2O3_EXTERN_C bool Memory_VirtualBufferInit(Memory_VirtualBuffer *buffer, size_t maxSize);
+AL2O3_EXTERN_C void Memory_VirtualBufferDestroy(Memory_VirtualBuffer *buffer);
+// commits as needed, false if size is past the reservation or out of memory
+AL2O3_EXTERN_C bool Memory_VirtualBufferResize(Memory_VirtualBuffer *buffer, size_t size);
+// the address of count new bytes at the end, NULL if the buffer can't grow
+AL2O3_EXTERN_C void *Memory_VirtualBufferPush(Memory_VirtualBuffer *buffer, size_t count);
+// decommits the pages past size
+AL2O3_EXTERN_C void Memory_VirtualBufferShrinkToFit(Memory_VirtualBuffer *buffer);
 
-// TODO temp pool
-#define MEMORY_TEMP_MALLOC(size) MEMORY_ALLOCATOR_MALLOC(&Memory_GlobalAllocator, size)
-#define MEMORY_TEMP_AALLOC(size, align) MEMORY_ALLOCATOR_AALLOC(&Memory_GlobalAllocator, size, align)
-#define MEMORY_TEMP_CALLOC(count, size) MEMORY_ALLOCATOR_CALLOC(&Memory_GlobalAllocator, count, size)
-#define MEMORY_TEMP_REALLOC(orig, size) MEMORY_ALLOCATOR_REALLOC(&Memory_GlobalAllocator,orig, size)
-#define MEMORY_TEMP_FREE(ptr) MEMORY_ALLOCATOR_FREE(&Memory_GlobalAllocator, ptr)
+// records every alloc, aalloc, calloc, realloc, expand and free made through
+// the global allocator to a compact binary file, with timestamps, threads and
+// source locations, for offline replay. One trace at a time, Start is false
+// if one is already running or the file can't be opened
+AL2O3_EXTERN_C bool Memory_TraceStart(char const *path);
+// waits for everything recorded to be written, false if writing failed
+AL2O3_EXTERN_C bool Memory_TraceStop();
+AL2O3_EXTERN_C bool Memory_TraceIsRecording();
+
+// temp allocations come from a per thread linear arena, they are very cheap but
+// must be freed (or realloced) on the thread that allocated them.
+// Free only reclaims space for the most recent allocation, everything else is
+// reclaimed when the thread has no live temp allocations or via a mark rewind
+AL2O3_EXTERN_C Memory_Allocator Memory_TempAllocator;
+
+typedef struct Memory_TempMark {
+	void *block;
+	void *cursor;
+	uint32_t depth; // how many marks were active before this one
+} Memory_TempMark;
+
+// the depth of a mark that couldn't be taken (out of memory), its rewind does nothing
+#define Memory_TempMarkInvalid 0xFFFFFFFFu
+
+// a rewind releases every temp allocation made on this thread since the mark
+// was taken. marks must be rewound in LIFO order
+AL2O3_EXTERN_C Memory_TempMark Memory_TempGetMark();
+AL2O3_EXTERN_C void Memory_TempRewind(Memory_TempMark mark);
+// releases the calling threads temp arena back to the OS, this happens anyway
+// when the thread exits
+AL2O3_EXTERN_C void Memory_TempThreadShutdown();
+
+// no tracking for temp allocs, so skip the source location push as well
+#define MEMORY_TEMP_MALLOC(size) Memory_TempAllocator.malloc(size)
+#define MEMORY_TEMP_AALLOC(size, align) Memory_TempAllocator.aalloc(size, align)
+#define MEMORY_TEMP_CALLOC(count, size) Memory_TempAllocator.calloc(count, size)
+#define MEMORY_TEMP_REALLOC(orig, size) Memory_TempAllocator.realloc(orig, size)
+#define MEMORY_TEMP_AREALLOC(orig, size, align) Memory_TempAllocator.arealloc(orig, size, align)
+#define MEMORY_TEMP_FREE(ptr) Memory_TempAllocator.free(ptr)
+
+// a thread caching size class allocator for lots of small (<= 2KiB) objects.
+// Blocks are 16 byte aligned and can be freed from any thread, bigger or more
+// aligned requests are passed to the global allocator. Small blocks aren't tracked
+AL2O3_EXTERN_C Memory_Allocator Memory_SmallObjectAllocator;
+
+// the source location is only for the blocks that go to the global allocator
+#define MEMORY_SMALL_MALLOC(size) MEMORY_ALLOCATOR_MALLOC(&Memory_SmallObjectAllocator, size)
+#define MEMORY_SMALL_AALLOC(size, align) MEMORY_ALLOCATOR_AALLOC(&Memory_SmallObjectAllocator, size, align)
+#define MEMORY_SMALL_CALLOC(count, size) MEMORY_ALLOCATOR_CALLOC(&Memory_SmallObjectAllocator, count, size)
+#define MEMORY_SMALL_REALLOC(orig, size) MEMORY_ALLOCATOR_REALLOC(&Memory_SmallObjectAllocator, orig, size)
+#define MEMORY_SMALL_AREALLOC(orig, size, align) MEMORY_ALLOCATOR_AREALLOC(&Memory_SmallObjectAllocator, orig, size, align)
+#define MEMORY_SMALL_FREE(ptr) Memory_SmallObjectAllocator.free(ptr)
+#define MEMORY_SMALL_FREE_SIZED(ptr, size) Memory_SmallObjectAllocator.freeSized(ptr, size)
+// a batch is carved straight off the current pages, usually from one contiguous run
+#define MEMORY_SMALL_MALLOC_BATCH(count, size, outPtrs) MEMORY_ALLOCATOR_MALLOC_BATCH(&Memory_SmallObjectAllocator, count, size, outPtrs)
+#define MEMORY_SMALL_FREE_BATCH(count, ptrs) Memory_SmallObjectAllocator.freeBatch(count, ptrs)
+
+// per callsite heap profile of tracked allocations, all empty without tracking.
+// When sampling the counts and bytes are estimates
+typedef struct Memory_CallsiteStats {
+	char const *sourceFile;
+	char const *sourceFunc;
+	uint32_t sourceLine;
+	uint32_t stackId; // for Memory_TrackerGetStack, 0 if no stack was captured
+	uint32_t srcLocId; // the Memory_SrcLoc id, 0 if the loc wasn't static
+	uint64_t liveBytes;
+	uint64_t liveCount;
+	uint64_t totalBytes;
+	uint64_t totalAllocs;
+	uint64_t totalFrees;
+	double churnPerSecond; // allocs + frees per second since the first tracked allocation
+} Memory_CallsiteStats;
+
+// fills up to maxCount callsites biggest live bytes first, returns how many callsites there are
+AL2O3_EXTERN_C size_t Memory_TrackerGetCallsites(Memory_CallsiteStats *callsites, size_t maxCount);
+
+// a callsite aggregated copy of the live heap, cheap enough to take between
+// batches of work in a running process. Nothing is paused, the callsite totals
+// are copied with one short lock so allocations racing the snapshot may or
+// may not be in it
+typedef struct Memory_HeapSnapshot {
+	uint64_t timeNs; // monotonic, only meaningful relative to other snapshots
+	uint64_t liveBytes;
+	uint64_t liveCount;
+	size_t callsiteCount;
+	Memory_CallsiteStats *callsites; // every callsite seen so far
+} Memory_HeapSnapshot;
+
+// NULL without tracking or if out of memory
+AL2O3_EXTERN_C Memory_HeapSnapshot *Memory_TrackerSnapshot();
+AL2O3_EXTERN_C void Memory_TrackerFreeSnapshot(Memory_HeapSnapshot *snapshot);
+
+// how a callsite changed from one snapshot to a later one
+typedef struct Memory_HeapDiffEntry {
+	Memory_CallsiteStats const *callsite; // in the later snapshot, or the earlier if nothing is live now
+	int64_t liveBytes;
+	int64_t liveCount;
+	uint64_t allocs; // made between the snapshots
+	uint64_t frees;
+} Memory_HeapDiffEntry;
+
+// fills up to maxCount callsites that changed, most live bytes gained first,
+// returns how many changed. Entries point into the snapshots so must not
+// outlive them
+AL2O3_EXTERN_C size_t Memory_TrackerDiff(Memory_HeapSnapshot const *a,
+																				 Memory_HeapSnapshot const *b,
+																				 Memory_HeapDiffEntry *entries,
+																				 size_t maxCount);
+
+// exports hand their output to writeFunc in one or more pieces, false if nothing could be written
+typedef void (*Memory_ProfileWriteFunc)(void *user, void const *data, size_t size);
+
+// an uncompressed pprof profile.proto with alloc_objects, alloc_space, inuse_objects
+// and inuse_space samples, pprof reads it directly (go tool pprof file)
+AL2O3_EXTERN_C bool Memory_TrackerWritePprof(Memory_ProfileWriteFunc writeFunc, void *user);
+
+typedef enum Memory_ProfileMetric {
+	Memory_ProfileMetric_LiveBytes,
+	Memory_ProfileMetric_LiveCount,
+	Memory_ProfileMetric_TotalBytes,
+	Memory_ProfileMetric_TotalAllocs,
+	Memory_ProfileMetric_Churn,
+} Memory_ProfileMetric;
+
+// one 'frame;frame value' line per callsite for flamegraph.pl, speedscope etc.
+AL2O3_EXTERN_C bool Memory_TrackerWriteCollapsed(Memory_ProfileWriteFunc writeFunc, void *user, Memory_ProfileMetric metric);
+
+// live heap statistics for the global and temp allocators, available without
+// tracking. Counts are per thread so cost very little, reading them walks every
+// thread. Without tracking aligned allocations are counted as plain (free can't
+// tell them apart) and sizes are the platforms usable size
+typedef struct Memory_StatsCounters {
+	uint64_t liveBytes;
+	uint64_t liveCount;
+	uint64_t peakBytes; // may be under by up to 64KiB per thread
+	uint64_t totalAllocs;
+	uint64_t totalFrees;
+	uint64_t totalReallocs;
+} Memory_StatsCounters;
+
+typedef struct Memory_Stats {
+	Memory_StatsCounters plain;
+	Memory_StatsCounters aligned;
+	Memory_StatsCounters temp;
+	uint64_t liveBytes;
+	uint64_t peakBytes;
+} Memory_Stats;
+
+AL2O3_EXTERN_C Memory_Stats Memory_GetStats();
+
+// global allocator blocks can carry a tag naming the subsystem they belong to
+// (textures, networking, caches...). Each tag keeps live and peak counts and
+// can have budgets. The tag lives in the tracking header, so it works at every
+// tracking level but Off and does nothing without tracking. Tag 0 is untagged
+// and costs nothing
+#define Memory_MaxTags 256
+typedef uint16_t Memory_Tag;
+
+// the tag for this threads allocations from now on, returns the previous one
+AL2O3_EXTERN_C Memory_Tag Memory_SetTag(Memory_Tag tag);
+AL2O3_EXTERN_C Memory_Tag Memory_GetTag();
+// always returns true, overrides the current tag for the next allocation only
+AL2O3_EXTERN_C bool Memory_PushNextTag(Memory_Tag tag);
+// name must outlive the tag
+AL2O3_EXTERN_C void Memory_TagSetName(Memory_Tag tag, char const *name);
+
+#define MEMORY_ALLOCATOR_MALLOC_TAGGED(allocator, tag, size) (Memory_PushNextTag(tag) ? MEMORY_ALLOCATOR_MALLOC(allocator, size) : NULL)
+#define MEMORY_ALLOCATOR_AALLOC_TAGGED(allocator, tag, size, align) (Memory_PushNextTag(tag) ? MEMORY_ALLOCATOR_AALLOC(allocator, size, align) : NULL)
+#define MEMORY_ALLOCATOR_CALLOC_TAGGED(allocator, tag, count, size) (Memory_PushNextTag(tag) ? MEMORY_ALLOCATOR_CALLOC(allocator, count, size) : NULL)
+#define MEMORY_MALLOC_TAGGED(tag, size) MEMORY_ALLOCATOR_MALLOC_TAGGED(Memory_CurrentAllocator, tag, size)
+#define MEMORY_AALLOC_TAGGED(tag, size, align) MEMORY_ALLOCATOR_AALLOC_TAGGED(Memory_CurrentAllocator, tag, size, align)
+#define MEMORY_CALLOC_TAGGED(tag, count, size) MEMORY_ALLOCATOR_CALLOC_TAGGED(Memory_CurrentAllocator, tag, count, size)
+
+typedef struct Memory_TagStats {
+	char const *name; // NULL if never named
+	uint64_t liveBytes;
+	uint64_t liveCount;
+	uint64_t peakBytes;
+	uint64_t totalAllocs;
+	uint64_t softBudget;
+	uint64_t hardBudget;
+} Memory_TagStats;
+
+AL2O3_EXTERN_C Memory_TagStats Memory_GetTagStats(Memory_Tag tag);
+// the peak starts again from the live bytes
+AL2O3_EXTERN_C void Memory_TagResetPeak(Memory_Tag tag);
+
+typedef enum Memory_BudgetEvent {
+	Memory_BudgetEvent_Soft, // the live bytes went over the soft budget
+	Memory_BudgetEvent_Hard, // an allocation of size was refused
+} Memory_BudgetEvent;
+
+// called on the allocating thread, allocations it makes don't call it again
+typedef void (*Memory_BudgetFunc)(void *user, Memory_Tag tag, Memory_BudgetEvent event, uint64_t liveBytes, size_t size);
+
+// 0 turns a budget off. Crossing the soft budget just calls the budget func,
+// an allocation or growth that would go over the hard budget fails
+AL2O3_EXTERN_C void Memory_TagSetBudget(Memory_Tag tag, uint64_t softBytes, uint64_t hardBytes);
+// set before any budget can be hit, NULL for none
+AL2O3_EXTERN_C void Memory_SetBudgetFunc(Memory_BudgetFunc func, void *user);
 
 #if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
 AL2O3_EXTERN_C void* _alloca(size_t size);
@@ -113,6 +594,39 @@ AL2O3_EXTERN_C void* _alloca(size_t size);
 
 #if __cplusplus
 #include <new>
+// for lots of objects of one type Memory_ObjectPool (objectpool.hpp) avoids the heap
 #define MEMORY_NEW(clas, ...) new( (clas*) MEMORY_MALLOC(sizeof(clas))) clas(__VA_ARGS__)
-#define MEMORY_DELETE(clas, ptr) ptr->~clas(); MEMORY_FREE(ptr);
+#define MEMORY_DELETE(clas, ptr) do { (ptr)->~clas(); MEMORY_FREE(ptr); } while (0)
+
+// rewinds the temp arena to where it was when the scope was entered
+struct Memory_TempScope {
+	Memory_TempScope() : mark(Memory_TempGetMark()) {}
+	~Memory_TempScope() { Memory_TempRewind(mark); }
+
+	Memory_TempScope(Memory_TempScope const&) = delete;
+	Memory_TempScope& operator=(Memory_TempScope const&) = delete;
+
+	Memory_TempMark const mark;
+};
+
+// makes allocator current for the rest of the scope, always pops as even a
+// failed push has to be popped
+struct Memory_AllocatorScope {
+	explicit Memory_AllocatorScope(Memory_Allocator const *allocator) { Memory_PushAllocator(allocator); }
+	~Memory_AllocatorScope() { Memory_PopAllocator(); }
+
+	Memory_AllocatorScope(Memory_AllocatorScope const&) = delete;
+	Memory_AllocatorScope& operator=(Memory_AllocatorScope const&) = delete;
+};
+
+// tags this threads allocations for the rest of the scope
+struct Memory_TagScope {
+	explicit Memory_TagScope(Memory_Tag tag) : previous(Memory_SetTag(tag)) {}
+	~Memory_TagScope() { Memory_SetTag(previous); }
+
+	Memory_TagScope(Memory_TagScope const&) = delete;
+	Memory_TagScope& operator=(Memory_TagScope const&) = delete;
+
+	Memory_Tag const previous;
+};
 #endif
\ No newline at end of file
@@ -0,0 +1,305 @@
+// License Summary: MIT see LICENSE file
+#pragma once
+#include "al2o3_memory/memory.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <utility>
+
+// fixed size blocks for one type, carved from chunks and recycled through a
+// free list, e.g.
+//   Memory_ObjectPool<Message> pool;
+//   Message *msg = pool.New(id, payload);
+//   pool.Delete(msg);
+// A pool belongs to one thread, only DeleteFromAnyThread/FreeFromAnyThread can
+// be used elsewhere, they go on a lock free list the owner picks up when its
+// own free list runs dry. Chunks come from the allocator (current at
+// construction by default) and are only given back by Release or when the
+// pool is destroyed. The pool object is 64 byte aligned, so the remote list
+// gets a cache line of its own
+template<typename T>
+class Memory_ObjectPool {
+public:
+	// each slot holds a T or the free list link, slots are aligned as T is
+	static size_t const SlotAlign = (alignof(T) > alignof(void *)) ? alignof(T) : alignof(void *);
+	static size_t const SlotSize = (((sizeof(T) > sizeof(void *)) ? sizeof(T) : sizeof(void *)) + SlotAlign - 1) & ~(SlotAlign - 1);
+
+	explicit Memory_ObjectPool(size_t objectsPerChunk = 256, Memory_Allocator const *allocator = Memory_CurrentAllocator) :
+			allocator_(allocator),
+			objectsPerChunk_(objectsPerChunk ? objectsPerChunk : 1) {}
+
+	// live objects are not destroyed
+	~Memory_ObjectPool() {
+		Release();
+		Memory_RangeSetDestroy(&chunkRanges_);
+	}
+
+	Memory_ObjectPool(Memory_ObjectPool const&) = delete;
+	Memory_ObjectPool& operator=(Memory_ObjectPool const&) = delete;
+
+	// NULL if out of memory, the constructor isn't run then
+	template<typename... Args>
+	T *New(Args&&... args) {
+		void *slot = Allocate();
+		if (slot == nullptr) {
+			return nullptr;
+		}
+#if defined(__cpp_exceptions) || defined(_CPPUNWIND)
+		try {
+			return new(slot) T(std::forward<Args>(args)...);
+		} catch (...) {
+			Free(slot);
+			throw;
+		}
+#else
+		return new(slot) T(std::forward<Args>(args)...);
+#endif
+	}
+
+	void Delete(T *object) {
+		if (object) {
+			object->~T();
+			Free(object);
+		}
+	}
+
+	void DeleteFromAnyThread(T *object) {
+		if (object) {
+			object->~T();
+			FreeFromAnyThread(object);
+		}
+	}
+
+	// uninitialised slots, for callers that construct themselves
+	void *Allocate() {
+		FreeSlot *slot = freeList_;
+		if (slot == nullptr && remoteFree_.load(std::memory_order_relaxed) != nullptr) {
+			// only the owner takes the list, so taking all of it can't suffer ABA
+			slot = remoteFree_.exchange(nullptr, std::memory_order_acquire);
+		}
+		if (slot) {
+			freeList_ = slot->next;
+		} else {
+			slot = Carve();
+			if (slot == nullptr) {
+				return nullptr;
+			}
+		}
+		live_++;
+		return slot;
+	}
+
+	void Free(void *ptr) {
+		if (ptr) {
+			FreeSlot *slot = static_cast<FreeSlot *>(ptr);
+			slot->next = freeList_;
+			freeList_ = slot;
+			live_--;
+		}
+	}
+
+	void FreeFromAnyThread(void *ptr) {
+		if (ptr) {
+			FreeSlot *slot = static_cast<FreeSlot *>(ptr);
+			FreeSlot *head = remoteFree_.load(std::memory_order_relaxed);
+			do {
+				slot->next = head;
+			} while (!remoteFree_.compare_exchange_weak(head, slot, std::memory_order_release, std::memory_order_relaxed));
+			remoteFreed_.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	// forgets every object at once without running destructors, the chunks are
+	// kept for reuse. Nothing may be freed from another thread during the reset
+	void Reset() {
+		freeList_ = nullptr;
+		remoteFree_.store(nullptr, std::memory_order_relaxed);
+		remoteFreed_.store(0, std::memory_order_relaxed);
+		live_ = 0;
+		current_ = chunks_;
+		cursor_ = 0;
+	}
+
+	// a reset that also gives the chunks back to the allocator
+	void Release() {
+		Reset();
+		// other threads may be asking Owns, so the index keeps its memory
+		Memory_RangeSetClear(&chunkRanges_);
+		Chunk *chunk = chunks_;
+		while (chunk) {
+			Chunk *next = chunk->next;
+			MEMORY_ALLOCATOR_FREE(allocator_, chunk);
+			chunk = next;
+		}
+		chunks_ = nullptr;
+		current_ = nullptr;
+	}
+
+	// remote frees not yet picked up are already taken off
+	size_t LiveCount() const {
+		return live_ - remoteFreed_.load(std::memory_order_relaxed);
+	}
+
+	// true if ptr is in one of the pools chunks (live or not). A search of a
+	// sorted chunk index, any thread can ask
+	bool Owns(void const *ptr) const {
+		return Memory_RangeSetContains(&chunkRanges_, ptr);
+	}
+
+private:
+	struct FreeSlot {
+		FreeSlot *next;
+	};
+
+	struct Chunk {
+		Chunk *next;
+
+		uint8_t *Slots() { return reinterpret_cast<uint8_t *>(this) + HeaderSize; }
+		uint8_t const *Slots() const { return reinterpret_cast<uint8_t const *>(this) + HeaderSize; }
+	};
+	static size_t const HeaderSize = (sizeof(Chunk) + SlotAlign - 1) & ~(SlotAlign - 1);
+
+	// the next never used slot, moving to a new (or after a reset, the next) chunk when one is full
+	FreeSlot *Carve() {
+		if (current_ == nullptr || cursor_ == objectsPerChunk_) {
+			Chunk *next = current_ ? current_->next : chunks_;
+			if (next == nullptr) {
+				next = static_cast<Chunk *>(MEMORY_ALLOCATOR_AALLOC(allocator_, HeaderSize + objectsPerChunk_ * SlotSize, SlotAlign));
+				if (next == nullptr) {
+					LOGERROR("Object pool is out of memory");
+					return nullptr;
+				}
+				if (!Memory_RangeSetAdd(&chunkRanges_, next->Slots(), objectsPerChunk_ * SlotSize)) {
+					LOGERROR("Object pool is out of memory");
+					MEMORY_ALLOCATOR_FREE(allocator_, next);
+					return nullptr;
+				}
+				next->next = nullptr;
+				if (current_) {
+					current_->next = next;
+				} else {
+					chunks_ = next;
+				}
+			}
+			current_ = next;
+			cursor_ = 0;
+		}
+		return reinterpret_cast<FreeSlot *>(current_->Slots() + SlotSize * cursor_++);
+	}
+
+	Memory_Allocator const *allocator_;
+	size_t const objectsPerChunk_;
+	Chunk *chunks_ = nullptr;
+	// the slots of every chunk, for Owns
+	Memory_RangeSet chunkRanges_{};
+	Chunk *current_ = nullptr;
+	size_t cursor_ = 0;
+	FreeSlot *freeList_ = nullptr;
+	size_t live_ = 0;
+	// other threads only touch these, keep them off the owners cache line
+	alignas(64) std::atomic<FreeSlot *> remoteFree_{nullptr};
+	std::atomic<size_t> remoteFreed_{0};
+};
+
+// the C allocator functions have no context pointer, so the pool is bound at
+// compile time and must have static storage
+template<typename T, Memory_ObjectPool<T> *Pool>
+struct Memory_ObjectPoolThunks {
+	static bool Fits(size_t size, size_t align) {
+		if (size > Memory_ObjectPool<T>::SlotSize || align > Memory_ObjectPool<T>::SlotAlign) {
+			LOGERROR("Object pool allocations are at most %u bytes", (unsigned int) Memory_ObjectPool<T>::SlotSize);
+			return false;
+		}
+		return true;
+	}
+	// the pools thread is the one allocating from it, blocks freed on any other
+	// thread go on the pools remote list
+	static bool &UsedHere() {
+		static thread_local bool used = false;
+		return used;
+	}
+	static void *Allocate() {
+		UsedHere() = true;
+		return Pool->Allocate();
+	}
+	static void *Malloc(size_t size) { return Fits(size, 0) ? Allocate() : nullptr; }
+	static void *Aalloc(size_t size, size_t align) { return Fits(size, align) ? Allocate() : nullptr; }
+	static void *Calloc(size_t count, size_t size) {
+		if (count == 0 || size > SIZE_MAX / count) {
+			return nullptr;
+		}
+		void *mem = Fits(count * size, 0) ? Allocate() : nullptr;
+		if (mem) {
+			memset(mem, 0, count * size);
+		}
+		return mem;
+	}
+	static void *Arealloc(void *ptr, size_t size, size_t align) {
+		if (ptr == nullptr) {
+			return Aalloc(size, align);
+		}
+		// every block is already as big as it can get
+		return Fits(size, align) ? ptr : nullptr;
+	}
+	static void *Realloc(void *ptr, size_t size) { return Arealloc(ptr, size, 0); }
+	static void Free(void *ptr) {
+		if (UsedHere()) {
+			Pool->Free(ptr);
+		} else {
+			Pool->FreeFromAnyThread(ptr);
+		}
+	}
+	static void FreeSized(void *ptr, size_t) { Free(ptr); }
+	static size_t UsableSize(void const *ptr) { return ptr ? Memory_ObjectPool<T>::SlotSize : 0; }
+	static bool TryExpandInPlace(void *ptr, size_t size) { return ptr && size <= Memory_ObjectPool<T>::SlotSize; }
+	static bool Owns(void const *ptr) { return Pool->Owns(ptr); }
+	static void FreeBatch(size_t count, void **ptrs) {
+		for (size_t i = 0; i < count; ++i) {
+			Free(ptrs[i]);
+		}
+	}
+	static bool MallocBatch(size_t count, size_t size, void **outPtrs) {
+		size_t done = 0;
+		if (Fits(size, 0)) {
+			for (; done < count; ++done) {
+				outPtrs[done] = Allocate();
+				if (outPtrs[done] == nullptr) {
+					break;
+				}
+			}
+		}
+		if (done < count) {
+			FreeBatch(done, outPtrs);
+			memset(outPtrs, 0, count * sizeof(void *));
+			return false;
+		}
+		return true;
+	}
+};
+
+// a Memory_Allocator over a pool, for C code or the allocator stack, e.g.
+//   static Memory_ObjectPool<Node> g_nodePool;
+//   Memory_PushAllocator(Memory_ObjectPoolAllocator<Node, &g_nodePool>());
+// Blocks can be at most the slot size and are aligned as T, anything else is
+// NULL. Only the pools own thread can allocate, blocks can be freed on any
+template<typename T, Memory_ObjectPool<T> *Pool>
+Memory_Allocator const *Memory_ObjectPoolAllocator() {
+	typedef Memory_ObjectPoolThunks<T, Pool> Thunks;
+	static Memory_Allocator const allocator = {
+			&Thunks::Malloc,
+			&Thunks::Aalloc,
+			&Thunks::Calloc,
+			&Thunks::Realloc,
+			&Thunks::Free,
+			&Thunks::FreeSized,
+			&Thunks::UsableSize,
+			&Thunks::TryExpandInPlace,
+			&Thunks::Arealloc,
+			&Thunks::MallocBatch,
+			&Thunks::FreeBatch,
+			&Thunks::Owns
+	};
+	return &allocator;
+}
@@ -0,0 +1,145 @@
+// License Summary: MIT see LICENSE file
+#pragma once
+#include "al2o3_memory/memory.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define MEMORY_STD_PMR 1
+#endif
+#endif
+#if !defined(MEMORY_STD_PMR)
+#define MEMORY_STD_PMR 0
+#endif
+
+// containers can't be told about a failed allocation any other way
+[[noreturn]] inline void Memory_ThrowBadAlloc() {
+#if defined(__cpp_exceptions) || defined(_CPPUNWIND)
+	throw std::bad_alloc();
+#else
+	LOGERROR("Out of memory in a std allocator");
+	abort();
+#endif
+}
+
+AL2O3_FORCE_INLINE void *Memory_StdAllocate(Memory_Allocator const *allocator, size_t size, size_t align) {
+	void *mem = (align > 16) ? MEMORY_ALLOCATOR_AALLOC(allocator, size, align) : MEMORY_ALLOCATOR_MALLOC(allocator, size);
+	if (mem == NULL) {
+		Memory_ThrowBadAlloc();
+	}
+	return mem;
+}
+
+// a std allocator over a Memory_Allocator, e.g.
+//   std::vector<int, Memory_StdAllocator<int>> v(Memory_StdAllocator<int>(&Memory_SmallObjectAllocator));
+// Default constructed it uses the current allocator (see Memory_PushAllocator)
+// and keeps it, so the container frees to the right allocator whatever is
+// current later. Containers take their allocator with them when moved, copied
+// or swapped
+template<typename T>
+struct Memory_StdAllocator {
+	typedef T value_type;
+	typedef std::true_type propagate_on_container_copy_assignment;
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type propagate_on_container_swap;
+	typedef std::false_type is_always_equal;
+
+	Memory_StdAllocator() noexcept : allocator(Memory_CurrentAllocator) {}
+	explicit Memory_StdAllocator(Memory_Allocator const *allocator_) noexcept : allocator(allocator_) {}
+	template<typename U>
+	Memory_StdAllocator(Memory_StdAllocator<U> const& other) noexcept : allocator(other.allocator) {}
+
+	T *allocate(size_t count) {
+		if (count > SIZE_MAX / sizeof(T)) {
+			Memory_ThrowBadAlloc();
+		}
+		return static_cast<T *>(Memory_StdAllocate(allocator, count * sizeof(T), alignof(T)));
+	}
+
+	void deallocate(T *ptr, size_t count) noexcept {
+		Memory_AllocatorFreeSized(allocator, ptr, count * sizeof(T));
+	}
+
+	Memory_Allocator const *allocator;
+};
+
+template<typename T, typename U>
+inline bool operator==(Memory_StdAllocator<T> const& a, Memory_StdAllocator<U> const& b) noexcept {
+	return a.allocator == b.allocator;
+}
+template<typename T, typename U>
+inline bool operator!=(Memory_StdAllocator<T> const& a, Memory_StdAllocator<U> const& b) noexcept {
+	return a.allocator != b.allocator;
+}
+
+#if MEMORY_STD_PMR == 1
+
+// a std::pmr::memory_resource over a Memory_Allocator, for std::pmr containers
+// and as the upstream of the pmr arenas and pools below. Like the std
+// allocator it defaults to the current allocator
+class Memory_Resource : public std::pmr::memory_resource {
+public:
+	explicit Memory_Resource(Memory_Allocator const *allocator = Memory_CurrentAllocator) noexcept : allocator_(allocator) {}
+
+	Memory_Allocator const *allocator() const noexcept { return allocator_; }
+
+protected:
+	void *do_allocate(size_t bytes, size_t alignment) override {
+		return Memory_StdAllocate(allocator_, bytes, alignment);
+	}
+
+	void do_deallocate(void *ptr, size_t bytes, size_t) override {
+		Memory_AllocatorFreeSized(allocator_, ptr, bytes);
+	}
+
+	// without RTTI only the same resource can be known to be equal
+	bool do_is_equal(std::pmr::memory_resource const& other) const noexcept override {
+		return this == &other;
+	}
+
+private:
+	Memory_Allocator const *allocator_;
+};
+
+// the upstream has to be built before the pmr resource that uses it, so it
+// lives in a base that comes first
+struct Memory_ResourceUpstream {
+	explicit Memory_ResourceUpstream(Memory_Allocator const *allocator) noexcept : upstream(allocator) {}
+	Memory_Resource upstream;
+};
+
+// an arena, allocation is a pointer bump, deallocate does nothing and
+// everything is given back at once by release() or when it's destroyed.
+// For one thread at a time
+class Memory_MonotonicResource : private Memory_ResourceUpstream, public std::pmr::monotonic_buffer_resource {
+public:
+	explicit Memory_MonotonicResource(size_t initialSize = 64 * 1024, Memory_Allocator const *allocator = Memory_CurrentAllocator) :
+			Memory_ResourceUpstream(allocator),
+			std::pmr::monotonic_buffer_resource(initialSize, &upstream) {}
+};
+
+// pools of fixed size blocks, sizes above options.largest_required_pool_block
+// go straight to the allocator. For one thread at a time
+class Memory_PoolResource : private Memory_ResourceUpstream, public std::pmr::unsynchronized_pool_resource {
+public:
+	explicit Memory_PoolResource(std::pmr::pool_options const& options = std::pmr::pool_options(),
+															 Memory_Allocator const *allocator = Memory_CurrentAllocator) :
+			Memory_ResourceUpstream(allocator),
+			std::pmr::unsynchronized_pool_resource(options, &upstream) {}
+};
+
+// as Memory_PoolResource but can be shared between threads
+class Memory_SharedPoolResource : private Memory_ResourceUpstream, public std::pmr::synchronized_pool_resource {
+public:
+	explicit Memory_SharedPoolResource(std::pmr::pool_options const& options = std::pmr::pool_options(),
+																		 Memory_Allocator const *allocator = Memory_CurrentAllocator) :
+			Memory_ResourceUpstream(allocator),
+			std::pmr::synchronized_pool_resource(options, &upstream) {}
+};
+
+#endif
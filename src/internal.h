@@ -0,0 +1,287 @@
+// License Summary: MIT see LICENSE file
+#pragma once
+#include "al2o3_platform/platform.h"
+#include "al2o3_memory/memory.h"
+
+// #define MEMORY_TRACKING 0 will switch off the cost of tracking bar a TLS push and memory for the source locations
+// #define MEMORY_TRACKING_SETUP 0 in header will remove this overhead as well..
+
+#if !defined(MEMORY_TRACKING) && (defined(MEMORY_TRACKING_SETUP) && MEMORY_TRACKING_SETUP != 0)
+#define MEMORY_TRACKING 1
+#endif
+
+#if MEMORY_TRACKING == 1 && (!defined(MEMORY_TRACKING_SETUP) && MEMORY_TRACKING_SETUP == 0)
+#error MEMORY_TRACKING requires MEMORY_TRACKING_SETUP == 1
+#endif
+
+// private to al2o3_memory, the raw OS/CRT allocation functions that every other
+// allocator in the library is eventually built on
+AL2O3_EXTERN_C void *platformMalloc(size_t size);
+AL2O3_EXTERN_C void *platformAalloc(size_t size, size_t align);
+AL2O3_EXTERN_C void *platformCalloc(size_t count, size_t size);
+AL2O3_EXTERN_C void *platformRealloc(void *ptr, size_t size);
+// align must match the original allocation (or be <= 16 for plain ones)
+AL2O3_EXTERN_C void *platformArealloc(void *ptr, size_t size, size_t align);
+AL2O3_EXTERN_C void platformFree(void *ptr);
+// 0 if the platform can't tell us
+AL2O3_EXTERN_C size_t platformUsableSize(void const *ptr);
+AL2O3_EXTERN_C bool platformTryExpandInPlace(void *ptr, size_t size);
+
+// blocks at or over the large threshold are mapped from the OS (large.c), zeroed
+// and page aligned. Only unix platforms use them
+AL2O3_EXTERN_C bool largeWanted(size_t size);
+AL2O3_EXTERN_C void *largeAlloc(size_t size, size_t align);
+// mapped bytes, 0 if ptr isn't a large block
+AL2O3_EXTERN_C size_t largeBlockSize(void const *ptr);
+// false if ptr isn't a large block
+AL2O3_EXTERN_C bool largeFree(void *ptr);
+// ptr must be a large block, align must match the original allocation
+AL2O3_EXTERN_C void *largeRealloc(void *ptr, size_t size, size_t align);
+AL2O3_EXTERN_C bool largeTryExpandInPlace(void *ptr, size_t size);
+
+// a minimal lock that can be statically initialised, so shards etc. never need
+// a create call racing the first allocation
+#if AL2O3_PLATFORM_OS == AL2O3_OS_OSX || AL2O3_PLATFORM == AL2O3_PLATFORM_UNIX
+#include <pthread.h>
+
+typedef pthread_mutex_t MemoryMutex;
+#define MEMORY_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define MUTEX_LOCK(m) pthread_mutex_lock(m);
+#define MUTEX_UNLOCK(m) pthread_mutex_unlock(m);
+
+#elif AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+#include "al2o3_platform/windows.h"
+
+typedef SRWLOCK MemoryMutex;
+#define MEMORY_MUTEX_INITIALIZER SRWLOCK_INIT
+#define MUTEX_LOCK(m) AcquireSRWLockExclusive(m);
+#define MUTEX_UNLOCK(m) ReleaseSRWLockExclusive(m);
+
+#endif
+
+// atomics used by the lock free parts of the library
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+
+AL2O3_FORCE_INLINE uint64_t atomicAdd64(uint64_t volatile *dest, uint64_t value) {
+	return (uint64_t) _InterlockedExchangeAdd64((__int64 volatile *) dest, (__int64) value) + value;
+}
+AL2O3_FORCE_INLINE uint64_t atomicLoad64(uint64_t volatile *src) {
+	return (uint64_t) _InterlockedOr64((__int64 volatile *) src, 0);
+}
+AL2O3_FORCE_INLINE void atomicStore64(uint64_t volatile *dest, uint64_t value) {
+	_InterlockedExchange64((__int64 volatile *) dest, (__int64) value);
+}
+AL2O3_FORCE_INLINE void *atomicLoadPtr(void *volatile *src) {
+	return _InterlockedCompareExchangePointer(src, NULL, NULL);
+}
+AL2O3_FORCE_INLINE void atomicStorePtr(void *volatile *dest, void *value) {
+	_InterlockedExchangePointer(dest, value);
+}
+AL2O3_FORCE_INLINE bool atomicCompareExchangePtr(void *volatile *dest, void *expected, void *value) {
+	return _InterlockedCompareExchangePointer(dest, value, expected) == expected;
+}
+AL2O3_FORCE_INLINE void *atomicExchangePtr(void *volatile *dest, void *value) {
+	return _InterlockedExchangePointer(dest, value);
+}
+AL2O3_FORCE_INLINE uint32_t atomicAdd32(uint32_t volatile *dest, uint32_t value) {
+	return (uint32_t) _InterlockedExchangeAdd((long volatile *) dest, (long) value) + value;
+}
+AL2O3_FORCE_INLINE uint32_t atomicLoad32(uint32_t volatile *src) {
+	return (uint32_t) _InterlockedOr((long volatile *) src, 0);
+}
+AL2O3_FORCE_INLINE void atomicStore32(uint32_t volatile *dest, uint32_t value) {
+	_InterlockedExchange((long volatile *) dest, (long) value);
+}
+AL2O3_FORCE_INLINE bool atomicCompareExchange32(uint32_t volatile *dest, uint32_t expected, uint32_t value) {
+	return (uint32_t) _InterlockedCompareExchange((long volatile *) dest, (long) value, (long) expected) == expected;
+}
+AL2O3_FORCE_INLINE bool atomicCompareExchange64(uint64_t volatile *dest, uint64_t expected, uint64_t value) {
+	return (uint64_t) _InterlockedCompareExchange64((__int64 volatile *) dest, (__int64) value, (__int64) expected) == expected;
+}
+// for single producer/consumer indices, the store publishes everything written before it
+AL2O3_FORCE_INLINE uint64_t atomicLoadAcquire64(uint64_t volatile *src) {
+	return (uint64_t) _InterlockedCompareExchange64((__int64 volatile *) src, 0, 0);
+}
+AL2O3_FORCE_INLINE void atomicStoreRelease64(uint64_t volatile *dest, uint64_t value) {
+	_InterlockedExchange64((__int64 volatile *) dest, (__int64) value);
+}
+// for counters with a single writer, readers just need untorn values
+AL2O3_FORCE_INLINE void counterAdd64(uint64_t volatile *dest, uint64_t value) {
+	*dest = *dest + value;
+}
+AL2O3_FORCE_INLINE uint64_t counterLoad64(uint64_t volatile *src) {
+	return *src;
+}
+
+#else
+
+AL2O3_FORCE_INLINE uint64_t atomicAdd64(uint64_t volatile *dest, uint64_t value) {
+	return __atomic_add_fetch(dest, value, __ATOMIC_RELAXED);
+}
+AL2O3_FORCE_INLINE uint64_t atomicLoad64(uint64_t volatile *src) {
+	return __atomic_load_n(src, __ATOMIC_RELAXED);
+}
+AL2O3_FORCE_INLINE void atomicStore64(uint64_t volatile *dest, uint64_t value) {
+	__atomic_store_n(dest, value, __ATOMIC_RELAXED);
+}
+AL2O3_FORCE_INLINE void *atomicLoadPtr(void *volatile *src) {
+	return __atomic_load_n(src, __ATOMIC_ACQUIRE);
+}
+AL2O3_FORCE_INLINE void atomicStorePtr(void *volatile *dest, void *value) {
+	__atomic_store_n(dest, value, __ATOMIC_RELEASE);
+}
+AL2O3_FORCE_INLINE bool atomicCompareExchangePtr(void *volatile *dest, void *expected, void *value) {
+	return __atomic_compare_exchange_n(dest, &expected, value, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+AL2O3_FORCE_INLINE void *atomicExchangePtr(void *volatile *dest, void *value) {
+	return __atomic_exchange_n(dest, value, __ATOMIC_ACQ_REL);
+}
+AL2O3_FORCE_INLINE uint32_t atomicAdd32(uint32_t volatile *dest, uint32_t value) {
+	return __atomic_add_fetch(dest, value, __ATOMIC_SEQ_CST);
+}
+AL2O3_FORCE_INLINE uint32_t atomicLoad32(uint32_t volatile *src) {
+	return __atomic_load_n(src, __ATOMIC_SEQ_CST);
+}
+AL2O3_FORCE_INLINE void atomicStore32(uint32_t volatile *dest, uint32_t value) {
+	__atomic_store_n(dest, value, __ATOMIC_SEQ_CST);
+}
+AL2O3_FORCE_INLINE bool atomicCompareExchange32(uint32_t volatile *dest, uint32_t expected, uint32_t value) {
+	return __atomic_compare_exchange_n(dest, &expected, value, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+AL2O3_FORCE_INLINE bool atomicCompareExchange64(uint64_t volatile *dest, uint64_t expected, uint64_t value) {
+	return __atomic_compare_exchange_n(dest, &expected, value, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+// for single producer/consumer indices, the store publishes everything written before it
+AL2O3_FORCE_INLINE uint64_t atomicLoadAcquire64(uint64_t volatile *src) {
+	return __atomic_load_n(src, __ATOMIC_ACQUIRE);
+}
+AL2O3_FORCE_INLINE void atomicStoreRelease64(uint64_t volatile *dest, uint64_t value) {
+	__atomic_store_n(dest, value, __ATOMIC_RELEASE);
+}
+// for counters with a single writer, readers just need untorn values
+AL2O3_FORCE_INLINE void counterAdd64(uint64_t volatile *dest, uint64_t value) {
+	__atomic_store_n(dest, __atomic_load_n(dest, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+AL2O3_FORCE_INLINE uint64_t counterLoad64(uint64_t volatile *src) {
+	return __atomic_load_n(src, __ATOMIC_RELAXED);
+}
+
+#endif
+
+// for data shared between threads that must start on its own cache line
+#if defined(_MSC_VER) && !defined(__clang__)
+#define MEMORY_CACHE_LINE_ALIGN __declspec(align(64))
+#else
+#define MEMORY_CACHE_LINE_ALIGN __attribute__((aligned(64)))
+#endif
+
+// nanoseconds from an arbitrary start, never goes backwards
+AL2O3_EXTERN_C uint64_t monotonicNs();
+
+// allocation trace recording (trace.c) of the global allocator
+typedef enum TraceEventType {
+	TRACE_ALLOC = 1,
+	TRACE_AALLOC,
+	TRACE_CALLOC,
+	TRACE_REALLOC,
+	TRACE_EXPAND,
+	TRACE_FREE,
+} TraceEventType;
+
+AL2O3_EXTERN_C uint32_t volatile g_traceRecording;
+AL2O3_EXTERN_C void traceRecord(TraceEventType type, void const *address, void const *oldAddress, size_t size, size_t align, Memory_SrcLoc const *loc);
+
+// frees should be recorded before the memory is released and everything else after,
+// so the timestamps order an address being reused on another thread. Failed
+// allocations and frees of NULL aren't recorded
+AL2O3_FORCE_INLINE void traceEvent(TraceEventType type, void const *address, void const *oldAddress, size_t size, size_t align, Memory_SrcLoc const *loc) {
+	if (address && atomicLoad32(&g_traceRecording)) {
+		traceRecord(type, address, oldAddress, size, align, loc);
+	}
+}
+
+// live heap statistics, fed by the global and temp allocators
+typedef enum MemoryStatsCategory {
+	MSC_PLAIN,
+	MSC_ALIGNED,
+	MSC_TEMP,
+	MSC_COUNT
+} MemoryStatsCategory;
+
+#if MEMORY_STATS == 1
+AL2O3_EXTERN_C void memoryStatsAlloc(MemoryStatsCategory category, size_t size);
+AL2O3_EXTERN_C void memoryStatsAllocMany(MemoryStatsCategory category, uint64_t count, size_t size);
+AL2O3_EXTERN_C void memoryStatsFree(MemoryStatsCategory category, size_t size);
+AL2O3_EXTERN_C void memoryStatsFreeMany(MemoryStatsCategory category, uint64_t count, size_t size);
+AL2O3_EXTERN_C void memoryStatsRealloc(MemoryStatsCategory category, size_t oldSize, size_t newSize);
+#else
+#define memoryStatsAlloc(category, size)
+#define memoryStatsAllocMany(category, count, size)
+#define memoryStatsFree(category, size)
+#define memoryStatsFreeMany(category, count, size)
+#define memoryStatsRealloc(category, oldSize, newSize)
+#endif
+
+// per tag counters (tags.c), tag 0 is never counted. False if the hard budget refuses it
+AL2O3_EXTERN_C bool tagAlloc(uint16_t tag, uint64_t count, size_t size);
+AL2O3_EXTERN_C void tagFree(uint16_t tag, uint64_t count, size_t size);
+AL2O3_EXTERN_C bool tagResize(uint16_t tag, size_t oldSize, size_t newSize);
+
+#if MEMORY_TRACKING == 1
+// the return address of the function using it, for stackCapture
+#if defined(_MSC_VER) && !defined(__clang__)
+#define MEMORY_RETURN_ADDRESS() _ReturnAddress()
+#else
+#define MEMORY_RETURN_ADDRESS() __builtin_return_address(0)
+#endif
+
+// hash consed call stacks, 0 if capture is off or failed. Frames above caller
+// (the return address of the public allocation function) are dropped if it is found
+AL2O3_EXTERN_C uint32_t stackCapture(void const *caller);
+// copies up to maxFrames innermost first, returns the depth of the stack
+AL2O3_EXTERN_C uint32_t stackGetFrames(uint32_t stackId, void **frames, uint32_t maxFrames);
+AL2O3_EXTERN_C size_t stackSymbolize(void const *frame, char *buffer, size_t size);
+// only when nothing refers to a stack anymore (tracker destroy)
+AL2O3_EXTERN_C void stackReset();
+
+// per callsite totals of tracked allocations, each AllocUnit points at its callsite
+typedef struct Callsite {
+	char const *sourceFile;
+	char const *sourceFunc;
+	uint32_t sourceLine;
+	uint32_t hash;
+	uint32_t stackId; // 0 if stacks aren't being captured
+	uint32_t srcLocId; // id of the first static Memory_SrcLoc seen here, 0 if none
+
+	uint64_t volatile liveBytes;
+	uint64_t volatile liveCount;
+	uint64_t volatile totalBytes;
+	uint64_t volatile totalAllocs;
+	uint64_t volatile totalFrees;
+} Callsite;
+
+// NULL if out of memory, callsites stay valid until callsiteReset.
+// Static locs get their id here, without a stack those ids find the callsite without a lock
+AL2O3_EXTERN_C Callsite *callsiteFor(Memory_SrcLoc *loc, uint32_t stackId);
+// only when nothing points at a callsite anymore (tracker destroy)
+AL2O3_EXTERN_C void callsiteReset();
+
+// weight is how many allocations a tracked one stands for, 1 unless sampling
+AL2O3_FORCE_INLINE void callsiteAlloc(Callsite *callsite, uint64_t size, uint64_t weight) {
+	if (callsite) {
+		atomicAdd64(&callsite->liveBytes, size * weight);
+		atomicAdd64(&callsite->liveCount, weight);
+		atomicAdd64(&callsite->totalBytes, size * weight);
+		atomicAdd64(&callsite->totalAllocs, weight);
+	}
+}
+
+AL2O3_FORCE_INLINE void callsiteFree(Callsite *callsite, uint64_t size, uint64_t weight) {
+	if (callsite) {
+		atomicAdd64(&callsite->liveBytes, (uint64_t) -(int64_t) (size * weight));
+		atomicAdd64(&callsite->liveCount, (uint64_t) -(int64_t) weight);
+		atomicAdd64(&callsite->totalFrees, weight);
+	}
+}
+#endif
@@ -0,0 +1,322 @@
+// License Summary: MIT see LICENSE file
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // for mremap
+#endif
+#include "al2o3_memory/memory.h"
+#include "internal.h"
+
+// Big blocks skip the heap and are mapped straight from the OS. Fresh pages
+// are already zero so calloc leaves them alone, realloc remaps rather than
+// copies and free unmaps so the memory goes straight back.
+// Mappings always start on a page boundary, the registry is only searched for
+// page aligned pointers (which the heap rarely hands out) and only when there
+// are large blocks live.
+
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_UNIX || AL2O3_PLATFORM_OS == AL2O3_OS_OSX
+#include <sys/mman.h>
+#include <unistd.h>
+
+// every page size is a multiple of this, so its enough to filter pointers
+#define largeMinPageSize 4096u
+#define largeHugePageSize (2u * 1024u * 1024u)
+
+typedef struct LargeBlock {
+	void *address; // NULL is an empty slot
+	size_t size; // mapped bytes, a page multiple
+} LargeBlock;
+
+typedef struct LargeRegistry {
+	MemoryMutex mutex;
+	LargeBlock *slots;
+	uint32_t slotCapacity; // always a power of 2
+	uint32_t count;
+	uint64_t volatile live; // read without the lock, frees skip the lookup when 0
+} LargeRegistry;
+
+static LargeRegistry g_large = { MEMORY_MUTEX_INITIALIZER, NULL, 0, 0, 0 };
+static uint64_t volatile g_largeThreshold = Memory_DefaultLargeAllocThreshold;
+static uint32_t volatile g_largeHugePages = 0;
+static uint64_t volatile g_pageSize = 0;
+
+static size_t pageSize() {
+	uint64_t size = atomicLoad64(&g_pageSize);
+	if (size == 0) {
+		size = (uint64_t) sysconf(_SC_PAGESIZE);
+		atomicStore64(&g_pageSize, size);
+	}
+	return (size_t) size;
+}
+
+AL2O3_FORCE_INLINE size_t roundUp(size_t size, size_t align) {
+	return (size + (align - 1)) & ~(align - 1);
+}
+
+AL2O3_FORCE_INLINE uint32_t hashAddress(void const *address) {
+	return (uint32_t) ((((uint64_t) (uintptr_t) address) >> 12) * 0x9E3779B97F4A7C15ull >> 32);
+}
+
+// call with the registry locked
+static LargeBlock *findBlock(void const *address) {
+	if (g_large.slots == NULL) {
+		return NULL;
+	}
+	uint32_t const mask = g_large.slotCapacity - 1;
+	uint32_t slot = hashAddress(address) & mask;
+	while (g_large.slots[slot].address) {
+		if (g_large.slots[slot].address == address) {
+			return &g_large.slots[slot];
+		}
+		slot = (slot + 1) & mask;
+	}
+	return NULL;
+}
+
+// call with the registry locked. The table is mapped too, so growing it can't
+// come back in here through the platform allocator
+static bool growSlots() {
+	uint32_t const capacity = g_large.slotCapacity ? g_large.slotCapacity * 2 : 256;
+	LargeBlock *slots = (LargeBlock *) mmap(NULL, capacity * sizeof(LargeBlock), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (slots == MAP_FAILED) {
+		return false;
+	}
+	for (uint32_t i = 0; i < g_large.slotCapacity; ++i) {
+		if (g_large.slots[i].address) {
+			uint32_t slot = hashAddress(g_large.slots[i].address) & (capacity - 1);
+			while (slots[slot].address) {
+				slot = (slot + 1) & (capacity - 1);
+			}
+			slots[slot] = g_large.slots[i];
+		}
+	}
+	if (g_large.slots) {
+		munmap(g_large.slots, g_large.slotCapacity * sizeof(LargeBlock));
+	}
+	g_large.slots = slots;
+	g_large.slotCapacity = capacity;
+	return true;
+}
+
+// call with the registry locked
+static bool insertBlock(void *address, size_t size) {
+	if ((g_large.count + 1) * 2 > g_large.slotCapacity && !growSlots()) {
+		return false;
+	}
+	uint32_t const mask = g_large.slotCapacity - 1;
+	uint32_t slot = hashAddress(address) & mask;
+	while (g_large.slots[slot].address) {
+		slot = (slot + 1) & mask;
+	}
+	g_large.slots[slot].address = address;
+	g_large.slots[slot].size = size;
+	g_large.count++;
+	atomicAdd64(&g_large.live, 1);
+	return true;
+}
+
+// call with the registry locked, shifts the rest of the run back so lookups never need tombstones
+static void removeBlock(LargeBlock *block) {
+	uint32_t const mask = g_large.slotCapacity - 1;
+	uint32_t hole = (uint32_t) (block - g_large.slots);
+	uint32_t slot = hole;
+	g_large.slots[hole].address = NULL;
+	for (;;) {
+		slot = (slot + 1) & mask;
+		if (g_large.slots[slot].address == NULL) {
+			break;
+		}
+		uint32_t const home = hashAddress(g_large.slots[slot].address) & mask;
+		// move it if the hole lies between its home and where it is now
+		if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+			g_large.slots[hole] = g_large.slots[slot];
+			g_large.slots[slot].address = NULL;
+			hole = slot;
+		}
+	}
+	g_large.count--;
+	atomicAdd64(&g_large.live, (uint64_t) -1);
+}
+
+static bool wantHugePages(size_t size) {
+	return atomicLoad32(&g_largeHugePages) && size >= largeHugePageSize;
+}
+
+static void adviseHugePages(void *address, size_t size) {
+#if defined(MADV_HUGEPAGE)
+	if (wantHugePages(size)) {
+		madvise(address, size, MADV_HUGEPAGE);
+	}
+#endif
+}
+
+// over maps then trims, so the block starts on the alignment
+static void *mapPages(size_t size, size_t align) {
+	size_t const page = pageSize();
+	if (align < page) {
+		align = page;
+	}
+	size_t const mapSize = size + (align - page);
+	uint8_t *mem = (uint8_t *) mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		return NULL;
+	}
+	uint8_t *start = (uint8_t *) roundUp((uintptr_t) mem, align);
+	if (start != mem) {
+		munmap(mem, (size_t) (start - mem));
+	}
+	size_t const tail = (size_t) ((mem + mapSize) - (start + size));
+	if (tail) {
+		munmap(start + size, tail);
+	}
+	adviseHugePages(start, size);
+	return start;
+}
+
+AL2O3_EXTERN_C bool largeWanted(size_t size) {
+	uint64_t const threshold = atomicLoad64(&g_largeThreshold);
+	return threshold != 0 && size >= threshold;
+}
+
+AL2O3_EXTERN_C void *largeAlloc(size_t size, size_t align) {
+	size = roundUp(size ? size : 1, pageSize());
+	if (wantHugePages(size) && align < largeHugePageSize) {
+		align = largeHugePageSize;
+	}
+	void *mem = mapPages(size, align);
+	if (mem == NULL) {
+		return NULL;
+	}
+	MUTEX_LOCK(&g_large.mutex)
+	bool const inserted = insertBlock(mem, size);
+	MUTEX_UNLOCK(&g_large.mutex)
+	if (!inserted) {
+		munmap(mem, size);
+		return NULL;
+	}
+	return mem;
+}
+
+AL2O3_EXTERN_C size_t largeBlockSize(void const *ptr) {
+	if (ptr == NULL || (((uintptr_t) ptr) & (largeMinPageSize - 1)) != 0 || atomicLoad64(&g_large.live) == 0) {
+		return 0;
+	}
+	MUTEX_LOCK(&g_large.mutex)
+	LargeBlock const *block = findBlock(ptr);
+	size_t const size = block ? block->size : 0;
+	MUTEX_UNLOCK(&g_large.mutex)
+	return size;
+}
+
+AL2O3_EXTERN_C bool largeFree(void *ptr) {
+	if (ptr == NULL || (((uintptr_t) ptr) & (largeMinPageSize - 1)) != 0 || atomicLoad64(&g_large.live) == 0) {
+		return false;
+	}
+	MUTEX_LOCK(&g_large.mutex)
+	LargeBlock *block = findBlock(ptr);
+	size_t const size = block ? block->size : 0;
+	if (block) {
+		removeBlock(block);
+	}
+	MUTEX_UNLOCK(&g_large.mutex)
+	if (size) {
+		munmap(ptr, size);
+	}
+	return size != 0;
+}
+
+AL2O3_EXTERN_C void *largeRealloc(void *ptr, size_t size, size_t align) {
+	size_t const page = pageSize();
+	size_t const newSize = roundUp(size ? size : 1, page);
+
+	MUTEX_LOCK(&g_large.mutex)
+	LargeBlock *block = findBlock(ptr);
+	ASSERT(block);
+	size_t const oldSize = block->size;
+	if (newSize == oldSize) {
+		MUTEX_UNLOCK(&g_large.mutex)
+		return ptr;
+	}
+#if defined(MREMAP_MAYMOVE)
+	// the kernel moves the pages rather than copying them, but a move only keeps page alignment
+	void *remapped = mremap(ptr, oldSize, newSize, (align > page) ? 0 : MREMAP_MAYMOVE);
+	if (remapped != MAP_FAILED) {
+		if (remapped == ptr) {
+			block->size = newSize;
+		} else {
+			// can't need to grow the table, a block was just removed
+			removeBlock(block);
+			insertBlock(remapped, newSize);
+		}
+		MUTEX_UNLOCK(&g_large.mutex)
+		if (newSize > oldSize) {
+			adviseHugePages(remapped, newSize);
+		}
+		return remapped;
+	}
+#endif
+	if (newSize < oldSize) {
+		munmap((uint8_t *) ptr + newSize, oldSize - newSize);
+		block->size = newSize;
+		MUTEX_UNLOCK(&g_large.mutex)
+		return ptr;
+	}
+	MUTEX_UNLOCK(&g_large.mutex)
+
+	void *mem = largeAlloc(size, align);
+	if (mem) {
+		memcpy(mem, ptr, oldSize);
+		largeFree(ptr);
+	}
+	return mem;
+}
+
+AL2O3_EXTERN_C bool largeTryExpandInPlace(void *ptr, size_t size) {
+	size_t const newSize = roundUp(size, pageSize());
+	MUTEX_LOCK(&g_large.mutex)
+	LargeBlock *block = findBlock(ptr);
+	bool expanded = block && newSize <= block->size;
+#if defined(MREMAP_MAYMOVE)
+	if (block && !expanded && mremap(ptr, block->size, newSize, 0) != MAP_FAILED) {
+		block->size = newSize;
+		expanded = true;
+	}
+#endif
+	MUTEX_UNLOCK(&g_large.mutex)
+	return expanded;
+}
+
+AL2O3_EXTERN_C void Memory_SetLargeAllocThreshold(size_t threshold) {
+	atomicStore64(&g_largeThreshold, (uint64_t) threshold);
+}
+
+AL2O3_EXTERN_C size_t Memory_GetLargeAllocThreshold() {
+	return (size_t) atomicLoad64(&g_largeThreshold);
+}
+
+AL2O3_EXTERN_C void Memory_SetLargeAllocHugePages(bool enable) {
+	atomicStore32(&g_largeHugePages, enable ? 1 : 0);
+}
+
+AL2O3_EXTERN_C bool Memory_GetLargeAllocHugePages() {
+	return atomicLoad32(&g_largeHugePages) != 0;
+}
+
+#else
+
+AL2O3_EXTERN_C void Memory_SetLargeAllocThreshold(size_t threshold) {
+	if (threshold != 0) {
+		LOGWARNING("Large allocations aren't mapped on this platform");
+	}
+}
+
+AL2O3_EXTERN_C size_t Memory_GetLargeAllocThreshold() {
+	return 0;
+}
+
+AL2O3_EXTERN_C void Memory_SetLargeAllocHugePages(bool enable) {
+}
+
+AL2O3_EXTERN_C bool Memory_GetLargeAllocHugePages() {
+	return false;
+}
+
+#endif
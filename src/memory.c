@@ -1,50 +1,216 @@
 // License Summary: MIT see LICENSE file
 #include "al2o3_memory/memory.h"
 #include "al2o3_platform/utf8.h"
+#include "internal.h"
 
-AL2O3_THREAD_LOCAL char const *g_lastSourceFile = NULL;
-AL2O3_THREAD_LOCAL unsigned int g_lastSourceLine = 0;
-AL2O3_THREAD_LOCAL char const *g_lastSourceFunc = NULL;
-static uint64_t g_allocCounter = 0;
+static AL2O3_THREAD_LOCAL Memory_SrcLoc *g_lastSrcLoc = NULL;
+static AL2O3_THREAD_LOCAL Memory_SrcLoc g_scratchSrcLoc;
 uint64_t Memory_TrackerBreakOnAllocNumber = 0; // set this here or in code before the allocation occurs to break
 
-// #define MEMORY_TRACKING 0 will switch off the cost of tracking bar 3 TLS pushing and memory for the strings
-// #define MEMORY_TRACKING_SETUP 0 in header will remove this overhead as well..
-
-#if !defined(MEMORY_TRACKING) && (defined(MEMORY_TRACKING_SETUP) && MEMORY_TRACKING_SETUP != 0)
-#define MEMORY_TRACKING 1
-#endif
-
-#if MEMORY_TRACKING == 1 && (!defined(MEMORY_TRACKING_SETUP) && MEMORY_TRACKING_SETUP == 0)
-#error MEMORY_TRACKING requires MEMORY_TRACKING_SETUP == 1
-#endif
+AL2O3_EXTERN_C bool Memory_TrackerPushSrcLoc(Memory_SrcLoc *loc) {
+	g_lastSrcLoc = loc;
+	return true;
+}
 
 AL2O3_EXTERN_C bool
 Memory_TrackerPushNextSrcLoc(const char *sourceFile,
 														 const unsigned int sourceLine,
 														 const char *sourceFunc) {
-	g_lastSourceFile = sourceFile;
-	g_lastSourceLine = sourceLine;
-	g_lastSourceFunc = sourceFunc;
+	Memory_SrcLoc *loc = &g_scratchSrcLoc;
+	loc->sourceFile = sourceFile;
+	loc->sourceFunc = sourceFunc;
+	loc->sourceLine = sourceLine;
+	loc->id = Memory_SrcLocNoId;
+	g_lastSrcLoc = loc;
+	return true;
+}
+
+static AL2O3_THREAD_LOCAL Memory_Tag g_currentTag = 0;
+static AL2O3_THREAD_LOCAL uint32_t g_nextTag = 0; // the pushed tag + 1, 0 if none
+
+AL2O3_EXTERN_C Memory_Tag Memory_SetTag(Memory_Tag tag) {
+	Memory_Tag const previous = g_currentTag;
+	if (tag >= Memory_MaxTags) {
+		LOGERROR("Memory tag %u is out of range", (unsigned int) tag);
+		tag = 0;
+	}
+	g_currentTag = tag;
+	return previous;
+}
+
+AL2O3_EXTERN_C Memory_Tag Memory_GetTag() {
+	return g_currentTag;
+}
+
+AL2O3_EXTERN_C bool Memory_PushNextTag(Memory_Tag tag) {
+	if (tag >= Memory_MaxTags) {
+		LOGERROR("Memory tag %u is out of range", (unsigned int) tag);
+		tag = 0;
+	}
+	g_nextTag = (uint32_t) tag + 1;
+	return true;
+}
+
+AL2O3_THREAD_LOCAL Memory_Allocator const *Memory_CurrentAllocator = &Memory_GlobalAllocator;
+// what was current before each push, pushes past the max depth are only counted
+static AL2O3_THREAD_LOCAL Memory_Allocator const *g_allocatorStack[Memory_AllocatorStackMaxDepth];
+static AL2O3_THREAD_LOCAL uint32_t g_allocatorStackDepth = 0;
+
+// every allocator ever pushed, so its blocks find their way back after the pop.
+// Copies, so one on the stack can be pushed. Entries never change once counted
+static Memory_Allocator g_owners[Memory_AllocatorMaxOwners];
+static uint32_t volatile g_ownerCount = 0;
+static MemoryMutex g_ownersMutex = MEMORY_MUTEX_INITIALIZER;
+
+static bool findOwner(Memory_Allocator const *allocator, uint32_t first, uint32_t count) {
+	for (uint32_t i = first; i < count; ++i) {
+		if (memcmp(&g_owners[i], allocator, sizeof(Memory_Allocator)) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool rememberOwner(Memory_Allocator const *allocator) {
+	if (allocator->owns == NULL) {
+		LOGERROR("Only allocators with an owns function can be pushed, the current allocator is unchanged");
+		return false;
+	}
+	uint32_t const seen = atomicLoad32(&g_ownerCount);
+	if (findOwner(allocator, 0, seen)) {
+		return true;
+	}
+
+	bool remembered = true;
+	MUTEX_LOCK(&g_ownersMutex)
+	uint32_t const count = g_ownerCount;
+	if (!findOwner(allocator, seen, count)) {
+		if (count == Memory_AllocatorMaxOwners) {
+			LOGERROR("Too many allocators pushed, the current allocator is unchanged");
+			remembered = false;
+		} else {
+			g_owners[count] = *allocator;
+			atomicStore32(&g_ownerCount, count + 1);
+		}
+	}
+	MUTEX_UNLOCK(&g_ownersMutex)
+	return remembered;
+}
+
+AL2O3_EXTERN_C bool Memory_PushAllocator(Memory_Allocator const *allocator) {
+	uint32_t const depth = g_allocatorStackDepth++;
+	if (depth >= Memory_AllocatorStackMaxDepth) {
+		LOGERROR("Allocator stack overflow, the current allocator is unchanged");
+		return false;
+	}
+	g_allocatorStack[depth] = Memory_CurrentAllocator;
+	if (allocator != &Memory_GlobalAllocator && !rememberOwner(allocator)) {
+		return false;
+	}
+	Memory_CurrentAllocator = allocator;
+	return true;
+}
+
+AL2O3_EXTERN_C void Memory_PopAllocator() {
+	if (g_allocatorStackDepth == 0) {
+		LOGERROR("Memory_PopAllocator without a matching push");
+		return;
+	}
+	uint32_t const depth = --g_allocatorStackDepth;
+	if (depth < Memory_AllocatorStackMaxDepth) {
+		Memory_CurrentAllocator = g_allocatorStack[depth];
+	}
+}
+
+// for allocations made without a pushed source location
+static Memory_SrcLoc g_unknownSrcLoc = { NULL, NULL, 0, 0 };
+
+// a push is for the next allocation only
+AL2O3_FORCE_INLINE Memory_SrcLoc *takeSrcLoc() {
+	Memory_SrcLoc *loc = g_lastSrcLoc;
+	g_lastSrcLoc = NULL;
+	return loc ? loc : &g_unknownSrcLoc;
+}
+
+AL2O3_EXTERN_C void Memory_FreeBatch(Memory_Allocator const *allocator, size_t count, void **ptrs) {
+	if (allocator->freeBatch) {
+		allocator->freeBatch(count, ptrs);
+		return;
+	}
+	for (size_t i = 0; i < count; ++i) {
+		if (ptrs[i]) {
+			allocator->free(ptrs[i]);
+		}
+	}
+}
+
+AL2O3_EXTERN_C Memory_Allocator const *Memory_OwnerOf(void const *memory) {
+	if (memory == NULL) {
+		return Memory_CurrentAllocator;
+	}
+	for (uint32_t i = atomicLoad32(&g_ownerCount); i > 0; --i) {
+		if (g_owners[i - 1].owns(memory)) {
+			return &g_owners[i - 1];
+		}
+	}
+	return &Memory_GlobalAllocator;
+}
+
+// runs with the same owner go as one batch
+AL2O3_EXTERN_C void Memory_OwnerFreeBatch(size_t count, void **ptrs) {
+	size_t first = 0;
+	while (first < count) {
+		Memory_Allocator const *owner = Memory_OwnerOf(ptrs[first]);
+		size_t last = first + 1;
+		while (last < count && (ptrs[last] == NULL || Memory_OwnerOf(ptrs[last]) == owner)) {
+			++last;
+		}
+		Memory_FreeBatch(owner, last - first, ptrs + first);
+		first = last;
+	}
+}
+
+AL2O3_EXTERN_C bool Memory_MallocBatch(Memory_Allocator const *allocator, size_t count, size_t size, void **outPtrs) {
+	// the batch as a whole has to have a size
+	if (size != 0 && count > SIZE_MAX / size) {
+		LOGERROR("Batch of %zu blocks of %zu bytes is too big", count, size);
+		memset(outPtrs, 0, count * sizeof(void *));
+		g_lastSrcLoc = NULL;
+		return false;
+	}
+	if (allocator->mallocBatch) {
+		return allocator->mallocBatch(count, size, outPtrs);
+	}
+
+	// one at a time, each block takes the same pushed source location
+	Memory_SrcLoc *loc = g_lastSrcLoc;
+	for (size_t i = 0; i < count; ++i) {
+		g_lastSrcLoc = loc;
+		outPtrs[i] = allocator->malloc(size);
+		if (outPtrs[i] == NULL) {
+			g_lastSrcLoc = NULL;
+			Memory_FreeBatch(allocator, i, outPtrs);
+			memset(outPtrs, 0, count * sizeof(void *));
+			return false;
+		}
+	}
+	g_lastSrcLoc = NULL;
 	return true;
 }
 
 #if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
 #include "malloc.h"
 // on win32 we only have 8-byte alignment guaranteed, but the CRT provides special aligned allocation fns
-AL2O3_FORCE_INLINE AL2O3_EXTERN_C
-void *platformMalloc(size_t size) {
+AL2O3_EXTERN_C void *platformMalloc(size_t size) {
 	return _aligned_malloc(size, 16);
 }
 
-AL2O3_FORCE_INLINE AL2O3_EXTERN_C
-void *platformAalloc(size_t size, size_t align) {
+AL2O3_EXTERN_C void *platformAalloc(size_t size, size_t align) {
 	return _aligned_malloc(size, align);
 }
 
-AL2O3_FORCE_INLINE AL2O3_EXTERN_C
-void *platformCalloc(size_t count, size_t size) {
-	if (count == 0) {
+AL2O3_EXTERN_C void *platformCalloc(size_t count, size_t size) {
+	if (count == 0 || size > SIZE_MAX / count) {
 		return NULL;
 	}
 	void *mem = _aligned_malloc(count * size, 16);
@@ -54,20 +220,46 @@ void *platformCalloc(size_t count, size_t size) {
 	return mem;
 }
 
-AL2O3_FORCE_INLINE AL2O3_EXTERN_C
-void *platformRealloc(void *ptr, size_t size) {
+AL2O3_EXTERN_C void *platformRealloc(void *ptr, size_t size) {
 	return _aligned_realloc(ptr, size, 16);
 }
 
-AL2O3_FORCE_INLINE AL2O3_EXTERN_C
-void platformFree(void *ptr) {
+// the CRT remembers the alignment, but it must match the original allocation
+AL2O3_EXTERN_C void *platformArealloc(void *ptr, size_t size, size_t align) {
+	if (align < 16) {
+		align = 16;
+	}
+	if (ptr && size <= _aligned_msize(ptr, align, 0)) {
+		return ptr;
+	}
+	return _aligned_realloc(ptr, size, align);
+}
+
+AL2O3_EXTERN_C void platformFree(void *ptr) {
 	_aligned_free(ptr);
 }
 
+AL2O3_EXTERN_C size_t platformUsableSize(void const *ptr) {
+	return _aligned_msize((void *) ptr, 16, 0);
+}
+
+AL2O3_EXTERN_C bool platformTryExpandInPlace(void *ptr, size_t size) {
+	// _expand doesn't understand the aligned heap, so only the slack we already have
+	return size <= platformUsableSize(ptr);
+}
+
 #elif AL2O3_PLATFORM == AL2O3_PLATFORM_UNIX || AL2O3_PLATFORM_OS == AL2O3_OS_OSX
+#if AL2O3_PLATFORM_OS == AL2O3_OS_OSX
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
 
 AL2O3_EXTERN_C void* platformMalloc(size_t size)
 {
+	if(largeWanted(size)) {
+		return largeAlloc(size, 16);
+	}
 	void* mem;
 	posix_memalign(&mem, 16, size);
 	return mem;
@@ -75,6 +267,9 @@ AL2O3_EXTERN_C void* platformMalloc(size_t size)
 
 AL2O3_EXTERN_C void* platformAalloc(size_t size, size_t align)
 {
+	if(largeWanted(size)) {
+		return largeAlloc(size, align);
+	}
 	void* mem;
 	posix_memalign(&mem, align, size);
 	return mem;
@@ -82,9 +277,13 @@ AL2O3_EXTERN_C void* platformAalloc(size_t size, size_t align)
 
 AL2O3_EXTERN_C void* platformCalloc(size_t count, size_t size)
 {
-	if(count == 0) {
+	if(count == 0 || size > SIZE_MAX / count) {
 		return NULL;
 	}
+	// fresh mappings are already zero, so the pages are never touched
+	if(largeWanted(count * size)) {
+		return largeAlloc(count * size, 16);
+	}
 
 	void* mem;
 	posix_memalign(&mem, 16, count * size);
@@ -94,7 +293,34 @@ AL2O3_EXTERN_C void* platformCalloc(size_t count, size_t size)
 	return mem;
 }
 
+// remaps large blocks and moves blocks crossing the threshold between the heap
+// and a mapping, false if neither the old or new block is large
+static bool largeArealloc(void* ptr, size_t size, size_t align, void** result) {
+	size_t const mapped = largeBlockSize(ptr);
+	// stay mapped until well below the threshold, so sizes around it don't bounce
+	if(mapped && largeWanted(size * 2)) {
+		*result = largeRealloc(ptr, size, align);
+		return true;
+	}
+	if(mapped == 0 && !largeWanted(size)) {
+		return false;
+	}
+
+	void* mem = platformAalloc(size, (align > 16) ? align : 16);
+	if(mem && ptr) {
+		size_t const oldSize = mapped ? mapped : platformUsableSize(ptr);
+		memcpy(mem, ptr, (oldSize < size) ? oldSize : size);
+		platformFree(ptr);
+	}
+	*result = mem;
+	return true;
+}
+
 AL2O3_EXTERN_C void* platformRealloc(void* ptr, size_t size) {
+	void* mem;
+	if(largeArealloc(ptr, size, 16, &mem)) {
+		return mem;
+	}
 	// technically this appears to be a bit dodgy but given
 	// chromium and ffmpeg do this according to
 	// https://trac.ffmpeg.org/ticket/6403
@@ -104,22 +330,72 @@ AL2O3_EXTERN_C void* platformRealloc(void* ptr, size_t size) {
 	return ptr;
 }
 
+AL2O3_EXTERN_C void* platformArealloc(void* ptr, size_t size, size_t align) {
+	if(align <= 16) {
+		return platformRealloc(ptr, size);
+	}
+	if(ptr == NULL) {
+		return platformAalloc(size, align);
+	}
+	void* mem;
+	if(largeArealloc(ptr, size, align, &mem)) {
+		return mem;
+	}
+
+	// the slack malloc gave us is often enough
+	size_t const usable = platformUsableSize(ptr);
+	if(size <= usable) {
+		return ptr;
+	}
+
+	// realloc can't be asked to keep the alignment so we have to copy
+	mem = platformAalloc(size, align);
+	if(mem) {
+		memcpy(mem, ptr, usable);
+		free(ptr);
+	}
+	return mem;
+}
+
 AL2O3_EXTERN_C void platformFree(void* ptr)
 {
-	free(ptr);
+	if(!largeFree(ptr)) {
+		free(ptr);
+	}
+}
+
+AL2O3_EXTERN_C size_t platformUsableSize(void const* ptr) {
+	size_t const mapped = largeBlockSize(ptr);
+	if(mapped) {
+		return mapped;
+	}
+#if AL2O3_PLATFORM_OS == AL2O3_OS_OSX
+	return malloc_size(ptr);
+#else
+	return malloc_usable_size((void*) ptr);
+#endif
+}
+
+AL2O3_EXTERN_C bool platformTryExpandInPlace(void* ptr, size_t size) {
+	if(largeBlockSize(ptr)) {
+		return largeTryExpandInPlace(ptr, size);
+	}
+	return size <= platformUsableSize(ptr);
 }
 
 #else
 
+// over allocate and keep the real pointer and the alignment just before the aligned one
 AL2O3_EXTERN_C void* platformAalloc(size_t size, size_t align)
 {
-		int const offset = align - 1 + sizeof(void*);
+		size_t const offset = align - 1 + sizeof(void*) * 2;
 		void* p1 = malloc(size + offset);
 
 		if (p1 == NULL) return NULL;
 
 		void** p2 = (void**)(((size_t)(p1) + offset) & ~(align - 1));
 		p2[-1] = p1;
+		p2[-2] = (void*)align;
 
 		return p2;
 }
@@ -131,7 +407,7 @@ AL2O3_EXTERN_C void* platformMalloc(size_t size)
 
 AL2O3_EXTERN_C void* platformCalloc(size_t count, size_t size)
 {
-	if(count == 0) {
+	if(count == 0 || size > SIZE_MAX / count) {
 		return NULL;
 	}
 
@@ -142,53 +418,80 @@ AL2O3_EXTERN_C void* platformCalloc(size_t count, size_t size)
 	return mem;
 }
 
-AL2O3_EXTERN_C void* platformRealloc(void* ptr, size_t size) {
+AL2O3_EXTERN_C void* platformArealloc(void* ptr, size_t size, size_t align) {
+	if(ptr == NULL) {
+		return platformAalloc(size, align);
+	}
 
-	// TODO store align? or at least warn if realloc on unknown with align != 16
-	int const align = 16;
-	int const offset = align - 1 + sizeof(void*);
-	void* p1 = realloc(ptr, size + offset);
+	// never drop below the alignment the block already has
+	size_t const oldAlign = (size_t)((void**)ptr)[-2];
+	if(align < oldAlign) {
+		align = oldAlign;
+	}
+
+	void* const oldP1 = ((void**)ptr)[-1];
+	size_t const oldShift = (size_t)((uint8_t*)ptr - (uint8_t*)oldP1);
+	size_t const offset = align - 1 + sizeof(void*) * 2;
+	void* p1 = realloc(oldP1, size + offset);
 	if(!p1) return NULL;
 
+	// realloc keeps the bytes where they were relative to p1, which may not be aligned anymore
 	void** p2 = (void**)(((size_t)(p1) + offset) & ~(align - 1));
+	if((uint8_t*)p2 - (uint8_t*)p1 != oldShift) {
+		memmove(p2, (uint8_t*)p1 + oldShift, size);
+	}
 	p2[-1] = p1;
+	p2[-2] = (void*)align;
 
 	return p2;
+}
 
+AL2O3_EXTERN_C void* platformRealloc(void* ptr, size_t size) {
+	return platformArealloc(ptr, size, 16);
 }
 
 AL2O3_EXTERN_C void platformFree(void* ptr)
 {
-	free(((void**)ptr)[-1]);
+	if(ptr) {
+		free(((void**)ptr)[-1]);
+	}
 }
 
-#endif
+AL2O3_EXTERN_C size_t platformUsableSize(void const* ptr) {
+	return 0;
+}
 
-#if MEMORY_TRACKING == 1
+AL2O3_EXTERN_C bool platformTryExpandInPlace(void* ptr, size_t size) {
+	return false;
+}
 
-#if AL2O3_PLATFORM_OS == AL2O3_OS_OSX || AL2O3_PLATFORM == AL2O3_PLATFORM_UNIX
-#include <unistd.h>
-#include <sys/sysctl.h>
-#if defined(__linux__)
-#include <sys/sysinfo.h>
 #endif
-#include <pthread.h>
 
-static pthread_mutex_t g_allocMutex = PTHREAD_MUTEX_INITIALIZER;
-#define MUTEX_CREATE
-#define MUTEX_DESTROY
-#define MUTEX_LOCK   pthread_mutex_lock(&g_allocMutex);
-#define MUTEX_UNLOCK pthread_mutex_unlock(&g_allocMutex);
+static void platformFreeSized(void *ptr, size_t size) {
+	(void) size;
+	platformFree(ptr);
+}
 
-#elif AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
-#include "al2o3_platform/windows.h"
+AL2O3_EXTERN_C Memory_Allocator Memory_PlatformAllocator = {
+		&platformMalloc,
+		&platformAalloc,
+		&platformCalloc,
+		&platformRealloc,
+		&platformFree,
+		&platformFreeSized,
+		&platformUsableSize,
+		&platformTryExpandInPlace,
+		&platformArealloc
+};
 
-static CRITICAL_SECTION g_allocMutex;
-#define MUTEX_CREATE InitializeCriticalSection(&g_allocMutex);
-#define MUTEX_DESTROY DeleteCriticalSection(&g_allocMutex);
-#define MUTEX_LOCK   EnterCriticalSection(&g_allocMutex);
-#define MUTEX_UNLOCK LeaveCriticalSection(&g_allocMutex);
+#if MEMORY_TRACKING == 1
 
+// MEMORY_TRACKING_HEADER 1 (the default) finds the tracking record of an allocation
+// directly from its header, so free and realloc never search for it.
+// MEMORY_TRACKING_HEADER 0 looks every allocation up in the trackers hash tables
+// instead, which is slower but validates every pointer before its header is touched
+#if !defined(MEMORY_TRACKING_HEADER)
+#define MEMORY_TRACKING_HEADER 1
 #endif
 
 // ---------------------------------------------------------------------------------------------------------------------------------
@@ -196,57 +499,125 @@ static CRITICAL_SECTION g_allocMutex;
 //
 // Copyright 2000, Fluid Studios, Inc., all rights reserved.
 // ---------------------------------------------------------------------------------------------------------------------------------
-#define REPORTED_ADDRESS_BITS_MASK(x) (((uintptr_t)(x)) & 0xF)
-#define REPORTED_ADDRESS_BITES_SAME_AS_REPORTED 0x1
-
-#define CLEAN_REPORTED_ADDRESS(x) (void*)(((uintptr_t)(x)) & ~0xF)
 
 typedef struct AllocUnit {
-	void *uncleanReportedAddress; //address is always at least 16 byte aligned so we stuff things in the bottom four bit!
-	char const *sourceFile;
-	char const *sourceFunc;
+	void *reportedAddress;
 	struct AllocUnit *next;
 	struct AllocUnit *prev;
+	Callsite *callsite; // file, line and func live here, NULL if the callsite table ran out of memory
 
 	uint64_t allocationNumber;
 
 	uint32_t reportedSize; // as most allocs will be less 4GiB we assume we saturate to 4GiB should be enough to spot
-	uint32_t sourceLine;
+	uint32_t sampleWeight; // how many allocations this one stands for, 1 unless sampling
 
 } AllocUnit;
 
-#define hashBits 12u
-#define hashSize (1u << hashBits)
-static AllocUnit *hashTable[hashSize];
-static AllocUnit *reservoir;
-static AllocUnit **reservoirBuffer = NULL;
-static uint32_t reservoirBufferSize = 0;
-
-AL2O3_FORCE_INLINE size_t calculateReportedSize(const size_t actualSize) {
-	return actualSize - Memory_TrackingPaddingSize * sizeof(uint32_t) * 2;
+// Every tracked allocation has this directly before its reported address, it
+// occupies all of the tracking padding (or the alignment gap for aligned
+// allocations). au is NULL when the allocation isn't being tracked.
+// Every allocation has a header whatever the tracking level, the flags record
+// what was done for it so free undoes just that when the level has changed since.
+// magic is last so an underrun of the allocation is likely to stomp it
+#define TRACKING_HEADER_SIZE (Memory_TrackingPaddingSize * sizeof(uint32_t) * 2)
+#define TRACKING_HEADER_MAGIC 0xA110CA7Eu
+#define TRACKING_HEADER_FREED 0xDEADA110u
+#define TRACKING_FLAG_UNTRACKED 0x1u // skipped by the level or sampling, never in the tracker
+#define TRACKING_FLAG_COUNTED 0x2u // in the stats
+
+typedef struct TrackingHeader {
+	union {
+		AllocUnit *au;
+		uint64_t auPadding;
+	};
+	uint64_t reportedSize;
+	uint32_t offset; // reported address - actual address
+	uint32_t align; // 0 for plain allocations
+	uint16_t flags;
+	uint16_t tag; // Memory_Tag charged for the block, 0 if none
+	uint32_t magic;
+} TrackingHeader;
+
+typedef char TrackingHeaderSizeCheck[(sizeof(TrackingHeader) == TRACKING_HEADER_SIZE) ? 1 : -1];
+
+AL2O3_FORCE_INLINE TrackingHeader *trackingHeader(const void *reportedAddress) {
+	return ((TrackingHeader *) reportedAddress) - 1;
 }
 
+// The tracker is split into shards each with its own lock.
+// An allocation lives in the shard picked by its reported address
+// so threads working on different allocations rarely touch the same lock.
+// In header mode a shard just links its live allocations together for the
+// leak report. Otherwise each shard is a Robin Hood open addressing table keyed
+// by the reported address. When it fills the shard starts a table twice the
+// size and moves a few entries from the old one every operation, so no single
+// allocation pays for a full rehash.
+#define shardBits 5u
+#define shardCount (1u << shardBits)
+
+#if MEMORY_TRACKING_HEADER == 0
+#define firstTableCapacity 256u
+#define tableMigrateStep 16u
+
+#define EMPTY_KEY ((uintptr_t)0)
+// only ever in the old table during a migration, addresses are 16 byte aligned so never 1
+#define TOMBSTONE_KEY ((uintptr_t)1)
+
+typedef struct TrackerEntry {
+	uintptr_t reportedAddress;
+	AllocUnit *au;
+} TrackerEntry;
+
+typedef struct TrackerTable {
+	TrackerEntry *entries;
+	uint32_t capacity; // always a power of 2
+	uint32_t count;
+} TrackerTable;
+#endif
+
+typedef struct TrackerShard {
+	MemoryMutex mutex;
+#if MEMORY_TRACKING_HEADER == 1
+	AllocUnit *live;
+#else
+	TrackerTable table;
+	// the table we are migrating from, entries are only removed (tombstoned) from it
+	TrackerTable old;
+	uint32_t migrateCursor;
+#endif
+	// keep the next shards lock off our cache lines
+	uint8_t padding[64];
+} TrackerShard;
+
+#define SHARD_INIT { MEMORY_MUTEX_INITIALIZER }
+#define SHARD_INIT4 SHARD_INIT, SHARD_INIT, SHARD_INIT, SHARD_INIT
+#define SHARD_INIT16 SHARD_INIT4, SHARD_INIT4, SHARD_INIT4, SHARD_INIT4
+static TrackerShard g_shards[shardCount] = { SHARD_INIT16, SHARD_INIT16 };
+#undef SHARD_INIT16
+#undef SHARD_INIT4
+#undef SHARD_INIT
+
+static uint64_t volatile g_allocCounter = 0;
+static uint64_t volatile g_trackerActive = 0;
+
 AL2O3_FORCE_INLINE void *Memory_TrackerCalculateActualAddress(const void *reportedAddress) {
 	// We allow this...
 	if (!reportedAddress) {
 		return NULL;
 	}
-	if( REPORTED_ADDRESS_BITS_MASK(reportedAddress) & REPORTED_ADDRESS_BITES_SAME_AS_REPORTED) {
-		return (void*) (((uintptr_t)reportedAddress) & ~0xF);
-	}
 
-	// JUst account for the padding
-	return (void *) (((uint8_t const *) (reportedAddress)) - sizeof(uint32_t) * Memory_TrackingPaddingSize);
+	// the header knows how far the reported address is from the real one
+	return (void *) (((uint8_t const *) (reportedAddress)) - trackingHeader(reportedAddress)->offset);
 }
 
-AL2O3_FORCE_INLINE void *calculateReportedAddress(const void *actualAddress) {
+AL2O3_FORCE_INLINE void *calculateReportedAddress(const void *actualAddress, size_t offset) {
 	// We allow this...
 	if (!actualAddress) {
 		return NULL;
 	}
 
 	// JUst account for the padding
-	return (void *) (((uint8_t const *) (actualAddress)) + sizeof(uint32_t) * Memory_TrackingPaddingSize);
+	return (void *) (((uint8_t const *) (actualAddress)) + offset);
 }
 
 static const char *sourceFileStripper(const char *sourceFile) {
@@ -264,206 +635,460 @@ static const char *sourceFileStripper(const char *sourceFile) {
 	return sourceFile;
 }
 
-static AllocUnit *findAllocUnit(const void *reportedAddress) {
+// murmur3 finalizer, allocations share lots of low and high bits so a plain
+// shift gives very poor coverage
+AL2O3_FORCE_INLINE uint64_t hashAddress(uintptr_t reportedAddress) {
+	uint64_t key = (uint64_t) reportedAddress;
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+	return key;
+}
+
+// the top bits pick the shard, the bottom bits the slot in the shards table
+AL2O3_FORCE_INLINE TrackerShard *shardFor(const void *reportedAddress) {
+	return &g_shards[hashAddress((uintptr_t) reportedAddress) >> (64 - shardBits)];
+}
+
+#if MEMORY_TRACKING_HEADER == 1
+
+static AllocUnit *findAllocUnit(TrackerShard *shard, const void *reportedAddress) {
+	// the header knows, the shard is only needed by the table lookup
+	(void) shard;
 	// Just in case...
 	ASSERT(reportedAddress != NULL);
+	return trackingHeader(reportedAddress)->au;
+}
 
-	// Use the address to locate the hash index. Note that we shift off the lower four bits. This is because most allocated
-	// addresses will be on four-, eight- or even sixteen-byte boundaries. If we didn't do this, the hash index would not have
-	// very good coverage.
-	uintptr_t hashIndex = (((uintptr_t) reportedAddress) >> 4) & (hashSize - 1);
-	AllocUnit *ptr = hashTable[hashIndex];
-	while (ptr) {
-		if (CLEAN_REPORTED_ADDRESS(ptr->uncleanReportedAddress) == reportedAddress) {
-			return ptr;
-		}
-		ptr = ptr->next;
+static bool insertAllocUnit(TrackerShard *shard, AllocUnit *au) {
+	au->prev = NULL;
+	au->next = shard->live;
+	if (shard->live) {
+		shard->live->prev = au;
 	}
-
-	return NULL;
+	shard->live = au;
+	trackingHeader(au->reportedAddress)->au = au;
+	return true;
 }
 
-static bool GrowReservoir() {
-	// Allocate 256 reservoir elements
-	reservoir = (AllocUnit *) platformCalloc(256, sizeof(AllocUnit));
-	// Danger Will Robinson!
-	if (reservoir == NULL) {
-		return false;
+static void removeAllocUnit(TrackerShard *shard, AllocUnit *au) {
+	if (shard->live == au) {
+		shard->live = au->next;
 	}
-
-	// Build a linked-list of the elements in our reservoir
-	for (unsigned int i = 0; i < 256 - 1; i++) {
-		reservoir[i].next = &reservoir[i + 1];
+	if (au->prev) {
+		au->prev->next = au->next;
+	}
+	if (au->next) {
+		au->next->prev = au->prev;
 	}
+}
+
+#else
+
+AL2O3_FORCE_INLINE uint32_t probeDistance(TrackerTable const *table, uintptr_t key, uint32_t slot) {
+	uint32_t const mask = table->capacity - 1;
+	return (slot - ((uint32_t) hashAddress(key) & mask)) & mask;
+}
 
-	// Add this address to our reservoirBuffer so we can free it later
-	AllocUnit **temp = (AllocUnit **) platformRealloc(reservoirBuffer, (reservoirBufferSize + 1) * sizeof(AllocUnit *));
-	ASSERT(temp);
-	if (temp) {
-		reservoirBuffer = temp;
-		reservoirBuffer[reservoirBufferSize++] = reservoir;
+static void tableInsert(TrackerTable *table, uintptr_t key, AllocUnit *au) {
+	uint32_t const mask = table->capacity - 1;
+	uint32_t slot = (uint32_t) hashAddress(key) & mask;
+	uint32_t distance = 0;
+	TrackerEntry entry = { key, au };
+
+	while (true) {
+		TrackerEntry *cur = &table->entries[slot];
+		if (cur->reportedAddress == EMPTY_KEY) {
+			*cur = entry;
+			table->count++;
+			return;
+		}
+		// rob the rich, whoever is closer to home moves along
+		uint32_t const curDistance = probeDistance(table, cur->reportedAddress, slot);
+		if (curDistance < distance) {
+			TrackerEntry const tmp = *cur;
+			*cur = entry;
+			entry = tmp;
+			distance = curDistance;
+		}
+		slot = (slot + 1) & mask;
+		distance++;
 	}
+}
 
-	return true;
+// returns the slot or capacity if not found
+static uint32_t tableFind(TrackerTable const *table, uintptr_t key) {
+	if (table->entries == NULL) {
+		return table->capacity;
+	}
+	uint32_t const mask = table->capacity - 1;
+	uint32_t slot = (uint32_t) hashAddress(key) & mask;
+	uint32_t distance = 0;
+
+	while (true) {
+		TrackerEntry const *cur = &table->entries[slot];
+		if (cur->reportedAddress == key) {
+			return slot;
+		}
+		if (cur->reportedAddress == EMPTY_KEY) {
+			return table->capacity;
+		}
+		if (cur->reportedAddress != TOMBSTONE_KEY &&
+				probeDistance(table, cur->reportedAddress, slot) < distance) {
+			return table->capacity;
+		}
+		slot = (slot + 1) & mask;
+		distance++;
+	}
 }
 
-AL2O3_EXTERN_C void *Memory_TrackedAlloc(const char *sourceFile,
-													const unsigned int sourceLine,
-													const char *sourceFunc,
-													const size_t reportedSize,
-													void *actualSizedAllocation) {
-	if (actualSizedAllocation == NULL) {
-		LOGERROR("Request for allocation failed. Out of memory.");
-		return NULL;
+// backward shift removal, the live table never has tombstones
+static void tableRemoveAt(TrackerTable *table, uint32_t slot) {
+	uint32_t const mask = table->capacity - 1;
+	uint32_t next = (slot + 1) & mask;
+	while (table->entries[next].reportedAddress != EMPTY_KEY &&
+			probeDistance(table, table->entries[next].reportedAddress, next) != 0) {
+		table->entries[slot] = table->entries[next];
+		slot = next;
+		next = (next + 1) & mask;
 	}
+	table->entries[slot].reportedAddress = EMPTY_KEY;
+	table->entries[slot].au = NULL;
+	table->count--;
+}
 
-	if (reservoirBufferSize == 0) {
-		MUTEX_CREATE
+static void migrateSome(TrackerShard *shard, uint32_t steps) {
+	if (shard->old.entries == NULL) {
+		return;
 	}
 
-	MUTEX_LOCK
-	// If necessary, grow the reservoir of unused allocation units
-	if (!reservoir) {
-			if (!GrowReservoir()) {
-				MUTEX_UNLOCK
-				return NULL;
+	while (steps-- && shard->migrateCursor < shard->old.capacity) {
+		TrackerEntry *entry = &shard->old.entries[shard->migrateCursor++];
+		if (entry->reportedAddress > TOMBSTONE_KEY) {
+			tableInsert(&shard->table, entry->reportedAddress, entry->au);
+			entry->reportedAddress = TOMBSTONE_KEY;
+			shard->old.count--;
 		}
 	}
 
-	if (Memory_TrackerBreakOnAllocNumber != 0 && Memory_TrackerBreakOnAllocNumber == g_allocCounter + 1) {
-		LOGWARNING("Break on allocation number hit");
-		AL2O3_DEBUG_BREAK();
+	if (shard->migrateCursor == shard->old.capacity) {
+		ASSERT(shard->old.count == 0);
+		platformFree(shard->old.entries);
+		memset(&shard->old, 0, sizeof(TrackerTable));
+		shard->migrateCursor = 0;
 	}
+}
 
-	if(sourceFile == NULL) {
-		LOGWARNING("Allocation without tracking file/line/function info");
-		AL2O3_DEBUG_BREAK();
+// make sure there is room for one more entry
+static bool reserveEntry(TrackerShard *shard) {
+	TrackerTable *table = &shard->table;
+	// keep the load factor under 3/4, Robin Hood copes well up to there
+	if (table->entries != NULL && (table->count + 1) * 4 <= table->capacity * 3) {
+		return true;
 	}
 
-	// Logical flow says this should never happen...
-	ASSERT(reservoir != NULL);
+	// can't start another migration until the last one is done
+	if (shard->old.entries) {
+		migrateSome(shard, shard->old.capacity);
+	}
 
-	// Grab a new allocaton unit from the front of the reservoir
-	AllocUnit *au = reservoir;
-	reservoir = au->next;
+	uint32_t const capacity = table->capacity ? table->capacity * 2 : firstTableCapacity;
+	TrackerEntry *entries = (TrackerEntry *) platformCalloc(capacity, sizeof(TrackerEntry));
+	if (entries == NULL) {
+		LOGERROR("Unable to grow memory tracker table. Out of memory.");
+		return table->entries != NULL && table->count + 1 < table->capacity;
+	}
 
-	// Populate it with some real data
-	memset(au, 0, sizeof(AllocUnit));
-	au->reportedSize = (reportedSize > 0xFFFFFFFF) ? (uint32_t)(0xFFFFFFFF) : (uint32_t) reportedSize;
-	au->uncleanReportedAddress = calculateReportedAddress(actualSizedAllocation);
-	au->sourceFile = sourceFile;
-	au->sourceLine = sourceLine;
-	au->sourceFunc = sourceFunc;
-	au->allocationNumber = ++g_allocCounter;
-
-	// Insert the new allocation into the hash table
-	uintptr_t hashIndex = (((uintptr_t) au->uncleanReportedAddress) >> 4) & (hashSize - 1);
-	if (hashTable[hashIndex]) {
-		hashTable[hashIndex]->prev = au;
-	}
-	au->next = hashTable[hashIndex];
-	au->prev = NULL;
-	hashTable[hashIndex] = au;
+	shard->old = *table;
+	shard->migrateCursor = 0;
+	table->entries = entries;
+	table->capacity = capacity;
+	table->count = 0;
+	return true;
+}
 
-	g_lastSourceFile = NULL;
-	g_lastSourceLine = 0;
-	g_lastSourceFunc = NULL;
+static AllocUnit *findAllocUnit(TrackerShard *shard, const void *reportedAddress) {
+	// Just in case...
+	ASSERT(reportedAddress != NULL);
 
-	MUTEX_UNLOCK
+	uintptr_t const key = (uintptr_t) reportedAddress;
+	uint32_t slot = tableFind(&shard->table, key);
+	if (slot != shard->table.capacity) {
+		return shard->table.entries[slot].au;
+	}
+	slot = tableFind(&shard->old, key);
+	if (slot != shard->old.capacity) {
+		return shard->old.entries[slot].au;
+	}
 
-	return CLEAN_REPORTED_ADDRESS(au->uncleanReportedAddress);
+	return NULL;
 }
 
-AL2O3_EXTERN_C void *Memory_TrackedAAlloc(const char *sourceFile,
-													 const unsigned int sourceLine,
-													 const char *sourceFunc,
-													 const size_t reportedSize,
-													 void *actualSizedAllocation) {
-	if (actualSizedAllocation == NULL) {
-		LOGERROR("Request for allocation failed. Out of memory.");
-		return NULL;
+static bool insertAllocUnit(TrackerShard *shard, AllocUnit *au) {
+	if (!reserveEntry(shard)) {
+		return false;
 	}
+	tableInsert(&shard->table, (uintptr_t) au->reportedAddress, au);
+	migrateSome(shard, tableMigrateStep);
+	return true;
+}
 
-	if (reservoirBufferSize == 0) {
-		MUTEX_CREATE
+static void removeAllocUnit(TrackerShard *shard, AllocUnit *au) {
+	uintptr_t const key = (uintptr_t) au->reportedAddress;
+	uint32_t slot = tableFind(&shard->table, key);
+	if (slot != shard->table.capacity) {
+		tableRemoveAt(&shard->table, slot);
+	} else {
+		slot = tableFind(&shard->old, key);
+		ASSERT(slot != shard->old.capacity);
+		shard->old.entries[slot].reportedAddress = TOMBSTONE_KEY;
+		shard->old.entries[slot].au = NULL;
+		shard->old.count--;
 	}
+	migrateSome(shard, tableMigrateStep);
+}
 
-	MUTEX_LOCK
+#endif
 
-	if(Memory_TrackerBreakOnAllocNumber != 0 && Memory_TrackerBreakOnAllocNumber == g_allocCounter+1) {
-		LOGWARNING("Break on allocation number hit");
-		AL2O3_DEBUG_BREAK();
-	}
+// AllocUnits are handed out from small per thread magazines, so in the steady
+// state getting or returning a unit touches no shared state at all. Magazines
+// are refilled from and drained to a shared depot in whole batches (Bonwick
+// style, each thread holds a loaded and a previous magazine so alternating
+// alloc/free at a batch boundary doesn't thrash the depot).
+// The units themselves live in a list of chunks that grow geometrically.
+// When a thread exits its magazines go back to the depot, partly used ones
+// are pooled in the depot until they make up a full batch.
+#define magazineSize 64u
+#define firstChunkUnits 256u
+#define maxChunkUnits (64u * 1024u)
+
+typedef struct ReservoirChunk {
+	struct ReservoirChunk *next;
+	uint32_t unitCount;
+	uint32_t padding;
+	// AllocUnits follow
+} ReservoirChunk;
+
+typedef struct ReservoirDepot {
+	MemoryMutex mutex;
+	// full batches of magazineSize units chained via next, batches are chained via the head unit prev
+	AllocUnit *fullBatches;
+	// units from exiting threads, not yet a full batch
+	AllocUnit *loose;
+	uint32_t looseCount;
+	ReservoirChunk *chunks;
+	uint32_t nextChunkUnits;
+	// bumped when the reservoir is destroyed so thread magazines know they are stale
+	uint64_t generation;
+} ReservoirDepot;
+
+typedef struct ThreadMagazine {
+	AllocUnit *loaded;
+	AllocUnit *previous;
+	uint32_t loadedCount;
+	uint32_t previousCount;
+	bool registered; // for the thread exit drain
+	uint64_t generation;
+} ThreadMagazine;
+
+static ReservoirDepot g_depot = { MEMORY_MUTEX_INITIALIZER, NULL, NULL, 0, NULL, firstChunkUnits, 1 };
+static AL2O3_THREAD_LOCAL ThreadMagazine g_magazine;
 
-	if(sourceFile == NULL) {
-		LOGWARNING("Allocation without tracking file/line/function info");
-		AL2O3_DEBUG_BREAK();
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+static INIT_ONCE g_magazineInitOnce = INIT_ONCE_STATIC_INIT;
+static DWORD g_magazineFls;
+#else
+static pthread_once_t g_magazineInitOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t g_magazineKey;
+#endif
+
+// call with the depot locked
+static bool GrowReservoir() {
+	uint32_t const unitCount = g_depot.nextChunkUnits;
+	ReservoirChunk *chunk = (ReservoirChunk *) platformMalloc(sizeof(ReservoirChunk) + unitCount * sizeof(AllocUnit));
+	// Danger Will Robinson!
+	if (chunk == NULL) {
+		return false;
+	}
+	chunk->unitCount = unitCount;
+	chunk->next = g_depot.chunks;
+	g_depot.chunks = chunk;
+	if (g_depot.nextChunkUnits < maxChunkUnits) {
+		g_depot.nextChunkUnits *= 2;
 	}
 
-	// If necessary, grow the reservoir of unused allocation units
-	if (!reservoir) {
-		if (!GrowReservoir()) {
-			MUTEX_UNLOCK
-			return NULL;
+	// Build linked full batches out of the elements in our new chunk
+	AllocUnit *units = (AllocUnit *) (chunk + 1);
+	for (uint32_t i = 0; i < unitCount; i += magazineSize) {
+		for (uint32_t j = 0; j < magazineSize - 1; ++j) {
+			units[i + j].next = &units[i + j + 1];
 		}
+		units[i + magazineSize - 1].next = NULL;
+		units[i].prev = g_depot.fullBatches;
+		g_depot.fullBatches = &units[i];
 	}
 
-	// Logical flow says this should never happen...
-	ASSERT(reservoir != NULL);
-
-	// Grab a new allocaton unit from the front of the reservoir
-	AllocUnit *au = reservoir;
-	reservoir = au->next;
-
-	// Populate it with some real data
-	memset(au, 0, sizeof(AllocUnit));
-	au->reportedSize = (reportedSize > 0xFFFFFFFF) ? (uint32_t)(0xFFFFFFFF) : (uint32_t)reportedSize;
-	au->uncleanReportedAddress = actualSizedAllocation;
-	au->sourceFile = sourceFile;
-	au->sourceLine = sourceLine;
-	au->sourceFunc = sourceFunc;
-	au->allocationNumber = ++g_allocCounter;
+	return true;
+}
 
-	// or in reported == allocated bit
-	au->uncleanReportedAddress = (void*)(((uintptr_t)au->uncleanReportedAddress) | REPORTED_ADDRESS_BITES_SAME_AS_REPORTED);
+// call with the depot locked
+static void depotReturnUnits(AllocUnit *au) {
+	while (au) {
+		AllocUnit *next = au->next;
+		au->next = g_depot.loose;
+		g_depot.loose = au;
+		if (++g_depot.looseCount == magazineSize) {
+			g_depot.loose->prev = g_depot.fullBatches;
+			g_depot.fullBatches = g_depot.loose;
+			g_depot.loose = NULL;
+			g_depot.looseCount = 0;
+		}
+		au = next;
+	}
+}
 
-	// Insert the new allocation into the hash table
-	uintptr_t hashIndex = (((uintptr_t) au->uncleanReportedAddress) >> 4) & (hashSize - 1);
-	if (hashTable[hashIndex]) {
-		hashTable[hashIndex]->prev = au;
+static void drainMagazine(void *ptr) {
+	ThreadMagazine *magazine = (ThreadMagazine *) ptr;
+	if (magazine == NULL) {
+		return;
 	}
-	au->next = hashTable[hashIndex];
-	au->prev = NULL;
-	hashTable[hashIndex] = au;
+	MUTEX_LOCK(&g_depot.mutex)
+	// units of a torn down depot are already gone
+	if (magazine->generation == g_depot.generation) {
+		depotReturnUnits(magazine->loaded);
+		depotReturnUnits(magazine->previous);
+	}
+	MUTEX_UNLOCK(&g_depot.mutex)
+	// later destructors on this thread may still free, they start a new magazine
+	memset(magazine, 0, sizeof(ThreadMagazine));
+}
 
-	g_lastSourceFile = NULL;
-	g_lastSourceLine = 0;
-	g_lastSourceFunc = NULL;
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+static void WINAPI drainMagazineFls(void *ptr) {
+	drainMagazine(ptr);
+}
 
-	MUTEX_UNLOCK
+static BOOL CALLBACK magazineInit(PINIT_ONCE initOnce, PVOID param, PVOID *context) {
+	g_magazineFls = FlsAlloc(&drainMagazineFls);
+	return TRUE;
+}
+#else
+static void magazineInit() {
+	pthread_key_create(&g_magazineKey, &drainMagazine);
+}
+#endif
 
-	return CLEAN_REPORTED_ADDRESS(au->uncleanReportedAddress);
+static void registerMagazine(ThreadMagazine *magazine) {
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+	InitOnceExecuteOnce(&g_magazineInitOnce, &magazineInit, NULL, NULL);
+	FlsSetValue(g_magazineFls, magazine);
+#else
+	pthread_once(&g_magazineInitOnce, &magazineInit);
+	pthread_setspecific(g_magazineKey, magazine);
+#endif
+	magazine->registered = true;
 }
 
-AL2O3_EXTERN_C void *Memory_TrackedRealloc(const char *sourceFile,
-														const unsigned int sourceLine,
-														const char *sourceFunc,
-														const size_t reportedSize,
-														void *reportedAddress,
-														void *actualSizedAllocation) {
-	// Calling realloc with a NULL should force same operations as a malloc
-	if (!reportedAddress) {
-		return Memory_TrackedAlloc(sourceFile, sourceLine, sourceFunc, reportedSize, actualSizedAllocation);
+AL2O3_FORCE_INLINE ThreadMagazine *threadMagazine() {
+	ThreadMagazine *magazine = &g_magazine;
+	// the depot has been torn down since we last looked, anything we hold is gone
+	if (magazine->generation != atomicLoad64(&g_depot.generation)) {
+		bool const registered = magazine->registered;
+		memset(magazine, 0, sizeof(ThreadMagazine));
+		magazine->registered = registered;
+		magazine->generation = atomicLoad64(&g_depot.generation);
+	}
+	if (!magazine->registered) {
+		registerMagazine(magazine);
 	}
+	return magazine;
+}
 
-	if (!actualSizedAllocation) {
-		LOGERROR("Request for reallocation failed. Out of memory.");
-		return NULL;
+static AllocUnit *newAllocUnit() {
+	ThreadMagazine *magazine = threadMagazine();
+
+	if (magazine->loadedCount == 0) {
+		if (magazine->previousCount != 0) {
+			AllocUnit *const tmp = magazine->loaded;
+			magazine->loaded = magazine->previous;
+			magazine->loadedCount = magazine->previousCount;
+			magazine->previous = tmp;
+			magazine->previousCount = 0;
+		} else {
+			MUTEX_LOCK(&g_depot.mutex)
+			// If necessary, grow the reservoir of unused allocation units
+			if (!g_depot.fullBatches && !GrowReservoir()) {
+				MUTEX_UNLOCK(&g_depot.mutex)
+				return NULL;
+			}
+			magazine->loaded = g_depot.fullBatches;
+			g_depot.fullBatches = magazine->loaded->prev;
+			MUTEX_UNLOCK(&g_depot.mutex)
+			magazine->loadedCount = magazineSize;
+		}
 	}
 
-	MUTEX_LOCK
+	// Logical flow says this should never happen...
+	ASSERT(magazine->loaded != NULL);
+
+	// Grab a new allocaton unit from the front of the magazine
+	AllocUnit *au = magazine->loaded;
+	magazine->loaded = au->next;
+	magazine->loadedCount--;
+	memset(au, 0, sizeof(AllocUnit));
+	return au;
+}
+
+static void deleteAllocUnit(AllocUnit *au) {
+	ThreadMagazine *magazine = threadMagazine();
+
+	if (magazine->loadedCount == magazineSize) {
+		if (magazine->previousCount != 0) {
+			// previous is full too, hand it back to the depot
+			ASSERT(magazine->previousCount == magazineSize);
+			MUTEX_LOCK(&g_depot.mutex)
+			magazine->previous->prev = g_depot.fullBatches;
+			g_depot.fullBatches = magazine->previous;
+			MUTEX_UNLOCK(&g_depot.mutex)
+		}
+		magazine->previous = magazine->loaded;
+		magazine->previousCount = magazine->loadedCount;
+		magazine->loaded = NULL;
+		magazine->loadedCount = 0;
+	}
+
+	// Add this allocation unit to the front of our magazine of unused allocation units
+	memset(au, 0, sizeof(AllocUnit));
+	au->next = magazine->loaded;
+	magazine->loaded = au;
+	magazine->loadedCount++;
+}
 
-	if(Memory_TrackerBreakOnAllocNumber != 0 && Memory_TrackerBreakOnAllocNumber == g_allocCounter+1) {
+// all the AllocUnits are released, so only call when nothing is using them
+static void destroyReservoir() {
+	MUTEX_LOCK(&g_depot.mutex)
+	ReservoirChunk *chunk = g_depot.chunks;
+	while (chunk) {
+		ReservoirChunk *next = chunk->next;
+		platformFree(chunk);
+		chunk = next;
+	}
+	g_depot.chunks = NULL;
+	g_depot.fullBatches = NULL;
+	g_depot.loose = NULL;
+	g_depot.looseCount = 0;
+	g_depot.nextChunkUnits = firstChunkUnits;
+	atomicAdd64(&g_depot.generation, 1);
+	MUTEX_UNLOCK(&g_depot.mutex)
+}
+
+// the first of count consecutive numbers
+static uint64_t nextAllocationNumber(const char *sourceFile, uint64_t count) {
+	uint64_t const allocationNumber = atomicAdd64(&g_allocCounter, count) - (count - 1);
+	uint64_t const breakOn = Memory_TrackerBreakOnAllocNumber;
+	if (breakOn != 0 && breakOn >= allocationNumber && breakOn - allocationNumber < count) {
 		LOGWARNING("Break on allocation number hit");
 		AL2O3_DEBUG_BREAK();
 	}
@@ -472,153 +1097,927 @@ AL2O3_EXTERN_C void *Memory_TrackedRealloc(const char *sourceFile,
 		LOGWARNING("Allocation without tracking file/line/function info");
 		AL2O3_DEBUG_BREAK();
 	}
+	return allocationNumber;
+}
+
+// Sampling picks points in the stream of allocated bytes with exponentially
+// distributed gaps (mean g_sampleRate bytes), an allocation is tracked if a point
+// lands in it. So an allocation of size bytes is tracked with probability
+// p = 1 - e^(-size / rate) and stands for 1 / p allocations, big allocations are
+// almost always tracked and lots of small ones still show up in proportion.
+// Each thread keeps its own countdown so untracked allocations touch nothing shared.
+#define defaultSampleRate (512u * 1024u)
+#define maxSampleRate (1ull << 40)
+
+typedef struct SampleState {
+	int64_t bytesUntilSample;
+	uint64_t rate; // what bytesUntilSample was drawn with
+	uint64_t rng;
+} SampleState;
+
+static uint32_t volatile g_trackingLevel = Memory_TrackingLevel_Full;
+static uint64_t volatile g_sampleRate = defaultSampleRate;
+static AL2O3_THREAD_LOCAL SampleState g_sampleState;
+
+// xorshift64*, seeded from the state address so every thread differs
+static uint64_t sampleRandom(SampleState *state) {
+	if (state->rng == 0) {
+		state->rng = hashAddress((uintptr_t) state) | 1;
+	}
+	state->rng ^= state->rng >> 12;
+	state->rng ^= state->rng << 25;
+	state->rng ^= state->rng >> 27;
+	return state->rng * 0x2545F4914F6CDD1DULL;
+}
+
+// uniform in (0, 1]
+AL2O3_FORCE_INLINE double sampleUniform(SampleState *state) {
+	return (double) ((sampleRandom(state) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+// the tracker can't assume libm is linked, these only need to be good to a few digits
+static double sampleLn(double x) {
+	union { double d; uint64_t u; } bits;
+	bits.d = x;
+	double const exponent = (double) ((int64_t) ((bits.u >> 52) & 0x7FF) - 1023);
+	bits.u = (bits.u & 0x000FFFFFFFFFFFFFull) | 0x3FF0000000000000ull;
+	// ln(m) = 2 atanh((m - 1) / (m + 1)) for the mantissa m in [1, 2)
+	double const t = (bits.d - 1.0) / (bits.d + 1.0);
+	double const t2 = t * t;
+	double const series = 2.0 * t * (1.0 + t2 * (1.0 / 3.0 + t2 * (1.0 / 5.0 + t2 * (1.0 / 7.0 + t2 * (1.0 / 9.0 + t2 * (1.0 / 11.0))))));
+	return exponent * 0.69314718055994530942 + series;
+}
+
+// e^-x for x >= 0
+static double sampleExpNeg(double x) {
+	if (x > 700.0) {
+		return 0.0;
+	}
+	// e^-x = 2^-k * e^-r with r in [0, ln 2)
+	uint64_t const k = (uint64_t) (x * 1.44269504088896340736);
+	double const r = x - (double) k * 0.69314718055994530942;
+	double term = 1.0;
+	double sum = 1.0;
+	for (uint32_t i = 1; i < 16; ++i) {
+		term *= -r / (double) i;
+		sum += term;
+	}
+	union { double d; uint64_t u; } scale;
+	scale.u = (1023 - k) << 52;
+	return sum * scale.d;
+}
+
+static int64_t nextSampleInterval(SampleState *state) {
+	double const interval = -sampleLn(sampleUniform(state)) * (double) state->rate;
+	return (interval < 1.0) ? 1 : (int64_t) interval;
+}
+
+// 0 means don't track it, otherwise how many allocations it stands for
+static uint32_t sampleWeight(size_t reportedSize) {
+	uint32_t const level = atomicLoad32(&g_trackingLevel);
+	if (level == Memory_TrackingLevel_Full) {
+		return 1;
+	}
+	if (level != Memory_TrackingLevel_Sampled) {
+		return 0;
+	}
+	uint64_t const rate = atomicLoad64(&g_sampleRate);
+
+	SampleState *state = &g_sampleState;
+	if (state->rate != rate) {
+		state->rate = rate;
+		state->bytesUntilSample = nextSampleInterval(state);
+	}
+	state->bytesUntilSample -= (int64_t) reportedSize;
+	if (state->bytesUntilSample > 0) {
+		return 0;
+	}
+	// the gaps are memoryless, so the next one starts fresh from here
+	state->bytesUntilSample = nextSampleInterval(state);
+
+	// 1 / p rounded up or down at random so the totals stay unbiased
+	double const probability = 1.0 - sampleExpNeg((double) reportedSize / (double) rate);
+	double const weight = (probability > 0.0) ? 1.0 / probability : (double) 0xFFFFFFFF;
+	if (weight >= (double) 0xFFFFFFFF) {
+		return 0xFFFFFFFF;
+	}
+	uint32_t result = (uint32_t) weight;
+	if (sampleUniform(state) <= weight - (double) result) {
+		result++;
+	}
+	return result ? result : 1;
+}
+
+AL2O3_EXTERN_C void Memory_TrackerSetSampleRate(size_t sampleBytes) {
+	if (sampleBytes == 0) {
+		sampleBytes = defaultSampleRate;
+	}
+	atomicStore64(&g_sampleRate, (sampleBytes > maxSampleRate) ? maxSampleRate : (uint64_t) sampleBytes);
+}
+
+AL2O3_EXTERN_C size_t Memory_TrackerGetSampleRate() {
+	return (size_t) atomicLoad64(&g_sampleRate);
+}
+
+// The global allocators functions never change, they look at the level on
+// every call instead. Swapping the function table while other threads are
+// mid call could pair an allocation with the wrong free, this way any block
+// can be freed under any level.
+AL2O3_EXTERN_C void Memory_TrackerSetLevel(Memory_TrackingLevel level) {
+	atomicStore32(&g_trackingLevel, (uint32_t) level);
+}
+
+AL2O3_EXTERN_C Memory_TrackingLevel Memory_TrackerGetLevel() {
+	return (Memory_TrackingLevel) atomicLoad32(&g_trackingLevel);
+}
+
+static void *writeTrackingHeader(void *actualAddress, size_t offset, size_t align, size_t reportedSize) {
+	void *reportedAddress = calculateReportedAddress(actualAddress, offset);
+	TrackingHeader *header = trackingHeader(reportedAddress);
+	header->au = NULL;
+	header->reportedSize = reportedSize;
+	header->offset = (uint32_t) offset;
+	header->align = (uint32_t) align;
+	header->flags = 0;
+	header->tag = 0;
+	header->magic = TRACKING_HEADER_MAGIC;
+	return reportedAddress;
+}
 
-	// Locate the existing allocation unit
-	AllocUnit *au = findAllocUnit(reportedAddress);
+// caller is the return address of the public allocation function, for the stack capture
+static void trackAllocUnit(Memory_SrcLoc *loc,
+													 const size_t reportedSize,
+													 void *reportedAddress,
+													 void const *caller) {
+	if (!atomicLoad64(&g_trackerActive)) {
+		atomicStore64(&g_trackerActive, 1);
+	}
+
+	uint32_t const weight = sampleWeight(reportedSize);
+	if (weight == 0) {
+		trackingHeader(reportedAddress)->flags |= TRACKING_FLAG_UNTRACKED;
+		return;
+	}
+	uint64_t const allocationNumber = nextAllocationNumber(loc->sourceFile, 1);
 
-	// If you hit this assert, you tried to reallocate RAM that wasn't allocated by this memory manager.
+	AllocUnit *au = newAllocUnit();
 	if (au == NULL) {
-		LOGERROR("Request to reallocate RAM that was never allocated");
-		MUTEX_UNLOCK
+		LOGERROR("Unable to track allocation. Out of memory.");
+		return;
+	}
+
+	// Populate it with some real data
+	au->reportedSize = (reportedSize > 0xFFFFFFFF) ? (uint32_t)(0xFFFFFFFF) : (uint32_t) reportedSize;
+	au->reportedAddress = reportedAddress;
+	au->sampleWeight = weight;
+	au->allocationNumber = allocationNumber;
+	au->callsite = callsiteFor(loc, stackCapture(caller));
+
+	// Insert the new allocation into the live set
+	TrackerShard *shard = shardFor(reportedAddress);
+	MUTEX_LOCK(&shard->mutex)
+	bool const inserted = insertAllocUnit(shard, au);
+	MUTEX_UNLOCK(&shard->mutex)
+
+	if (inserted) {
+		callsiteAlloc(au->callsite, au->reportedSize, au->sampleWeight);
+	} else {
+		// the memory is still valid, we just can't track it
+		deleteAllocUnit(au);
+	}
+}
+
+// align 0 for plain allocations
+static void *trackNewAllocation(Memory_SrcLoc *loc,
+																const size_t reportedSize,
+																const size_t align,
+																void *actualSizedAllocation,
+																void const *caller) {
+	if (actualSizedAllocation == NULL) {
+		LOGERROR("Request for allocation failed. Out of memory.");
 		return NULL;
 	}
 
+	// the header lives in the alignment gap so the reported address keeps the alignment
+	size_t const offset = (align > TRACKING_HEADER_SIZE) ? align : TRACKING_HEADER_SIZE;
+	void *reportedAddress = writeTrackingHeader(actualSizedAllocation, offset, align, reportedSize);
+	trackAllocUnit(loc, reportedSize, reportedAddress, caller);
+	return reportedAddress;
+}
+
+AL2O3_EXTERN_C void *Memory_TrackedAlloc(const char *sourceFile,
+													const unsigned int sourceLine,
+													const char *sourceFunc,
+													const size_t reportedSize,
+													void *actualSizedAllocation) {
+	Memory_SrcLoc loc = { sourceFile, sourceFunc, sourceLine, Memory_SrcLocNoId };
+	takeSrcLoc();
+	return trackNewAllocation(&loc, reportedSize, 0, actualSizedAllocation, MEMORY_RETURN_ADDRESS());
+}
+
+AL2O3_EXTERN_C void *Memory_TrackedAAlloc(const char *sourceFile,
+													 const unsigned int sourceLine,
+													 const char *sourceFunc,
+													 const size_t reportedSize,
+													 const size_t align,
+													 void *actualSizedAllocation) {
+	Memory_SrcLoc loc = { sourceFile, sourceFunc, sourceLine, Memory_SrcLocNoId };
+	takeSrcLoc();
+	return trackNewAllocation(&loc, reportedSize, align, actualSizedAllocation, MEMORY_RETURN_ADDRESS());
+}
+
+// the header sits offset bytes into the actual allocation, it moved with the contents
+static void *retrackRealloc(Memory_SrcLoc *loc,
+														const size_t reportedSize,
+														void *reportedAddress,
+														void *actualSizedAllocation,
+														const size_t offset,
+														void const *caller) {
+	if (!actualSizedAllocation) {
+		LOGERROR("Request for reallocation failed. Out of memory.");
+		return NULL;
+	}
+
+	void *newReportedAddress = calculateReportedAddress(actualSizedAllocation, offset);
+	TrackingHeader *header = trackingHeader(newReportedAddress);
+	ASSERT(header->magic == TRACKING_HEADER_MAGIC);
+	ASSERT(header->offset == offset);
+	header->reportedSize = reportedSize;
+
+	// sampling is decided once by the first allocation, a realloc keeps it
+	if (header->flags & TRACKING_FLAG_UNTRACKED) {
+		return newReportedAddress;
+	}
+
+	uint64_t const allocationNumber = nextAllocationNumber(loc->sourceFile, 1);
+	Callsite *callsite = callsiteFor(loc, stackCapture(caller));
+
+	// Locate the existing allocation unit, the old address may already have been freed so only the new header can be read
+	TrackerShard *oldShard = shardFor(reportedAddress);
+	MUTEX_LOCK(&oldShard->mutex)
+#if MEMORY_TRACKING_HEADER == 1
+	AllocUnit *au = header->au;
+#else
+	AllocUnit *au = findAllocUnit(oldShard, reportedAddress);
+#endif
+
+	if (au == NULL) {
+		MUTEX_UNLOCK(&oldShard->mutex)
+#if MEMORY_TRACKING_HEADER == 0
+		// If you hit this, you tried to reallocate RAM that wasn't allocated by this memory manager.
+		LOGERROR("Request to reallocate RAM that was never allocated");
+#endif
+		return newReportedAddress;
+	}
+
 	// Do the reallocation
 	void *oldReportedAddress = reportedAddress;
-	size_t newActualSize = Memory_TrackerCalculateActualSize(reportedSize);
-
-	// Update the allocation with the new information
-	au->reportedSize = (calculateReportedSize(newActualSize) > 0xFFFFFFFF) ? (uint32_t)(0xFFFFFFFF) : (uint32_t)calculateReportedSize(newActualSize);
-	au->uncleanReportedAddress = calculateReportedAddress(actualSizedAllocation);
-	au->sourceFile = sourceFile;
-	au->sourceLine = sourceLine;
-	au->sourceFunc = sourceFunc;
-	au->allocationNumber = ++g_allocCounter;
-
-	// The reallocation may cause the address to change, so we should relocate our allocation unit within the hash table
-	unsigned int hashIndex = ~0;
-	if (oldReportedAddress != CLEAN_REPORTED_ADDRESS(au->uncleanReportedAddress)) {
-		// Remove this allocation unit from the hash table
-		{
-			uintptr_t hashIndex = (((uintptr_t) reportedAddress) >> 4) & (hashSize - 1);
-			if (hashTable[hashIndex] == au) {
-				hashTable[hashIndex] = hashTable[hashIndex]->next;
-			} else {
-				if (au->prev) {
-					au->prev->next = au->next;
-				}
-				if (au->next) {
-					au->next->prev = au->prev;
-				}
-			}
-		}
-
-		// Re-insert it back into the hash table
-		hashIndex = (((uintptr_t) au->uncleanReportedAddress) >> 4) & (hashSize - 1);
-		if (hashTable[hashIndex]) {
-			hashTable[hashIndex]->prev = au;
+	TrackerShard *newShard = shardFor(newReportedAddress);
+
+	// The reallocation may cause the address to change, so we should relocate our allocation unit
+	if (oldReportedAddress != newReportedAddress) {
+		removeAllocUnit(oldShard, au);
+		if (newShard != oldShard) {
+			// nobody else can reach the unit now, so its safe to hop shards
+			MUTEX_UNLOCK(&oldShard->mutex)
+			MUTEX_LOCK(&newShard->mutex)
 		}
-		au->next = hashTable[hashIndex];
-		au->prev = NULL;
-		hashTable[hashIndex] = au;
 	}
 
+	// Update the allocation with the new information, a realloc counts as a free and an alloc for the callsites
+	callsiteFree(au->callsite, au->reportedSize, au->sampleWeight);
+	au->callsite = callsite;
+	au->reportedSize = (reportedSize > 0xFFFFFFFF) ? (uint32_t)(0xFFFFFFFF) : (uint32_t)reportedSize;
+	au->reportedAddress = newReportedAddress;
+	au->allocationNumber = allocationNumber;
+
+	// Re-insert it back into the live set
+	bool inserted = true;
+	if (oldReportedAddress != newReportedAddress) {
+		inserted = insertAllocUnit(newShard, au);
+	}
 
 	// Prepare the allocation unit for use (wipe it with recognizable garbage)
 	//	wipeWithPattern(au, unusedPattern, originalReportedSize);
 
-	g_lastSourceFile = NULL;
-	g_lastSourceLine = 0;
-	g_lastSourceFunc = NULL;
+	MUTEX_UNLOCK(&newShard->mutex)
 
-	MUTEX_UNLOCK
+	if (inserted) {
+		callsiteAlloc(au->callsite, au->reportedSize, au->sampleWeight);
+	} else {
+		// the memory is still valid, we just can no longer track it
+		header->au = NULL;
+		deleteAllocUnit(au);
+	}
 
 	// Return the (reported) address of the new allocation unit
-	return CLEAN_REPORTED_ADDRESS(au->uncleanReportedAddress);
+	return newReportedAddress;
 }
 
-AL2O3_EXTERN_C bool Memory_TrackedFree(const void *reportedAddress) {
+AL2O3_EXTERN_C void *Memory_TrackedRealloc(const char *sourceFile,
+														const unsigned int sourceLine,
+														const char *sourceFunc,
+														const size_t reportedSize,
+														void *reportedAddress,
+														void *actualSizedAllocation) {
+	Memory_SrcLoc loc = { sourceFile, sourceFunc, sourceLine, Memory_SrcLocNoId };
+	takeSrcLoc();
+	// Calling realloc with a NULL should force same operations as a malloc
 	if (!reportedAddress) {
-		return false;
+		return trackNewAllocation(&loc, reportedSize, 0, actualSizedAllocation, MEMORY_RETURN_ADDRESS());
 	}
+	return retrackRealloc(&loc, reportedSize, reportedAddress, actualSizedAllocation, TRACKING_HEADER_SIZE, MEMORY_RETURN_ADDRESS());
+}
 
-	if (reservoirBufferSize == 0 || reservoirBuffer == NULL) {
-		LOGERROR("Free before any allocations have occured or after exit!");
-		return true; // we can't tell if this is an aalloc or other assume other as more common...
+AL2O3_EXTERN_C void *Memory_TrackedARealloc(const char *sourceFile,
+														 const unsigned int sourceLine,
+														 const char *sourceFunc,
+														 const size_t reportedSize,
+														 const size_t align,
+														 void *reportedAddress,
+														 void *actualSizedAllocation) {
+	Memory_SrcLoc loc = { sourceFile, sourceFunc, sourceLine, Memory_SrcLocNoId };
+	takeSrcLoc();
+	if (!reportedAddress) {
+		return trackNewAllocation(&loc, reportedSize, align, actualSizedAllocation, MEMORY_RETURN_ADDRESS());
 	}
+	size_t const offset = (align > TRACKING_HEADER_SIZE) ? align : TRACKING_HEADER_SIZE;
+	return retrackRealloc(&loc, reportedSize, reportedAddress, actualSizedAllocation, offset, MEMORY_RETURN_ADDRESS());
+}
 
-	MUTEX_LOCK
+AL2O3_EXTERN_C void *Memory_TrackedFree(const void *reportedAddress) {
+	if (!reportedAddress) {
+		return NULL;
+	}
 
-	// Go get the allocation unit
-	AllocUnit *au = findAllocUnit(reportedAddress);
-	if (au == NULL) {
-		LOGERROR("Request to deallocate RAM that was never allocated");
-		MUTEX_UNLOCK
-		return false;
+	TrackingHeader *header = trackingHeader(reportedAddress);
+	AllocUnit *au = NULL;
+
+#if MEMORY_TRACKING_HEADER == 1
+	if (header->magic != TRACKING_HEADER_MAGIC) {
+		if (header->magic == TRACKING_HEADER_FREED) {
+			LOGERROR("Request to deallocate RAM that has already been freed");
+		} else {
+			LOGERROR("Request to deallocate RAM that was never allocated (or has been overwritten)");
+		}
+		return NULL;
+	}
+	au = header->au;
+	if (au) {
+		TrackerShard *shard = shardFor(reportedAddress);
+		MUTEX_LOCK(&shard->mutex)
+		removeAllocUnit(shard, au);
+		MUTEX_UNLOCK(&shard->mutex)
+	}
+#else
+	if (header->magic == TRACKING_HEADER_MAGIC && (header->flags & TRACKING_FLAG_UNTRACKED)) {
+		// never made it into the tables
+	} else if (!atomicLoad64(&g_trackerActive)) {
+		LOGERROR("Free before any allocations have occured or after exit!");
+	} else {
+		TrackerShard *shard = shardFor(reportedAddress);
+		MUTEX_LOCK(&shard->mutex)
+
+		// Go get the allocation unit
+		au = findAllocUnit(shard, reportedAddress);
+		if (au == NULL) {
+			LOGERROR("Request to deallocate RAM that was never allocated");
+			MUTEX_UNLOCK(&shard->mutex)
+			return NULL;
+		}
+
+		// Remove this allocation unit from the hash table
+		removeAllocUnit(shard, au);
+		MUTEX_UNLOCK(&shard->mutex)
+	}
+	if (header->magic != TRACKING_HEADER_MAGIC) {
+		LOGERROR("Tracking header of a freed allocation has been overwritten");
 	}
-	bool const adjustPtr = (REPORTED_ADDRESS_BITS_MASK(au->uncleanReportedAddress) & REPORTED_ADDRESS_BITES_SAME_AS_REPORTED) == 0;
+#endif
 
 	// Wipe the deallocated RAM with a new pattern. This doen't actually do us much good in debug mode under WIN32,
 	// because Microsoft's memory debugging & tracking utilities will wipe it right after we do. Oh well.
 
 	//	wipeWithPattern(au, releasedPattern);
 
-	// Remove this allocation unit from the hash table
-	uintptr_t hashIndex = (((uintptr_t) au->uncleanReportedAddress) >> 4) & (hashSize - 1);
-	if (hashTable[hashIndex] == au) {
-		hashTable[hashIndex] = au->next;
-	} else {
-		if (au->prev) {
-			au->prev->next = au->next;
-		}
-		if (au->next) {
-			au->next->prev = au->prev;
-		}
+	if (au) {
+		callsiteFree(au->callsite, au->reportedSize, au->sampleWeight);
+		deleteAllocUnit(au);
 	}
+	header->magic = TRACKING_HEADER_FREED;
 
-	// Add this allocation unit to the front of our reservoir of unused allocation units
-	memset(au, 0, sizeof(AllocUnit));
-	au->next = reservoir;
-	reservoir = au;
+	return Memory_TrackerCalculateActualAddress(reportedAddress);
+}
 
-	MUTEX_UNLOCK
+AL2O3_FORCE_INLINE MemoryStatsCategory statsCategory(TrackingHeader const *header) {
+	return header->align ? MSC_ALIGNED : MSC_PLAIN;
+}
+
+// a pushed tag is for the next allocation only, nothing is tagged when the level is off
+AL2O3_FORCE_INLINE uint16_t takeTag() {
+	uint32_t const next = g_nextTag;
+	g_nextTag = 0;
+	uint16_t const tag = next ? (uint16_t) (next - 1) : g_currentTag;
+	return (tag && atomicLoad32(&g_trackingLevel) != Memory_TrackingLevel_Off) ? tag : 0;
+}
+
+// blocks are only counted if the stats were on when they were allocated.
+// The tag has already been charged, if the allocation failed it's given back
+AL2O3_FORCE_INLINE void *countAllocation(void *reported, uint16_t tag, size_t size) {
+	if (reported == NULL) {
+		if (tag) {
+			tagFree(tag, 1, size);
+		}
+		return NULL;
+	}
+	TrackingHeader *header = trackingHeader(reported);
+	header->tag = tag;
+	if (atomicLoad32(&g_trackingLevel) != Memory_TrackingLevel_Off) {
+		header->flags |= TRACKING_FLAG_COUNTED;
+		memoryStatsAlloc(statsCategory(header), (size_t) header->reportedSize);
+	}
+	return reported;
+}
 
-	return adjustPtr;
+// the tracked functions below pass their own return address down, so a
+// captured stack starts in the code that called the allocator
+static void *trackedAallocFrom(Memory_SrcLoc *loc, size_t size, size_t align, uint16_t tag, void const *caller) {
+	if (tag && !tagAlloc(tag, 1, size)) {
+		return NULL;
+	}
+	// 16 is what plain allocations get anyway
+	if (align <= 16) {
+		void *mem = platformMalloc(Memory_TrackerCalculateActualSize(size));
+		return countAllocation(trackNewAllocation(loc, size, 0, mem, caller), tag, size);
+	}
+	void *mem = platformAalloc(Memory_TrackerCalculateActualAlignedSize(size, align), align);
+	return countAllocation(trackNewAllocation(loc, size, align, mem, caller), tag, size);
 }
 
 AL2O3_EXTERN_C void *trackedMalloc(size_t size) {
-	void *mem = platformMalloc(Memory_TrackerCalculateActualSize(size));
-	return Memory_TrackedAlloc(g_lastSourceFile, g_lastSourceLine, g_lastSourceFunc, size, mem);
+	Memory_SrcLoc *loc = takeSrcLoc();
+	void *mem = trackedAallocFrom(loc, size, 0, takeTag(), MEMORY_RETURN_ADDRESS());
+	traceEvent(TRACE_ALLOC, mem, NULL, size, 0, loc);
+	return mem;
 }
 
 AL2O3_EXTERN_C void *trackedAalloc(size_t size, size_t align) {
-	if( align <= 16) {
-		return trackedMalloc(size);
-	}
-	void *mem = platformAalloc(Memory_TrackerCalculateActualSize(size), align);
-	return Memory_TrackedAAlloc(g_lastSourceFile, g_lastSourceLine, g_lastSourceFunc, size, mem);
+	Memory_SrcLoc *loc = takeSrcLoc();
+	void *mem = trackedAallocFrom(loc, size, align, takeTag(), MEMORY_RETURN_ADDRESS());
+	traceEvent(TRACE_AALLOC, mem, NULL, size, align, loc);
+	return mem;
 }
 
 AL2O3_EXTERN_C void *trackedCalloc(size_t count, size_t size) {
-	void *mem = platformMalloc(Memory_TrackerCalculateActualSize(count * size));
-	if (mem) {
-		memset(mem, 0, Memory_TrackerCalculateActualSize(count * size));
+	Memory_SrcLoc *loc = takeSrcLoc();
+	uint16_t const tag = takeTag();
+	// the pushes are used up either way
+	if (count != 0 && size > SIZE_MAX / count) {
+		return NULL;
 	}
-	return Memory_TrackedAlloc(g_lastSourceFile, g_lastSourceLine, g_lastSourceFunc, count * size, mem);
+	if (tag && !tagAlloc(tag, 1, count * size)) {
+		return NULL;
+	}
+	void *actual = platformCalloc(1, Memory_TrackerCalculateActualSize(count * size));
+	void *mem = countAllocation(trackNewAllocation(loc, count * size, 0, actual, MEMORY_RETURN_ADDRESS()), tag, count * size);
+	traceEvent(TRACE_CALLOC, mem, NULL, count * size, 0, loc);
+	return mem;
+}
+
+static void freeTracked(void *ptr) {
+	if (ptr == NULL) {
+		return;
+	}
+	TrackingHeader const *header = trackingHeader(ptr);
+	MemoryStatsCategory const category = statsCategory(header);
+	size_t const size = (size_t) header->reportedSize;
+	bool const counted = (header->flags & TRACKING_FLAG_COUNTED) != 0;
+	uint16_t const tag = header->tag;
+
+	void *actual = Memory_TrackedFree(ptr);
+	if (actual) {
+		if (counted) {
+			memoryStatsFree(category, size);
+		}
+		if (tag) {
+			tagFree(tag, 1, size);
+		}
+		platformFree(actual);
+	}
+}
+
+static void *trackedAreallocFrom(Memory_SrcLoc *loc, void *ptr, size_t size, size_t align, void const *caller) {
+	if (align <= 16) {
+		align = 0;
+	}
+	// a pushed tag is used up either way, a block keeps the tag it was allocated with
+	uint16_t const newTag = takeTag();
+	if (ptr == NULL) {
+		return trackedAallocFrom(loc, size, align, newTag, caller);
+	}
+
+	TrackingHeader *header = trackingHeader(ptr);
+	uint16_t const tag = header->tag;
+	size_t const oldSize = (size_t) header->reportedSize;
+	// only the change in size is charged, the tag never holds both blocks
+	if (tag && !tagResize(tag, oldSize, size)) {
+		return NULL;
+	}
+
+	if (header->align != align) {
+		// the header would have to move, so make a new one and copy.
+		// The tag moves with the block rather than being charged again
+		void *mem = trackedAallocFrom(loc, size, align, 0, caller);
+		if (mem == NULL) {
+			if (tag) {
+				tagResize(tag, size, oldSize);
+			}
+			return NULL;
+		}
+		trackingHeader(mem)->tag = tag;
+		memcpy(mem, ptr, (oldSize < size) ? oldSize : size);
+		header->tag = 0;
+		freeTracked(ptr);
+		return mem;
+	}
+
+	uint16_t const flags = header->flags;
+	size_t const offset = (align > TRACKING_HEADER_SIZE) ? align : TRACKING_HEADER_SIZE;
+	void *actual = Memory_TrackerCalculateActualAddress(ptr);
+	void *mem;
+	if (align == 0) {
+		mem = platformRealloc(actual, Memory_TrackerCalculateActualSize(size));
+	} else {
+		mem = platformArealloc(actual, Memory_TrackerCalculateActualAlignedSize(size, align), align);
+	}
+	void *reported = retrackRealloc(loc, size, ptr, mem, offset, caller);
+	if (reported && (flags & TRACKING_FLAG_COUNTED)) {
+		memoryStatsRealloc(align ? MSC_ALIGNED : MSC_PLAIN, oldSize, size);
+	}
+	if (reported == NULL && tag) {
+		// the old block is untouched
+		tagResize(tag, size, oldSize);
+	}
+	return reported;
+}
+
+AL2O3_EXTERN_C void *trackedArealloc(void *ptr, size_t size, size_t align) {
+	Memory_SrcLoc *loc = takeSrcLoc();
+	void *mem = trackedAreallocFrom(loc, ptr, size, align, MEMORY_RETURN_ADDRESS());
+	traceEvent(TRACE_REALLOC, mem, ptr, size, align, loc);
+	return mem;
 }
 
 AL2O3_EXTERN_C void *trackedRealloc(void *ptr, size_t size) {
-	void *mem = platformRealloc(Memory_TrackerCalculateActualAddress(ptr), Memory_TrackerCalculateActualSize(size));
-	return Memory_TrackedRealloc(g_lastSourceFile, g_lastSourceLine, g_lastSourceFunc, size, ptr, mem);
+	Memory_SrcLoc *loc = takeSrcLoc();
+	// aligned allocations keep their alignment
+	size_t const align = ptr ? trackingHeader(ptr)->align : 0;
+	void *mem = trackedAreallocFrom(loc, ptr, size, align, MEMORY_RETURN_ADDRESS());
+	traceEvent(TRACE_REALLOC, mem, ptr, size, align, loc);
+	return mem;
 }
 
 AL2O3_EXTERN_C void trackedFree(void *ptr) {
-	bool const adjustPtr = Memory_TrackedFree(ptr);
-	if (adjustPtr) {
-		platformFree(Memory_TrackerCalculateActualAddress(ptr));
-	} else {
-		platformFree(ptr);
+	traceEvent(TRACE_FREE, ptr, NULL, 0, 0, NULL);
+	freeTracked(ptr);
+}
+
+AL2O3_EXTERN_C void trackedFreeSized(void *ptr, size_t size) {
+	// the header already knows the size
+	(void) size;
+	trackedFree(ptr);
+}
+
+AL2O3_EXTERN_C size_t trackedUsableSize(void const *ptr) {
+	if (ptr == NULL) {
+		return 0;
+	}
+	TrackingHeader const *header = trackingHeader(ptr);
+	size_t const usable = platformUsableSize(Memory_TrackerCalculateActualAddress(ptr));
+	if (usable < header->offset + header->reportedSize) {
+		return (size_t) header->reportedSize;
+	}
+	return usable - header->offset;
+}
+
+AL2O3_EXTERN_C bool trackedTryExpandInPlace(void *ptr, size_t size) {
+	if (ptr == NULL) {
+		return false;
+	}
+	TrackingHeader *header = trackingHeader(ptr);
+	if (size <= header->reportedSize) {
+		return true;
+	}
+	if (header->tag && !tagResize(header->tag, (size_t) header->reportedSize, size)) {
+		return false;
+	}
+	if (!platformTryExpandInPlace(Memory_TrackerCalculateActualAddress(ptr), size + header->offset)) {
+		if (header->tag) {
+			tagResize(header->tag, size, (size_t) header->reportedSize);
+		}
+		return false;
+	}
+
+	// the leak report should show the size being used
+	if (header->flags & TRACKING_FLAG_COUNTED) {
+		memoryStatsRealloc(statsCategory(header), (size_t) header->reportedSize, size);
+	}
+	header->reportedSize = size;
+	traceEvent(TRACE_EXPAND, ptr, ptr, size, 0, NULL);
+	if (header->flags & TRACKING_FLAG_UNTRACKED) {
+		return true;
+	}
+	TrackerShard *shard = shardFor(ptr);
+	MUTEX_LOCK(&shard->mutex)
+#if MEMORY_TRACKING_HEADER == 1
+	AllocUnit *au = header->au;
+#else
+	AllocUnit *au = findAllocUnit(shard, ptr);
+#endif
+	if (au) {
+		uint32_t const oldSize = au->reportedSize;
+		au->reportedSize = (size > 0xFFFFFFFF) ? (uint32_t)(0xFFFFFFFF) : (uint32_t) size;
+		if (au->callsite) {
+			uint64_t const grown = (uint64_t) (au->reportedSize - oldSize) * au->sampleWeight;
+			atomicAdd64(&au->callsite->liveBytes, grown);
+			atomicAdd64(&au->callsite->totalBytes, grown);
+		}
+	}
+	MUTEX_UNLOCK(&shard->mutex)
+	return true;
+}
+
+// Batches are worked on in chunks, each chunk is grouped by shard so every
+// shard it touches is locked just once however big the chunk is
+#define batchChunkSize 256u
+
+// chunk indices in shard order, shard s has order[start[s]] to order[start[s + 1]]
+typedef struct ShardOrder {
+	uint16_t order[batchChunkSize];
+	uint16_t start[shardCount + 1];
+} ShardOrder;
+
+// NULL keys are left out
+static void sortByShard(ShardOrder *sorted, void *const *keys, uint32_t count) {
+	uint8_t shardOf[batchChunkSize];
+	uint16_t next[shardCount];
+	memset(sorted->start, 0, sizeof(sorted->start));
+	for (uint32_t i = 0; i < count; ++i) {
+		if (keys[i]) {
+			shardOf[i] = (uint8_t) (shardFor(keys[i]) - g_shards);
+			sorted->start[shardOf[i] + 1]++;
+		}
+	}
+	for (uint32_t s = 0; s < shardCount; ++s) {
+		sorted->start[s + 1] += sorted->start[s];
+		next[s] = sorted->start[s];
+	}
+	for (uint32_t i = 0; i < count; ++i) {
+		if (keys[i]) {
+			sorted->order[next[shardOf[i]]++] = (uint16_t) i;
+		}
+	}
+}
+
+// trackAllocUnit for a chunk of same sized plain allocations from one callsite
+static void trackAllocUnits(Memory_SrcLoc *loc,
+														const size_t reportedSize,
+														void **reportedAddresses,
+														uint32_t count,
+														void const *caller) {
+	if (!atomicLoad64(&g_trackerActive)) {
+		atomicStore64(&g_trackerActive, 1);
+	}
+
+	AllocUnit *units[batchChunkSize];
+	uint32_t tracked = 0;
+	for (uint32_t i = 0; i < count; ++i) {
+		units[i] = NULL;
+		uint32_t const weight = sampleWeight(reportedSize);
+		if (weight == 0) {
+			trackingHeader(reportedAddresses[i])->flags |= TRACKING_FLAG_UNTRACKED;
+			continue;
+		}
+		units[i] = newAllocUnit();
+		if (units[i] == NULL) {
+			LOGERROR("Unable to track allocation. Out of memory.");
+			continue;
+		}
+		units[i]->sampleWeight = weight;
+		tracked++;
+	}
+	if (tracked == 0) {
+		return;
+	}
+
+	uint64_t allocationNumber = nextAllocationNumber(loc->sourceFile, tracked);
+	Callsite *callsite = callsiteFor(loc, stackCapture(caller));
+	void *keys[batchChunkSize];
+	for (uint32_t i = 0; i < count; ++i) {
+		AllocUnit *au = units[i];
+		keys[i] = au ? reportedAddresses[i] : NULL;
+		if (au) {
+			au->reportedSize = (reportedSize > 0xFFFFFFFF) ? (uint32_t)(0xFFFFFFFF) : (uint32_t) reportedSize;
+			au->reportedAddress = reportedAddresses[i];
+			au->allocationNumber = allocationNumber++;
+			au->callsite = callsite;
+		}
+	}
+
+	ShardOrder sorted;
+	sortByShard(&sorted, keys, count);
+	uint64_t totalWeight = 0;
+	AllocUnit *notInserted = NULL;
+	for (uint32_t s = 0; s < shardCount; ++s) {
+		if (sorted.start[s] == sorted.start[s + 1]) {
+			continue;
+		}
+		TrackerShard *shard = &g_shards[s];
+		MUTEX_LOCK(&shard->mutex)
+		for (uint32_t j = sorted.start[s]; j < sorted.start[s + 1]; ++j) {
+			AllocUnit *au = units[sorted.order[j]];
+			if (insertAllocUnit(shard, au)) {
+				totalWeight += au->sampleWeight;
+			} else {
+				au->next = notInserted;
+				notInserted = au;
+			}
+		}
+		MUTEX_UNLOCK(&shard->mutex)
+	}
+
+	// the memory is still valid, we just can't track it
+	while (notInserted) {
+		AllocUnit *next = notInserted->next;
+		deleteAllocUnit(notInserted);
+		notInserted = next;
+	}
+	callsiteAlloc(callsite, reportedSize, totalWeight);
+}
+
+static void trackedFreeBatch(size_t count, void **ptrs) {
+	for (size_t done = 0; done < count;) {
+		uint32_t const chunk = (count - done < batchChunkSize) ? (uint32_t) (count - done) : batchChunkSize;
+		void **chunkPtrs = ptrs + done;
+		done += chunk;
+
+		// first check the headers and pick out the ones in the tracker
+		void *keys[batchChunkSize];
+		AllocUnit *units[batchChunkSize];
+		bool release[batchChunkSize];
+		for (uint32_t i = 0; i < chunk; ++i) {
+			void *ptr = chunkPtrs[i];
+			keys[i] = NULL;
+			units[i] = NULL;
+			release[i] = false;
+			traceEvent(TRACE_FREE, ptr, NULL, 0, 0, NULL);
+			if (ptr == NULL) {
+				continue;
+			}
+			TrackingHeader *header = trackingHeader(ptr);
+#if MEMORY_TRACKING_HEADER == 1
+			if (header->magic != TRACKING_HEADER_MAGIC) {
+				if (header->magic == TRACKING_HEADER_FREED) {
+					LOGERROR("Request to deallocate RAM that has already been freed");
+				} else {
+					LOGERROR("Request to deallocate RAM that was never allocated (or has been overwritten)");
+				}
+				continue;
+			}
+			// so the same pointer twice in a batch is caught
+			header->magic = TRACKING_HEADER_FREED;
+			keys[i] = header->au ? ptr : NULL;
+#else
+			if (header->magic == TRACKING_HEADER_MAGIC && (header->flags & TRACKING_FLAG_UNTRACKED)) {
+				// never made it into the tables
+			} else if (!atomicLoad64(&g_trackerActive)) {
+				LOGERROR("Free before any allocations have occured or after exit!");
+			} else {
+				keys[i] = ptr;
+			}
+#endif
+			release[i] = true;
+		}
+
+		ShardOrder sorted;
+		sortByShard(&sorted, keys, chunk);
+		for (uint32_t s = 0; s < shardCount; ++s) {
+			if (sorted.start[s] == sorted.start[s + 1]) {
+				continue;
+			}
+			TrackerShard *shard = &g_shards[s];
+			MUTEX_LOCK(&shard->mutex)
+			for (uint32_t j = sorted.start[s]; j < sorted.start[s + 1]; ++j) {
+				uint32_t const i = sorted.order[j];
+				AllocUnit *au = findAllocUnit(shard, keys[i]);
+				if (au == NULL) {
+					LOGERROR("Request to deallocate RAM that was never allocated");
+					release[i] = false;
+					continue;
+				}
+				removeAllocUnit(shard, au);
+				units[i] = au;
+			}
+			MUTEX_UNLOCK(&shard->mutex)
+		}
+
+		uint64_t freedCount[MSC_COUNT] = { 0 };
+		size_t freedBytes[MSC_COUNT] = { 0 };
+		// a batch is usually all one tag, so runs of it are given back together
+		uint16_t runTag = 0;
+		uint64_t runCount = 0;
+		size_t runBytes = 0;
+		for (uint32_t i = 0; i < chunk; ++i) {
+			if (!release[i]) {
+				continue;
+			}
+			TrackingHeader *header = trackingHeader(chunkPtrs[i]);
+#if MEMORY_TRACKING_HEADER == 0
+			if (header->magic != TRACKING_HEADER_MAGIC) {
+				LOGERROR("Tracking header of a freed allocation has been overwritten");
+			}
+			header->magic = TRACKING_HEADER_FREED;
+#endif
+			if (units[i]) {
+				callsiteFree(units[i]->callsite, units[i]->reportedSize, units[i]->sampleWeight);
+				deleteAllocUnit(units[i]);
+			}
+			if (header->flags & TRACKING_FLAG_COUNTED) {
+				freedCount[statsCategory(header)]++;
+				freedBytes[statsCategory(header)] += (size_t) header->reportedSize;
+			}
+			if (header->tag != runTag) {
+				if (runTag) {
+					tagFree(runTag, runCount, runBytes);
+				}
+				runTag = header->tag;
+				runCount = 0;
+				runBytes = 0;
+			}
+			runCount++;
+			runBytes += (size_t) header->reportedSize;
+			platformFree(Memory_TrackerCalculateActualAddress(chunkPtrs[i]));
+		}
+		if (runTag) {
+			tagFree(runTag, runCount, runBytes);
+		}
+		memoryStatsFreeMany(MSC_PLAIN, freedCount[MSC_PLAIN], freedBytes[MSC_PLAIN]);
+		memoryStatsFreeMany(MSC_ALIGNED, freedCount[MSC_ALIGNED], freedBytes[MSC_ALIGNED]);
+	}
+}
+
+// The platform heap can't free part of a block, so each block is still its
+// own allocation. What a batch saves is the tracker work
+static bool trackedMallocBatch(size_t count, size_t size, void **outPtrs) {
+	Memory_SrcLoc *loc = takeSrcLoc();
+	void const *caller = MEMORY_RETURN_ADDRESS();
+	bool const counted = atomicLoad32(&g_trackingLevel) != Memory_TrackingLevel_Off;
+	uint16_t const tag = takeTag();
+	// the tag and stats are charged for the whole batch at once
+	if (size != 0 && count > SIZE_MAX / size) {
+		LOGERROR("Batch of %zu blocks of %zu bytes is too big", count, size);
+		memset(outPtrs, 0, count * sizeof(void *));
+		return false;
+	}
+	if (tag && !tagAlloc(tag, count, count * size)) {
+		memset(outPtrs, 0, count * sizeof(void *));
+		return false;
+	}
+
+	for (size_t done = 0; done < count;) {
+		uint32_t const chunk = (count - done < batchChunkSize) ? (uint32_t) (count - done) : batchChunkSize;
+		void **chunkPtrs = outPtrs + done;
+		for (uint32_t i = 0; i < chunk; ++i) {
+			void *actual = platformMalloc(Memory_TrackerCalculateActualSize(size));
+			if (actual == NULL) {
+				LOGERROR("Request for allocation failed. Out of memory.");
+				for (uint32_t j = 0; j < i; ++j) {
+					platformFree(Memory_TrackerCalculateActualAddress(chunkPtrs[j]));
+				}
+				trackedFreeBatch(done, outPtrs);
+				if (tag) {
+					// the freed blocks gave their share back
+					tagFree(tag, count - done, (count - done) * size);
+				}
+				memset(outPtrs, 0, count * sizeof(void *));
+				return false;
+			}
+			chunkPtrs[i] = writeTrackingHeader(actual, TRACKING_HEADER_SIZE, 0, size);
+			trackingHeader(chunkPtrs[i])->tag = tag;
+			if (counted) {
+				trackingHeader(chunkPtrs[i])->flags |= TRACKING_FLAG_COUNTED;
+			}
+		}
+		trackAllocUnits(loc, size, chunkPtrs, chunk, caller);
+		if (counted) {
+			memoryStatsAllocMany(MSC_PLAIN, chunk, chunk * size);
+		}
+		for (uint32_t i = 0; i < chunk; ++i) {
+			traceEvent(TRACE_ALLOC, chunkPtrs[i], NULL, size, 0, loc);
+		}
+		done += chunk;
 	}
+	return true;
 }
 
 AL2O3_EXTERN_C Memory_Allocator Memory_GlobalAllocator = {
@@ -626,60 +2025,197 @@ AL2O3_EXTERN_C Memory_Allocator Memory_GlobalAllocator = {
 		&trackedAalloc,
 		&trackedCalloc,
 		&trackedRealloc,
-		&trackedFree
+		&trackedFree,
+		&trackedFreeSized,
+		&trackedUsableSize,
+		&trackedTryExpandInPlace,
+		&trackedArealloc,
+		&trackedMallocBatch,
+		&trackedFreeBatch
 };
 
+static void logLeak(AllocUnit const *au, bool *loggedHeader) {
+	if (*loggedHeader == false) {
+		*loggedHeader = true;
+		LOGINFO("-=-=-=-=-=-=- Memory Leak Report -=-=-=-=-=-=-");
+		if (atomicLoad32(&g_trackingLevel) != Memory_TrackingLevel_Full) {
+			LOGINFO("tracking isn't at full, only tracked allocations are reported");
+		}
+	}
+	// a sampled leak stands in for sampleWeight similar ones
+	if(au->callsite && au->callsite->sourceFile) {
+		char const *fileNameOnly = sourceFileStripper(au->callsite->sourceFile);
+		LOGINFO("%u bytes from %s(%u): %s number: %llu weight: %u", au->reportedSize, fileNameOnly, au->callsite->sourceLine, au->callsite->sourceFunc, (unsigned long long)au->allocationNumber, au->sampleWeight);
+	} else {
+		LOGINFO("%u bytes from an unknown caller number: %llu weight: %u", au->reportedSize, (unsigned long long)au->allocationNumber, au->sampleWeight);
+	}
+
+	// the first frame is the function above, so start from its caller
+	void *frames[Memory_TrackerMaxStackDepth];
+	uint32_t const depth = au->callsite ? stackGetFrames(au->callsite->stackId, frames, Memory_TrackerMaxStackDepth) : 0;
+	for (uint32_t i = 1; i < depth && i < Memory_TrackerMaxStackDepth; ++i) {
+		char symbol[256];
+		stackSymbolize(frames[i], symbol, sizeof(symbol));
+		LOGINFO("    from %s", symbol);
+	}
+}
+
 AL2O3_EXTERN_C void Memory_TrackerDestroyAndLogLeaks() {
-	MUTEX_LOCK
-	bool loggedHeader = 0;
-	for (int i = 0; i < hashSize; ++i) {
-		AllocUnit *au = hashTable[i];
+	Memory_TempThreadShutdown();
+
+	// take every shard so the report is a consistent picture
+	for (uint32_t s = 0; s < shardCount; ++s) {
+		MUTEX_LOCK(&g_shards[s].mutex)
+	}
+	atomicStore64(&g_trackerActive, 0);
+
+	bool loggedHeader = false;
+	for (uint32_t s = 0; s < shardCount; ++s) {
+		TrackerShard *shard = &g_shards[s];
+#if MEMORY_TRACKING_HEADER == 1
+		AllocUnit *au = shard->live;
 		while (au != NULL) {
-			if (loggedHeader == false) {
-				loggedHeader = true;
-				LOGINFO("-=-=-=-=-=-=- Memory Leak Report -=-=-=-=-=-=-");
-			}
-			if(au->sourceFile) {
-				char const *fileNameOnly = sourceFileStripper(au->sourceFile);
-				LOGINFO("%u bytes from %s(%u): %s number: %u", au->reportedSize, fileNameOnly, au->sourceLine, au->sourceFunc, au->allocationNumber);
-			} else {
-				LOGINFO("%u bytes from an unknown caller number: %u", au->reportedSize, au->allocationNumber);
-			}
+			logLeak(au, &loggedHeader);
+			// the leaked memory may still be freed later, it will be untracked from now on
+			trackingHeader(au->reportedAddress)->au = NULL;
 			au = au->next;
 		}
+		shard->live = NULL;
+#else
+		// finish any migration so there is only one table to walk
+		migrateSome(shard, shard->old.capacity);
+
+		for (uint32_t i = 0; i < shard->table.capacity; ++i) {
+			AllocUnit *au = shard->table.entries[i].au;
+			if (au != NULL) {
+				logLeak(au, &loggedHeader);
+			}
+		}
+
+		platformFree(shard->table.entries);
+		memset(&shard->table, 0, sizeof(TrackerTable));
+#endif
 	}
 
 	// free the reservoirs
-	for(uint32_t i = 0;i < reservoirBufferSize;++i) {
-		platformFree(reservoirBuffer[i]);
+	destroyReservoir();
+	callsiteReset();
+	stackReset();
+
+	for (uint32_t s = 0; s < shardCount; ++s) {
+		MUTEX_UNLOCK(&g_shards[s].mutex)
 	}
-	reservoirBuffer = NULL;
-	reservoir = NULL;
-	reservoirBufferSize = 0;
+}
 
-	memset(hashTable, 0, sizeof(AllocUnit*) * hashSize);
-	MUTEX_UNLOCK
+#else
 
-	MUTEX_DESTROY
+// free can't tell aligned from plain without a header, so the stats count both as plain
+static void *globalMalloc(size_t size) {
+	void *mem = platformMalloc(size);
+	if (mem) {
+		memoryStatsAlloc(MSC_PLAIN, platformUsableSize(mem));
+	}
+	traceEvent(TRACE_ALLOC, mem, NULL, size, 0, takeSrcLoc());
+	return mem;
 }
 
-#else
+static void *globalAalloc(size_t size, size_t align) {
+	void *mem = platformAalloc(size, align);
+	if (mem) {
+		memoryStatsAlloc(MSC_PLAIN, platformUsableSize(mem));
+	}
+	traceEvent(TRACE_AALLOC, mem, NULL, size, align, takeSrcLoc());
+	return mem;
+}
+
+static void *globalCalloc(size_t count, size_t size) {
+	void *mem = platformCalloc(count, size);
+	if (mem) {
+		memoryStatsAlloc(MSC_PLAIN, platformUsableSize(mem));
+	}
+	traceEvent(TRACE_CALLOC, mem, NULL, count * size, 0, takeSrcLoc());
+	return mem;
+}
+
+static void *globalArealloc(void *ptr, size_t size, size_t align) {
+	if (ptr == NULL) {
+		return globalAalloc(size, align);
+	}
+	size_t const oldSize = platformUsableSize(ptr);
+	void *mem = platformArealloc(ptr, size, align);
+	if (mem) {
+		memoryStatsRealloc(MSC_PLAIN, oldSize, platformUsableSize(mem));
+	}
+	traceEvent(TRACE_REALLOC, mem, ptr, size, align, takeSrcLoc());
+	return mem;
+}
+
+static void *globalRealloc(void *ptr, size_t size) {
+	return globalArealloc(ptr, size, 16);
+}
+
+static void globalFree(void *ptr) {
+	traceEvent(TRACE_FREE, ptr, NULL, 0, 0, NULL);
+	if (ptr) {
+		memoryStatsFree(MSC_PLAIN, platformUsableSize(ptr));
+		platformFree(ptr);
+	}
+}
+
+static void globalFreeSized(void *ptr, size_t size) {
+	globalFree(ptr);
+}
+
+static bool globalTryExpandInPlace(void *ptr, size_t size) {
+	size_t const oldSize = platformUsableSize(ptr);
+	if (!platformTryExpandInPlace(ptr, size)) {
+		return false;
+	}
+	// heap blocks only claim slack usable size already counted, large ones can really grow
+	memoryStatsRealloc(MSC_PLAIN, oldSize, platformUsableSize(ptr));
+	traceEvent(TRACE_EXPAND, ptr, ptr, size, 0, NULL);
+	return true;
+}
 
 AL2O3_EXTERN_C Memory_Allocator
 Memory_GlobalAllocator = {
-		&platformMalloc,
-		&platformAalloc,
-		&platformCalloc,
-		&platformRealloc,
-		&platformFree
+		&globalMalloc,
+		&globalAalloc,
+		&globalCalloc,
+		&globalRealloc,
+		&globalFree,
+		&globalFreeSized,
+		&platformUsableSize,
+		&globalTryExpandInPlace,
+		&globalArealloc
 };
-AL2O3_EXTERN_C void Memory_TrackerDestroyAndLogLeaks() {}
+AL2O3_EXTERN_C void Memory_TrackerDestroyAndLogLeaks() {
+	Memory_TempThreadShutdown();
+}
+
+AL2O3_EXTERN_C void Memory_TrackerSetSampleRate(size_t sampleBytes) {
+}
+
+AL2O3_EXTERN_C size_t Memory_TrackerGetSampleRate() {
+	return 0;
+}
+
+// without the header free can't tell which blocks were counted, so the level is fixed
+AL2O3_EXTERN_C void Memory_TrackerSetLevel(Memory_TrackingLevel level) {
+	if (level != Memory_TrackerGetLevel()) {
+		LOGWARNING("Memory_TrackerSetLevel needs a tracking build");
+	}
+}
+
+AL2O3_EXTERN_C Memory_TrackingLevel Memory_TrackerGetLevel() {
+	return (MEMORY_STATS == 1) ? Memory_TrackingLevel_Stats : Memory_TrackingLevel_Off;
+}
 
 AL2O3_EXTERN_C void *Memory_TrackedAlloc(const char *a, const unsigned int b, const char *c, const size_t d, void *e) {
 	LOGERROR("Memory_TrackedAlloc called in non tracking build");
 	return NULL;
 };
-AL2O3_EXTERN_C void *Memory_TrackedAAlloc(const char *a, const unsigned int b, const char *c, const size_t d, void *e) {
+AL2O3_EXTERN_C void *Memory_TrackedAAlloc(const char *a, const unsigned int b, const char *c, const size_t d, const size_t e, void *f) {
 	LOGERROR("Memory_TrackedAAlloc called in non tracking build");
 	return NULL;
 }
@@ -692,4 +2228,18 @@ AL2O3_EXTERN_C void *Memory_TrackedRealloc(const char *a,
 	LOGERROR("Memory_TrackedRealloc called in non tracking build");
 	return NULL;
 }
+AL2O3_EXTERN_C void *Memory_TrackedARealloc(const char *a,
+																						const unsigned int b,
+																						const char *c,
+																						const size_t d,
+																						const size_t e,
+																						void *f,
+																						void *g) {
+	LOGERROR("Memory_TrackedARealloc called in non tracking build");
+	return NULL;
+}
+AL2O3_EXTERN_C void *Memory_TrackedFree(const void *a) {
+	LOGERROR("Memory_TrackedFree called in non tracking build");
+	return NULL;
+}
 #endif
@@ -0,0 +1,823 @@
+// License Summary: MIT see LICENSE file
+#include "al2o3_memory/memory.h"
+#include "internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#if MEMORY_TRACKING == 1
+
+// Every tracked allocation is counted against the callsite (file, line, func)
+// that made it. Callsites live in chunks that never move so an AllocUnit can
+// point straight at its callsite and free never has to look it up.
+// Static Memory_SrcLocs get a dense id the first time they are seen, without
+// a stack the id indexes straight to the callsite with no lock or hashing.
+// Everything else goes through a small per thread cache keyed by the source
+// pointers, only misses take the table lock.
+
+#define callsiteChunkShift 8u
+#define callsiteChunkSize (1u << callsiteChunkShift)
+#define callsiteCacheSize 64u
+#define srcLocChunkShift 10u
+#define srcLocChunkSize (1u << srcLocChunkShift)
+#define srcLocMaxChunks 1024u
+
+typedef struct CallsiteTable {
+	MemoryMutex mutex;
+	Callsite **chunks;
+	uint32_t chunkCapacity;
+	uint32_t count;
+	uint32_t *slots; // callsite index + 1, 0 is empty
+	uint32_t slotCapacity; // always a power of 2
+	uint64_t startNs;
+	uint64_t volatile generation; // invalidates the thread caches on reset
+	uint32_t srcLocCount; // ids handed out, a loc keeps its id over a reset
+} CallsiteTable;
+
+typedef struct CallsiteCacheEntry {
+	char const *sourceFile;
+	char const *sourceFunc;
+	uint32_t sourceLine;
+	uint32_t stackId;
+	Callsite *callsite;
+} CallsiteCacheEntry;
+
+typedef struct CallsiteCache {
+	uint64_t generation;
+	CallsiteCacheEntry entries[callsiteCacheSize];
+} CallsiteCache;
+
+static CallsiteTable g_callsites = { MEMORY_MUTEX_INITIALIZER, NULL, 0, 0, NULL, 0, 0, 1, 0 };
+static AL2O3_THREAD_LOCAL CallsiteCache g_callsiteCache;
+// chunks of stackless Callsite pointers indexed by Memory_SrcLoc id, written with the table locked
+static void *volatile g_callsiteById[srcLocMaxChunks];
+
+AL2O3_FORCE_INLINE uint64_t fmix64(uint64_t key) {
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+	return key;
+}
+
+// the same file/func strings can live at different addresses in different
+// translation units, so the table hashes the contents
+static uint32_t hashString(uint32_t hash, char const *str) {
+	if (str) {
+		while (*str) {
+			hash = (hash ^ (uint8_t) *str++) * 16777619u;
+		}
+	}
+	return hash;
+}
+
+AL2O3_FORCE_INLINE bool stringsEqual(char const *a, char const *b) {
+	if (a == b) {
+		return true;
+	}
+	return a && b && strcmp(a, b) == 0;
+}
+
+AL2O3_FORCE_INLINE Callsite *callsiteAt(uint32_t index) {
+	return &g_callsites.chunks[index >> callsiteChunkShift][index & (callsiteChunkSize - 1)];
+}
+
+// call with the table locked
+static bool growSlots() {
+	uint32_t const capacity = g_callsites.slotCapacity ? g_callsites.slotCapacity * 2 : 256;
+	uint32_t *slots = (uint32_t *) platformCalloc(capacity, sizeof(uint32_t));
+	if (slots == NULL) {
+		return false;
+	}
+	for (uint32_t i = 0; i < g_callsites.count; ++i) {
+		uint32_t slot = callsiteAt(i)->hash & (capacity - 1);
+		while (slots[slot] != 0) {
+			slot = (slot + 1) & (capacity - 1);
+		}
+		slots[slot] = i + 1;
+	}
+	platformFree(g_callsites.slots);
+	g_callsites.slots = slots;
+	g_callsites.slotCapacity = capacity;
+	return true;
+}
+
+// call with the table locked
+static Callsite *newCallsite() {
+	uint32_t const index = g_callsites.count;
+	uint32_t const chunk = index >> callsiteChunkShift;
+	if (chunk >= g_callsites.chunkCapacity) {
+		uint32_t const capacity = g_callsites.chunkCapacity ? g_callsites.chunkCapacity * 2 : 16;
+		Callsite **chunks = (Callsite **) platformRealloc(g_callsites.chunks, capacity * sizeof(Callsite *));
+		if (chunks == NULL) {
+			return NULL;
+		}
+		memset(chunks + g_callsites.chunkCapacity, 0, (capacity - g_callsites.chunkCapacity) * sizeof(Callsite *));
+		g_callsites.chunks = chunks;
+		g_callsites.chunkCapacity = capacity;
+	}
+	if (g_callsites.chunks[chunk] == NULL) {
+		g_callsites.chunks[chunk] = (Callsite *) platformCalloc(callsiteChunkSize, sizeof(Callsite));
+		if (g_callsites.chunks[chunk] == NULL) {
+			return NULL;
+		}
+	}
+	g_callsites.count++;
+	return callsiteAt(index);
+}
+
+static Callsite *findOrAddCallsite(char const *sourceFile, uint32_t sourceLine, char const *sourceFunc, uint32_t stackId) {
+	uint32_t hash = hashString(2166136261u, sourceFile);
+	hash = hashString(hash, sourceFunc);
+	hash = (uint32_t) fmix64(hash ^ ((uint64_t) sourceLine << 32) ^ ((uint64_t) stackId << 1));
+
+	if ((g_callsites.count + 1) * 4 > g_callsites.slotCapacity * 3 && !growSlots()) {
+		return NULL;
+	}
+
+	uint32_t const mask = g_callsites.slotCapacity - 1;
+	uint32_t slot = hash & mask;
+	while (g_callsites.slots[slot] != 0) {
+		Callsite *callsite = callsiteAt(g_callsites.slots[slot] - 1);
+		if (callsite->hash == hash &&
+				callsite->sourceLine == sourceLine &&
+				callsite->stackId == stackId &&
+				stringsEqual(callsite->sourceFile, sourceFile) &&
+				stringsEqual(callsite->sourceFunc, sourceFunc)) {
+			return callsite;
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	Callsite *callsite = newCallsite();
+	if (callsite == NULL) {
+		return NULL;
+	}
+	if (g_callsites.startNs == 0) {
+		g_callsites.startNs = monotonicNs();
+	}
+	callsite->sourceFile = sourceFile;
+	callsite->sourceFunc = sourceFunc;
+	callsite->sourceLine = sourceLine;
+	callsite->stackId = stackId;
+	callsite->hash = hash;
+	g_callsites.slots[slot] = g_callsites.count;
+	return callsite;
+}
+
+AL2O3_FORCE_INLINE Callsite *callsiteById(uint32_t id) {
+	if ((id >> srcLocChunkShift) >= srcLocMaxChunks) {
+		return NULL;
+	}
+	void *volatile *chunk = (void *volatile *) atomicLoadPtr(&g_callsiteById[id >> srcLocChunkShift]);
+	return chunk ? (Callsite *) atomicLoadPtr(&chunk[id & (srcLocChunkSize - 1)]) : NULL;
+}
+
+// call with the table locked
+static void publishCallsiteId(uint32_t id, Callsite *callsite) {
+	if ((id >> srcLocChunkShift) >= srcLocMaxChunks) {
+		return;
+	}
+	void *volatile *chunk = (void *volatile *) g_callsiteById[id >> srcLocChunkShift];
+	if (chunk == NULL) {
+		chunk = (void *volatile *) platformCalloc(srcLocChunkSize, sizeof(void *));
+		if (chunk == NULL) {
+			return;
+		}
+		atomicStorePtr(&g_callsiteById[id >> srcLocChunkShift], (void *) chunk);
+	}
+	atomicStorePtr(&chunk[id & (srcLocChunkSize - 1)], callsite);
+}
+
+static Callsite *lockedCallsiteFor(Memory_SrcLoc *loc, uint32_t stackId) {
+	MUTEX_LOCK(&g_callsites.mutex)
+	Callsite *callsite = findOrAddCallsite(loc->sourceFile, loc->sourceLine, loc->sourceFunc, stackId);
+	uint32_t id = atomicLoad32((uint32_t volatile *) &loc->id);
+	if (callsite && id != Memory_SrcLocNoId) {
+		if (id == 0 && g_callsites.srcLocCount + 1 != Memory_SrcLocNoId) {
+			id = ++g_callsites.srcLocCount;
+			atomicStore32((uint32_t volatile *) &loc->id, id);
+		}
+		if (callsite->srcLocId == 0) {
+			callsite->srcLocId = id;
+		}
+		if (stackId == 0 && id != 0) {
+			publishCallsiteId(id, callsite);
+		}
+	}
+	MUTEX_UNLOCK(&g_callsites.mutex)
+	return callsite;
+}
+
+AL2O3_EXTERN_C Callsite *callsiteFor(Memory_SrcLoc *loc, uint32_t stackId) {
+	uint32_t const id = atomicLoad32((uint32_t volatile *) &loc->id);
+	if (id != Memory_SrcLocNoId && (id == 0 || stackId == 0)) {
+		Callsite *callsite = id ? callsiteById(id) : NULL;
+		return callsite ? callsite : lockedCallsiteFor(loc, stackId);
+	}
+
+	CallsiteCache *cache = &g_callsiteCache;
+	uint64_t const generation = atomicLoad64(&g_callsites.generation);
+	if (cache->generation != generation) {
+		memset(cache, 0, sizeof(CallsiteCache));
+		cache->generation = generation;
+	}
+
+	char const *sourceFile = loc->sourceFile;
+	char const *sourceFunc = loc->sourceFunc;
+	uint32_t const sourceLine = loc->sourceLine;
+	uint64_t const key = ((uintptr_t) sourceFile) ^ (((uintptr_t) sourceFunc) << 1) ^ sourceLine ^ ((uint64_t) stackId << 32);
+	CallsiteCacheEntry *entry = &cache->entries[fmix64(key) & (callsiteCacheSize - 1)];
+	if (entry->callsite &&
+			entry->sourceFile == sourceFile &&
+			entry->sourceFunc == sourceFunc &&
+			entry->sourceLine == sourceLine &&
+			entry->stackId == stackId) {
+		return entry->callsite;
+	}
+
+	Callsite *callsite = lockedCallsiteFor(loc, stackId);
+	if (callsite) {
+		entry->sourceFile = sourceFile;
+		entry->sourceFunc = sourceFunc;
+		entry->sourceLine = sourceLine;
+		entry->stackId = stackId;
+		entry->callsite = callsite;
+	}
+	return callsite;
+}
+
+AL2O3_EXTERN_C void callsiteReset() {
+	MUTEX_LOCK(&g_callsites.mutex)
+	for (uint32_t i = 0; i < g_callsites.chunkCapacity; ++i) {
+		platformFree(g_callsites.chunks[i]);
+	}
+	platformFree(g_callsites.chunks);
+	platformFree(g_callsites.slots);
+	g_callsites.chunks = NULL;
+	g_callsites.chunkCapacity = 0;
+	g_callsites.count = 0;
+	g_callsites.slots = NULL;
+	g_callsites.slotCapacity = 0;
+	g_callsites.startNs = 0;
+	for (uint32_t i = 0; i < srcLocMaxChunks; ++i) {
+		platformFree(atomicExchangePtr(&g_callsiteById[i], NULL));
+	}
+	atomicAdd64(&g_callsites.generation, 1);
+	MUTEX_UNLOCK(&g_callsites.mutex)
+}
+
+// copies everything out so the exports never call back into user code with the lock held
+static Memory_CallsiteStats *snapshotCallsites(size_t *count) {
+	MUTEX_LOCK(&g_callsites.mutex)
+	*count = g_callsites.count;
+	Memory_CallsiteStats *stats = NULL;
+	if (g_callsites.count) {
+		stats = (Memory_CallsiteStats *) platformMalloc(g_callsites.count * sizeof(Memory_CallsiteStats));
+	}
+	if (stats) {
+		double const seconds = (double) (monotonicNs() - g_callsites.startNs) * 1e-9;
+		for (uint32_t i = 0; i < g_callsites.count; ++i) {
+			Callsite *callsite = callsiteAt(i);
+			Memory_CallsiteStats *out = &stats[i];
+			out->sourceFile = callsite->sourceFile;
+			out->sourceFunc = callsite->sourceFunc;
+			out->sourceLine = callsite->sourceLine;
+			out->stackId = callsite->stackId;
+			out->srcLocId = callsite->srcLocId;
+			out->liveBytes = atomicLoad64(&callsite->liveBytes);
+			out->liveCount = atomicLoad64(&callsite->liveCount);
+			out->totalBytes = atomicLoad64(&callsite->totalBytes);
+			out->totalAllocs = atomicLoad64(&callsite->totalAllocs);
+			out->totalFrees = atomicLoad64(&callsite->totalFrees);
+			out->churnPerSecond = (seconds > 0.0) ? (double) (out->totalAllocs + out->totalFrees) / seconds : 0.0;
+		}
+	} else {
+		*count = 0;
+	}
+	MUTEX_UNLOCK(&g_callsites.mutex)
+	return stats;
+}
+
+static int compareLiveBytes(void const *a, void const *b) {
+	uint64_t const aBytes = ((Memory_CallsiteStats const *) a)->liveBytes;
+	uint64_t const bBytes = ((Memory_CallsiteStats const *) b)->liveBytes;
+	return (aBytes < bBytes) ? 1 : ((aBytes > bBytes) ? -1 : 0);
+}
+
+AL2O3_EXTERN_C size_t Memory_TrackerGetCallsites(Memory_CallsiteStats *callsites, size_t maxCount) {
+	size_t count;
+	Memory_CallsiteStats *stats = snapshotCallsites(&count);
+	if (stats == NULL) {
+		return 0;
+	}
+	qsort(stats, count, sizeof(Memory_CallsiteStats), &compareLiveBytes);
+	if (callsites) {
+		memcpy(callsites, stats, ((count < maxCount) ? count : maxCount) * sizeof(Memory_CallsiteStats));
+	}
+	platformFree(stats);
+	return count;
+}
+
+// the callsites already total their live allocations, so a snapshot only has
+// to copy them out and no tracker shard is ever locked
+AL2O3_EXTERN_C Memory_HeapSnapshot *Memory_TrackerSnapshot() {
+	size_t count;
+	Memory_CallsiteStats *stats = snapshotCallsites(&count);
+	if (stats == NULL && count != 0) {
+		return NULL;
+	}
+
+	Memory_HeapSnapshot *snapshot = (Memory_HeapSnapshot *) platformMalloc(sizeof(Memory_HeapSnapshot) + count * sizeof(Memory_CallsiteStats));
+	if (snapshot == NULL) {
+		LOGERROR("Unable to take a heap snapshot. Out of memory.");
+		platformFree(stats);
+		return NULL;
+	}
+	snapshot->timeNs = monotonicNs();
+	snapshot->liveBytes = 0;
+	snapshot->liveCount = 0;
+	snapshot->callsiteCount = count;
+	snapshot->callsites = (Memory_CallsiteStats *) (snapshot + 1);
+	if (count) {
+		memcpy(snapshot->callsites, stats, count * sizeof(Memory_CallsiteStats));
+	}
+	for (size_t i = 0; i < count; ++i) {
+		snapshot->liveBytes += stats[i].liveBytes;
+		snapshot->liveCount += stats[i].liveCount;
+	}
+	platformFree(stats);
+	return snapshot;
+}
+
+AL2O3_EXTERN_C void Memory_TrackerFreeSnapshot(Memory_HeapSnapshot *snapshot) {
+	platformFree(snapshot);
+}
+
+AL2O3_FORCE_INLINE bool sameCallsite(Memory_CallsiteStats const *a, Memory_CallsiteStats const *b) {
+	// a callsite keeps the strings it was first seen with, so pointers are enough
+	return a->sourceFile == b->sourceFile && a->sourceFunc == b->sourceFunc &&
+			a->sourceLine == b->sourceLine && a->stackId == b->stackId;
+}
+
+static int compareLiveBytesGained(void const *a, void const *b) {
+	int64_t const aBytes = ((Memory_HeapDiffEntry const *) a)->liveBytes;
+	int64_t const bBytes = ((Memory_HeapDiffEntry const *) b)->liveBytes;
+	return (aBytes < bBytes) ? 1 : ((aBytes > bBytes) ? -1 : 0);
+}
+
+AL2O3_EXTERN_C size_t Memory_TrackerDiff(Memory_HeapSnapshot const *a,
+																				 Memory_HeapSnapshot const *b,
+																				 Memory_HeapDiffEntry *entries,
+																				 size_t maxCount) {
+	if (a == NULL || b == NULL) {
+		return 0;
+	}
+	size_t const capacity = a->callsiteCount + b->callsiteCount;
+	if (capacity == 0) {
+		return 0;
+	}
+	Memory_HeapDiffEntry *diff = (Memory_HeapDiffEntry *) platformMalloc(capacity * sizeof(Memory_HeapDiffEntry));
+	if (diff == NULL) {
+		LOGERROR("Unable to diff heap snapshots. Out of memory.");
+		return 0;
+	}
+
+	// both snapshots are in table order and new callsites are only ever added
+	// at the end, so one pass pairs them up. Only a tracker reset in between
+	// can leave callsites of a without a match, they count as all freed
+	size_t count = 0;
+	size_t j = 0;
+	for (size_t i = 0; i < b->callsiteCount; ++i) {
+		Memory_CallsiteStats const *later = &b->callsites[i];
+		size_t match = j;
+		while (match < a->callsiteCount && !sameCallsite(&a->callsites[match], later)) {
+			match++;
+		}
+		Memory_CallsiteStats const *earlier = NULL;
+		if (match < a->callsiteCount) {
+			for (; j < match; ++j) {
+				Memory_HeapDiffEntry *entry = &diff[count++];
+				entry->callsite = &a->callsites[j];
+				entry->liveBytes = -(int64_t) a->callsites[j].liveBytes;
+				entry->liveCount = -(int64_t) a->callsites[j].liveCount;
+				entry->allocs = 0;
+				entry->frees = a->callsites[j].liveCount;
+			}
+			earlier = &a->callsites[j++];
+		}
+
+		Memory_HeapDiffEntry *entry = &diff[count];
+		entry->callsite = later;
+		entry->liveBytes = (int64_t) later->liveBytes - (int64_t) (earlier ? earlier->liveBytes : 0);
+		entry->liveCount = (int64_t) later->liveCount - (int64_t) (earlier ? earlier->liveCount : 0);
+		entry->allocs = later->totalAllocs - (earlier ? earlier->totalAllocs : 0);
+		entry->frees = later->totalFrees - (earlier ? earlier->totalFrees : 0);
+		if (entry->liveBytes != 0 || entry->liveCount != 0 || entry->allocs != 0 || entry->frees != 0) {
+			count++;
+		}
+	}
+	for (; j < a->callsiteCount; ++j) {
+		Memory_HeapDiffEntry *entry = &diff[count++];
+		entry->callsite = &a->callsites[j];
+		entry->liveBytes = -(int64_t) a->callsites[j].liveBytes;
+		entry->liveCount = -(int64_t) a->callsites[j].liveCount;
+		entry->allocs = 0;
+		entry->frees = a->callsites[j].liveCount;
+	}
+
+	qsort(diff, count, sizeof(Memory_HeapDiffEntry), &compareLiveBytesGained);
+	if (entries) {
+		memcpy(entries, diff, ((count < maxCount) ? count : maxCount) * sizeof(Memory_HeapDiffEntry));
+	}
+	platformFree(diff);
+	return count;
+}
+
+// just enough protobuf to write a profile.proto
+typedef struct PbBuffer {
+	uint8_t *data;
+	size_t size;
+	size_t capacity;
+	bool failed;
+} PbBuffer;
+
+static void pbWrite(PbBuffer *buffer, void const *data, size_t size) {
+	if (buffer->size + size > buffer->capacity) {
+		size_t capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+		while (capacity < buffer->size + size) {
+			capacity *= 2;
+		}
+		uint8_t *mem = (uint8_t *) platformRealloc(buffer->data, capacity);
+		if (mem == NULL) {
+			buffer->failed = true;
+			return;
+		}
+		buffer->data = mem;
+		buffer->capacity = capacity;
+	}
+	memcpy(buffer->data + buffer->size, data, size);
+	buffer->size += size;
+}
+
+static void pbVarint(PbBuffer *buffer, uint64_t value) {
+	uint8_t bytes[10];
+	size_t count = 0;
+	do {
+		bytes[count] = (uint8_t) (value & 0x7F);
+		value >>= 7;
+		if (value) {
+			bytes[count] |= 0x80;
+		}
+		count++;
+	} while (value);
+	pbWrite(buffer, bytes, count);
+}
+
+static void pbInt(PbBuffer *buffer, uint32_t field, uint64_t value) {
+	pbVarint(buffer, (field << 3) | 0);
+	pbVarint(buffer, value);
+}
+
+static void pbBytes(PbBuffer *buffer, uint32_t field, void const *data, size_t size) {
+	pbVarint(buffer, (field << 3) | 2);
+	pbVarint(buffer, size);
+	pbWrite(buffer, data, size);
+}
+
+static void pbMessage(PbBuffer *buffer, uint32_t field, PbBuffer *message) {
+	pbBytes(buffer, field, message->data, message->size);
+	buffer->failed |= message->failed;
+	message->size = 0;
+}
+
+// string table with pointer dedup, the table is written at the end
+typedef struct PprofStrings {
+	char const **strings;
+	uint32_t count;
+	uint32_t capacity;
+	char const **keys;
+	uint32_t *ids;
+	uint32_t keyCapacity;
+} PprofStrings;
+
+static uint32_t pprofString(PprofStrings *strings, char const *str) {
+	if (str == NULL) {
+		str = "unknown";
+	}
+	uint32_t const mask = strings->keyCapacity - 1;
+	uint32_t slot = (uint32_t) fmix64((uintptr_t) str) & mask;
+	while (strings->keys[slot] != NULL) {
+		if (strings->keys[slot] == str) {
+			return strings->ids[slot];
+		}
+		slot = (slot + 1) & mask;
+	}
+	ASSERT(strings->count < strings->capacity);
+	strings->keys[slot] = str;
+	strings->ids[slot] = strings->count;
+	strings->strings[strings->count] = str;
+	return strings->count++;
+}
+
+// every distinct return address in the captured stacks gets its own location
+// and function, symbolized once here
+typedef struct PprofFrames {
+	void **addresses;
+	char **names;
+	uint32_t count;
+	void **keys;
+	uint32_t *ids; // index + 1, 0 is empty
+	uint32_t keyCapacity;
+} PprofFrames;
+
+static bool pprofFramesInit(PprofFrames *frames, Memory_CallsiteStats const *stats, size_t count) {
+	uint32_t total = 1;
+	for (size_t i = 0; i < count; ++i) {
+		uint32_t const depth = stackGetFrames(stats[i].stackId, NULL, 0);
+		total += (depth < Memory_TrackerMaxStackDepth) ? depth : Memory_TrackerMaxStackDepth;
+	}
+	memset(frames, 0, sizeof(PprofFrames));
+	frames->keyCapacity = 16;
+	while (frames->keyCapacity < total * 2) {
+		frames->keyCapacity *= 2;
+	}
+	frames->addresses = (void **) platformMalloc(total * sizeof(void *));
+	frames->names = (char **) platformCalloc(total, sizeof(char *));
+	frames->keys = (void **) platformCalloc(frames->keyCapacity, sizeof(void *));
+	frames->ids = (uint32_t *) platformCalloc(frames->keyCapacity, sizeof(uint32_t));
+	return frames->addresses && frames->names && frames->keys && frames->ids;
+}
+
+static uint32_t pprofFrame(PprofFrames *frames, void *address) {
+	uint32_t const mask = frames->keyCapacity - 1;
+	uint32_t slot = (uint32_t) fmix64((uintptr_t) address) & mask;
+	while (frames->ids[slot] != 0) {
+		if (frames->keys[slot] == address) {
+			return frames->ids[slot] - 1;
+		}
+		slot = (slot + 1) & mask;
+	}
+	uint32_t const index = frames->count++;
+	frames->keys[slot] = address;
+	frames->ids[slot] = index + 1;
+	frames->addresses[index] = address;
+
+	// a failed name just becomes "unknown"
+	char symbol[256];
+	size_t const length = stackSymbolize(address, symbol, sizeof(symbol));
+	frames->names[index] = (char *) platformMalloc(length + 1);
+	if (frames->names[index]) {
+		memcpy(frames->names[index], symbol, length + 1);
+	}
+	return index;
+}
+
+static void pprofFramesDestroy(PprofFrames *frames) {
+	if (frames->names) {
+		for (uint32_t i = 0; i < frames->count; ++i) {
+			platformFree(frames->names[i]);
+		}
+	}
+	platformFree(frames->addresses);
+	platformFree(frames->names);
+	platformFree(frames->keys);
+	platformFree(frames->ids);
+}
+
+AL2O3_EXTERN_C bool Memory_TrackerWritePprof(Memory_ProfileWriteFunc writeFunc, void *user) {
+	size_t count;
+	Memory_CallsiteStats *stats = snapshotCallsites(&count);
+
+	// the innermost frame of a stack is the callsites function, so it is skipped
+	void *stack[Memory_TrackerMaxStackDepth];
+	PprofFrames frames;
+	bool const framesOk = pprofFramesInit(&frames, stats, count);
+	for (size_t i = 0; framesOk && i < count; ++i) {
+		uint32_t const depth = stackGetFrames(stats[i].stackId, stack, Memory_TrackerMaxStackDepth);
+		for (uint32_t j = 1; j < depth && j < Memory_TrackerMaxStackDepth; ++j) {
+			pprofFrame(&frames, stack[j]);
+		}
+	}
+
+	// 7 fixed strings then at most a file and function for each callsite and a name per frame
+	PprofStrings strings;
+	memset(&strings, 0, sizeof(PprofStrings));
+	strings.capacity = (uint32_t) (7 + count * 2 + frames.count);
+	strings.keyCapacity = 16;
+	while (strings.keyCapacity < strings.capacity * 2) {
+		strings.keyCapacity *= 2;
+	}
+	strings.strings = (char const **) platformMalloc(strings.capacity * sizeof(char const *));
+	strings.keys = (char const **) platformCalloc(strings.keyCapacity, sizeof(char const *));
+	strings.ids = (uint32_t *) platformMalloc(strings.keyCapacity * sizeof(uint32_t));
+
+	PbBuffer out, message, inner;
+	memset(&out, 0, sizeof(PbBuffer));
+	memset(&message, 0, sizeof(PbBuffer));
+	memset(&inner, 0, sizeof(PbBuffer));
+
+	bool ok = framesOk && strings.strings && strings.keys && strings.ids;
+	if (ok) {
+		pprofString(&strings, "");
+		uint32_t const allocObjects = pprofString(&strings, "alloc_objects");
+		uint32_t const allocSpace = pprofString(&strings, "alloc_space");
+		uint32_t const inuseObjects = pprofString(&strings, "inuse_objects");
+		uint32_t const inuseSpace = pprofString(&strings, "inuse_space");
+		uint32_t const countUnit = pprofString(&strings, "count");
+		uint32_t const bytesUnit = pprofString(&strings, "bytes");
+
+		// sample_type = 1, in the same order as the sample values
+		uint32_t const types[4][2] = {
+				{ allocObjects, countUnit },
+				{ allocSpace, bytesUnit },
+				{ inuseObjects, countUnit },
+				{ inuseSpace, bytesUnit },
+		};
+		for (uint32_t i = 0; i < 4; ++i) {
+			pbInt(&message, 1, types[i][0]);
+			pbInt(&message, 2, types[i][1]);
+			pbMessage(&out, 1, &message);
+		}
+
+		for (size_t i = 0; i < count; ++i) {
+			Memory_CallsiteStats const *callsite = &stats[i];
+			uint64_t const id = i + 1;
+
+			// sample = 2, location ids innermost first
+			pbInt(&message, 1, id);
+			uint32_t const depth = stackGetFrames(callsite->stackId, stack, Memory_TrackerMaxStackDepth);
+			for (uint32_t j = 1; j < depth && j < Memory_TrackerMaxStackDepth; ++j) {
+				pbInt(&message, 1, count + 1 + pprofFrame(&frames, stack[j]));
+			}
+			pbInt(&message, 2, callsite->totalAllocs);
+			pbInt(&message, 2, callsite->totalBytes);
+			pbInt(&message, 2, callsite->liveCount);
+			pbInt(&message, 2, callsite->liveBytes);
+			pbMessage(&out, 2, &message);
+
+			// location = 4 with a single line
+			pbInt(&inner, 1, id);
+			pbInt(&inner, 2, callsite->sourceLine);
+			pbInt(&message, 1, id);
+			pbMessage(&message, 4, &inner);
+			pbMessage(&out, 4, &message);
+
+			// function = 5
+			pbInt(&message, 1, id);
+			pbInt(&message, 2, pprofString(&strings, callsite->sourceFunc));
+			pbInt(&message, 4, pprofString(&strings, callsite->sourceFile));
+			pbMessage(&out, 5, &message);
+		}
+
+		// stack frames follow the callsites, location = 4 with an address and function = 5
+		for (uint32_t i = 0; i < frames.count; ++i) {
+			uint64_t const id = count + 1 + i;
+			pbInt(&inner, 1, id);
+			pbInt(&message, 1, id);
+			pbInt(&message, 3, (uint64_t) (uintptr_t) frames.addresses[i]);
+			pbMessage(&message, 4, &inner);
+			pbMessage(&out, 4, &message);
+
+			pbInt(&message, 1, id);
+			pbInt(&message, 2, pprofString(&strings, frames.names[i]));
+			pbMessage(&out, 5, &message);
+		}
+
+		// string_table = 6
+		for (uint32_t i = 0; i < strings.count; ++i) {
+			pbBytes(&out, 6, strings.strings[i], strlen(strings.strings[i]));
+		}
+
+		// time_nanos = 9, duration_nanos = 10, default_sample_type = 14
+		pbInt(&out, 9, (uint64_t) time(NULL) * 1000000000ull);
+		MUTEX_LOCK(&g_callsites.mutex)
+		uint64_t const startNs = g_callsites.startNs;
+		MUTEX_UNLOCK(&g_callsites.mutex)
+		pbInt(&out, 10, startNs ? monotonicNs() - startNs : 0);
+		// period_type = 11, period = 12, the values are already scaled so this is informational
+		size_t const sampleRate = Memory_TrackerGetSampleRate();
+		if (Memory_TrackerGetLevel() == Memory_TrackingLevel_Sampled) {
+			pbInt(&message, 1, allocSpace);
+			pbInt(&message, 2, bytesUnit);
+			pbMessage(&out, 11, &message);
+			pbInt(&out, 12, sampleRate);
+		}
+		pbInt(&out, 14, inuseSpace);
+
+		ok = !out.failed;
+	}
+
+	if (ok) {
+		writeFunc(user, out.data, out.size);
+	} else {
+		LOGERROR("Unable to write pprof profile. Out of memory.");
+	}
+
+	platformFree(out.data);
+	platformFree(message.data);
+	platformFree(inner.data);
+	platformFree((void *) strings.strings);
+	platformFree((void *) strings.keys);
+	platformFree(strings.ids);
+	pprofFramesDestroy(&frames);
+	platformFree(stats);
+	return ok;
+}
+
+AL2O3_EXTERN_C bool Memory_TrackerWriteCollapsed(Memory_ProfileWriteFunc writeFunc,
+																								 void *user,
+																								 Memory_ProfileMetric metric) {
+	size_t count;
+	Memory_CallsiteStats *stats = snapshotCallsites(&count);
+	if (stats == NULL) {
+		return count == 0;
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		Memory_CallsiteStats const *callsite = &stats[i];
+		uint64_t value = 0;
+		switch (metric) {
+			case Memory_ProfileMetric_LiveBytes: value = callsite->liveBytes;
+				break;
+			case Memory_ProfileMetric_LiveCount: value = callsite->liveCount;
+				break;
+			case Memory_ProfileMetric_TotalBytes: value = callsite->totalBytes;
+				break;
+			case Memory_ProfileMetric_TotalAllocs: value = callsite->totalAllocs;
+				break;
+			case Memory_ProfileMetric_Churn: value = (uint64_t) (callsite->churnPerSecond + 0.5);
+				break;
+		}
+		// flamegraph tools drop zero samples anyway
+		if (value == 0) {
+			continue;
+		}
+
+		// outermost frame first, the callsite stands in for the innermost frame
+		char line[4096];
+		size_t length = 0;
+		void *frames[Memory_TrackerMaxStackDepth];
+		uint32_t depth = stackGetFrames(callsite->stackId, frames, Memory_TrackerMaxStackDepth);
+		depth = (depth < Memory_TrackerMaxStackDepth) ? depth : Memory_TrackerMaxStackDepth;
+		for (uint32_t j = depth; j-- > 1;) {
+			length += stackSymbolize(frames[j], line + length, sizeof(line) - length);
+			if (length < sizeof(line) - 1) {
+				line[length++] = ';';
+			}
+		}
+
+		int const size = snprintf(line + length, sizeof(line) - length, "%s (%s:%u) %llu\n",
+															callsite->sourceFunc ? callsite->sourceFunc : "unknown",
+															callsite->sourceFile ? callsite->sourceFile : "unknown",
+															callsite->sourceLine,
+															(unsigned long long) value);
+		if (size > 0) {
+			length += (size_t) size;
+			if (length >= sizeof(line)) {
+				// keep the newline if the names were too long
+				length = sizeof(line) - 1;
+				line[length - 1] = '\n';
+			}
+			writeFunc(user, line, length);
+		}
+	}
+
+	platformFree(stats);
+	return true;
+}
+
+#else
+
+AL2O3_EXTERN_C size_t Memory_TrackerGetCallsites(Memory_CallsiteStats *callsites, size_t maxCount) {
+	return 0;
+}
+
+AL2O3_EXTERN_C Memory_HeapSnapshot *Memory_TrackerSnapshot() {
+	return NULL;
+}
+
+AL2O3_EXTERN_C void Memory_TrackerFreeSnapshot(Memory_HeapSnapshot *snapshot) {
+}
+
+AL2O3_EXTERN_C size_t Memory_TrackerDiff(Memory_HeapSnapshot const *a,
+																				 Memory_HeapSnapshot const *b,
+																				 Memory_HeapDiffEntry *entries,
+																				 size_t maxCount) {
+	return 0;
+}
+
+AL2O3_EXTERN_C bool Memory_TrackerWritePprof(Memory_ProfileWriteFunc writeFunc, void *user) {
+	LOGWARNING("Memory_TrackerWritePprof called in non tracking build");
+	return false;
+}
+
+AL2O3_EXTERN_C bool Memory_TrackerWriteCollapsed(Memory_ProfileWriteFunc writeFunc,
+																								 void *user,
+																								 Memory_ProfileMetric metric) {
+	LOGWARNING("Memory_TrackerWriteCollapsed called in non tracking build");
+	return false;
+}
+
+#endif
@@ -0,0 +1,153 @@
+// License Summary: MIT see LICENSE file
+#include "al2o3_memory/memory.h"
+#include "internal.h"
+
+// A sorted array of ranges guarded by a version number (a seqlock). Writers
+// make the version odd while they change anything and every store releases,
+// so a reader that saw any of a change also sees the version move and looks
+// again. An array is only replaced when it is full, the old one is kept until
+// the set is destroyed as a reader may still be searching it.
+
+typedef struct RangeEntry {
+	uint64_t volatile start;
+	uint64_t volatile end;
+} RangeEntry;
+
+typedef struct RangeArray {
+	struct RangeArray *replaced;
+	uint64_t capacity;
+	uint64_t volatile count;
+	RangeEntry entries[];
+} RangeArray;
+
+#define RANGE_SET_FIRST_CAPACITY 16u
+
+AL2O3_FORCE_INLINE void beginChange(Memory_RangeSet *set) {
+	atomicStoreRelease64(&set->version, set->version + 1);
+}
+
+AL2O3_FORCE_INLINE void endChange(Memory_RangeSet *set) {
+	atomicStoreRelease64(&set->version, set->version + 1);
+}
+
+AL2O3_FORCE_INLINE void storeEntry(RangeEntry *entry, uint64_t start, uint64_t end) {
+	atomicStoreRelease64(&entry->start, start);
+	atomicStoreRelease64(&entry->end, end);
+}
+
+AL2O3_EXTERN_C bool Memory_RangeSetAdd(Memory_RangeSet *set, void const *start, size_t size) {
+	uint64_t const first = (uint64_t) (uintptr_t) start;
+	RangeArray *array = (RangeArray *) set->ranges;
+	uint64_t const count = array ? array->count : 0;
+
+	// a full array is copied to a bigger one, nobody can see the copy yet
+	RangeArray *target = array;
+	if (array == NULL || count == array->capacity) {
+		uint64_t const capacity = array ? array->capacity * 2 : RANGE_SET_FIRST_CAPACITY;
+		target = (RangeArray *) platformMalloc(sizeof(RangeArray) + (size_t) capacity * sizeof(RangeEntry));
+		if (target == NULL) {
+			return false;
+		}
+		target->replaced = array;
+		target->capacity = capacity;
+		target->count = count;
+		for (uint64_t i = 0; i < count; ++i) {
+			target->entries[i].start = array->entries[i].start;
+			target->entries[i].end = array->entries[i].end;
+		}
+	}
+
+	uint64_t at = count;
+	while (at > 0 && target->entries[at - 1].start > first) {
+		--at;
+	}
+
+	beginChange(set);
+	for (uint64_t i = count; i > at; --i) {
+		storeEntry(&target->entries[i], target->entries[i - 1].start, target->entries[i - 1].end);
+	}
+	storeEntry(&target->entries[at], first, first + size);
+	atomicStoreRelease64(&target->count, count + 1);
+	if (target != array) {
+		atomicStorePtr(&set->ranges, target);
+	}
+	endChange(set);
+	return true;
+}
+
+AL2O3_EXTERN_C void Memory_RangeSetRemove(Memory_RangeSet *set, void const *start) {
+	uint64_t const first = (uint64_t) (uintptr_t) start;
+	RangeArray *array = (RangeArray *) set->ranges;
+	uint64_t const count = array ? array->count : 0;
+	uint64_t at = 0;
+	while (at < count && array->entries[at].start != first) {
+		++at;
+	}
+	if (at == count) {
+		LOGERROR("Memory_RangeSetRemove of a range that isn't in the set");
+		return;
+	}
+
+	beginChange(set);
+	for (uint64_t i = at; i + 1 < count; ++i) {
+		storeEntry(&array->entries[i], array->entries[i + 1].start, array->entries[i + 1].end);
+	}
+	atomicStoreRelease64(&array->count, count - 1);
+	endChange(set);
+}
+
+AL2O3_EXTERN_C void Memory_RangeSetClear(Memory_RangeSet *set) {
+	RangeArray *array = (RangeArray *) set->ranges;
+	if (array == NULL) {
+		return;
+	}
+	beginChange(set);
+	atomicStoreRelease64(&array->count, 0);
+	endChange(set);
+}
+
+AL2O3_EXTERN_C bool Memory_RangeSetContains(Memory_RangeSet const *set, void const *address) {
+	// the atomics don't take const, nothing is written
+	Memory_RangeSet *readSet = (Memory_RangeSet *) set;
+	uint64_t const key = (uint64_t) (uintptr_t) address;
+	for (;;) {
+		uint64_t const version = atomicLoadAcquire64(&readSet->version);
+		if (version & 1) {
+			continue;
+		}
+
+		bool found = false;
+		RangeArray *array = (RangeArray *) atomicLoadPtr(&readSet->ranges);
+		if (array) {
+			// the last range starting at or before the address
+			uint64_t low = 0;
+			uint64_t high = atomicLoadAcquire64(&array->count);
+			if (high > array->capacity) {
+				high = array->capacity;
+			}
+			while (low < high) {
+				uint64_t const middle = low + (high - low) / 2;
+				if (atomicLoadAcquire64(&array->entries[middle].start) <= key) {
+					low = middle + 1;
+				} else {
+					high = middle;
+				}
+			}
+			found = low > 0 && key < atomicLoadAcquire64(&array->entries[low - 1].end);
+		}
+
+		if (atomicLoadAcquire64(&readSet->version) == version) {
+			return found;
+		}
+	}
+}
+
+AL2O3_EXTERN_C void Memory_RangeSetDestroy(Memory_RangeSet *set) {
+	RangeArray *array = (RangeArray *) set->ranges;
+	set->ranges = NULL;
+	while (array) {
+		RangeArray *replaced = array->replaced;
+		platformFree(array);
+		array = replaced;
+	}
+}
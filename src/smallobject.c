@@ -0,0 +1,593 @@
+// License Summary: MIT see LICENSE file
+#include "al2o3_memory/memory.h"
+#include "internal.h"
+
+// A thread caching size class allocator for small objects.
+// Memory is reserved from the platform in 4MiB segments that are split into
+// 64KiB pages, each page holds blocks of one size class and belongs to one
+// thread heap. The owning thread allocates and frees with no atomics at all,
+// other threads free into a lock free remote list on the page which the owner
+// collects when it runs out of local blocks.
+// Pages that run out of blocks leave their heaps active list, if another
+// thread frees into a full page it is pushed onto the owning heaps delayed
+// list so the owner can pick it back up.
+// Heaps are never freed, when a thread exits its heap (and all its pages) is
+// parked for the next new thread to adopt.
+// Anything too big (or too aligned) for a size class goes to the global
+// allocator, the segment map tells free which is which.
+
+#define SMALL_PAGE_SHIFT 16u
+#define SMALL_PAGE_SIZE (1u << SMALL_PAGE_SHIFT)
+#define SMALL_SEGMENT_SHIFT 22u
+#define SMALL_SEGMENT_SIZE (1u << SMALL_SEGMENT_SHIFT)
+#define SMALL_PAGES_PER_SEGMENT (SMALL_SEGMENT_SIZE / SMALL_PAGE_SIZE)
+#define SMALL_PAGE_HEADER_SIZE 128u
+#define SMALL_MAX_SIZE 2048u
+#define SMALL_ALIGN 16u
+
+// segment map covers a 48 bit address space with a 2 level bitmap
+#define SEGMENT_MAP_KEY_BITS (48u - SMALL_SEGMENT_SHIFT)
+#define SEGMENT_MAP_L2_BITS 13u
+#define SEGMENT_MAP_L1_BITS (SEGMENT_MAP_KEY_BITS - SEGMENT_MAP_L2_BITS)
+
+// ~25% apart after 256 bytes, everything a multiple of 16 to keep the alignment contract
+static uint32_t const g_sizeClasses[] = {
+		16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240, 256,
+		320, 384, 448, 512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048
+};
+#define SMALL_CLASS_COUNT (sizeof(g_sizeClasses) / sizeof(g_sizeClasses[0]))
+
+// size / 16 rounded up -> size class
+static uint8_t g_sizeToClass[SMALL_MAX_SIZE / SMALL_ALIGN + 1];
+
+typedef enum SmallPageState {
+	SPS_ACTIVE = 0,       // in the owner heaps active list
+	SPS_FULL = 1,         // not in any list
+	SPS_FULL_NOTIFIED = 2 // on the owner heaps delayed list
+} SmallPageState;
+
+struct SmallHeap;
+
+typedef struct SmallPage {
+	// owner thread only
+	struct SmallPage *next;
+	struct SmallPage *prev;
+	void *freeList;
+	uint8_t *bump;
+	uint8_t *end;
+	uint32_t blockSize;
+	uint32_t sizeClass;
+	uint32_t used;
+
+	// set before the page is handed out, constant while it has live blocks
+	struct SmallHeap *owner;
+
+	// shared with other threads
+	void *volatile remoteFree;
+	struct SmallPage *volatile delayedNext;
+	uint32_t volatile remoteFreed;
+	uint32_t volatile state;
+} SmallPage;
+
+typedef char SmallPageHeaderSizeCheck[(sizeof(SmallPage) <= SMALL_PAGE_HEADER_SIZE) ? 1 : -1];
+
+typedef struct SmallHeap {
+	SmallPage *active[SMALL_CLASS_COUNT];
+	SmallPage *volatile delayed;
+	struct SmallHeap *nextParked;
+} SmallHeap;
+
+typedef struct SmallPool {
+	MemoryMutex mutex;
+	SmallPage *freePages;
+	SmallHeap *parkedHeaps;
+} SmallPool;
+
+static SmallPool g_smallPool = { MEMORY_MUTEX_INITIALIZER };
+static uint64_t *volatile g_segmentMap[1u << SEGMENT_MAP_L1_BITS];
+static AL2O3_THREAD_LOCAL SmallHeap *g_smallHeap;
+
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+static INIT_ONCE g_smallInitOnce = INIT_ONCE_STATIC_INIT;
+static DWORD g_smallHeapFls;
+#else
+static pthread_once_t g_smallInitOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t g_smallHeapKey;
+#endif
+
+AL2O3_FORCE_INLINE SmallPage *pageOf(void const *ptr) {
+	return (SmallPage *) (((uintptr_t) ptr) & ~((uintptr_t) SMALL_PAGE_SIZE - 1));
+}
+
+AL2O3_FORCE_INLINE uint32_t sizeClassOf(size_t size) {
+	return g_sizeToClass[(size + SMALL_ALIGN - 1) / SMALL_ALIGN];
+}
+
+static bool isSmallObject(void const *ptr) {
+	uint64_t const key = ((uint64_t) (uintptr_t) ptr) >> SMALL_SEGMENT_SHIFT;
+	if (key >> SEGMENT_MAP_KEY_BITS) {
+		return false;
+	}
+	uint64_t *l2 = (uint64_t *) atomicLoadPtr((void *volatile *) &g_segmentMap[key >> SEGMENT_MAP_L2_BITS]);
+	if (l2 == NULL) {
+		return false;
+	}
+	uint32_t const bit = (uint32_t) (key & ((1u << SEGMENT_MAP_L2_BITS) - 1));
+	return (atomicLoad64(&l2[bit >> 6]) & (1ULL << (bit & 63))) != 0;
+}
+
+// call with the pool locked
+static bool registerSegment(void const *segment) {
+	uint64_t const key = ((uint64_t) (uintptr_t) segment) >> SMALL_SEGMENT_SHIFT;
+	if (key >> SEGMENT_MAP_KEY_BITS) {
+		return false;
+	}
+	uint64_t *l2 = g_segmentMap[key >> SEGMENT_MAP_L2_BITS];
+	if (l2 == NULL) {
+		l2 = (uint64_t *) platformCalloc((1u << SEGMENT_MAP_L2_BITS) / 64, sizeof(uint64_t));
+		if (l2 == NULL) {
+			return false;
+		}
+		atomicStorePtr((void *volatile *) &g_segmentMap[key >> SEGMENT_MAP_L2_BITS], l2);
+	}
+	uint32_t const bit = (uint32_t) (key & ((1u << SEGMENT_MAP_L2_BITS) - 1));
+	// only written under the lock, but any thread freeing anything reads it
+	atomicStore64(&l2[bit >> 6], atomicLoad64(&l2[bit >> 6]) | (1ULL << (bit & 63)));
+	return true;
+}
+
+static void releaseHeap(void *heap) {
+	if (heap == NULL) {
+		return;
+	}
+	// later destructors on this thread may still free small objects, once the
+	// heap is parked another thread can adopt it so those must be remote frees
+	// (or allocate from a newly acquired heap)
+	if (g_smallHeap == heap) {
+		g_smallHeap = NULL;
+	}
+	// park it with all its pages, a new thread will adopt it
+	MUTEX_LOCK(&g_smallPool.mutex)
+	((SmallHeap *) heap)->nextParked = g_smallPool.parkedHeaps;
+	g_smallPool.parkedHeaps = (SmallHeap *) heap;
+	MUTEX_UNLOCK(&g_smallPool.mutex)
+}
+
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+static void WINAPI releaseHeapFls(void *heap) {
+	releaseHeap(heap);
+}
+
+static BOOL CALLBACK smallInit(PINIT_ONCE initOnce, PVOID param, PVOID *context) {
+#else
+static void smallInit() {
+#endif
+	uint32_t sizeClass = 0;
+	for (uint32_t i = 0; i <= SMALL_MAX_SIZE / SMALL_ALIGN; ++i) {
+		while (g_sizeClasses[sizeClass] < i * SMALL_ALIGN) {
+			sizeClass++;
+		}
+		g_sizeToClass[i] = (uint8_t) sizeClass;
+	}
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+	g_smallHeapFls = FlsAlloc(&releaseHeapFls);
+	return TRUE;
+#else
+	pthread_key_create(&g_smallHeapKey, &releaseHeap);
+#endif
+}
+
+static SmallHeap *acquireHeap() {
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+	InitOnceExecuteOnce(&g_smallInitOnce, &smallInit, NULL, NULL);
+#else
+	pthread_once(&g_smallInitOnce, &smallInit);
+#endif
+
+	MUTEX_LOCK(&g_smallPool.mutex)
+	SmallHeap *heap = g_smallPool.parkedHeaps;
+	if (heap) {
+		g_smallPool.parkedHeaps = heap->nextParked;
+	}
+	MUTEX_UNLOCK(&g_smallPool.mutex)
+
+	if (heap == NULL) {
+		heap = (SmallHeap *) platformCalloc(1, sizeof(SmallHeap));
+		if (heap == NULL) {
+			return NULL;
+		}
+	}
+	heap->nextParked = NULL;
+
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+	FlsSetValue(g_smallHeapFls, heap);
+#else
+	pthread_setspecific(g_smallHeapKey, heap);
+#endif
+	g_smallHeap = heap;
+	return heap;
+}
+
+// call with the pool locked
+static bool growPool() {
+	uint8_t *segment = (uint8_t *) platformAalloc(SMALL_SEGMENT_SIZE, SMALL_SEGMENT_SIZE);
+	if (segment == NULL) {
+		return false;
+	}
+	if (!registerSegment(segment)) {
+		platformFree(segment);
+		return false;
+	}
+	for (uint32_t i = 0; i < SMALL_PAGES_PER_SEGMENT; ++i) {
+		SmallPage *page = (SmallPage *) (segment + i * SMALL_PAGE_SIZE);
+		page->next = g_smallPool.freePages;
+		g_smallPool.freePages = page;
+	}
+	return true;
+}
+
+static SmallPage *newPage(SmallHeap *heap, uint32_t sizeClass) {
+	MUTEX_LOCK(&g_smallPool.mutex)
+	if (g_smallPool.freePages == NULL && !growPool()) {
+		MUTEX_UNLOCK(&g_smallPool.mutex)
+		return NULL;
+	}
+	SmallPage *page = g_smallPool.freePages;
+	g_smallPool.freePages = page->next;
+	MUTEX_UNLOCK(&g_smallPool.mutex)
+
+	memset(page, 0, sizeof(SmallPage));
+	page->bump = ((uint8_t *) page) + SMALL_PAGE_HEADER_SIZE;
+	page->blockSize = g_sizeClasses[sizeClass];
+	page->end = page->bump + ((SMALL_PAGE_SIZE - SMALL_PAGE_HEADER_SIZE) / page->blockSize) * page->blockSize;
+	page->sizeClass = sizeClass;
+	page->owner = heap;
+	page->state = SPS_ACTIVE;
+	return page;
+}
+
+static void pushActive(SmallHeap *heap, SmallPage *page) {
+	SmallPage **head = &heap->active[page->sizeClass];
+	page->prev = NULL;
+	page->next = *head;
+	if (*head) {
+		(*head)->prev = page;
+	}
+	*head = page;
+}
+
+static void unlinkActive(SmallHeap *heap, SmallPage *page) {
+	if (heap->active[page->sizeClass] == page) {
+		heap->active[page->sizeClass] = page->next;
+	}
+	if (page->prev) {
+		page->prev->next = page->next;
+	}
+	if (page->next) {
+		page->next->prev = page->prev;
+	}
+	page->next = page->prev = NULL;
+}
+
+// pick up pages other threads have freed into whilst they were full
+static bool collectDelayed(SmallHeap *heap) {
+	SmallPage *page = (SmallPage *) atomicExchangePtr((void *volatile *) &heap->delayed, NULL);
+	bool const any = page != NULL;
+	while (page) {
+		SmallPage *next = page->delayedNext;
+		atomicStore32(&page->state, SPS_ACTIVE);
+		pushActive(heap, page);
+		page = next;
+	}
+	return any;
+}
+
+AL2O3_FORCE_INLINE void *popBlock(SmallPage *page) {
+	void *block = page->freeList;
+	if (block) {
+		page->freeList = *(void **) block;
+	} else if (page->bump < page->end) {
+		block = page->bump;
+		page->bump += page->blockSize;
+	} else {
+		// local blocks are gone, take whatever other threads have given back
+		block = atomicExchangePtr(&page->remoteFree, NULL);
+		if (block == NULL) {
+			return NULL;
+		}
+		page->freeList = *(void **) block;
+	}
+	page->used++;
+	return block;
+}
+
+static void *smallAllocSlow(SmallHeap *heap, uint32_t sizeClass) {
+	while (true) {
+		SmallPage *page = heap->active[sizeClass];
+		while (page) {
+			void *block = popBlock(page);
+			if (block) {
+				return block;
+			}
+
+			// this page is full, park it until a free happens on it
+			SmallPage *next = page->next;
+			unlinkActive(heap, page);
+			atomicStore32(&page->state, SPS_FULL);
+			// a remote free may have raced us before it could see the page was full
+			if (atomicLoadPtr(&page->remoteFree) != NULL &&
+					atomicCompareExchange32(&page->state, SPS_FULL, SPS_ACTIVE)) {
+				pushActive(heap, page);
+				continue;
+			}
+			page = next;
+		}
+
+		if (!collectDelayed(heap)) {
+			break;
+		}
+	}
+
+	SmallPage *page = newPage(heap, sizeClass);
+	if (page == NULL) {
+		return NULL;
+	}
+	pushActive(heap, page);
+	return popBlock(page);
+}
+
+static void *smallMalloc(size_t size) {
+	if (size > SMALL_MAX_SIZE) {
+		return Memory_GlobalAllocator.malloc(size);
+	}
+
+	SmallHeap *heap = g_smallHeap;
+	if (heap == NULL) {
+		heap = acquireHeap();
+		if (heap == NULL) {
+			return NULL;
+		}
+	}
+
+	uint32_t const sizeClass = sizeClassOf(size);
+	SmallPage *page = heap->active[sizeClass];
+	if (page) {
+		// fast path, pop a local free block
+		void *block = page->freeList;
+		if (block) {
+			page->freeList = *(void **) block;
+			page->used++;
+			return block;
+		}
+	}
+	return smallAllocSlow(heap, sizeClass);
+}
+
+static void *smallAalloc(size_t size, size_t align) {
+	if (align <= SMALL_ALIGN) {
+		return smallMalloc(size);
+	}
+	return Memory_GlobalAllocator.aalloc(size, align);
+}
+
+static void *smallCalloc(size_t count, size_t size) {
+	if (count == 0 || size > SIZE_MAX / count) {
+		return NULL;
+	}
+	if (count * size > SMALL_MAX_SIZE) {
+		return Memory_GlobalAllocator.calloc(count, size);
+	}
+	void *mem = smallMalloc(count * size);
+	if (mem) {
+		memset(mem, 0, count * size);
+	}
+	return mem;
+}
+
+static void smallFreeRemote(SmallPage *page, void *block) {
+	void *head;
+	do {
+		head = atomicLoadPtr(&page->remoteFree);
+		*(void **) block = head;
+	} while (!atomicCompareExchangePtr(&page->remoteFree, head, block));
+
+	// if the owner parked it as full, tell it about the free (only once)
+	if (atomicLoad32(&page->state) == SPS_FULL &&
+			atomicCompareExchange32(&page->state, SPS_FULL, SPS_FULL_NOTIFIED)) {
+		SmallHeap *owner = page->owner;
+		SmallPage *delayedHead;
+		do {
+			delayedHead = (SmallPage *) atomicLoadPtr((void *volatile *) &owner->delayed);
+			page->delayedNext = delayedHead;
+		} while (!atomicCompareExchangePtr((void *volatile *) &owner->delayed, delayedHead, page));
+	}
+
+	// must be the last touch of the page, once the owner sees every block as
+	// free it can recycle the page
+	atomicAdd32(&page->remoteFreed, 1);
+}
+
+static void smallFree(void *ptr) {
+	if (ptr == NULL) {
+		return;
+	}
+	if (!isSmallObject(ptr)) {
+		Memory_GlobalAllocator.free(ptr);
+		return;
+	}
+
+	SmallPage *page = pageOf(ptr);
+	SmallHeap *heap = g_smallHeap;
+	if (page->owner != heap) {
+		smallFreeRemote(page, ptr);
+		return;
+	}
+
+	*(void **) ptr = page->freeList;
+	page->freeList = ptr;
+	page->used--;
+
+	uint32_t const state = atomicLoad32(&page->state);
+	if (state == SPS_FULL) {
+		// has space again, only we can take it out of the full state unless a remote free notifies first
+		if (atomicCompareExchange32(&page->state, SPS_FULL, SPS_ACTIVE)) {
+			pushActive(heap, page);
+		}
+	} else if (state == SPS_ACTIVE &&
+			page->used == atomicLoad32(&page->remoteFreed) &&
+			(page->prev != NULL || page->next != NULL)) {
+		// completely empty and not the only page of its class, give it back
+		unlinkActive(heap, page);
+		MUTEX_LOCK(&g_smallPool.mutex)
+		page->next = g_smallPool.freePages;
+		g_smallPool.freePages = page;
+		MUTEX_UNLOCK(&g_smallPool.mutex)
+	}
+}
+
+static void *smallRealloc(void *ptr, size_t size) {
+	if (ptr == NULL) {
+		return smallMalloc(size);
+	}
+	if (!isSmallObject(ptr)) {
+		// we don't know the old size, so it stays global
+		return Memory_GlobalAllocator.realloc(ptr, size);
+	}
+
+	uint32_t const blockSize = pageOf(ptr)->blockSize;
+	if (size <= blockSize && size > blockSize / 2) {
+		return ptr;
+	}
+
+	void *mem = smallMalloc(size);
+	if (mem) {
+		memcpy(mem, ptr, (blockSize < size) ? blockSize : size);
+		smallFree(ptr);
+	}
+	return mem;
+}
+
+static void *smallArealloc(void *ptr, size_t size, size_t align) {
+	if (align <= SMALL_ALIGN) {
+		return smallRealloc(ptr, size);
+	}
+	if (ptr == NULL) {
+		return smallAalloc(size, align);
+	}
+	if (!isSmallObject(ptr)) {
+		return Memory_AllocatorArealloc(&Memory_GlobalAllocator, ptr, size, align);
+	}
+
+	// a plain block being given an alignment, it may already have it
+	uint32_t const blockSize = pageOf(ptr)->blockSize;
+	if (size <= blockSize && (((uintptr_t) ptr) & (align - 1)) == 0) {
+		return ptr;
+	}
+	void *mem = Memory_GlobalAllocator.aalloc(size, align);
+	if (mem) {
+		memcpy(mem, ptr, (blockSize < size) ? blockSize : size);
+		smallFree(ptr);
+	}
+	return mem;
+}
+
+static void smallFreeSized(void *ptr, size_t size) {
+	// nothing over the biggest class is ever in a page, so no need to ask the segment map
+	if (size > SMALL_MAX_SIZE) {
+		Memory_AllocatorFreeSized(&Memory_GlobalAllocator, ptr, size);
+	} else {
+		smallFree(ptr);
+	}
+}
+
+static size_t smallUsableSize(void const *ptr) {
+	if (ptr == NULL) {
+		return 0;
+	}
+	if (!isSmallObject(ptr)) {
+		return Memory_AllocatorUsableSize(&Memory_GlobalAllocator, ptr);
+	}
+	return pageOf(ptr)->blockSize;
+}
+
+static bool smallTryExpandInPlace(void *ptr, size_t size) {
+	if (ptr == NULL) {
+		return false;
+	}
+	if (!isSmallObject(ptr)) {
+		return Memory_AllocatorTryExpandInPlace(&Memory_GlobalAllocator, ptr, size);
+	}
+	return size <= pageOf(ptr)->blockSize;
+}
+
+static void smallFreeBatch(size_t count, void **ptrs) {
+	for (size_t i = 0; i < count; ++i) {
+		smallFree(ptrs[i]);
+	}
+}
+
+// free blocks of the current page first, then the rest of its never used
+// space is carved off in one go so a big batch is mostly one contiguous run
+static bool smallMallocBatch(size_t count, size_t size, void **outPtrs) {
+	if (size > SMALL_MAX_SIZE) {
+		return Memory_MallocBatch(&Memory_GlobalAllocator, count, size, outPtrs);
+	}
+
+	size_t done = 0;
+	SmallHeap *heap = g_smallHeap;
+	if (heap == NULL) {
+		heap = acquireHeap();
+	}
+	uint32_t const sizeClass = sizeClassOf(size);
+	while (heap != NULL && done < count) {
+		SmallPage *page = heap->active[sizeClass];
+		if (page) {
+			while (done < count && page->freeList) {
+				void *block = page->freeList;
+				page->freeList = *(void **) block;
+				page->used++;
+				outPtrs[done++] = block;
+			}
+			size_t carve = (size_t) (page->end - page->bump) / page->blockSize;
+			if (carve > count - done) {
+				carve = count - done;
+			}
+			for (size_t i = 0; i < carve; ++i) {
+				outPtrs[done++] = page->bump;
+				page->bump += page->blockSize;
+			}
+			page->used += (uint32_t) carve;
+			if (done == count) {
+				break;
+			}
+		}
+		// remote frees, other pages or a new page
+		void *block = smallAllocSlow(heap, sizeClass);
+		if (block == NULL) {
+			break;
+		}
+		outPtrs[done++] = block;
+	}
+
+	if (done < count) {
+		smallFreeBatch(done, outPtrs);
+		memset(outPtrs, 0, count * sizeof(void *));
+		return false;
+	}
+	return true;
+}
+
+AL2O3_EXTERN_C Memory_Allocator Memory_SmallObjectAllocator = {
+		&smallMalloc,
+		&smallAalloc,
+		&smallCalloc,
+		&smallRealloc,
+		&smallFree,
+		&smallFreeSized,
+		&smallUsableSize,
+		&smallTryExpandInPlace,
+		&smallArealloc,
+		&smallMallocBatch,
+		&smallFreeBatch,
+		&isSmallObject
+};
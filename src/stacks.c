@@ -0,0 +1,326 @@
+// License Summary: MIT see LICENSE file
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // for dladdr
+#endif
+#include "al2o3_memory/memory.h"
+#include "internal.h"
+
+// Call stacks of tracked allocations are hash consed, every distinct stack is
+// stored once and callsites refer to it by a 32 bit id (0 is no stack).
+// Capture only records return addresses, nothing is symbolized until a report
+// asks for it. Stacks live until the tracker is destroyed.
+
+#if MEMORY_TRACKING == 1
+
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+#include <dbghelp.h>
+#pragma comment(lib, "dbghelp.lib")
+#define STACK_CAPTURE 1
+#elif defined(__GLIBC__) || AL2O3_PLATFORM_OS == AL2O3_OS_OSX
+#include <execinfo.h>
+#include <dlfcn.h>
+#define STACK_CAPTURE 1
+#else
+#define STACK_CAPTURE 0
+#endif
+
+// how far above the allocation functions caller the tracker can be, the frames
+// between capture and the caller are dropped
+#define stackSlackFrames 8u
+#define stackChunkShift 10u
+#define stackChunkSize (1u << stackChunkShift)
+#define framePoolSize (16u * 1024u)
+
+typedef struct StackEntry {
+	uint32_t hash;
+	uint32_t depth;
+	void **frames;
+} StackEntry;
+
+typedef struct StackTable {
+	MemoryMutex mutex;
+	StackEntry **chunks;
+	uint32_t chunkCapacity;
+	uint32_t count;
+	uint32_t *slots; // stack id, 0 is empty
+	uint32_t slotCapacity;
+	// frames are bump allocated out of blocks chained through their first pointer
+	void **frameBlocks;
+	void **framePool;
+	uint32_t framePoolLeft;
+} StackTable;
+
+static StackTable g_stacks = { MEMORY_MUTEX_INITIALIZER };
+static uint32_t volatile g_stackDepth = 0;
+
+AL2O3_FORCE_INLINE uint64_t fmix64(uint64_t key) {
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+	return key;
+}
+
+AL2O3_FORCE_INLINE StackEntry *stackAt(uint32_t stackId) {
+	uint32_t const index = stackId - 1;
+	return &g_stacks.chunks[index >> stackChunkShift][index & (stackChunkSize - 1)];
+}
+
+AL2O3_FORCE_INLINE uint32_t captureFrames(void **frames, uint32_t maxFrames) {
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+	return (uint32_t) CaptureStackBackTrace(0, (DWORD) maxFrames, frames, NULL);
+#elif STACK_CAPTURE == 1
+	int const count = backtrace(frames, (int) maxFrames);
+	return (count > 0) ? (uint32_t) count : 0;
+#else
+	return 0;
+#endif
+}
+
+// call with the table locked
+static bool growStackSlots() {
+	uint32_t const capacity = g_stacks.slotCapacity ? g_stacks.slotCapacity * 2 : 1024;
+	uint32_t *slots = (uint32_t *) platformCalloc(capacity, sizeof(uint32_t));
+	if (slots == NULL) {
+		return false;
+	}
+	for (uint32_t id = 1; id <= g_stacks.count; ++id) {
+		uint32_t slot = stackAt(id)->hash & (capacity - 1);
+		while (slots[slot] != 0) {
+			slot = (slot + 1) & (capacity - 1);
+		}
+		slots[slot] = id;
+	}
+	platformFree(g_stacks.slots);
+	g_stacks.slots = slots;
+	g_stacks.slotCapacity = capacity;
+	return true;
+}
+
+// call with the table locked
+static void **allocFrames(uint32_t depth) {
+	if (g_stacks.framePoolLeft < depth) {
+		void **block = (void **) platformMalloc(framePoolSize * sizeof(void *));
+		if (block == NULL) {
+			return NULL;
+		}
+		block[0] = (void *) g_stacks.frameBlocks;
+		g_stacks.frameBlocks = block;
+		g_stacks.framePool = block + 1;
+		g_stacks.framePoolLeft = framePoolSize - 1;
+	}
+	void **frames = g_stacks.framePool;
+	g_stacks.framePool += depth;
+	g_stacks.framePoolLeft -= depth;
+	return frames;
+}
+
+// call with the table locked
+static StackEntry *newStack() {
+	uint32_t const index = g_stacks.count;
+	uint32_t const chunk = index >> stackChunkShift;
+	if (chunk >= g_stacks.chunkCapacity) {
+		uint32_t const capacity = g_stacks.chunkCapacity ? g_stacks.chunkCapacity * 2 : 16;
+		StackEntry **chunks = (StackEntry **) platformRealloc(g_stacks.chunks, capacity * sizeof(StackEntry *));
+		if (chunks == NULL) {
+			return NULL;
+		}
+		memset(chunks + g_stacks.chunkCapacity, 0, (capacity - g_stacks.chunkCapacity) * sizeof(StackEntry *));
+		g_stacks.chunks = chunks;
+		g_stacks.chunkCapacity = capacity;
+	}
+	if (g_stacks.chunks[chunk] == NULL) {
+		g_stacks.chunks[chunk] = (StackEntry *) platformMalloc(stackChunkSize * sizeof(StackEntry));
+		if (g_stacks.chunks[chunk] == NULL) {
+			return NULL;
+		}
+	}
+	g_stacks.count++;
+	return stackAt(g_stacks.count);
+}
+
+static uint32_t internStack(void *const *frames, uint32_t depth) {
+	uint64_t key = depth;
+	for (uint32_t i = 0; i < depth; ++i) {
+		key = fmix64(key ^ (uint64_t) (uintptr_t) frames[i]);
+	}
+	uint32_t const hash = (uint32_t) key;
+
+	uint32_t stackId = 0;
+	MUTEX_LOCK(&g_stacks.mutex)
+	if ((g_stacks.count + 1) * 4 <= g_stacks.slotCapacity * 3 || growStackSlots()) {
+		uint32_t const mask = g_stacks.slotCapacity - 1;
+		uint32_t slot = hash & mask;
+		while (g_stacks.slots[slot] != 0) {
+			StackEntry const *entry = stackAt(g_stacks.slots[slot]);
+			if (entry->hash == hash && entry->depth == depth && memcmp(entry->frames, frames, depth * sizeof(void *)) == 0) {
+				stackId = g_stacks.slots[slot];
+				break;
+			}
+			slot = (slot + 1) & mask;
+		}
+
+		if (stackId == 0) {
+			void **copy = allocFrames(depth);
+			StackEntry *entry = copy ? newStack() : NULL;
+			if (entry) {
+				memcpy(copy, frames, depth * sizeof(void *));
+				entry->hash = hash;
+				entry->depth = depth;
+				entry->frames = copy;
+				stackId = g_stacks.count;
+				g_stacks.slots[slot] = stackId;
+			}
+		}
+	}
+	MUTEX_UNLOCK(&g_stacks.mutex)
+	return stackId;
+}
+
+AL2O3_EXTERN_C uint32_t stackCapture(void const *caller) {
+	uint32_t const depth = atomicLoad32(&g_stackDepth);
+	if (depth == 0) {
+		return 0;
+	}
+
+	void *frames[Memory_TrackerMaxStackDepth + stackSlackFrames];
+	uint32_t const captured = captureFrames(frames, depth + stackSlackFrames);
+
+	// start at the allocation functions caller, if its been inlined or tail
+	// called away just drop our own frame
+	uint32_t first = (captured > 0) ? 1 : 0;
+	for (uint32_t i = 0; i < captured && i < stackSlackFrames; ++i) {
+		if (frames[i] == caller) {
+			first = i;
+			break;
+		}
+	}
+	uint32_t const count = (captured - first > depth) ? depth : captured - first;
+	if (count == 0) {
+		return 0;
+	}
+	return internStack(frames + first, count);
+}
+
+AL2O3_EXTERN_C uint32_t stackGetFrames(uint32_t stackId, void **frames, uint32_t maxFrames) {
+	uint32_t depth = 0;
+	MUTEX_LOCK(&g_stacks.mutex)
+	if (stackId != 0 && stackId <= g_stacks.count) {
+		StackEntry const *entry = stackAt(stackId);
+		depth = entry->depth;
+		if (frames) {
+			memcpy(frames, entry->frames, ((depth < maxFrames) ? depth : maxFrames) * sizeof(void *));
+		}
+	}
+	MUTEX_UNLOCK(&g_stacks.mutex)
+	return depth;
+}
+
+AL2O3_EXTERN_C size_t stackSymbolize(void const *frame, char *buffer, size_t size) {
+	if (size == 0) {
+		return 0;
+	}
+	int length = -1;
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+	// dbghelp is single threaded
+	static MemoryMutex symbolMutex = MEMORY_MUTEX_INITIALIZER;
+	static bool symbolsLoaded = false;
+	MUTEX_LOCK(&symbolMutex)
+	if (!symbolsLoaded) {
+		SymSetOptions(SymGetOptions() | SYMOPT_DEFERRED_LOADS | SYMOPT_UNDNAME);
+		symbolsLoaded = SymInitialize(GetCurrentProcess(), NULL, TRUE) != FALSE;
+	}
+	char symbolBuffer[sizeof(SYMBOL_INFO) + 256];
+	SYMBOL_INFO *symbol = (SYMBOL_INFO *) symbolBuffer;
+	memset(symbol, 0, sizeof(SYMBOL_INFO));
+	symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
+	symbol->MaxNameLen = 255;
+	DWORD64 displacement = 0;
+	if (symbolsLoaded && SymFromAddr(GetCurrentProcess(), (DWORD64) (uintptr_t) frame, &displacement, symbol)) {
+		length = snprintf(buffer, size, "%s+0x%llx", symbol->Name, (unsigned long long) displacement);
+	}
+	MUTEX_UNLOCK(&symbolMutex)
+#elif STACK_CAPTURE == 1
+	// only exported symbols have names, otherwise module+offset is enough for addr2line/atos
+	Dl_info info;
+	if (dladdr(frame, &info)) {
+		if (info.dli_sname) {
+			length = snprintf(buffer, size, "%s+0x%llx", info.dli_sname,
+												(unsigned long long) ((uintptr_t) frame - (uintptr_t) info.dli_saddr));
+		} else if (info.dli_fname) {
+			char const *module = strrchr(info.dli_fname, '/');
+			length = snprintf(buffer, size, "%s+0x%llx", module ? module + 1 : info.dli_fname,
+												(unsigned long long) ((uintptr_t) frame - (uintptr_t) info.dli_fbase));
+		}
+	}
+#endif
+	if (length < 0) {
+		length = snprintf(buffer, size, "0x%llx", (unsigned long long) (uintptr_t) frame);
+	}
+	if (length < 0) {
+		buffer[0] = 0;
+		return 0;
+	}
+	return ((size_t) length < size) ? (size_t) length : size - 1;
+}
+
+AL2O3_EXTERN_C void stackReset() {
+	MUTEX_LOCK(&g_stacks.mutex)
+	void **block = g_stacks.frameBlocks;
+	while (block) {
+		void **next = (void **) block[0];
+		platformFree(block);
+		block = next;
+	}
+	for (uint32_t i = 0; i < g_stacks.chunkCapacity; ++i) {
+		platformFree(g_stacks.chunks[i]);
+	}
+	platformFree(g_stacks.chunks);
+	platformFree(g_stacks.slots);
+	g_stacks.chunks = NULL;
+	g_stacks.chunkCapacity = 0;
+	g_stacks.count = 0;
+	g_stacks.slots = NULL;
+	g_stacks.slotCapacity = 0;
+	g_stacks.frameBlocks = NULL;
+	g_stacks.framePool = NULL;
+	g_stacks.framePoolLeft = 0;
+	MUTEX_UNLOCK(&g_stacks.mutex)
+}
+
+AL2O3_EXTERN_C void Memory_TrackerSetStackDepth(uint32_t depth) {
+#if STACK_CAPTURE == 0
+	if (depth) {
+		LOGWARNING("Stack capture isn't supported on this platform");
+	}
+	depth = 0;
+#endif
+	atomicStore32(&g_stackDepth, (depth > Memory_TrackerMaxStackDepth) ? Memory_TrackerMaxStackDepth : depth);
+}
+
+AL2O3_EXTERN_C uint32_t Memory_TrackerGetStack(uint32_t stackId, void **frames, uint32_t maxFrames) {
+	return stackGetFrames(stackId, frames, maxFrames);
+}
+
+AL2O3_EXTERN_C size_t Memory_TrackerSymbolizeFrame(void const *frame, char *buffer, size_t size) {
+	return stackSymbolize(frame, buffer, size);
+}
+
+#else
+
+AL2O3_EXTERN_C void Memory_TrackerSetStackDepth(uint32_t depth) {
+}
+
+AL2O3_EXTERN_C uint32_t Memory_TrackerGetStack(uint32_t stackId, void **frames, uint32_t maxFrames) {
+	return 0;
+}
+
+AL2O3_EXTERN_C size_t Memory_TrackerSymbolizeFrame(void const *frame, char *buffer, size_t size) {
+	if (size) {
+		buffer[0] = 0;
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,258 @@
+// License Summary: MIT see LICENSE file
+#include "al2o3_memory/memory.h"
+#include "internal.h"
+
+// Every thread counts into its own block so the allocation path never touches
+// a shared cache line. Memory_GetStats walks all the blocks under a lock.
+// Live bytes are also batched into global atomics whenever a thread has moved
+// more than statsFlushBytes, which is where the peak comes from. So the peak
+// can be under by at most statsFlushBytes per thread.
+// When a thread exits its counts are folded into g_stats.retired and the
+// block is kept for the next thread.
+
+#if MEMORY_STATS == 1
+
+#define statsFlushBytes (64 * 1024)
+
+typedef struct ThreadStats {
+	struct ThreadStats *next;
+	struct ThreadStats *prev;
+
+	// written by the owning thread, read by anyone
+	uint64_t volatile liveBytes[MSC_COUNT]; // may go 'negative' if other threads free our allocations
+	uint64_t volatile allocs[MSC_COUNT];
+	uint64_t volatile frees[MSC_COUNT];
+	uint64_t volatile reallocs[MSC_COUNT];
+
+	// owner only, bytes not yet added to the global live counts
+	int64_t pending[MSC_COUNT];
+} ThreadStats;
+
+typedef struct StatsRegistry {
+	MemoryMutex mutex;
+	ThreadStats *live;
+	ThreadStats *freeBlocks;
+	ThreadStats retired;
+} StatsRegistry;
+
+static StatsRegistry g_stats = { MEMORY_MUTEX_INITIALIZER };
+static uint64_t volatile g_flushedLive[MSC_COUNT + 1]; // last is the total
+static uint64_t volatile g_peak[MSC_COUNT + 1];
+static AL2O3_THREAD_LOCAL ThreadStats *g_threadStats;
+
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+static INIT_ONCE g_statsInitOnce = INIT_ONCE_STATIC_INIT;
+static DWORD g_statsFls;
+#else
+static pthread_once_t g_statsInitOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t g_statsKey;
+#endif
+
+static void raisePeak(uint32_t index, uint64_t live) {
+	uint64_t peak = atomicLoad64(&g_peak[index]);
+	while ((int64_t) live > (int64_t) peak) {
+		if (atomicCompareExchange64(&g_peak[index], peak, live)) {
+			return;
+		}
+		peak = atomicLoad64(&g_peak[index]);
+	}
+}
+
+static void flushPending(ThreadStats *stats, MemoryStatsCategory category) {
+	int64_t const pending = stats->pending[category];
+	stats->pending[category] = 0;
+	uint64_t const live = atomicAdd64(&g_flushedLive[category], (uint64_t) pending);
+	uint64_t const total = atomicAdd64(&g_flushedLive[MSC_COUNT], (uint64_t) pending);
+	if (pending > 0) {
+		raisePeak(category, live);
+		raisePeak(MSC_COUNT, total);
+	}
+}
+
+static void retireThreadStats(void *ptr) {
+	ThreadStats *stats = (ThreadStats *) ptr;
+	if (stats == NULL) {
+		return;
+	}
+	for (uint32_t i = 0; i < MSC_COUNT; ++i) {
+		flushPending(stats, (MemoryStatsCategory) i);
+	}
+
+	MUTEX_LOCK(&g_stats.mutex)
+	for (uint32_t i = 0; i < MSC_COUNT; ++i) {
+		g_stats.retired.liveBytes[i] += stats->liveBytes[i];
+		g_stats.retired.allocs[i] += stats->allocs[i];
+		g_stats.retired.frees[i] += stats->frees[i];
+		g_stats.retired.reallocs[i] += stats->reallocs[i];
+	}
+	if (stats->prev) {
+		stats->prev->next = stats->next;
+	} else {
+		g_stats.live = stats->next;
+	}
+	if (stats->next) {
+		stats->next->prev = stats->prev;
+	}
+	stats->next = g_stats.freeBlocks;
+	g_stats.freeBlocks = stats;
+	MUTEX_UNLOCK(&g_stats.mutex)
+
+	g_threadStats = NULL;
+}
+
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+static void WINAPI retireThreadStatsFls(void *ptr) {
+	retireThreadStats(ptr);
+}
+
+static BOOL CALLBACK statsInit(PINIT_ONCE initOnce, PVOID param, PVOID *context) {
+	g_statsFls = FlsAlloc(&retireThreadStatsFls);
+	return TRUE;
+}
+#else
+static void statsInit() {
+	pthread_key_create(&g_statsKey, &retireThreadStats);
+}
+#endif
+
+static ThreadStats *registerThreadStats() {
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+	InitOnceExecuteOnce(&g_statsInitOnce, &statsInit, NULL, NULL);
+#else
+	pthread_once(&g_statsInitOnce, &statsInit);
+#endif
+
+	MUTEX_LOCK(&g_stats.mutex)
+	ThreadStats *stats = g_stats.freeBlocks;
+	if (stats) {
+		g_stats.freeBlocks = stats->next;
+	} else {
+		stats = (ThreadStats *) platformMalloc(sizeof(ThreadStats));
+	}
+	if (stats) {
+		memset(stats, 0, sizeof(ThreadStats));
+		stats->next = g_stats.live;
+		if (g_stats.live) {
+			g_stats.live->prev = stats;
+		}
+		g_stats.live = stats;
+	}
+	MUTEX_UNLOCK(&g_stats.mutex)
+
+	if (stats) {
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+		FlsSetValue(g_statsFls, stats);
+#else
+		pthread_setspecific(g_statsKey, stats);
+#endif
+	}
+	g_threadStats = stats;
+	return stats;
+}
+
+AL2O3_FORCE_INLINE ThreadStats *threadStats() {
+	ThreadStats *stats = g_threadStats;
+	return stats ? stats : registerThreadStats();
+}
+
+AL2O3_FORCE_INLINE void addLiveBytes(ThreadStats *stats, MemoryStatsCategory category, int64_t delta) {
+	counterAdd64(&stats->liveBytes[category], (uint64_t) delta);
+	stats->pending[category] += delta;
+	if (stats->pending[category] > statsFlushBytes || stats->pending[category] < -statsFlushBytes) {
+		flushPending(stats, category);
+	}
+}
+
+AL2O3_EXTERN_C void memoryStatsAlloc(MemoryStatsCategory category, size_t size) {
+	memoryStatsAllocMany(category, 1, size);
+}
+
+AL2O3_EXTERN_C void memoryStatsAllocMany(MemoryStatsCategory category, uint64_t count, size_t size) {
+	ThreadStats *stats = threadStats();
+	if (stats == NULL || count == 0) {
+		return;
+	}
+	counterAdd64(&stats->allocs[category], count);
+	addLiveBytes(stats, category, (int64_t) size);
+}
+
+AL2O3_EXTERN_C void memoryStatsFree(MemoryStatsCategory category, size_t size) {
+	memoryStatsFreeMany(category, 1, size);
+}
+
+AL2O3_EXTERN_C void memoryStatsFreeMany(MemoryStatsCategory category, uint64_t count, size_t size) {
+	ThreadStats *stats = threadStats();
+	if (stats == NULL || count == 0) {
+		return;
+	}
+	counterAdd64(&stats->frees[category], count);
+	addLiveBytes(stats, category, -(int64_t) size);
+}
+
+AL2O3_EXTERN_C void memoryStatsRealloc(MemoryStatsCategory category, size_t oldSize, size_t newSize) {
+	ThreadStats *stats = threadStats();
+	if (stats == NULL) {
+		return;
+	}
+	counterAdd64(&stats->reallocs[category], 1);
+	addLiveBytes(stats, category, (int64_t) newSize - (int64_t) oldSize);
+}
+
+AL2O3_FORCE_INLINE uint64_t clampLive(int64_t live) {
+	return (live > 0) ? (uint64_t) live : 0;
+}
+
+AL2O3_EXTERN_C Memory_Stats Memory_GetStats() {
+	int64_t liveBytes[MSC_COUNT];
+	uint64_t allocs[MSC_COUNT];
+	uint64_t frees[MSC_COUNT];
+	uint64_t reallocs[MSC_COUNT];
+
+	MUTEX_LOCK(&g_stats.mutex)
+	for (uint32_t i = 0; i < MSC_COUNT; ++i) {
+		liveBytes[i] = (int64_t) g_stats.retired.liveBytes[i];
+		allocs[i] = g_stats.retired.allocs[i];
+		frees[i] = g_stats.retired.frees[i];
+		reallocs[i] = g_stats.retired.reallocs[i];
+	}
+	for (ThreadStats *stats = g_stats.live; stats != NULL; stats = stats->next) {
+		for (uint32_t i = 0; i < MSC_COUNT; ++i) {
+			liveBytes[i] += (int64_t) counterLoad64(&stats->liveBytes[i]);
+			allocs[i] += counterLoad64(&stats->allocs[i]);
+			frees[i] += counterLoad64(&stats->frees[i]);
+			reallocs[i] += counterLoad64(&stats->reallocs[i]);
+		}
+	}
+	MUTEX_UNLOCK(&g_stats.mutex)
+
+	Memory_Stats result;
+	memset(&result, 0, sizeof(Memory_Stats));
+	Memory_StatsCounters *counters[MSC_COUNT] = { &result.plain, &result.aligned, &result.temp };
+
+	int64_t totalLive = 0;
+	for (uint32_t i = 0; i < MSC_COUNT; ++i) {
+		counters[i]->liveBytes = clampLive(liveBytes[i]);
+		counters[i]->liveCount = clampLive((int64_t) (allocs[i] - frees[i]));
+		counters[i]->totalAllocs = allocs[i];
+		counters[i]->totalFrees = frees[i];
+		counters[i]->totalReallocs = reallocs[i];
+		// the flushed peak lags the exact count a little
+		uint64_t const peak = clampLive((int64_t) atomicLoad64(&g_peak[i]));
+		counters[i]->peakBytes = (peak > counters[i]->liveBytes) ? peak : counters[i]->liveBytes;
+		totalLive += liveBytes[i];
+	}
+	result.liveBytes = clampLive(totalLive);
+	uint64_t const peak = clampLive((int64_t) atomicLoad64(&g_peak[MSC_COUNT]));
+	result.peakBytes = (peak > result.liveBytes) ? peak : result.liveBytes;
+	return result;
+}
+
+#else
+
+AL2O3_EXTERN_C Memory_Stats Memory_GetStats() {
+	Memory_Stats result;
+	memset(&result, 0, sizeof(Memory_Stats));
+	return result;
+}
+
+#endif
@@ -0,0 +1,141 @@
+// License Summary: MIT see LICENSE file
+#include "al2o3_memory/memory.h"
+#include "internal.h"
+
+// Each tag is a line of shared atomics, unlike the stats they aren't per
+// thread as a hard budget has to see every allocation as it happens. Only
+// tagged allocations touch them so untagged ones pay nothing.
+// A hard budget is checked with a compare and swap so racing allocations
+// can't push the tag over it, without one a plain add does.
+
+typedef struct TagCounters {
+	uint64_t volatile liveBytes;
+	uint64_t volatile liveCount;
+	uint64_t volatile peakBytes;
+	uint64_t volatile totalAllocs;
+	uint64_t volatile softBudget; // 0 is no budget
+	uint64_t volatile hardBudget;
+	char const *name;
+	// one cache line per tag, g_tags is line aligned
+	uint8_t padding[64 - 6 * sizeof(uint64_t) - sizeof(char const *)];
+} TagCounters;
+
+typedef char TagCountersSizeCheck[(sizeof(TagCounters) == 64) ? 1 : -1];
+
+static MEMORY_CACHE_LINE_ALIGN TagCounters g_tags[Memory_MaxTags];
+static Memory_BudgetFunc g_budgetFunc = NULL;
+static void *g_budgetUser = NULL;
+static AL2O3_THREAD_LOCAL bool g_inBudgetFunc = false;
+
+static void budgetEvent(uint16_t tag, Memory_BudgetEvent event, uint64_t liveBytes, size_t size) {
+	Memory_BudgetFunc func = g_budgetFunc;
+	// the func may well allocate with the same tag
+	if (func == NULL || g_inBudgetFunc) {
+		return;
+	}
+	g_inBudgetFunc = true;
+	func(g_budgetUser, tag, event, liveBytes, size);
+	g_inBudgetFunc = false;
+}
+
+static void tagPeak(TagCounters *counters, uint64_t live) {
+	uint64_t peak = atomicLoad64(&counters->peakBytes);
+	while (live > peak && !atomicCompareExchange64(&counters->peakBytes, peak, live)) {
+		peak = atomicLoad64(&counters->peakBytes);
+	}
+}
+
+// adds size live bytes, false if the hard budget refuses them
+static bool tagGrow(uint16_t tag, uint64_t size) {
+	TagCounters *counters = &g_tags[tag];
+	uint64_t const hard = atomicLoad64(&counters->hardBudget);
+	uint64_t live;
+	if (hard == 0) {
+		live = atomicAdd64(&counters->liveBytes, size);
+	} else {
+		uint64_t old;
+		do {
+			old = atomicLoad64(&counters->liveBytes);
+			live = old + size;
+			if (live > hard) {
+				budgetEvent(tag, Memory_BudgetEvent_Hard, old, (size_t) size);
+				return false;
+			}
+		} while (!atomicCompareExchange64(&counters->liveBytes, old, live));
+	}
+	tagPeak(counters, live);
+
+	// only the allocation that crosses it reports the soft budget
+	uint64_t const soft = atomicLoad64(&counters->softBudget);
+	if (soft != 0 && live > soft && live - size <= soft) {
+		budgetEvent(tag, Memory_BudgetEvent_Soft, live, (size_t) size);
+	}
+	return true;
+}
+
+AL2O3_EXTERN_C bool tagAlloc(uint16_t tag, uint64_t count, size_t size) {
+	if (!tagGrow(tag, size)) {
+		return false;
+	}
+	atomicAdd64(&g_tags[tag].liveCount, count);
+	atomicAdd64(&g_tags[tag].totalAllocs, count);
+	return true;
+}
+
+AL2O3_EXTERN_C void tagFree(uint16_t tag, uint64_t count, size_t size) {
+	atomicAdd64(&g_tags[tag].liveBytes, (uint64_t) -(int64_t) size);
+	atomicAdd64(&g_tags[tag].liveCount, (uint64_t) -(int64_t) count);
+}
+
+AL2O3_EXTERN_C bool tagResize(uint16_t tag, size_t oldSize, size_t newSize) {
+	if (newSize > oldSize) {
+		return tagGrow(tag, newSize - oldSize);
+	}
+	atomicAdd64(&g_tags[tag].liveBytes, (uint64_t) -(int64_t) (oldSize - newSize));
+	return true;
+}
+
+AL2O3_EXTERN_C void Memory_TagSetName(Memory_Tag tag, char const *name) {
+	if (tag >= Memory_MaxTags) {
+		LOGERROR("Memory tag %u is out of range", (unsigned int) tag);
+		return;
+	}
+	g_tags[tag].name = name;
+}
+
+AL2O3_EXTERN_C Memory_TagStats Memory_GetTagStats(Memory_Tag tag) {
+	Memory_TagStats result;
+	memset(&result, 0, sizeof(Memory_TagStats));
+	if (tag >= Memory_MaxTags) {
+		return result;
+	}
+	TagCounters *counters = &g_tags[tag];
+	result.name = counters->name;
+	result.liveBytes = atomicLoad64(&counters->liveBytes);
+	result.liveCount = atomicLoad64(&counters->liveCount);
+	result.peakBytes = atomicLoad64(&counters->peakBytes);
+	result.totalAllocs = atomicLoad64(&counters->totalAllocs);
+	result.softBudget = atomicLoad64(&counters->softBudget);
+	result.hardBudget = atomicLoad64(&counters->hardBudget);
+	return result;
+}
+
+AL2O3_EXTERN_C void Memory_TagResetPeak(Memory_Tag tag) {
+	if (tag < Memory_MaxTags) {
+		atomicStore64(&g_tags[tag].peakBytes, atomicLoad64(&g_tags[tag].liveBytes));
+	}
+}
+
+AL2O3_EXTERN_C void Memory_TagSetBudget(Memory_Tag tag, uint64_t softBytes, uint64_t hardBytes) {
+	if (tag == 0 || tag >= Memory_MaxTags) {
+		LOGERROR("Memory tag %u can't have a budget", (unsigned int) tag);
+		return;
+	}
+	atomicStore64(&g_tags[tag].softBudget, softBytes);
+	atomicStore64(&g_tags[tag].hardBudget, hardBytes);
+}
+
+AL2O3_EXTERN_C void Memory_SetBudgetFunc(Memory_BudgetFunc func, void *user) {
+	g_budgetUser = user;
+	g_budgetFunc = func;
+}
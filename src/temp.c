@@ -0,0 +1,515 @@
+// License Summary: MIT see LICENSE file
+#include "al2o3_memory/memory.h"
+#include "internal.h"
+
+// The temp allocator is a per thread bump pointer arena. Memory is carved
+// linearly out of a chain of blocks, the only per allocation cost is a small
+// header holding the size so that realloc can copy and free can pop the
+// last allocation. No locks are taken and the heap is only touched when a
+// new block is required.
+// The arena resets itself when the last live allocation is freed (and no
+// marks are active) so the MEMORY_TEMP_MALLOC/MEMORY_TEMP_FREE pairs that
+// already exist keep the memory bounded without any extra calls.
+// Temp memory is thread affine, it must be freed/realloced on the thread
+// that allocated it. The arena is given back when its thread exits.
+// Each active mark counts the live allocations made inside it, so a rewind
+// releases exactly those even if older ones were freed inside the scope.
+
+#define TEMP_MIN_BLOCK_SIZE (64u * 1024u)
+#define TEMP_MAX_GROW_BLOCK_SIZE (4u * 1024u * 1024u)
+#define TEMP_ALIGN 16u
+
+typedef struct TempBlock {
+	struct TempBlock *prev;
+	uint8_t *end;
+	size_t size;
+	// pad so the first allocation starts on a 16 byte boundary
+	size_t pad;
+} TempBlock;
+
+// sits directly before each returned pointer, its size keeps the data 16 byte aligned
+typedef struct TempHeader {
+	size_t size;
+	uint8_t *start; // where the cursor was before this allocation (for pops)
+} TempHeader;
+
+// everything allocated after the mark position is inside its scope
+typedef struct TempMarkScope {
+	TempBlock *block; // NULL if the mark was taken before the first block
+	uint8_t *cursor;
+	size_t liveCount; // of allocations made inside the scope
+	size_t liveBytes;
+} TempMarkScope;
+
+typedef struct TempArena {
+	TempBlock *current;
+	TempBlock *spare;
+	uint8_t *cursor;
+	uint8_t *lastAlloc;
+	size_t liveCount;
+	size_t liveBytes;
+	TempMarkScope *marks;
+	uint32_t markDepth;
+	uint32_t markCapacity;
+	size_t nextBlockSize;
+	bool registered; // for the thread exit release
+} TempArena;
+
+static AL2O3_THREAD_LOCAL TempArena g_tempArena;
+
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+static INIT_ONCE g_tempInitOnce = INIT_ONCE_STATIC_INIT;
+static DWORD g_tempArenaFls;
+#else
+static pthread_once_t g_tempInitOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t g_tempArenaKey;
+#endif
+
+static void releaseArena(void *ptr);
+
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+static void WINAPI releaseArenaFls(void *ptr) {
+	releaseArena(ptr);
+}
+
+static BOOL CALLBACK tempInit(PINIT_ONCE initOnce, PVOID param, PVOID *context) {
+	g_tempArenaFls = FlsAlloc(&releaseArenaFls);
+	return TRUE;
+}
+#else
+static void tempInit() {
+	pthread_key_create(&g_tempArenaKey, &releaseArena);
+}
+#endif
+
+// once the arena holds any memory, so the thread exit gives it back
+static void registerArena(TempArena *arena) {
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+	InitOnceExecuteOnce(&g_tempInitOnce, &tempInit, NULL, NULL);
+	FlsSetValue(g_tempArenaFls, arena);
+#else
+	pthread_once(&g_tempInitOnce, &tempInit);
+	pthread_setspecific(g_tempArenaKey, arena);
+#endif
+	arena->registered = true;
+}
+
+AL2O3_FORCE_INLINE uint8_t *alignUp(uint8_t *ptr, size_t align) {
+	return (uint8_t *) ((((uintptr_t) ptr) + (align - 1)) & ~((uintptr_t) align - 1));
+}
+
+AL2O3_FORCE_INLINE uint8_t *blockStart(TempBlock *block) {
+	return (uint8_t *) (block + 1);
+}
+
+// every threads blocks, so a temp allocation that reaches MEMORY_FREE on
+// another thread is known to be temp rather than passed to the global allocator
+static Memory_RangeSet g_tempBlocks;
+static MemoryMutex g_tempBlocksMutex = MEMORY_MUTEX_INITIALIZER;
+
+static TempBlock *allocBlock(size_t size) {
+	TempBlock *block = (TempBlock *) platformMalloc(sizeof(TempBlock) + size);
+	if (block == NULL) {
+		return NULL;
+	}
+	MUTEX_LOCK(&g_tempBlocksMutex)
+	bool const added = Memory_RangeSetAdd(&g_tempBlocks, block, sizeof(TempBlock) + size);
+	MUTEX_UNLOCK(&g_tempBlocksMutex)
+	if (!added) {
+		platformFree(block);
+		return NULL;
+	}
+	block->size = size;
+	block->end = blockStart(block) + size;
+	return block;
+}
+
+static void freeBlock(TempBlock *block) {
+	MUTEX_LOCK(&g_tempBlocksMutex)
+	Memory_RangeSetRemove(&g_tempBlocks, block);
+	MUTEX_UNLOCK(&g_tempBlocksMutex)
+	platformFree(block);
+}
+
+// true if ptr is in one of the calling threads blocks, the newest is the likeliest
+static bool inArena(TempArena *arena, void const *ptr) {
+	uint8_t const *address = (uint8_t const *) ptr;
+	for (TempBlock *block = arena->current; block; block = block->prev) {
+		if (address >= blockStart(block) && address < block->end) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void releaseBlock(TempArena *arena, TempBlock *block) {
+	// keep the biggest (normal sized) block we have seen around, it stops us
+	// thrashing the heap when a scope repeatedly rewinds over a block boundary
+	if (block->size > TEMP_MAX_GROW_BLOCK_SIZE) {
+		freeBlock(block);
+	} else if (arena->spare == NULL) {
+		arena->spare = block;
+	} else if (arena->spare->size < block->size) {
+		freeBlock(arena->spare);
+		arena->spare = block;
+	} else {
+		freeBlock(block);
+	}
+}
+
+static bool newBlock(TempArena *arena, size_t required) {
+	size_t size = arena->nextBlockSize ? arena->nextBlockSize : TEMP_MIN_BLOCK_SIZE;
+	if (size < required) {
+		size = required;
+	}
+
+	if (!arena->registered) {
+		registerArena(arena);
+	}
+
+	TempBlock *block;
+	if (arena->spare && arena->spare->size >= required) {
+		block = arena->spare;
+		arena->spare = NULL;
+	} else {
+		block = allocBlock(size);
+		if (block == NULL) {
+			return false;
+		}
+		size_t const grow = (size * 2 > TEMP_MAX_GROW_BLOCK_SIZE) ? TEMP_MAX_GROW_BLOCK_SIZE : size * 2;
+		if (grow > arena->nextBlockSize) {
+			arena->nextBlockSize = grow;
+		}
+	}
+
+	block->prev = arena->current;
+	arena->current = block;
+	arena->cursor = blockStart(block);
+	return true;
+}
+
+static void *tempPush(TempArena *arena, size_t size, size_t align) {
+	if (align < TEMP_ALIGN) {
+		align = TEMP_ALIGN;
+	}
+
+	uint8_t *mem = NULL;
+	if (arena->current) {
+		mem = alignUp(arena->cursor + sizeof(TempHeader), align);
+		if (mem + size > arena->current->end || mem + size < mem) {
+			mem = NULL;
+		}
+	}
+
+	if (mem == NULL) {
+		if (!newBlock(arena, size + sizeof(TempHeader) + align)) {
+			LOGERROR("Request for temp allocation failed. Out of memory.");
+			return NULL;
+		}
+		mem = alignUp(arena->cursor + sizeof(TempHeader), align);
+	}
+
+	TempHeader *header = ((TempHeader *) mem) - 1;
+	header->size = size;
+	header->start = arena->cursor;
+
+	arena->cursor = mem + size;
+	arena->lastAlloc = mem;
+	arena->liveCount++;
+	arena->liveBytes += size;
+	if (arena->markDepth) {
+		TempMarkScope *scope = &arena->marks[arena->markDepth - 1];
+		scope->liveCount++;
+		scope->liveBytes += size;
+	}
+	return mem;
+}
+
+// true if ptr was allocated after the mark was taken. Later blocks are all
+// newer than the marks block, in it only what is past the marks cursor is
+static bool inMarkScope(TempArena *arena, TempMarkScope const *scope, void const *ptr) {
+	if (scope->block == NULL) {
+		return true;
+	}
+	uint8_t const *address = (uint8_t const *) ptr;
+	for (TempBlock *block = arena->current; block != scope->block; block = block->prev) {
+		if (address >= blockStart(block) && address < block->end) {
+			return true;
+		}
+	}
+	return address >= scope->cursor && address < scope->block->end;
+}
+
+// the innermost mark whose scope ptr was allocated in, NULL if before every mark
+static TempMarkScope *markScopeOf(TempArena *arena, void const *ptr) {
+	for (uint32_t i = arena->markDepth; i > 0; --i) {
+		if (inMarkScope(arena, &arena->marks[i - 1], ptr)) {
+			return &arena->marks[i - 1];
+		}
+	}
+	return NULL;
+}
+
+// a live allocation has gone or changed size
+static void tempForget(TempArena *arena, void const *ptr, size_t count, size_t size) {
+	arena->liveCount -= count;
+	arena->liveBytes -= size;
+	TempMarkScope *scope = markScopeOf(arena, ptr);
+	if (scope) {
+		scope->liveCount -= count;
+		scope->liveBytes -= size;
+	}
+}
+
+static void *tempAalloc(size_t size, size_t align) {
+	void *mem = tempPush(&g_tempArena, size, align);
+	if (mem) {
+		memoryStatsAlloc(MSC_TEMP, size);
+	}
+	return mem;
+}
+
+static void resetArena(TempArena *arena) {
+	if (arena->current == NULL) {
+		return;
+	}
+	// wind back to the first block, most temp usage should then fit in one block
+	while (arena->current->prev) {
+		TempBlock *block = arena->current;
+		arena->current = block->prev;
+		releaseBlock(arena, block);
+	}
+	arena->cursor = blockStart(arena->current);
+	arena->lastAlloc = NULL;
+	arena->liveCount = 0;
+	arena->liveBytes = 0;
+}
+
+static void *tempMalloc(size_t size) {
+	return tempAalloc(size, TEMP_ALIGN);
+}
+
+static void *tempCalloc(size_t count, size_t size) {
+	if (count == 0 || size > SIZE_MAX / count) {
+		return NULL;
+	}
+	void *mem = tempAalloc(count * size, TEMP_ALIGN);
+	if (mem) {
+		memset(mem, 0, count * size);
+	}
+	return mem;
+}
+
+static void tempFree(void *ptr) {
+	if (ptr == NULL) {
+		return;
+	}
+	TempArena *arena = &g_tempArena;
+	if (!inArena(arena, ptr)) {
+		LOGERROR("Temp allocations can only be freed on the thread that made them, ignoring the free");
+		return;
+	}
+	ASSERT(arena->liveCount > 0);
+
+	// pop if its the top of the stack, otherwise the space is reclaimed on reset/rewind
+	TempHeader *header = ((TempHeader *) ptr) - 1;
+	if (ptr == arena->lastAlloc) {
+		arena->cursor = header->start;
+		arena->lastAlloc = NULL;
+	}
+
+	memoryStatsFree(MSC_TEMP, header->size);
+	tempForget(arena, ptr, 1, header->size);
+	if (arena->liveCount == 0 && arena->markDepth == 0) {
+		resetArena(arena);
+	}
+}
+
+static void *tempArealloc(void *ptr, size_t size, size_t align) {
+	if (ptr == NULL) {
+		return tempAalloc(size, align);
+	}
+
+	TempArena *arena = &g_tempArena;
+	if (!inArena(arena, ptr)) {
+		LOGERROR("Temp allocations can only be realloced on the thread that made them");
+		return NULL;
+	}
+	TempHeader *header = ((TempHeader *) ptr) - 1;
+
+	// the last allocation can just move the cursor if it fits in its block
+	if (ptr == arena->lastAlloc && (((uintptr_t) ptr) & (align - 1)) == 0) {
+		uint8_t *newEnd = ((uint8_t *) ptr) + size;
+		if (newEnd <= arena->current->end && newEnd >= (uint8_t *) ptr) {
+			memoryStatsRealloc(MSC_TEMP, header->size, size);
+			// the last allocation is always in the innermost scope
+			arena->liveBytes += size - header->size;
+			if (arena->markDepth) {
+				arena->marks[arena->markDepth - 1].liveBytes += size - header->size;
+			}
+			header->size = size;
+			arena->cursor = newEnd;
+			return ptr;
+		}
+	}
+
+	size_t const oldSize = header->size;
+	void *mem = tempPush(arena, size, align);
+	if (mem) {
+		memcpy(mem, ptr, oldSize < size ? oldSize : size);
+		// can't use tempFree as the old allocation is no longer the top of the stack
+		memoryStatsRealloc(MSC_TEMP, oldSize, size);
+		tempForget(arena, ptr, 1, oldSize);
+	}
+	return mem;
+}
+
+static void *tempRealloc(void *ptr, size_t size) {
+	return tempArealloc(ptr, size, TEMP_ALIGN);
+}
+
+static void tempFreeSized(void *ptr, size_t size) {
+	// the header already knows the size
+	(void) size;
+	tempFree(ptr);
+}
+
+static size_t tempUsableSize(void const *ptr) {
+	if (ptr == NULL) {
+		return 0;
+	}
+	return (((TempHeader const *) ptr) - 1)->size;
+}
+
+static bool tempTryExpandInPlace(void *ptr, size_t size) {
+	if (ptr == NULL) {
+		return false;
+	}
+	TempArena *arena = &g_tempArena;
+	TempHeader *header = ((TempHeader *) ptr) - 1;
+	if (size <= header->size) {
+		return true;
+	}
+	// only the last allocation has anything after it to grow into
+	if (ptr == arena->lastAlloc) {
+		uint8_t *newEnd = ((uint8_t *) ptr) + size;
+		if (newEnd <= arena->current->end && newEnd >= (uint8_t *) ptr) {
+			memoryStatsRealloc(MSC_TEMP, header->size, size);
+			// the last allocation is always in the innermost scope
+			arena->liveBytes += size - header->size;
+			if (arena->markDepth) {
+				arena->marks[arena->markDepth - 1].liveBytes += size - header->size;
+			}
+			header->size = size;
+			arena->cursor = newEnd;
+			return true;
+		}
+	}
+	return false;
+}
+
+AL2O3_EXTERN_C Memory_TempMark Memory_TempGetMark() {
+	TempArena *arena = &g_tempArena;
+	Memory_TempMark mark = { arena->current, arena->cursor, arena->markDepth };
+	if (arena->markDepth == arena->markCapacity) {
+		if (!arena->registered) {
+			registerArena(arena);
+		}
+		uint32_t const capacity = arena->markCapacity ? arena->markCapacity * 2 : 8;
+		TempMarkScope *marks = (TempMarkScope *) platformRealloc(arena->marks, capacity * sizeof(TempMarkScope));
+		if (marks == NULL) {
+			LOGERROR("Out of memory for a temp mark, it won't rewind anything");
+			mark.depth = Memory_TempMarkInvalid;
+			return mark;
+		}
+		arena->marks = marks;
+		arena->markCapacity = capacity;
+	}
+
+	TempMarkScope *scope = &arena->marks[arena->markDepth++];
+	scope->block = arena->current;
+	scope->cursor = arena->cursor;
+	scope->liveCount = 0;
+	scope->liveBytes = 0;
+	// nothing made before the mark may grow past it
+	arena->lastAlloc = NULL;
+	return mark;
+}
+
+AL2O3_EXTERN_C void Memory_TempRewind(Memory_TempMark mark) {
+	TempArena *arena = &g_tempArena;
+	if (mark.depth == Memory_TempMarkInvalid) {
+		return;
+	}
+	ASSERT(arena->markDepth > 0 && mark.depth == arena->markDepth - 1);
+	TempMarkScope const *scope = &arena->marks[--arena->markDepth];
+
+	// older allocations freed inside the scope were already taken off
+	memoryStatsFreeMany(MSC_TEMP, scope->liveCount, scope->liveBytes);
+	arena->liveCount -= scope->liveCount;
+	arena->liveBytes -= scope->liveBytes;
+
+	if (scope->block == NULL) {
+		resetArena(arena);
+		return;
+	}
+
+	while (arena->current != scope->block) {
+		ASSERT(arena->current);
+		TempBlock *block = arena->current;
+		arena->current = block->prev;
+		releaseBlock(arena, block);
+	}
+	arena->cursor = scope->cursor;
+	arena->lastAlloc = NULL;
+	if (arena->liveCount == 0 && arena->markDepth == 0) {
+		resetArena(arena);
+	}
+}
+
+static void releaseArena(void *ptr) {
+	TempArena *arena = (TempArena *) ptr;
+	if (arena == NULL) {
+		return;
+	}
+	if (arena->liveCount != 0) {
+		LOGWARNING("%zu temp allocations still live at thread shutdown", arena->liveCount);
+		memoryStatsFreeMany(MSC_TEMP, arena->liveCount, arena->liveBytes);
+	}
+
+	while (arena->current) {
+		TempBlock *block = arena->current;
+		arena->current = block->prev;
+		freeBlock(block);
+	}
+	if (arena->spare) {
+		freeBlock(arena->spare);
+	}
+	platformFree(arena->marks);
+	// a later destructor on this thread can still use temp memory, it registers again
+	memset(arena, 0, sizeof(TempArena));
+}
+
+AL2O3_EXTERN_C void Memory_TempThreadShutdown() {
+	releaseArena(&g_tempArena);
+}
+
+// any threads blocks, free and realloc then refuse the ones that aren't ours
+static bool tempOwns(void const *ptr) {
+	return Memory_RangeSetContains(&g_tempBlocks, ptr);
+}
+
+AL2O3_EXTERN_C Memory_Allocator Memory_TempAllocator = {
+		&tempMalloc,
+		&tempAalloc,
+		&tempCalloc,
+		&tempRealloc,
+		&tempFree,
+		&tempFreeSized,
+		&tempUsableSize,
+		&tempTryExpandInPlace,
+		&tempArealloc,
+		NULL,
+		NULL,
+		&tempOwns
+};
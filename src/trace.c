@@ -0,0 +1,547 @@
+// License Summary: MIT see LICENSE file
+#include "al2o3_memory/memory.h"
+#include "internal.h"
+#include <stdio.h>
+#include <time.h>
+
+// Every thread that allocates while a trace is recording gets a single
+// producer/single consumer ring of raw events, pushing one is a few stores
+// and never takes a lock. A writer thread drains the rings and encodes the
+// events into the file. If a ring fills its thread waits for the writer,
+// so the trace is always the complete allocation stream.
+// Rings are kept after a trace stops and reused by the next one. When a
+// thread exits its ring is given up, a new thread takes it over once the
+// writer has drained it, so thread churn doesn't grow the ring list.
+//
+// File format, all integers are LEB128 varints, deltas are zigzag encoded:
+//   "AL2OMTRC" then the version
+//   records, each a type byte then
+//     TRACE_FILE_SRCLOC: id, line, file, func (strings are length then bytes)
+//     TRACE_FILE_THREAD: thread index, the events that follow are from it
+//     TRACE_FILE_END: nothing, the last record
+//     events: time delta (ns) and address delta from the previous event
+//       TRACE_ALLOC, TRACE_CALLOC: size, srcloc id
+//       TRACE_AALLOC: size, align, srcloc id
+//       TRACE_REALLOC: old address delta from the new one, size, align, srcloc id
+//       TRACE_EXPAND: size (the block grew in place)
+//       TRACE_FREE: nothing else
+// srcloc id 0 is unknown, ids are defined by a TRACE_FILE_SRCLOC before first use.
+// Events are written a ring at a time, so a reader must sort on the time to
+// interleave the threads.
+
+#define TRACE_FILE_END 0
+#define TRACE_FILE_SRCLOC 16
+#define TRACE_FILE_THREAD 17
+#define TRACE_FILE_VERSION 1
+
+#define traceRingShift 12u
+#define traceRingSize (1u << traceRingShift)
+#define traceBufferSize (64u * 1024u)
+// the longest encoded record (bar srclocs which are flushed on their own)
+#define traceMaxRecordSize 64u
+
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+typedef HANDLE TraceThread;
+#else
+#include <sched.h>
+typedef pthread_t TraceThread;
+#endif
+
+typedef struct TraceRingEvent {
+	uint64_t ns;
+	uintptr_t address;
+	uintptr_t oldAddress;
+	uint64_t size;
+	Memory_SrcLoc const *loc;
+	uint32_t align;
+	uint32_t type;
+} TraceRingEvent;
+
+typedef struct TraceRing {
+	uint64_t volatile head; // written by the owning thread
+	uint8_t pad0[56];
+	uint64_t volatile tail; // written by the writer
+	uint8_t pad1[56];
+	uint32_t volatile active; // set while the owner is pushing
+	uint32_t volatile owned; // clear once the owning thread has exited
+	uint32_t index;
+	struct TraceRing *next;
+	TraceRingEvent events[traceRingSize];
+} TraceRing;
+
+typedef struct TraceSrcLocMap {
+	Memory_SrcLoc const **keys;
+	uint32_t *ids;
+	uint32_t capacity; // always a power of 2
+	uint32_t count;
+} TraceSrcLocMap;
+
+typedef struct TraceWriter {
+	FILE *file;
+	uint8_t *buffer;
+	size_t used;
+	bool failed;
+	uint64_t lastNs;
+	uintptr_t lastAddress;
+	uint32_t lastThread;
+	TraceSrcLocMap srcLocs;
+} TraceWriter;
+
+typedef struct TraceState {
+	MemoryMutex mutex; // only start and stop
+	void *volatile rings; // TraceRing list, only ever pushed on
+	uint32_t volatile ringCount;
+	uint32_t volatile stopping;
+	bool running;
+	TraceThread thread;
+	TraceWriter writer;
+} TraceState;
+
+uint32_t volatile g_traceRecording = 0;
+static TraceState g_trace = { MEMORY_MUTEX_INITIALIZER };
+static AL2O3_THREAD_LOCAL TraceRing *g_traceRing = NULL;
+
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+static INIT_ONCE g_traceInitOnce = INIT_ONCE_STATIC_INIT;
+static DWORD g_traceRingFls;
+#else
+static pthread_once_t g_traceInitOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t g_traceRingKey;
+#endif
+
+AL2O3_EXTERN_C uint64_t monotonicNs() {
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (uint64_t) ((double) counter.QuadPart * (1e9 / (double) frequency.QuadPart));
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+static void traceYield() {
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+	SwitchToThread();
+#else
+	sched_yield();
+#endif
+}
+
+static void traceSleep() {
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+	Sleep(1);
+#else
+	struct timespec ts = { 0, 1000000 };
+	nanosleep(&ts, NULL);
+#endif
+}
+
+static void releaseRing(void *ptr) {
+	TraceRing *ring = (TraceRing *) ptr;
+	if (ring == NULL) {
+		return;
+	}
+	// whatever is still in it is drained by the writer as usual
+	atomicStore32(&ring->owned, 0);
+	if (g_traceRing == ring) {
+		g_traceRing = NULL;
+	}
+}
+
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+static void WINAPI releaseRingFls(void *ptr) {
+	releaseRing(ptr);
+}
+
+static BOOL CALLBACK traceInit(PINIT_ONCE initOnce, PVOID param, PVOID *context) {
+	g_traceRingFls = FlsAlloc(&releaseRingFls);
+	return TRUE;
+}
+#else
+static void traceInit() {
+	pthread_key_create(&g_traceRingKey, &releaseRing);
+}
+#endif
+
+// a ring given up by an exited thread, once the writer has emptied it
+static TraceRing *adoptRing() {
+	TraceRing *ring = (TraceRing *) atomicLoadPtr(&g_trace.rings);
+	while (ring) {
+		if (atomicLoad32(&ring->owned) == 0 && atomicCompareExchange32(&ring->owned, 0, 1)) {
+			if (atomicLoadAcquire64(&ring->tail) == ring->head) {
+				return ring;
+			}
+			atomicStore32(&ring->owned, 0);
+		}
+		ring = ring->next;
+	}
+	return NULL;
+}
+
+static TraceRing *newRing() {
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+	InitOnceExecuteOnce(&g_traceInitOnce, &traceInit, NULL, NULL);
+#else
+	pthread_once(&g_traceInitOnce, &traceInit);
+#endif
+
+	TraceRing *ring = adoptRing();
+	if (ring == NULL) {
+		// straight from the platform, the global allocator would record itself
+		ring = (TraceRing *) platformMalloc(sizeof(TraceRing));
+		if (ring == NULL) {
+			return NULL;
+		}
+		memset(ring, 0, offsetof(TraceRing, events));
+		ring->owned = 1;
+		void *head;
+		do {
+			head = atomicLoadPtr(&g_trace.rings);
+			ring->next = (TraceRing *) head;
+		} while (!atomicCompareExchangePtr(&g_trace.rings, head, ring));
+	}
+	// every thread gets its own index even in a reused ring, the writer only
+	// reads it for events pushed after this
+	ring->index = atomicAdd32(&g_trace.ringCount, 1) - 1;
+
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+	FlsSetValue(g_traceRingFls, ring);
+#else
+	pthread_setspecific(g_traceRingKey, ring);
+#endif
+	g_traceRing = ring;
+	return ring;
+}
+
+AL2O3_EXTERN_C void traceRecord(TraceEventType type, void const *address, void const *oldAddress, size_t size, size_t align, Memory_SrcLoc const *loc) {
+	TraceRing *ring = g_traceRing;
+	if (ring == NULL) {
+		ring = newRing();
+		if (ring == NULL) {
+			return;
+		}
+	}
+
+	// the writer checks active after recording is cleared, so it either sees us
+	// here or we see that recording has stopped
+	atomicStore32(&ring->active, 1);
+	if (atomicLoad32(&g_traceRecording) == 0) {
+		atomicStore32(&ring->active, 0);
+		return;
+	}
+
+	uint64_t const head = ring->head;
+	while (head - atomicLoadAcquire64(&ring->tail) >= traceRingSize) {
+		traceYield();
+	}
+
+	TraceRingEvent *event = &ring->events[head & (traceRingSize - 1)];
+	event->ns = monotonicNs();
+	event->address = (uintptr_t) address;
+	event->oldAddress = (uintptr_t) oldAddress;
+	event->size = size;
+	// a loc without an id is scratch space that will be overwritten, so can't be kept
+	event->loc = (loc && atomicLoad32((uint32_t volatile *) &loc->id) != Memory_SrcLocNoId && loc->sourceFile) ? loc : NULL;
+	event->align = (uint32_t) align;
+	event->type = (uint32_t) type;
+	atomicStoreRelease64(&ring->head, head + 1);
+
+	atomicStore32(&ring->active, 0);
+}
+
+static void writerFlush(TraceWriter *writer) {
+	if (writer->used && !writer->failed) {
+		if (fwrite(writer->buffer, 1, writer->used, writer->file) != writer->used) {
+			LOGERROR("Allocation trace write failed, the rest of the trace is lost");
+			writer->failed = true;
+		}
+	}
+	writer->used = 0;
+}
+
+static void writerBytes(TraceWriter *writer, void const *data, size_t size) {
+	if (writer->used + size > traceBufferSize) {
+		writerFlush(writer);
+	}
+	if (size > traceBufferSize) {
+		if (!writer->failed && fwrite(data, 1, size, writer->file) != size) {
+			writer->failed = true;
+		}
+		return;
+	}
+	memcpy(writer->buffer + writer->used, data, size);
+	writer->used += size;
+}
+
+AL2O3_FORCE_INLINE void writerVarint(TraceWriter *writer, uint64_t value) {
+	uint8_t *out = writer->buffer + writer->used;
+	while (value >= 0x80) {
+		*out++ = (uint8_t) (value | 0x80);
+		value >>= 7;
+	}
+	*out++ = (uint8_t) value;
+	writer->used = (size_t) (out - writer->buffer);
+}
+
+AL2O3_FORCE_INLINE void writerDelta(TraceWriter *writer, uint64_t from, uint64_t to) {
+	int64_t const delta = (int64_t) (to - from);
+	writerVarint(writer, ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63));
+}
+
+static void writerString(TraceWriter *writer, char const *str) {
+	size_t const length = str ? strlen(str) : 0;
+	if (writer->used + traceMaxRecordSize > traceBufferSize) {
+		writerFlush(writer);
+	}
+	writerVarint(writer, length);
+	if (length) {
+		writerBytes(writer, str, length);
+	}
+}
+
+static bool growSrcLocs(TraceSrcLocMap *map) {
+	uint32_t const capacity = map->capacity ? map->capacity * 2 : 1024;
+	Memory_SrcLoc const **keys = (Memory_SrcLoc const **) platformCalloc(capacity, sizeof(Memory_SrcLoc const *));
+	uint32_t *ids = (uint32_t *) platformMalloc(capacity * sizeof(uint32_t));
+	if (keys == NULL || ids == NULL) {
+		platformFree(keys);
+		platformFree(ids);
+		return false;
+	}
+	for (uint32_t i = 0; i < map->capacity; ++i) {
+		if (map->keys[i]) {
+			uint32_t slot = (uint32_t) (((uintptr_t) map->keys[i] >> 4) * 0x9E3779B1u) & (capacity - 1);
+			while (keys[slot]) {
+				slot = (slot + 1) & (capacity - 1);
+			}
+			keys[slot] = map->keys[i];
+			ids[slot] = map->ids[i];
+		}
+	}
+	platformFree(map->keys);
+	platformFree(map->ids);
+	map->keys = keys;
+	map->ids = ids;
+	map->capacity = capacity;
+	return true;
+}
+
+// the locs own trace id, writing its definition the first time it's seen
+static uint32_t writerSrcLoc(TraceWriter *writer, Memory_SrcLoc const *loc) {
+	if (loc == NULL) {
+		return 0;
+	}
+	TraceSrcLocMap *map = &writer->srcLocs;
+	if ((map->count + 1) * 2 > map->capacity && !growSrcLocs(map)) {
+		return 0;
+	}
+	uint32_t slot = (uint32_t) (((uintptr_t) loc >> 4) * 0x9E3779B1u) & (map->capacity - 1);
+	while (map->keys[slot]) {
+		if (map->keys[slot] == loc) {
+			return map->ids[slot];
+		}
+		slot = (slot + 1) & (map->capacity - 1);
+	}
+	map->keys[slot] = loc;
+	map->ids[slot] = ++map->count;
+
+	uint8_t const type = TRACE_FILE_SRCLOC;
+	writerBytes(writer, &type, 1);
+	if (writer->used + traceMaxRecordSize > traceBufferSize) {
+		writerFlush(writer);
+	}
+	writerVarint(writer, map->count);
+	writerVarint(writer, loc->sourceLine);
+	writerString(writer, loc->sourceFile);
+	writerString(writer, loc->sourceFunc);
+	return map->count;
+}
+
+static void writerEvent(TraceWriter *writer, uint32_t thread, TraceRingEvent const *event) {
+	// the definition has to come first, so look it up before starting the record
+	uint32_t const srcLoc = (event->type == TRACE_FREE || event->type == TRACE_EXPAND) ? 0 : writerSrcLoc(writer, event->loc);
+	if (writer->used + traceMaxRecordSize * 2 > traceBufferSize) {
+		writerFlush(writer);
+	}
+	if (thread != writer->lastThread) {
+		writer->buffer[writer->used++] = TRACE_FILE_THREAD;
+		writerVarint(writer, thread);
+		writer->lastThread = thread;
+	}
+
+	writer->buffer[writer->used++] = (uint8_t) event->type;
+	writerDelta(writer, writer->lastNs, event->ns);
+	writerDelta(writer, writer->lastAddress, event->address);
+	writer->lastNs = event->ns;
+	writer->lastAddress = event->address;
+	switch (event->type) {
+		case TRACE_ALLOC:
+		case TRACE_CALLOC:
+			writerVarint(writer, event->size);
+			writerVarint(writer, srcLoc);
+			break;
+		case TRACE_AALLOC:
+			writerVarint(writer, event->size);
+			writerVarint(writer, event->align);
+			writerVarint(writer, srcLoc);
+			break;
+		case TRACE_REALLOC:
+			writerDelta(writer, event->address, event->oldAddress);
+			writerVarint(writer, event->size);
+			writerVarint(writer, event->align);
+			writerVarint(writer, srcLoc);
+			break;
+		case TRACE_EXPAND:
+			writerVarint(writer, event->size);
+			break;
+		default:
+			break;
+	}
+}
+
+// returns how many events were written
+static uint64_t drainRings(TraceWriter *writer) {
+	uint64_t drained = 0;
+	TraceRing *ring = (TraceRing *) atomicLoadPtr(&g_trace.rings);
+	while (ring) {
+		uint64_t const head = atomicLoadAcquire64(&ring->head);
+		uint64_t tail = ring->tail;
+		drained += head - tail;
+		while (tail != head) {
+			writerEvent(writer, ring->index, &ring->events[tail & (traceRingSize - 1)]);
+			tail++;
+			// let a waiting producer carry on now and then
+			if ((tail & 255) == 0) {
+				atomicStoreRelease64(&ring->tail, tail);
+			}
+		}
+		atomicStoreRelease64(&ring->tail, tail);
+		ring = ring->next;
+	}
+	return drained;
+}
+
+static bool anyRingActive() {
+	TraceRing *ring = (TraceRing *) atomicLoadPtr(&g_trace.rings);
+	while (ring) {
+		if (atomicLoad32(&ring->active)) {
+			return true;
+		}
+		ring = ring->next;
+	}
+	return false;
+}
+
+static void writerLoop() {
+	TraceWriter *writer = &g_trace.writer;
+	for (;;) {
+		bool const stopping = atomicLoad32(&g_trace.stopping) != 0;
+		// active before draining, a push that finishes in between is still drained
+		bool const active = stopping && anyRingActive();
+		uint64_t const drained = drainRings(writer);
+		if (stopping && !active && drained == 0) {
+			break;
+		}
+		if (drained == 0) {
+			traceSleep();
+		}
+	}
+	uint8_t const end = TRACE_FILE_END;
+	writerBytes(writer, &end, 1);
+	writerFlush(writer);
+}
+
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+static DWORD WINAPI writerThread(LPVOID param) {
+	writerLoop();
+	return 0;
+}
+#else
+static void *writerThread(void *param) {
+	(void) param;
+	writerLoop();
+	return NULL;
+}
+#endif
+
+AL2O3_EXTERN_C bool Memory_TraceStart(char const *path) {
+	MUTEX_LOCK(&g_trace.mutex)
+	if (g_trace.running) {
+		MUTEX_UNLOCK(&g_trace.mutex)
+		LOGWARNING("An allocation trace is already recording");
+		return false;
+	}
+
+	TraceWriter *writer = &g_trace.writer;
+	memset(writer, 0, sizeof(TraceWriter));
+	writer->file = fopen(path, "wb");
+	writer->buffer = (uint8_t *) platformMalloc(traceBufferSize);
+	if (writer->file == NULL || writer->buffer == NULL) {
+		if (writer->file) {
+			fclose(writer->file);
+		}
+		platformFree(writer->buffer);
+		MUTEX_UNLOCK(&g_trace.mutex)
+		LOGERROR("Unable to start an allocation trace to %s", path);
+		return false;
+	}
+	writer->lastThread = ~0u;
+	writerBytes(writer, "AL2OMTRC", 8);
+	writerVarint(writer, TRACE_FILE_VERSION);
+
+	atomicStore32(&g_trace.stopping, 0);
+	atomicStore32(&g_traceRecording, 1);
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+	g_trace.thread = CreateThread(NULL, 0, &writerThread, NULL, 0, NULL);
+	bool const started = g_trace.thread != NULL;
+#else
+	bool const started = pthread_create(&g_trace.thread, NULL, &writerThread, NULL) == 0;
+#endif
+	if (!started) {
+		atomicStore32(&g_traceRecording, 0);
+		fclose(writer->file);
+		platformFree(writer->buffer);
+		MUTEX_UNLOCK(&g_trace.mutex)
+		LOGERROR("Unable to start the allocation trace writer thread");
+		return false;
+	}
+	g_trace.running = true;
+	MUTEX_UNLOCK(&g_trace.mutex)
+	return true;
+}
+
+AL2O3_EXTERN_C bool Memory_TraceStop() {
+	MUTEX_LOCK(&g_trace.mutex)
+	if (!g_trace.running) {
+		MUTEX_UNLOCK(&g_trace.mutex)
+		return false;
+	}
+	atomicStore32(&g_traceRecording, 0);
+	atomicStore32(&g_trace.stopping, 1);
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+	WaitForSingleObject(g_trace.thread, INFINITE);
+	CloseHandle(g_trace.thread);
+#else
+	pthread_join(g_trace.thread, NULL);
+#endif
+
+	TraceWriter *writer = &g_trace.writer;
+	bool const ok = !writer->failed && fclose(writer->file) == 0;
+	if (writer->failed) {
+		fclose(writer->file);
+	}
+	platformFree(writer->buffer);
+	platformFree(writer->srcLocs.keys);
+	platformFree(writer->srcLocs.ids);
+	memset(writer, 0, sizeof(TraceWriter));
+	g_trace.running = false;
+	MUTEX_UNLOCK(&g_trace.mutex)
+	return ok;
+}
+
+AL2O3_EXTERN_C bool Memory_TraceIsRecording() {
+	return atomicLoad32(&g_traceRecording) != 0;
+}
@@ -0,0 +1,153 @@
+// License Summary: MIT see LICENSE file
+#include "al2o3_memory/memory.h"
+#include "internal.h"
+
+// Reserving only claims address space, pages cost memory once committed (and
+// on unix not until first touched). Decommit replaces the pages with fresh
+// inaccessible ones so the memory goes straight back to the OS.
+
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+
+AL2O3_EXTERN_C size_t Memory_VirtualPageSize() {
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (size_t) info.dwPageSize;
+}
+
+AL2O3_EXTERN_C void *Memory_VirtualReserve(size_t size) {
+	return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+AL2O3_EXTERN_C bool Memory_VirtualCommit(void *address, size_t size) {
+	return VirtualAlloc(address, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+}
+
+AL2O3_EXTERN_C void Memory_VirtualDecommit(void *address, size_t size) {
+	VirtualFree(address, size, MEM_DECOMMIT);
+}
+
+AL2O3_EXTERN_C void Memory_VirtualRelease(void *address, size_t size) {
+	if (address) {
+		VirtualFree(address, 0, MEM_RELEASE);
+	}
+}
+
+#elif AL2O3_PLATFORM == AL2O3_PLATFORM_UNIX || AL2O3_PLATFORM_OS == AL2O3_OS_OSX
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if !defined(MAP_NORESERVE)
+#define MAP_NORESERVE 0
+#endif
+
+AL2O3_EXTERN_C size_t Memory_VirtualPageSize() {
+	return (size_t) sysconf(_SC_PAGESIZE);
+}
+
+AL2O3_EXTERN_C void *Memory_VirtualReserve(size_t size) {
+	void *mem = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return (mem == MAP_FAILED) ? NULL : mem;
+}
+
+AL2O3_EXTERN_C bool Memory_VirtualCommit(void *address, size_t size) {
+	return mprotect(address, size, PROT_READ | PROT_WRITE) == 0;
+}
+
+AL2O3_EXTERN_C void Memory_VirtualDecommit(void *address, size_t size) {
+	// mapping over the top drops the old pages in one go and keeps the range reserved
+	mmap(address, size, PROT_NONE, MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+}
+
+AL2O3_EXTERN_C void Memory_VirtualRelease(void *address, size_t size) {
+	if (address) {
+		munmap(address, size);
+	}
+}
+
+#else
+
+// no virtual memory control, so everything is committed when reserved
+AL2O3_EXTERN_C size_t Memory_VirtualPageSize() {
+	return 4096;
+}
+
+AL2O3_EXTERN_C void *Memory_VirtualReserve(size_t size) {
+	return platformCalloc(1, size);
+}
+
+AL2O3_EXTERN_C bool Memory_VirtualCommit(void *address, size_t size) {
+	return true;
+}
+
+AL2O3_EXTERN_C void Memory_VirtualDecommit(void *address, size_t size) {
+	memset(address, 0, size);
+}
+
+AL2O3_EXTERN_C void Memory_VirtualRelease(void *address, size_t size) {
+	platformFree(address);
+}
+
+#endif
+
+#define virtualBufferMinCommit (64u * 1024u)
+
+AL2O3_FORCE_INLINE size_t roundToPage(size_t size, size_t pageSize) {
+	return (size + (pageSize - 1)) & ~(pageSize - 1);
+}
+
+AL2O3_EXTERN_C bool Memory_VirtualBufferInit(Memory_VirtualBuffer *buffer, size_t maxSize) {
+	memset(buffer, 0, sizeof(Memory_VirtualBuffer));
+	size_t const reserved = roundToPage(maxSize, Memory_VirtualPageSize());
+	buffer->base = (uint8_t *) Memory_VirtualReserve(reserved);
+	if (buffer->base == NULL) {
+		LOGERROR("Unable to reserve %zu bytes of address space", reserved);
+		return false;
+	}
+	buffer->reserved = reserved;
+	return true;
+}
+
+AL2O3_EXTERN_C void Memory_VirtualBufferDestroy(Memory_VirtualBuffer *buffer) {
+	Memory_VirtualRelease(buffer->base, buffer->reserved);
+	memset(buffer, 0, sizeof(Memory_VirtualBuffer));
+}
+
+AL2O3_EXTERN_C bool Memory_VirtualBufferResize(Memory_VirtualBuffer *buffer, size_t size) {
+	if (size > buffer->reserved) {
+		return false;
+	}
+	if (size > buffer->committed) {
+		// commit at least as much again as we have, so growing a byte at a time is still few calls
+		size_t commit = buffer->committed ? buffer->committed * 2 : virtualBufferMinCommit;
+		if (commit < size) {
+			commit = size;
+		}
+		commit = roundToPage(commit, Memory_VirtualPageSize());
+		if (commit > buffer->reserved) {
+			commit = buffer->reserved;
+		}
+		if (!Memory_VirtualCommit(buffer->base + buffer->committed, commit - buffer->committed)) {
+			LOGERROR("Unable to commit %zu bytes", commit - buffer->committed);
+			return false;
+		}
+		buffer->committed = commit;
+	}
+	buffer->size = size;
+	return true;
+}
+
+AL2O3_EXTERN_C void *Memory_VirtualBufferPush(Memory_VirtualBuffer *buffer, size_t count) {
+	size_t const offset = buffer->size;
+	if (count > buffer->reserved - offset || !Memory_VirtualBufferResize(buffer, offset + count)) {
+		return NULL;
+	}
+	return buffer->base + offset;
+}
+
+AL2O3_EXTERN_C void Memory_VirtualBufferShrinkToFit(Memory_VirtualBuffer *buffer) {
+	size_t const keep = roundToPage(buffer->size, Memory_VirtualPageSize());
+	if (keep < buffer->committed) {
+		Memory_VirtualDecommit(buffer->base + keep, buffer->committed - keep);
+		buffer->committed = keep;
+	}
+}
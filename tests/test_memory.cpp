@@ -1,5 +1,13 @@
 #include "al2o3_catch2/catch2.hpp"
 #include "al2o3_memory/memory.h"
+#include "al2o3_memory/objectpool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
 
 TEST_CASE("Basic tests", "[al2o3 Memory]") {
 	void* m0 = MEMORY_MALLOC(10);
@@ -10,6 +18,8 @@ TEST_CASE("Basic tests", "[al2o3 Memory]") {
 	for(int i =0;i < 10 * 10;++i) {
 		REQUIRE( ((uint8_t*)m1)[i] == 0);
 	}
+	// a count * size that wraps must fail, not give a small block
+	REQUIRE(MEMORY_CALLOC(SIZE_MAX / 8 + 2, 8) == NULL);
 
 	void* m2 = MEMORY_MALLOC(10);
 	REQUIRE(m2);
@@ -27,3 +37,674 @@ TEST_CASE("Basic tests", "[al2o3 Memory]") {
 	MEMORY_FREE(m1);
 }
 
+
+TEST_CASE("Sized free, usable size and expand in place", "[al2o3 Memory]") {
+	Memory_Allocator* const allocators[] = {
+		&Memory_GlobalAllocator,
+		&Memory_TempAllocator,
+		&Memory_SmallObjectAllocator
+	};
+
+	for (Memory_Allocator* allocator : allocators) {
+		void* m0 = MEMORY_ALLOCATOR_MALLOC(allocator, 100);
+		REQUIRE(m0);
+		size_t const usable = MEMORY_ALLOCATOR_USABLE_SIZE(allocator, m0);
+		// 0 is allowed if the platform can't tell, but never less than asked for
+		REQUIRE((usable == 0 || usable >= 100));
+		REQUIRE(MEMORY_ALLOCATOR_TRY_EXPAND_IN_PLACE(allocator, m0, 50));
+		if (usable) {
+			REQUIRE(MEMORY_ALLOCATOR_TRY_EXPAND_IN_PLACE(allocator, m0, usable));
+			memset(m0, 0xAB, usable);
+		}
+		MEMORY_ALLOCATOR_FREE_SIZED(allocator, m0, usable ? usable : 100);
+
+		void* m1 = MEMORY_ALLOCATOR_MALLOC(allocator, 10000);
+		REQUIRE(m1);
+		MEMORY_ALLOCATOR_FREE_SIZED(allocator, m1, 10000);
+	}
+
+	// the last temp allocation can always grow into its block
+	void* t0 = MEMORY_TEMP_MALLOC(10);
+	REQUIRE(Memory_TempAllocator.tryExpandInPlace(t0, 1000));
+	REQUIRE(Memory_TempAllocator.usableSize(t0) == 1000);
+	MEMORY_TEMP_FREE(t0);
+}
+
+TEST_CASE("Aligned realloc", "[al2o3 Memory]") {
+	Memory_Allocator* const allocators[] = {
+		&Memory_GlobalAllocator,
+		&Memory_TempAllocator,
+		&Memory_SmallObjectAllocator
+	};
+
+	for (Memory_Allocator* allocator : allocators) {
+		for (size_t align : { 16, 64, 256 }) {
+			uint8_t* m = (uint8_t*) MEMORY_ALLOCATOR_AALLOC(allocator, 10, align);
+			REQUIRE(m);
+			for (int i = 0; i < 10; ++i) {
+				m[i] = (uint8_t) i;
+			}
+			for (size_t size : { 100, 4000, 100000, 50 }) {
+				m = (uint8_t*) MEMORY_ALLOCATOR_AREALLOC(allocator, m, size, align);
+				REQUIRE(m);
+				REQUIRE((((uintptr_t) m) & (align - 1)) == 0);
+				for (int i = 0; i < 10; ++i) {
+					REQUIRE(m[i] == i);
+				}
+			}
+			MEMORY_ALLOCATOR_FREE(allocator, m);
+		}
+	}
+}
+
+TEST_CASE("Large allocations", "[al2o3 Memory]") {
+	size_t const oldThreshold = Memory_GetLargeAllocThreshold();
+	Memory_SetLargeAllocThreshold(256 * 1024);
+	size_t const big = 4 * 1024 * 1024;
+
+	// the total must not wrap to something that looks mappable
+	REQUIRE(Memory_PlatformAllocator.calloc(SIZE_MAX / big + 2, big) == NULL);
+
+	uint8_t* m = (uint8_t*) MEMORY_CALLOC(big / 16, 16);
+	REQUIRE(m);
+	for (size_t i = 0; i < big; i += 4096) {
+		REQUIRE(m[i] == 0);
+		m[i] = (uint8_t) (i >> 12);
+	}
+	REQUIRE(m[big - 1] == 0);
+
+	// grows and shrinks stay mapped, then it goes back to the heap well below the threshold
+	for (size_t size : { big * 4, big / 2, (size_t) 1000 }) {
+		m = (uint8_t*) MEMORY_REALLOC(m, size);
+		REQUIRE(m);
+		for (size_t i = 0; i < size && i < big; i += 4096) {
+			REQUIRE(m[i] == (uint8_t) (i >> 12));
+		}
+	}
+	MEMORY_FREE(m);
+
+	m = (uint8_t*) MEMORY_AALLOC(big, 64 * 1024);
+	REQUIRE(m);
+	REQUIRE((((uintptr_t) m) & (64 * 1024 - 1)) == 0);
+	m[0] = 1;
+	m = (uint8_t*) MEMORY_AREALLOC(m, big * 2, 64 * 1024);
+	REQUIRE(m);
+	REQUIRE((((uintptr_t) m) & (64 * 1024 - 1)) == 0);
+	REQUIRE(m[0] == 1);
+	MEMORY_FREE(m);
+
+	Memory_SetLargeAllocHugePages(true);
+	m = (uint8_t*) MEMORY_MALLOC(big);
+	REQUIRE(m);
+	size_t const usable = MEMORY_USABLE_SIZE(m);
+	REQUIRE((usable == 0 || usable >= big));
+	memset(m, 0xAB, big);
+	if (usable) {
+		REQUIRE(MEMORY_TRY_EXPAND_IN_PLACE(m, usable));
+	}
+	MEMORY_FREE(m);
+	Memory_SetLargeAllocHugePages(false);
+
+	Memory_SetLargeAllocThreshold(oldThreshold);
+	REQUIRE(Memory_GetLargeAllocThreshold() == oldThreshold);
+}
+
+#if MEMORY_STATS == 1
+TEST_CASE("Stats", "[al2o3 Memory]") {
+	Memory_Stats const before = Memory_GetStats();
+
+	void* m0 = MEMORY_MALLOC(1000);
+	void* m1 = MEMORY_AALLOC(1000, 64);
+	void* t0 = MEMORY_TEMP_MALLOC(100);
+	m0 = MEMORY_REALLOC(m0, 2000);
+
+	Memory_Stats const during = Memory_GetStats();
+	// without tracking aligned allocations are counted as plain and sizes are what the platform really gave
+	REQUIRE(during.plain.totalAllocs + during.aligned.totalAllocs == before.plain.totalAllocs + before.aligned.totalAllocs + 2);
+	REQUIRE(during.plain.totalReallocs + during.aligned.totalReallocs == before.plain.totalReallocs + before.aligned.totalReallocs + 1);
+	REQUIRE(during.plain.liveCount + during.aligned.liveCount == before.plain.liveCount + before.aligned.liveCount + 2);
+	REQUIRE(during.plain.liveBytes + during.aligned.liveBytes >= before.plain.liveBytes + before.aligned.liveBytes + 3000);
+	REQUIRE(during.temp.liveBytes == before.temp.liveBytes + 100);
+	REQUIRE(during.temp.liveCount == before.temp.liveCount + 1);
+	REQUIRE(during.peakBytes >= during.liveBytes);
+
+	// frees on another thread still balance out
+	std::thread freer([&] {
+		MEMORY_FREE(m0);
+		MEMORY_FREE(m1);
+	});
+	freer.join();
+	MEMORY_TEMP_FREE(t0);
+
+	Memory_Stats const after = Memory_GetStats();
+	REQUIRE(after.plain.liveCount + after.aligned.liveCount == before.plain.liveCount + before.aligned.liveCount);
+	REQUIRE(after.plain.liveBytes + after.aligned.liveBytes == before.plain.liveBytes + before.aligned.liveBytes);
+	REQUIRE(after.temp.liveBytes == before.temp.liveBytes);
+	REQUIRE(after.temp.totalFrees == before.temp.totalFrees + 1);
+	REQUIRE(after.peakBytes >= during.liveBytes);
+}
+#endif
+
+TEST_CASE("Tracking level", "[al2o3 Memory]") {
+	if (Memory_TrackerGetLevel() != Memory_TrackingLevel_Full) {
+		// not a tracking build, the level is fixed
+		return;
+	}
+	Memory_Stats const before = Memory_GetStats();
+
+	void *full = MEMORY_MALLOC(100);
+	Memory_TrackerSetLevel(Memory_TrackingLevel_Off);
+	void *off = MEMORY_MALLOC(200);
+	void *offAligned = MEMORY_AALLOC(200, 64);
+	REQUIRE((((uintptr_t) offAligned) & 63) == 0);
+	Memory_TrackerSetLevel(Memory_TrackingLevel_Stats);
+	void *stats = MEMORY_MALLOC(300);
+	// blocks keep what they were allocated with whatever the level is when they are resized or freed
+	full = MEMORY_REALLOC(full, 1000);
+	off = MEMORY_REALLOC(off, 2000);
+	Memory_TrackerSetLevel(Memory_TrackingLevel_Full);
+	stats = MEMORY_REALLOC(stats, 3000);
+	REQUIRE(full);
+	REQUIRE(off);
+	REQUIRE(stats);
+
+#if MEMORY_STATS == 1
+	Memory_Stats const during = Memory_GetStats();
+	REQUIRE(during.plain.liveCount == before.plain.liveCount + 2);
+	REQUIRE(during.plain.liveBytes == before.plain.liveBytes + 4000);
+	REQUIRE(during.aligned.liveCount == before.aligned.liveCount);
+#endif
+
+	MEMORY_FREE(off);
+	MEMORY_FREE(offAligned);
+	MEMORY_FREE(stats);
+	Memory_TrackerSetLevel(Memory_TrackingLevel_Off);
+	MEMORY_FREE(full);
+	Memory_TrackerSetLevel(Memory_TrackingLevel_Full);
+
+#if MEMORY_STATS == 1
+	Memory_Stats const after = Memory_GetStats();
+	REQUIRE(after.plain.liveCount == before.plain.liveCount);
+	REQUIRE(after.plain.liveBytes == before.plain.liveBytes);
+	REQUIRE(after.aligned.liveCount == before.aligned.liveCount);
+#endif
+}
+
+TEST_CASE("Multi-threaded throughput", "[al2o3 Memory]") {
+	unsigned int const maxThreads = std::max(1u, std::thread::hardware_concurrency());
+	int const opsPerThread = 20000;
+	int const window = 64;
+
+	double singleThreadRate = 0.0;
+	for (unsigned int threadCount = 1; threadCount <= maxThreads; threadCount *= 2) {
+		std::atomic<int> failures(0);
+		auto const start = std::chrono::steady_clock::now();
+
+		std::vector<std::thread> threads;
+		for (unsigned int t = 0; t < threadCount; ++t) {
+			threads.emplace_back([&failures, opsPerThread, window]() {
+				void* live[window] = {};
+				for (int i = 0; i < opsPerThread; ++i) {
+					int const slot = i % window;
+					MEMORY_FREE(live[slot]);
+					live[slot] = MEMORY_MALLOC(16 + (i & 255));
+					if (!live[slot]) {
+						failures++;
+					}
+				}
+				for (int i = 0; i < window; ++i) {
+					MEMORY_FREE(live[i]);
+				}
+			});
+		}
+		for (auto& thread : threads) {
+			thread.join();
+		}
+
+		std::chrono::duration<double> const elapsed = std::chrono::steady_clock::now() - start;
+		double const rate = (double(opsPerThread) * threadCount) / elapsed.count();
+		if (threadCount == 1) {
+			singleThreadRate = rate;
+		}
+		REQUIRE(failures == 0);
+		printf("%2u threads: %12.0f alloc+free/s (%.2fx single thread)\n", threadCount, rate, rate / singleThreadRate);
+	}
+}
+
+TEST_CASE("Many live allocations", "[al2o3 Memory]") {
+	// enough to force the tracker tables to grow (and migrate) several times
+	int const count = 200000;
+	std::vector<void*> allocs(count);
+	for (int i = 0; i < count; ++i) {
+		allocs[i] = MEMORY_MALLOC(8 + (i & 63));
+		REQUIRE(allocs[i]);
+		*(int*)allocs[i] = i;
+	}
+
+	// realloc every other one whilst the tables are still busy migrating
+	for (int i = 0; i < count; i += 2) {
+		allocs[i] = MEMORY_REALLOC(allocs[i], 128);
+		REQUIRE(allocs[i]);
+	}
+
+	// free in a scrambled order
+	for (int i = 0; i < count; ++i) {
+		int const index = (int)((i * 7919ull) % count);
+		REQUIRE(*(int*)allocs[index] == index);
+		MEMORY_FREE(allocs[index]);
+	}
+}
+
+// for the frees that find their way back to a pool
+static Memory_ObjectPool<uint64_t> g_ownerPool;
+
+static std::atomic<int> countingAllocs{0};
+// what the counting allocator has handed out, so it can say what it owns
+static std::mutex countingMutex;
+static std::set<void*> countingBlocks;
+static void* counted(void* ptr, void* old = nullptr) {
+	std::lock_guard<std::mutex> lock(countingMutex);
+	if (ptr) {
+		countingBlocks.erase(old);
+		countingBlocks.insert(ptr);
+	}
+	return ptr;
+}
+static void* countingMalloc(size_t size) { countingAllocs++; return counted(Memory_GlobalAllocator.malloc(size)); }
+static void* countingAalloc(size_t size, size_t align) { countingAllocs++; return counted(Memory_GlobalAllocator.aalloc(size, align)); }
+static void* countingCalloc(size_t count, size_t size) { countingAllocs++; return counted(Memory_GlobalAllocator.calloc(count, size)); }
+static void* countingRealloc(void* ptr, size_t size) { countingAllocs++; return counted(Memory_GlobalAllocator.realloc(ptr, size), ptr); }
+static void countingFree(void* ptr) {
+	countingAllocs--;
+	{
+		std::lock_guard<std::mutex> lock(countingMutex);
+		countingBlocks.erase(ptr);
+	}
+	Memory_GlobalAllocator.free(ptr);
+}
+static bool countingOwns(void const* ptr) {
+	std::lock_guard<std::mutex> lock(countingMutex);
+	return countingBlocks.count(const_cast<void*>(ptr)) != 0;
+}
+
+TEST_CASE("Allocator stack", "[al2o3 Memory]") {
+	Memory_Allocator counting = { &countingMalloc, &countingAalloc, &countingCalloc, &countingRealloc, &countingFree };
+	counting.owns = &countingOwns;
+	REQUIRE(Memory_CurrentAllocator == &Memory_GlobalAllocator);
+
+	{
+		Memory_AllocatorScope scope(&counting);
+		REQUIRE(Memory_CurrentAllocator == &counting);
+		void* a = MEMORY_MALLOC(16);
+		void* b = MEMORY_CALLOC(4, 4);
+		REQUIRE(countingAllocs == 2);
+
+		// nested scopes restore what they replaced
+		{
+			Memory_AllocatorScope inner(&Memory_TempAllocator);
+			void* temp = MEMORY_MALLOC(64);
+			REQUIRE(temp);
+			MEMORY_FREE(temp);
+			REQUIRE(countingAllocs == 2);
+		}
+		REQUIRE(Memory_CurrentAllocator == &counting);
+
+		// other threads are unaffected
+		std::thread([] {
+			REQUIRE(Memory_CurrentAllocator == &Memory_GlobalAllocator);
+			MEMORY_FREE(MEMORY_MALLOC(16));
+		}).join();
+		REQUIRE(countingAllocs == 2);
+
+		MEMORY_FREE(a);
+		MEMORY_FREE(b);
+		REQUIRE(countingAllocs == 0);
+	}
+	REQUIRE(Memory_CurrentAllocator == &Memory_GlobalAllocator);
+
+	// overflowing keeps the current allocator, but still has to be popped
+	for (int i = 0; i < Memory_AllocatorStackMaxDepth; ++i) {
+		REQUIRE(Memory_PushAllocator(&counting));
+	}
+	REQUIRE(!Memory_PushAllocator(&Memory_TempAllocator));
+	REQUIRE(Memory_CurrentAllocator == &counting);
+	Memory_PopAllocator();
+	REQUIRE(Memory_CurrentAllocator == &counting);
+	for (int i = 0; i < Memory_AllocatorStackMaxDepth; ++i) {
+		Memory_PopAllocator();
+	}
+	REQUIRE(Memory_CurrentAllocator == &Memory_GlobalAllocator);
+
+	// an allocator that can't tell its blocks apart can't be pushed
+	Memory_Allocator anonymous = { &countingMalloc, &countingAalloc, &countingCalloc, &countingRealloc, &countingFree };
+	REQUIRE(!Memory_PushAllocator(&anonymous));
+	REQUIRE(Memory_CurrentAllocator == &Memory_GlobalAllocator);
+	Memory_PopAllocator();
+}
+
+TEST_CASE("Frees go to the blocks owner", "[al2o3 Memory]") {
+	Memory_Allocator counting = { &countingMalloc, &countingAalloc, &countingCalloc, &countingRealloc, &countingFree };
+	counting.owns = &countingOwns;
+
+	// global blocks resized and freed while other allocators are current
+	void* global = MEMORY_MALLOC(100);
+	{
+		Memory_AllocatorScope scope(&Memory_TempAllocator);
+		REQUIRE(Memory_OwnerOf(global) == &Memory_GlobalAllocator);
+		global = MEMORY_REALLOC(global, 5000);
+		REQUIRE(global);
+		REQUIRE(Memory_OwnerOf(global) == &Memory_GlobalAllocator);
+	}
+	{
+		Memory_AllocatorScope scope(&Memory_SmallObjectAllocator);
+		MEMORY_FREE(global);
+	}
+
+	// and blocks of pushed allocators after they have been popped
+	void* temp;
+	void* small;
+	void* big;
+	void* counted;
+	{
+		Memory_AllocatorScope scope(&Memory_TempAllocator);
+		temp = MEMORY_MALLOC(64);
+	}
+	{
+		Memory_AllocatorScope scope(&Memory_SmallObjectAllocator);
+		small = MEMORY_MALLOC(32);
+		// too big for a size class, so it goes to the global allocator
+		big = MEMORY_MALLOC(10000);
+	}
+	{
+		Memory_AllocatorScope scope(&counting);
+		counted = MEMORY_MALLOC(16);
+	}
+	REQUIRE(Memory_OwnerOf(temp)->free == Memory_TempAllocator.free);
+	REQUIRE(Memory_OwnerOf(small)->free == Memory_SmallObjectAllocator.free);
+	REQUIRE(Memory_OwnerOf(big) == &Memory_GlobalAllocator);
+	REQUIRE(Memory_OwnerOf(counted)->free == &countingFree);
+
+	small = MEMORY_REALLOC(small, 48);
+	REQUIRE(Memory_OwnerOf(small)->free == Memory_SmallObjectAllocator.free);
+	REQUIRE(MEMORY_USABLE_SIZE(small) >= 48);
+	MEMORY_FREE(small);
+	MEMORY_FREE(big);
+	{
+		Memory_AllocatorScope scope(&Memory_SmallObjectAllocator);
+		MEMORY_FREE(temp);
+	}
+	// the arena is empty again so the next temp block is where the last one was
+	void* again = MEMORY_TEMP_MALLOC(64);
+	REQUIRE(again == temp);
+	MEMORY_TEMP_FREE(again);
+
+	// batches are split by owner
+	void* mixed[4] = { counted, MEMORY_MALLOC(16), MEMORY_SMALL_MALLOC(16), nullptr };
+	{
+		Memory_AllocatorScope scope(&Memory_TempAllocator);
+		MEMORY_FREE_BATCH(4, mixed);
+	}
+	REQUIRE(countingAllocs == 0);
+
+	// and on threads that never allocated from the owner
+	void* pooled;
+	{
+		Memory_AllocatorScope scope(Memory_ObjectPoolAllocator<uint64_t, &g_ownerPool>());
+		pooled = MEMORY_MALLOC(sizeof(uint64_t));
+	}
+	{
+		Memory_AllocatorScope scope(&counting);
+		counted = MEMORY_MALLOC(16);
+	}
+	{
+		Memory_AllocatorScope scope(&Memory_TempAllocator);
+		temp = MEMORY_MALLOC(64);
+	}
+	small = MEMORY_SMALL_MALLOC(32);
+	REQUIRE(g_ownerPool.LiveCount() == 1);
+	std::thread([&] {
+		MEMORY_FREE(pooled);
+		MEMORY_FREE(counted);
+		MEMORY_FREE(small);
+		// temp memory can't leave its thread, so the free is refused rather than passed on
+		MEMORY_FREE(temp);
+	}).join();
+	REQUIRE(g_ownerPool.LiveCount() == 0);
+	REQUIRE(countingAllocs == 0);
+	// temp is still live, so the arena hasn't been reset
+	again = MEMORY_TEMP_MALLOC(64);
+	REQUIRE(again != temp);
+	MEMORY_FREE(again);
+	MEMORY_FREE(temp);
+	again = MEMORY_TEMP_MALLOC(64);
+	REQUIRE(again == temp);
+	MEMORY_TEMP_FREE(again);
+	g_ownerPool.Release();
+}
+
+TEST_CASE("Range sets", "[al2o3 Memory]") {
+	static uint8_t memory[4096];
+	Memory_RangeSet set = {};
+	REQUIRE(!Memory_RangeSetContains(&set, memory));
+
+	// added out of order and past the first arrays capacity
+	for (int i = 63; i >= 0; i -= 2) {
+		REQUIRE(Memory_RangeSetAdd(&set, memory + i * 64, 64));
+	}
+	for (int i = 0; i < 64; ++i) {
+		bool const added = (i & 1) != 0;
+		REQUIRE(Memory_RangeSetContains(&set, memory + i * 64) == added);
+		REQUIRE(Memory_RangeSetContains(&set, memory + i * 64 + 63) == added);
+	}
+
+	Memory_RangeSetRemove(&set, memory + 31 * 64);
+	REQUIRE(!Memory_RangeSetContains(&set, memory + 31 * 64));
+	REQUIRE(Memory_RangeSetContains(&set, memory + 29 * 64));
+	REQUIRE(Memory_RangeSetContains(&set, memory + 33 * 64));
+
+	Memory_RangeSetClear(&set);
+	REQUIRE(!Memory_RangeSetContains(&set, memory + 33 * 64));
+	REQUIRE(Memory_RangeSetAdd(&set, memory, sizeof(memory)));
+	REQUIRE(Memory_RangeSetContains(&set, memory + 33 * 64));
+	REQUIRE(!Memory_RangeSetContains(&set, memory + sizeof(memory)));
+	Memory_RangeSetDestroy(&set);
+}
+
+TEST_CASE("Batch allocation", "[al2o3 Memory]") {
+	size_t const count = 1000;
+	std::vector<void*> ptrs(count);
+
+#if MEMORY_STATS == 1
+	Memory_Stats const before = Memory_GetStats();
+#endif
+	REQUIRE(MEMORY_MALLOC_BATCH(count, 48, ptrs.data()));
+#if MEMORY_STATS == 1
+	Memory_Stats const during = Memory_GetStats();
+	REQUIRE(during.plain.liveCount + during.aligned.liveCount == before.plain.liveCount + before.aligned.liveCount + count);
+	REQUIRE(during.plain.liveBytes + during.aligned.liveBytes >= before.plain.liveBytes + before.aligned.liveBytes + count * 48);
+#endif
+	for (size_t i = 0; i < count; ++i) {
+		REQUIRE(ptrs[i]);
+		REQUIRE((((uintptr_t) ptrs[i]) & 0xF) == 0);
+		memset(ptrs[i], (int) i, 48);
+	}
+	for (size_t i = 0; i < count; ++i) {
+		REQUIRE(((uint8_t*) ptrs[i])[47] == (uint8_t) i);
+	}
+
+	// batch blocks can be freed singly and batches can skip NULLs
+	for (size_t i = 0; i < count; i += 3) {
+		MEMORY_FREE(ptrs[i]);
+		ptrs[i] = NULL;
+	}
+	MEMORY_FREE_BATCH(count, ptrs.data());
+#if MEMORY_STATS == 1
+	Memory_Stats const after = Memory_GetStats();
+	REQUIRE(after.plain.liveCount + after.aligned.liveCount == before.plain.liveCount + before.aligned.liveCount);
+	REQUIRE(after.plain.liveBytes + after.aligned.liveBytes == before.plain.liveBytes + before.aligned.liveBytes);
+#endif
+
+	// sampled batches only track some of the blocks
+	if (Memory_TrackerGetLevel() == Memory_TrackingLevel_Full) {
+		Memory_TrackerSetLevel(Memory_TrackingLevel_Sampled);
+		REQUIRE(MEMORY_MALLOC_BATCH(count, 100, ptrs.data()));
+		Memory_TrackerSetLevel(Memory_TrackingLevel_Full);
+		MEMORY_FREE_BATCH(count, ptrs.data());
+	}
+
+	// a batch too big to have a size fails rather than wrapping
+	void *huge[3] = { ptrs[0], ptrs[1], ptrs[2] };
+	REQUIRE(!MEMORY_MALLOC_BATCH(3, SIZE_MAX / 2, huge));
+	REQUIRE((huge[0] == NULL && huge[1] == NULL && huge[2] == NULL));
+	if (Memory_GlobalAllocator.mallocBatch) {
+		huge[0] = ptrs[0];
+		REQUIRE(!Memory_GlobalAllocator.mallocBatch(3, SIZE_MAX / 2, huge));
+		REQUIRE(huge[0] == NULL);
+	}
+
+	// allocators without batch functions get one block at a time
+	Memory_Allocator counting = { &countingMalloc, &countingAalloc, &countingCalloc, &countingRealloc, &countingFree };
+	REQUIRE(MEMORY_ALLOCATOR_MALLOC_BATCH(&counting, 10, 32, ptrs.data()));
+	REQUIRE(countingAllocs == 10);
+	MEMORY_ALLOCATOR_FREE_BATCH(&counting, 10, ptrs.data());
+	REQUIRE(countingAllocs == 0);
+}
+
+struct BudgetEvents {
+	int soft;
+	int hard;
+	Memory_Tag lastTag;
+};
+
+static void recordBudgetEvent(void *user, Memory_Tag tag, Memory_BudgetEvent event, uint64_t, size_t) {
+	BudgetEvents *events = (BudgetEvents *) user;
+	if (event == Memory_BudgetEvent_Soft) {
+		events->soft++;
+	} else {
+		events->hard++;
+	}
+	events->lastTag = tag;
+}
+
+TEST_CASE("Allocation tags", "[al2o3 Memory]") {
+	// tags live in the tracking header
+	if (Memory_TrackerGetLevel() != Memory_TrackingLevel_Full) {
+		return;
+	}
+	Memory_Tag const textures = 7;
+	Memory_Tag const sound = 8;
+	Memory_TagSetName(textures, "Textures");
+	REQUIRE(strcmp(Memory_GetTagStats(textures).name, "Textures") == 0);
+	Memory_TagStats const before = Memory_GetTagStats(textures);
+
+	void *a = MEMORY_MALLOC_TAGGED(textures, 1000);
+	REQUIRE(a);
+	// the pushed tag was only for that allocation
+	void *untagged = MEMORY_MALLOC(1000);
+	Memory_TagStats stats = Memory_GetTagStats(textures);
+	REQUIRE(stats.liveBytes == before.liveBytes + 1000);
+	REQUIRE(stats.liveCount == before.liveCount + 1);
+	REQUIRE(stats.totalAllocs == before.totalAllocs + 1);
+
+	void *b;
+	void *c;
+	{
+		Memory_TagScope scope(textures);
+		REQUIRE(Memory_GetTag() == textures);
+		b = MEMORY_AALLOC(500, 64);
+		c = MEMORY_CALLOC_TAGGED(sound, 10, 10);
+		// a wrapped total is refused before it can be charged
+		REQUIRE(MEMORY_CALLOC_TAGGED(sound, SIZE_MAX / 8 + 2, 8) == NULL);
+	}
+	REQUIRE(Memory_GetTag() == 0);
+	REQUIRE(Memory_GetTagStats(textures).liveBytes == before.liveBytes + 1500);
+	REQUIRE(Memory_GetTagStats(sound).liveBytes == 100);
+
+	// a block keeps its tag through a realloc
+	a = MEMORY_REALLOC(a, 3000);
+	REQUIRE(a);
+	stats = Memory_GetTagStats(textures);
+	REQUIRE(stats.liveBytes == before.liveBytes + 3500);
+	REQUIRE(stats.peakBytes >= before.liveBytes + 3500);
+	MEMORY_FREE(a);
+	MEMORY_FREE(b);
+	MEMORY_FREE(c);
+	MEMORY_FREE(untagged);
+	stats = Memory_GetTagStats(textures);
+	REQUIRE(stats.liveBytes == before.liveBytes);
+	REQUIRE(stats.liveCount == before.liveCount);
+	REQUIRE(stats.peakBytes >= before.liveBytes + 3500);
+	Memory_TagResetPeak(textures);
+	REQUIRE(Memory_GetTagStats(textures).peakBytes == before.liveBytes);
+	REQUIRE(Memory_GetTagStats(sound).liveBytes == 0);
+
+	// budgets
+	BudgetEvents events = { 0, 0, 0 };
+	Memory_SetBudgetFunc(&recordBudgetEvent, &events);
+	Memory_TagSetBudget(sound, 1000, 2000);
+	void *s0 = MEMORY_MALLOC_TAGGED(sound, 800);
+	REQUIRE(events.soft == 0);
+	void *s1 = MEMORY_MALLOC_TAGGED(sound, 800);
+	REQUIRE(s1);
+	REQUIRE(events.soft == 1);
+	REQUIRE(events.lastTag == sound);
+	void *s2 = MEMORY_MALLOC_TAGGED(sound, 100);
+	REQUIRE(events.soft == 1);
+	void *refused = MEMORY_MALLOC_TAGGED(sound, 800);
+	REQUIRE(refused == NULL);
+	REQUIRE(events.hard == 1);
+	REQUIRE(MEMORY_REALLOC(s2, 1000) == NULL);
+	REQUIRE(events.hard == 2);
+	void *batch[4];
+	Memory_PushNextTag(sound);
+	REQUIRE(!MEMORY_MALLOC_BATCH(4, 100, batch));
+	REQUIRE(batch[0] == NULL);
+	REQUIRE(Memory_GetTagStats(sound).liveBytes == 1700);
+	REQUIRE(Memory_GetTagStats(sound).liveCount == 3);
+	MEMORY_FREE(s1);
+
+	// batches are charged as a whole
+	Memory_PushNextTag(sound);
+	REQUIRE(MEMORY_MALLOC_BATCH(4, 100, batch));
+	REQUIRE(Memory_GetTagStats(sound).liveBytes == 1300);
+	MEMORY_FREE_BATCH(4, batch);
+	REQUIRE(Memory_GetTagStats(sound).liveBytes == 900);
+
+	// a realloc that moves the block to change its alignment only charges the difference
+	int const softEvents = events.soft;
+	int const hardEvents = events.hard;
+	s0 = MEMORY_AREALLOC(s0, 850, 64);
+	REQUIRE(s0);
+	REQUIRE(events.soft == softEvents);
+	REQUIRE(Memory_GetTagStats(sound).liveBytes == 950);
+	s0 = MEMORY_AREALLOC(s0, 1150, 16);
+	REQUIRE(s0);
+	REQUIRE(events.hard == hardEvents);
+	REQUIRE(events.soft == softEvents + 1);
+	REQUIRE(Memory_GetTagStats(sound).liveBytes == 1250);
+	REQUIRE(Memory_GetTagStats(sound).liveCount == 2);
+	s0 = MEMORY_REALLOC(s0, 800);
+	REQUIRE(Memory_GetTagStats(sound).liveBytes == 900);
+
+	// the cheaper levels still keep tags
+	Memory_TrackerSetLevel(Memory_TrackingLevel_Sampled);
+	void *sampled = MEMORY_MALLOC_TAGGED(sound, 50);
+	Memory_TrackerSetLevel(Memory_TrackingLevel_Stats);
+	void *counted = MEMORY_MALLOC_TAGGED(sound, 50);
+	REQUIRE(Memory_GetTagStats(sound).liveBytes == 1000);
+	Memory_TrackerSetLevel(Memory_TrackingLevel_Off);
+	void *off = MEMORY_MALLOC_TAGGED(sound, 5000);
+	REQUIRE(off);
+	REQUIRE(Memory_GetTagStats(sound).liveBytes == 1000);
+	MEMORY_FREE(off);
+	Memory_TrackerSetLevel(Memory_TrackingLevel_Full);
+	MEMORY_FREE(sampled);
+	MEMORY_FREE(counted);
+	MEMORY_FREE(s0);
+	MEMORY_FREE(s2);
+	REQUIRE(Memory_GetTagStats(sound).liveBytes == 0);
+	REQUIRE(Memory_GetTagStats(sound).liveCount == 0);
+
+	Memory_TagSetBudget(sound, 0, 0);
+	Memory_SetBudgetFunc(NULL, NULL);
+}
@@ -0,0 +1,139 @@
+#include "al2o3_catch2/catch2.hpp"
+#include "al2o3_memory/objectpool.hpp"
+#include <thread>
+#include <vector>
+
+static int liveBlocks = 0;
+static void* countingMalloc(size_t size) { liveBlocks++; return Memory_GlobalAllocator.malloc(size); }
+static void* countingAalloc(size_t size, size_t align) { liveBlocks++; return Memory_GlobalAllocator.aalloc(size, align); }
+static void* countingCalloc(size_t count, size_t size) { liveBlocks++; return Memory_GlobalAllocator.calloc(count, size); }
+static void* countingRealloc(void* ptr, size_t size) { return Memory_GlobalAllocator.realloc(ptr, size); }
+static void countingFree(void* ptr) { if (ptr) { liveBlocks--; } Memory_GlobalAllocator.free(ptr); }
+static Memory_Allocator counting = { &countingMalloc, &countingAalloc, &countingCalloc, &countingRealloc, &countingFree };
+
+static int liveEntities = 0;
+struct Entity {
+	Entity(int id_, float x_) : id(id_), x(x_) { liveEntities++; }
+	~Entity() { liveEntities--; }
+	int id;
+	float x;
+};
+
+struct alignas(64) Aligned {
+	uint8_t data[100];
+};
+
+TEST_CASE("Object pool", "[al2o3 Memory]") {
+	{
+		Memory_ObjectPool<Entity> pool(64, &counting);
+		std::vector<Entity *> entities;
+		for (int i = 0; i < 1000; ++i) {
+			entities.push_back(pool.New(i, (float) i * 0.5f));
+			REQUIRE(entities.back());
+		}
+		REQUIRE(liveEntities == 1000);
+		REQUIRE(pool.LiveCount() == 1000);
+		// 1000 objects in chunks of 64
+		REQUIRE(liveBlocks == 16);
+		for (int i = 0; i < 1000; ++i) {
+			REQUIRE(entities[i]->id == i);
+			REQUIRE(pool.Owns(entities[i]));
+		}
+
+		// freed slots are reused before new chunks are made
+		for (int i = 0; i < 1000; i += 2) {
+			pool.Delete(entities[i]);
+		}
+		REQUIRE(liveEntities == 500);
+		for (int i = 0; i < 1000; i += 2) {
+			entities[i] = pool.New(i, 0.0f);
+		}
+		REQUIRE(liveBlocks == 16);
+
+		// frees from other threads are picked up when the free list is empty
+		std::thread([&] {
+			for (int i = 0; i < 1000; ++i) {
+				pool.DeleteFromAnyThread(entities[i]);
+			}
+		}).join();
+		REQUIRE(liveEntities == 0);
+		REQUIRE(pool.LiveCount() == 0);
+		for (int i = 0; i < 1000; ++i) {
+			entities[i] = pool.New(i, 0.0f);
+		}
+		REQUIRE(liveBlocks == 16);
+		for (Entity *entity : entities) {
+			pool.Delete(entity);
+		}
+
+		// a reset drops everything but keeps the chunks
+		for (int i = 0; i < 100; ++i) {
+			REQUIRE(pool.Allocate());
+		}
+		pool.Reset();
+		REQUIRE(pool.LiveCount() == 0);
+		for (int i = 0; i < 1000; ++i) {
+			REQUIRE(pool.Allocate());
+		}
+		REQUIRE(liveBlocks == 16);
+		pool.Release();
+		REQUIRE(liveBlocks == 0);
+		Entity *entity = pool.New(1, 1.0f);
+		REQUIRE(entity);
+		pool.Delete(entity);
+	}
+	REQUIRE(liveBlocks == 0);
+
+	Memory_ObjectPool<Aligned> alignedPool(10);
+	for (int i = 0; i < 25; ++i) {
+		Aligned *aligned = alignedPool.New();
+		REQUIRE((((uintptr_t) aligned) & 63) == 0);
+	}
+}
+
+static Memory_ObjectPool<Entity> g_entityPool;
+
+TEST_CASE("Object pool allocator", "[al2o3 Memory]") {
+	Memory_Allocator const *allocator = Memory_ObjectPoolAllocator<Entity, &g_entityPool>();
+	REQUIRE(allocator == Memory_ObjectPoolAllocator<Entity, &g_entityPool>());
+
+	void *a = MEMORY_ALLOCATOR_MALLOC(allocator, sizeof(Entity));
+	void *b = MEMORY_ALLOCATOR_CALLOC(allocator, 1, 4);
+	REQUIRE(a);
+	REQUIRE(b);
+	REQUIRE(*(uint32_t *) b == 0);
+	REQUIRE(g_entityPool.LiveCount() == 2);
+	REQUIRE(MEMORY_ALLOCATOR_USABLE_SIZE(allocator, a) >= sizeof(Entity));
+	REQUIRE(MEMORY_ALLOCATOR_REALLOC(allocator, a, 2) == a);
+	// too big for a slot
+	REQUIRE(MEMORY_ALLOCATOR_MALLOC(allocator, 1000) == NULL);
+	// even when count * size wraps to something small
+	REQUIRE(MEMORY_ALLOCATOR_CALLOC(allocator, 2, SIZE_MAX / 2 + 2) == NULL);
+	REQUIRE(g_entityPool.LiveCount() == 2);
+
+	void *batch[10];
+	REQUIRE(MEMORY_ALLOCATOR_MALLOC_BATCH(allocator, 10, sizeof(Entity), batch));
+	REQUIRE(g_entityPool.LiveCount() == 12);
+	MEMORY_ALLOCATOR_FREE_BATCH(allocator, 10, batch);
+
+	// and through the allocator stack
+	void *later;
+	{
+		Memory_AllocatorScope scope(allocator);
+		Entity *entity = MEMORY_NEW(Entity, 7, 1.0f);
+		REQUIRE(entity->id == 7);
+		REQUIRE(g_entityPool.Owns(entity));
+		MEMORY_DELETE(Entity, entity);
+		later = MEMORY_MALLOC(sizeof(Entity));
+	}
+	REQUIRE(liveEntities == 0);
+	// the block still goes back to the pool once it isn't current
+	REQUIRE(g_entityPool.LiveCount() == 3);
+	MEMORY_FREE(later);
+	REQUIRE(g_entityPool.LiveCount() == 2);
+
+	MEMORY_ALLOCATOR_FREE(allocator, a);
+	MEMORY_ALLOCATOR_FREE(allocator, b);
+	REQUIRE(g_entityPool.LiveCount() == 0);
+	g_entityPool.Release();
+}
@@ -0,0 +1,269 @@
+#include "al2o3_catch2/catch2.hpp"
+#include "al2o3_memory/memory.h"
+#include <string>
+#include <vector>
+
+static void appendToString(void *user, void const *data, size_t size) {
+	((std::string *) user)->append((char const *) data, size);
+}
+
+TEST_CASE("Callsite profile", "[al2o3 Memory]") {
+	unsigned int const line = __LINE__ + 3;
+	std::vector<void *> ptrs;
+	for (int i = 0; i < 10; ++i) {
+		ptrs.push_back(MEMORY_MALLOC(100));
+	}
+
+	size_t const count = Memory_TrackerGetCallsites(NULL, 0);
+	if (count == 0) {
+		// not a tracking build
+		REQUIRE(!Memory_TrackerWritePprof(&appendToString, NULL));
+		for (void *ptr : ptrs) {
+			MEMORY_FREE(ptr);
+		}
+		return;
+	}
+
+	std::vector<Memory_CallsiteStats> callsites(count);
+	REQUIRE(Memory_TrackerGetCallsites(callsites.data(), callsites.size()) == count);
+	Memory_CallsiteStats const *ours = NULL;
+	for (Memory_CallsiteStats const &callsite : callsites) {
+		if (callsite.sourceLine == line && strstr(callsite.sourceFile, "test_profile.cpp")) {
+			ours = &callsite;
+		}
+	}
+	REQUIRE(ours);
+	REQUIRE(ours->liveCount == 10);
+	REQUIRE(ours->liveBytes == 1000);
+	REQUIRE(ours->totalAllocs == 10);
+	std::string const funcName = ours->sourceFunc;
+
+	std::string collapsed;
+	REQUIRE(Memory_TrackerWriteCollapsed(&appendToString, &collapsed, Memory_ProfileMetric_LiveBytes));
+	REQUIRE(collapsed.find(funcName + " (") != std::string::npos);
+	REQUIRE(collapsed.find(":" + std::to_string(line) + ") 1000\n") != std::string::npos);
+
+	std::string pprof;
+	REQUIRE(Memory_TrackerWritePprof(&appendToString, &pprof));
+	REQUIRE(pprof.size() > 0);
+	REQUIRE(pprof.find("inuse_space") != std::string::npos);
+	REQUIRE(pprof.find(funcName) != std::string::npos);
+
+	for (void *ptr : ptrs) {
+		MEMORY_FREE(ptr);
+	}
+	REQUIRE(Memory_TrackerGetCallsites(callsites.data(), callsites.size()) >= count);
+	for (Memory_CallsiteStats const &callsite : callsites) {
+		if (callsite.sourceLine == line && strstr(callsite.sourceFile, "test_profile.cpp")) {
+			REQUIRE(callsite.liveCount == 0);
+			REQUIRE(callsite.totalFrees == 10);
+		}
+	}
+}
+
+static Memory_CallsiteStats findCallsite(unsigned int line) {
+	Memory_CallsiteStats result;
+	memset(&result, 0, sizeof(Memory_CallsiteStats));
+	std::vector<Memory_CallsiteStats> callsites(Memory_TrackerGetCallsites(NULL, 0));
+	Memory_TrackerGetCallsites(callsites.data(), callsites.size());
+	for (Memory_CallsiteStats const &callsite : callsites) {
+		if (callsite.sourceLine == line && strstr(callsite.sourceFile, "test_profile.cpp")) {
+			result = callsite;
+		}
+	}
+	return result;
+}
+
+TEST_CASE("Sampled callsite profile", "[al2o3 Memory]") {
+	if (Memory_TrackerGetSampleRate() == 0) {
+		// not a tracking build
+		return;
+	}
+	Memory_TrackerSetLevel(Memory_TrackingLevel_Sampled);
+	Memory_TrackerSetSampleRate(64 * 1024);
+
+	// ~400 samples, so the estimate should be well within 25%
+	size_t const count = 100000;
+	unsigned int const line = __LINE__ + 3;
+	std::vector<void *> ptrs;
+	for (size_t i = 0; i < count; ++i) {
+		ptrs.push_back(MEMORY_MALLOC(256));
+		REQUIRE(ptrs.back());
+	}
+	unsigned int const bigLine = __LINE__ + 1;
+	void *big = MEMORY_MALLOC(4 * 1024 * 1024);
+	REQUIRE(big);
+
+	Memory_CallsiteStats small = findCallsite(line);
+	REQUIRE(small.liveCount > count * 3 / 4);
+	REQUIRE(small.liveCount < count * 5 / 4);
+	REQUIRE(small.liveBytes == small.liveCount * 256);
+	// way over the sample rate so always tracked and stands for itself
+	Memory_CallsiteStats large = findCallsite(bigLine);
+	REQUIRE(large.liveCount == 1);
+	REQUIRE(large.liveBytes == 4 * 1024 * 1024);
+
+	// sampling changes don't affect allocations already made
+	Memory_TrackerSetLevel(Memory_TrackingLevel_Full);
+	Memory_TrackerSetSampleRate(0);
+	for (size_t i = 0; i < count; i += 2) {
+		ptrs[i] = MEMORY_REALLOC(ptrs[i], 128);
+		REQUIRE(ptrs[i]);
+	}
+	for (void *ptr : ptrs) {
+		MEMORY_FREE(ptr);
+	}
+	MEMORY_FREE(big);
+	REQUIRE(findCallsite(line).liveCount == 0);
+	REQUIRE(findCallsite(line).liveBytes == 0);
+	REQUIRE(findCallsite(bigLine).liveCount == 0);
+}
+
+static void *allocForStackTest() {
+	return MEMORY_MALLOC(48);
+}
+
+TEST_CASE("Callsite stacks", "[al2o3 Memory]") {
+	Memory_TrackerSetStackDepth(16);
+	// through a pointer so the two calls below keep distinct return addresses
+	void *(*volatile alloc)() = &allocForStackTest;
+	void *a = alloc();
+	void *b = alloc();
+	REQUIRE(a);
+	REQUIRE(b);
+	Memory_TrackerSetStackDepth(0);
+
+	std::vector<Memory_CallsiteStats> callsites(Memory_TrackerGetCallsites(NULL, 0));
+	Memory_TrackerGetCallsites(callsites.data(), callsites.size());
+	std::vector<uint32_t> stackIds;
+	for (Memory_CallsiteStats const &callsite : callsites) {
+		if (callsite.sourceFunc && strstr(callsite.sourceFunc, "allocForStackTest") && callsite.liveCount == 1) {
+			stackIds.push_back(callsite.stackId);
+		}
+	}
+
+	void *frames[Memory_TrackerMaxStackDepth];
+	if (!callsites.empty() && Memory_TrackerGetStack(stackIds.empty() ? 0 : stackIds[0], frames, 16) > 1) {
+		// the same line reached from two places is two callsites
+		REQUIRE(stackIds.size() == 2);
+		REQUIRE(stackIds[0] != stackIds[1]);
+		char symbol[256];
+		REQUIRE(Memory_TrackerSymbolizeFrame(frames[0], symbol, sizeof(symbol)) > 0);
+
+		std::string collapsed;
+		REQUIRE(Memory_TrackerWriteCollapsed(&appendToString, &collapsed, Memory_ProfileMetric_LiveCount));
+		size_t const pos = collapsed.find("allocForStackTest");
+		REQUIRE(pos != std::string::npos);
+		size_t const lineStart = collapsed.rfind('\n', pos);
+		REQUIRE(collapsed.substr(lineStart + 1, pos - lineStart - 1).find(';') != std::string::npos);
+
+		std::string pprof;
+		REQUIRE(Memory_TrackerWritePprof(&appendToString, &pprof));
+	}
+
+	MEMORY_FREE(a);
+	MEMORY_FREE(b);
+}
+
+TEST_CASE("Source location ids", "[al2o3 Memory]") {
+	if (Memory_TrackerGetLevel() != Memory_TrackingLevel_Full) {
+		// not a tracking build
+		return;
+	}
+	unsigned int const line = __LINE__ + 3;
+	void *ptrs[4];
+	for (int i = 0; i < 4; ++i) {
+		ptrs[i] = MEMORY_MALLOC(64);
+	}
+	unsigned int const otherLine = __LINE__ + 1;
+	void *other = MEMORY_MALLOC(64);
+	// a pushed file/line/func has no static loc so gets no id
+	unsigned int const pushedLine = __LINE__ + 1;
+	Memory_TrackerPushNextSrcLoc(__FILE__, pushedLine, __FUNCTION__);
+	void *pushed = Memory_GlobalAllocator.malloc(64);
+
+	Memory_CallsiteStats const ours = findCallsite(line);
+	REQUIRE(ours.liveCount == 4);
+	REQUIRE(ours.srcLocId != 0);
+	Memory_CallsiteStats const others = findCallsite(otherLine);
+	REQUIRE(others.liveCount == 1);
+	REQUIRE(others.srcLocId != 0);
+	REQUIRE(others.srcLocId != ours.srcLocId);
+	Memory_CallsiteStats const pushedStats = findCallsite(pushedLine);
+	REQUIRE(pushedStats.liveCount == 1);
+	REQUIRE(pushedStats.srcLocId == 0);
+
+	for (void *ptr : ptrs) {
+		MEMORY_FREE(ptr);
+	}
+	MEMORY_FREE(other);
+	MEMORY_FREE(pushed);
+	REQUIRE(findCallsite(line).liveCount == 0);
+}
+
+TEST_CASE("Heap snapshot and diff", "[al2o3 Memory]") {
+	Memory_HeapSnapshot *before = Memory_TrackerSnapshot();
+	if (before == NULL) {
+		// not a tracking build
+		REQUIRE(Memory_TrackerDiff(NULL, NULL, NULL, 0) == 0);
+		return;
+	}
+
+	unsigned int const leakLine = __LINE__ + 3;
+	std::vector<void *> leaks;
+	for (int i = 0; i < 20; ++i) {
+		leaks.push_back(MEMORY_MALLOC(64));
+	}
+	unsigned int const churnLine = __LINE__ + 2;
+	for (int i = 0; i < 20; ++i) {
+		MEMORY_FREE(MEMORY_MALLOC(32));
+	}
+
+	Memory_HeapSnapshot *after = Memory_TrackerSnapshot();
+	REQUIRE(after);
+	REQUIRE(after->timeNs >= before->timeNs);
+
+	std::vector<Memory_HeapDiffEntry> entries(Memory_TrackerDiff(before, after, NULL, 0));
+	REQUIRE(entries.size() >= 2);
+	REQUIRE(Memory_TrackerDiff(before, after, entries.data(), entries.size()) == entries.size());
+	Memory_HeapDiffEntry const *leak = NULL;
+	Memory_HeapDiffEntry const *churn = NULL;
+	for (Memory_HeapDiffEntry const &entry : entries) {
+		if (entry.callsite->sourceLine == leakLine && strstr(entry.callsite->sourceFile, "test_profile.cpp")) {
+			leak = &entry;
+		} else if (entry.callsite->sourceLine == churnLine && strstr(entry.callsite->sourceFile, "test_profile.cpp")) {
+			churn = &entry;
+		}
+	}
+	REQUIRE(leak);
+	REQUIRE(leak->liveBytes == 64 * 20);
+	REQUIRE(leak->liveCount == 20);
+	REQUIRE(leak->allocs == 20);
+	REQUIRE(churn);
+	REQUIRE(churn->liveBytes == 0);
+	REQUIRE(churn->allocs == 20);
+	REQUIRE(churn->frees == 20);
+	// growth first
+	REQUIRE(entries[0].liveBytes >= leak->liveBytes);
+
+	for (void *ptr : leaks) {
+		MEMORY_FREE(ptr);
+	}
+	Memory_HeapSnapshot *freed = Memory_TrackerSnapshot();
+	REQUIRE(freed);
+	entries.resize(Memory_TrackerDiff(after, freed, NULL, 0));
+	Memory_TrackerDiff(after, freed, entries.data(), entries.size());
+	bool foundFree = false;
+	for (Memory_HeapDiffEntry const &entry : entries) {
+		if (entry.callsite->sourceLine == leakLine && strstr(entry.callsite->sourceFile, "test_profile.cpp")) {
+			REQUIRE(entry.liveCount == -20);
+			REQUIRE(entry.frees == 20);
+			foundFree = true;
+		}
+	}
+	REQUIRE(foundFree);
+
+	Memory_TrackerFreeSnapshot(freed);
+	Memory_TrackerFreeSnapshot(after);
+	Memory_TrackerFreeSnapshot(before);
+}
@@ -0,0 +1,140 @@
+#include "al2o3_catch2/catch2.hpp"
+#include "al2o3_memory/memory.h"
+#include <thread>
+#include <vector>
+
+TEST_CASE("Small object basic", "[al2o3 Memory]") {
+	for (size_t size = 1; size <= 4096; size += 7) {
+		void *m = MEMORY_SMALL_MALLOC(size);
+		REQUIRE(m);
+		REQUIRE((((uintptr_t) m) & 0xF) == 0);
+		memset(m, 0xAB, size);
+		MEMORY_SMALL_FREE(m);
+	}
+
+	void *c = MEMORY_SMALL_CALLOC(10, 10);
+	REQUIRE(c);
+	for (int i = 0; i < 10 * 10; ++i) {
+		REQUIRE(((uint8_t *) c)[i] == 0);
+	}
+	MEMORY_SMALL_FREE(c);
+	// a count * size that wraps must not get a small block
+	REQUIRE(MEMORY_SMALL_CALLOC(SIZE_MAX / 8 + 2, 8) == NULL);
+
+	void *a = MEMORY_SMALL_AALLOC(100, 256);
+	REQUIRE(a);
+	REQUIRE((((uintptr_t) a) & 0xFF) == 0);
+	MEMORY_SMALL_FREE(a);
+}
+
+TEST_CASE("Small object realloc", "[al2o3 Memory]") {
+	uint8_t tst[100];
+	for (int i = 0; i < 100; ++i) {
+		tst[i] = (uint8_t) i;
+	}
+
+	void *m = MEMORY_SMALL_MALLOC(100);
+	memcpy(m, tst, 100);
+	// crosses from a size class to the platform and back
+	m = MEMORY_SMALL_REALLOC(m, 10000);
+	REQUIRE(m);
+	REQUIRE(memcmp(m, tst, 100) == 0);
+	m = MEMORY_SMALL_REALLOC(m, 20);
+	REQUIRE(m);
+	REQUIRE(memcmp(m, tst, 20) == 0);
+	m = MEMORY_SMALL_REALLOC(m, 1000);
+	REQUIRE(m);
+	REQUIRE(memcmp(m, tst, 20) == 0);
+	MEMORY_SMALL_FREE(m);
+}
+
+TEST_CASE("Small object reuse", "[al2o3 Memory]") {
+	std::vector<void *> ptrs;
+	for (int i = 0; i < 100000; ++i) {
+		ptrs.push_back(MEMORY_SMALL_MALLOC(16 + (i % 64) * 16));
+		REQUIRE(ptrs.back());
+		*(int *) ptrs.back() = i;
+	}
+	for (int i = 0; i < 100000; ++i) {
+		REQUIRE(*(int *) ptrs[i] == i);
+	}
+	for (size_t i = 0; i < ptrs.size(); i += 2) {
+		MEMORY_SMALL_FREE(ptrs[i]);
+	}
+	for (size_t i = 1; i < ptrs.size(); i += 2) {
+		MEMORY_SMALL_FREE(ptrs[i]);
+	}
+}
+
+TEST_CASE("Small object cross thread free", "[al2o3 Memory]") {
+	unsigned int const count = 50000;
+	std::vector<void *> ptrs(count);
+
+	// allocate on one thread, free on another whilst the first keeps allocating
+	std::thread producer([&] {
+		for (unsigned int i = 0; i < count; ++i) {
+			ptrs[i] = MEMORY_SMALL_MALLOC(32 + (i % 8) * 16);
+			*(unsigned int *) ptrs[i] = i;
+		}
+	});
+	producer.join();
+
+	std::thread consumer([&] {
+		for (unsigned int i = 0; i < count; ++i) {
+			REQUIRE(*(unsigned int *) ptrs[i] == i);
+			MEMORY_SMALL_FREE(ptrs[i]);
+		}
+	});
+	std::thread churn([&] {
+		for (unsigned int i = 0; i < count; ++i) {
+			void *m = MEMORY_SMALL_MALLOC(32 + (i % 8) * 16);
+			MEMORY_SMALL_FREE(m);
+		}
+	});
+	consumer.join();
+	churn.join();
+
+	// a new thread adopts a parked heap and sees the remote frees
+	std::thread adopter([&] {
+		for (unsigned int i = 0; i < count; ++i) {
+			ptrs[i] = MEMORY_SMALL_MALLOC(32 + (i % 8) * 16);
+			REQUIRE(ptrs[i]);
+		}
+		for (unsigned int i = 0; i < count; ++i) {
+			MEMORY_SMALL_FREE(ptrs[i]);
+		}
+	});
+	adopter.join();
+}
+
+TEST_CASE("Small object batch", "[al2o3 Memory]") {
+	size_t const count = 5000;
+	std::vector<void *> ptrs(count);
+
+	for (size_t size : { (size_t) 16, (size_t) 100, (size_t) 2048, (size_t) 4096 }) {
+		REQUIRE(MEMORY_SMALL_MALLOC_BATCH(count, size, ptrs.data()));
+		for (size_t i = 0; i < count; ++i) {
+			REQUIRE(ptrs[i]);
+			REQUIRE(Memory_AllocatorUsableSize(&Memory_SmallObjectAllocator, ptrs[i]) >= size);
+			*(size_t *) ptrs[i] = i;
+		}
+		// every block is distinct
+		for (size_t i = 0; i < count; ++i) {
+			REQUIRE(*(size_t *) ptrs[i] == i);
+		}
+		// some freed first so the next batch takes free list blocks as well as fresh ones
+		for (size_t i = 0; i < count; i += 2) {
+			MEMORY_SMALL_FREE(ptrs[i]);
+			ptrs[i] = NULL;
+		}
+		MEMORY_SMALL_FREE_BATCH(count, ptrs.data());
+	}
+
+	// a batch freed on another thread
+	REQUIRE(MEMORY_SMALL_MALLOC_BATCH(count, 64, ptrs.data()));
+	std::thread([&] {
+		MEMORY_SMALL_FREE_BATCH(count, ptrs.data());
+	}).join();
+	REQUIRE(MEMORY_SMALL_MALLOC_BATCH(count, 64, ptrs.data()));
+	MEMORY_SMALL_FREE_BATCH(count, ptrs.data());
+}
@@ -0,0 +1,139 @@
+#include "al2o3_catch2/catch2.hpp"
+#include "al2o3_memory/stdallocator.hpp"
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+static int liveBlocks = 0;
+// what the counting allocator has handed out, so it can be pushed
+static std::mutex countingMutex;
+static std::set<void*> countingBlocks;
+static void* counted(void* ptr, void* old = nullptr) {
+	std::lock_guard<std::mutex> lock(countingMutex);
+	if (ptr) {
+		countingBlocks.erase(old);
+		countingBlocks.insert(ptr);
+	}
+	return ptr;
+}
+static void* countingMalloc(size_t size) { liveBlocks++; return counted(Memory_GlobalAllocator.malloc(size)); }
+static void* countingAalloc(size_t size, size_t align) { liveBlocks++; return counted(Memory_GlobalAllocator.aalloc(size, align)); }
+static void* countingCalloc(size_t count, size_t size) { liveBlocks++; return counted(Memory_GlobalAllocator.calloc(count, size)); }
+static void* countingRealloc(void* ptr, size_t size) { return counted(Memory_GlobalAllocator.realloc(ptr, size), ptr); }
+static void countingFree(void* ptr) {
+	if (ptr) {
+		liveBlocks--;
+		std::lock_guard<std::mutex> lock(countingMutex);
+		countingBlocks.erase(ptr);
+	}
+	Memory_GlobalAllocator.free(ptr);
+}
+static bool countingOwns(void const* ptr) {
+	std::lock_guard<std::mutex> lock(countingMutex);
+	return countingBlocks.count(const_cast<void*>(ptr)) != 0;
+}
+static Memory_Allocator counting = { &countingMalloc, &countingAalloc, &countingCalloc, &countingRealloc, &countingFree,
+																		 NULL, NULL, NULL, NULL, NULL, NULL, &countingOwns };
+
+struct alignas(64) Aligned {
+	uint8_t data[64];
+};
+
+TEST_CASE("Std allocator", "[al2o3 Memory]") {
+	typedef std::vector<int, Memory_StdAllocator<int>> Vector;
+	{
+		Vector v{Memory_StdAllocator<int>(&counting)};
+		for (int i = 0; i < 1000; ++i) {
+			v.push_back(i);
+		}
+		REQUIRE(liveBlocks == 1);
+
+		// the allocator goes with the contents
+		Vector moved(std::move(v));
+		REQUIRE(moved.get_allocator().allocator == &counting);
+		REQUIRE(moved[999] == 999);
+		Vector copy(moved);
+		REQUIRE(copy.get_allocator() == moved.get_allocator());
+		REQUIRE(liveBlocks == 2);
+	}
+	REQUIRE(liveBlocks == 0);
+
+	// default constructed takes the current allocator and keeps it
+	{
+		typedef std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, Memory_StdAllocator<std::pair<int const, int>>> Map;
+		Memory_PushAllocator(&counting);
+		Map map;
+		Memory_PopAllocator();
+		for (int i = 0; i < 100; ++i) {
+			map[i] = i * 2;
+		}
+		REQUIRE(liveBlocks > 100);
+		REQUIRE(map[50] == 100);
+	}
+	REQUIRE(liveBlocks == 0);
+
+	{
+		std::vector<Aligned, Memory_StdAllocator<Aligned>> aligned{Memory_StdAllocator<Aligned>(&counting)};
+		aligned.resize(10);
+		REQUIRE((((uintptr_t) aligned.data()) & 63) == 0);
+	}
+	REQUIRE(liveBlocks == 0);
+}
+
+#if MEMORY_STD_PMR == 1
+TEST_CASE("Pmr resources", "[al2o3 Memory]") {
+	{
+		Memory_Resource resource(&counting);
+		std::pmr::vector<int> v(&resource);
+		v.resize(100);
+		REQUIRE(liveBlocks == 1);
+		void* aligned = resource.allocate(256, 128);
+		REQUIRE((((uintptr_t) aligned) & 127) == 0);
+		resource.deallocate(aligned, 256, 128);
+	}
+	REQUIRE(liveBlocks == 0);
+
+	{
+		Memory_MonotonicResource arena(4096, &counting);
+		std::pmr::vector<std::pmr::string> strings(&arena);
+		for (int i = 0; i < 1000; ++i) {
+			strings.emplace_back("a string long enough to need its own allocation");
+		}
+		REQUIRE(strings[999] == "a string long enough to need its own allocation");
+		// grows geometrically, so far fewer blocks than allocations
+		REQUIRE(liveBlocks > 0);
+		REQUIRE(liveBlocks < 20);
+		strings.clear();
+		strings.shrink_to_fit();
+		arena.release();
+		REQUIRE(liveBlocks == 0);
+	}
+
+	{
+		Memory_PoolResource pool(std::pmr::pool_options(), &counting);
+		std::pmr::unordered_map<int, int> map(&pool);
+		for (int i = 0; i < 1000; ++i) {
+			map[i] = i;
+		}
+		int const blocks = liveBlocks;
+		REQUIRE(blocks > 0);
+		map.clear();
+		for (int i = 0; i < 1000; ++i) {
+			map[i] = i;
+		}
+		// nodes are reused from the pool
+		REQUIRE(liveBlocks <= blocks + 1);
+	}
+	REQUIRE(liveBlocks == 0);
+
+	{
+		Memory_SharedPoolResource shared(std::pmr::pool_options(), &counting);
+		void* mem = shared.allocate(48);
+		REQUIRE(mem);
+		shared.deallocate(mem, 48);
+	}
+	REQUIRE(liveBlocks == 0);
+}
+#endif
@@ -0,0 +1,135 @@
+#include "al2o3_catch2/catch2.hpp"
+#include "al2o3_memory/memory.h"
+#include <thread>
+
+TEST_CASE("Temp basic", "[al2o3 Memory]") {
+	void* t0 = MEMORY_TEMP_MALLOC(10);
+	REQUIRE(t0);
+	REQUIRE((((uintptr_t)t0) & 0xF) == 0);
+
+	void* t1 = MEMORY_TEMP_CALLOC(10, 10);
+	REQUIRE(t1);
+	for(int i =0;i < 10 * 10;++i) {
+		REQUIRE( ((uint8_t*)t1)[i] == 0);
+	}
+	// a count * size that wraps must not bump a small block
+	REQUIRE(MEMORY_TEMP_CALLOC(SIZE_MAX / 8 + 2, 8) == NULL);
+
+	void* at0 = MEMORY_TEMP_AALLOC(10, 256);
+	REQUIRE(at0);
+	REQUIRE((((uintptr_t)at0) & 0xFF) == 0);
+
+	MEMORY_TEMP_FREE(at0);
+	MEMORY_TEMP_FREE(t1);
+	MEMORY_TEMP_FREE(t0);
+}
+
+TEST_CASE("Temp realloc", "[al2o3 Memory]") {
+	uint8_t const tst[10] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+
+	// last allocation grows in place
+	void* t0 = MEMORY_TEMP_MALLOC(10);
+	memcpy(t0, tst, 10);
+	void* t1 = MEMORY_TEMP_REALLOC(t0, 100);
+	REQUIRE(t1 == t0);
+	REQUIRE(memcmp(tst, t1, 10) == 0);
+
+	// not the last allocation so has to copy
+	void* t2 = MEMORY_TEMP_MALLOC(10);
+	REQUIRE(t2);
+	void* t3 = MEMORY_TEMP_REALLOC(t1, 200);
+	REQUIRE(t3 != t1);
+	REQUIRE(memcmp(tst, t3, 10) == 0);
+
+	// bigger than a block
+	void* t4 = MEMORY_TEMP_REALLOC(t3, 1024 * 1024);
+	REQUIRE(t4);
+	REQUIRE(memcmp(tst, t4, 10) == 0);
+
+	MEMORY_TEMP_FREE(t2);
+	MEMORY_TEMP_FREE(t4);
+}
+
+TEST_CASE("Temp mark and rewind", "[al2o3 Memory]") {
+	void* outer = MEMORY_TEMP_MALLOC(16);
+	{
+		Memory_TempScope scope;
+		void* a = MEMORY_TEMP_MALLOC(32);
+		REQUIRE(a);
+		// spill into several new blocks
+		for(int i = 0; i < 16; ++i) {
+			REQUIRE(MEMORY_TEMP_MALLOC(64 * 1024));
+		}
+	}
+	void* after = MEMORY_TEMP_MALLOC(32);
+	REQUIRE(after);
+	REQUIRE((uint8_t*)after > (uint8_t*)outer);
+	REQUIRE((uint8_t*)after < (uint8_t*)outer + 1024);
+
+	MEMORY_TEMP_FREE(after);
+	MEMORY_TEMP_FREE(outer);
+
+	// free of the last allocation pops, so the next one reuses the space
+	void* p0 = MEMORY_TEMP_MALLOC(48);
+	MEMORY_TEMP_FREE(p0);
+	void* p1 = MEMORY_TEMP_MALLOC(48);
+	REQUIRE(p0 == p1);
+	MEMORY_TEMP_FREE(p1);
+}
+
+TEST_CASE("Temp rewind after freeing older allocations", "[al2o3 Memory]") {
+	void* first = MEMORY_TEMP_MALLOC(64);
+	void* older = MEMORY_TEMP_MALLOC(64);
+	Memory_Stats const before = Memory_GetStats();
+	{
+		Memory_TempScope scope;
+		MEMORY_TEMP_FREE(older);
+		REQUIRE(MEMORY_TEMP_MALLOC(100));
+		{
+			Memory_TempScope inner;
+			REQUIRE(MEMORY_TEMP_MALLOC(300));
+		}
+		REQUIRE(MEMORY_TEMP_MALLOC(200));
+	}
+#if MEMORY_STATS == 1
+	// only the scopes own allocations were released
+	Memory_Stats const after = Memory_GetStats();
+	REQUIRE(after.temp.liveCount == before.temp.liveCount - 1);
+	REQUIRE(after.temp.liveBytes == before.temp.liveBytes - 64);
+#endif
+
+	// nothing is live, so the arena starts again from the top
+	MEMORY_TEMP_FREE(first);
+	void* again = MEMORY_TEMP_MALLOC(64);
+	REQUIRE(again == first);
+
+	// an older allocation freed in a nested scope belongs to the outer one
+	{
+		Memory_TempScope outer;
+		void* a = MEMORY_TEMP_MALLOC(32);
+		{
+			Memory_TempScope inner;
+			MEMORY_TEMP_FREE(a);
+			MEMORY_TEMP_FREE(again);
+			REQUIRE(MEMORY_TEMP_MALLOC(48));
+		}
+	}
+	void* last = MEMORY_TEMP_MALLOC(64);
+	REQUIRE(last == first);
+	MEMORY_TEMP_FREE(last);
+}
+
+TEST_CASE("Temp arena released at thread exit", "[al2o3 Memory]") {
+	Memory_Stats const before = Memory_GetStats();
+	std::thread thread([] {
+		// never freed, the arena goes when the thread does
+		void* leaked = MEMORY_TEMP_MALLOC(1000);
+		(void) leaked;
+	});
+	thread.join();
+#if MEMORY_STATS == 1
+	Memory_Stats const after = Memory_GetStats();
+	REQUIRE(after.temp.liveCount == before.temp.liveCount);
+	REQUIRE(after.temp.liveBytes == before.temp.liveBytes);
+#endif
+}
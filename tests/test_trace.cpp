@@ -0,0 +1,139 @@
+#include "al2o3_catch2/catch2.hpp"
+#include "al2o3_memory/memory.h"
+#include <cstdio>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+static uint64_t readVarint(std::vector<uint8_t> const &data, size_t &pos) {
+	uint64_t value = 0;
+	for (uint32_t shift = 0; pos < data.size(); shift += 7) {
+		uint8_t const byte = data[pos++];
+		value |= (uint64_t) (byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0) {
+			break;
+		}
+	}
+	return value;
+}
+
+static std::vector<uint8_t> readTrace(char const *path) {
+	std::vector<uint8_t> data;
+	FILE *file = fopen(path, "rb");
+	REQUIRE(file);
+	uint8_t buffer[4096];
+	size_t got;
+	while ((got = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+		data.insert(data.end(), buffer, buffer + got);
+	}
+	fclose(file);
+	remove(path);
+	return data;
+}
+
+// counts each record type and collects the thread indices
+static void parseTrace(std::vector<uint8_t> const &data, uint32_t counts[18], std::set<uint64_t> &threads) {
+	REQUIRE(data.size() > 9);
+	REQUIRE(std::string((char const *) data.data(), 8) == "AL2OMTRC");
+	size_t pos = 8;
+	REQUIRE(readVarint(data, pos) == 1);
+
+	bool ended = false;
+	while (pos < data.size() && !ended) {
+		uint8_t const type = data[pos++];
+		REQUIRE(type < 18);
+		counts[type]++;
+		switch (type) {
+			case 0: ended = true;
+				break;
+			case 16: readVarint(data, pos);
+				readVarint(data, pos);
+				pos += readVarint(data, pos);
+				pos += readVarint(data, pos);
+				break;
+			case 17: threads.insert(readVarint(data, pos));
+				break;
+			case 1:
+			case 3: readVarint(data, pos);
+				readVarint(data, pos);
+				readVarint(data, pos);
+				readVarint(data, pos);
+				break;
+			case 2: for (int i = 0; i < 5; ++i) {
+					readVarint(data, pos);
+				}
+				break;
+			case 4: for (int i = 0; i < 6; ++i) {
+					readVarint(data, pos);
+				}
+				break;
+			case 5: readVarint(data, pos);
+				readVarint(data, pos);
+				readVarint(data, pos);
+				break;
+			case 6: readVarint(data, pos);
+				readVarint(data, pos);
+				break;
+			default: FAIL("unknown record type");
+		}
+	}
+	REQUIRE(ended);
+	REQUIRE(pos == data.size());
+}
+
+TEST_CASE("Allocation trace", "[al2o3 Memory]") {
+	char const *path = "al2o3_memory_test.trace";
+	REQUIRE(!Memory_TraceIsRecording());
+	REQUIRE(Memory_TraceStart(path));
+	REQUIRE(Memory_TraceIsRecording());
+	REQUIRE(!Memory_TraceStart(path));
+
+	void *a = MEMORY_MALLOC(100);
+	void *b = MEMORY_AALLOC(100, 64);
+	void *c = MEMORY_CALLOC(10, 10);
+	a = MEMORY_REALLOC(a, 200);
+	MEMORY_FREE(a);
+	MEMORY_FREE(b);
+	MEMORY_FREE(c);
+	MEMORY_FREE(NULL);
+
+	REQUIRE(Memory_TraceStop());
+	REQUIRE(!Memory_TraceIsRecording());
+	REQUIRE(!Memory_TraceStop());
+
+	// not recording any more
+	MEMORY_FREE(MEMORY_MALLOC(100));
+
+	uint32_t counts[18] = {};
+	std::set<uint64_t> threads;
+	parseTrace(readTrace(path), counts, threads);
+	REQUIRE(counts[17] >= 1);
+	// other threads may have allocated too
+	REQUIRE(counts[1] >= 1);
+	REQUIRE(counts[2] >= 1);
+	REQUIRE(counts[3] >= 1);
+	REQUIRE(counts[4] >= 1);
+	REQUIRE(counts[6] >= 3);
+}
+
+TEST_CASE("Allocation trace thread churn", "[al2o3 Memory]") {
+	char const *path = "al2o3_memory_churn_test.trace";
+	REQUIRE(Memory_TraceStart(path));
+	// each thread gives its ring up when it exits, later threads reuse it
+	for (int i = 0; i < 16; ++i) {
+		std::thread thread([] {
+			MEMORY_FREE(MEMORY_MALLOC(32));
+		});
+		thread.join();
+	}
+	REQUIRE(Memory_TraceStop());
+
+	uint32_t counts[18] = {};
+	std::set<uint64_t> threads;
+	parseTrace(readTrace(path), counts, threads);
+	// but still shows up as its own thread
+	REQUIRE(threads.size() >= 16);
+	REQUIRE(counts[1] >= 16);
+	REQUIRE(counts[6] >= 16);
+}
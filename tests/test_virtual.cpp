@@ -0,0 +1,67 @@
+#include "al2o3_catch2/catch2.hpp"
+#include "al2o3_memory/memory.h"
+
+TEST_CASE("Virtual reserve and commit", "[al2o3 Memory]") {
+	size_t const page = Memory_VirtualPageSize();
+	REQUIRE(page > 0);
+	REQUIRE((page & (page - 1)) == 0);
+
+	size_t const size = page * 64;
+	uint8_t* mem = (uint8_t*) Memory_VirtualReserve(size);
+	REQUIRE(mem);
+	REQUIRE((((uintptr_t) mem) & (page - 1)) == 0);
+
+	REQUIRE(Memory_VirtualCommit(mem + page * 4, page * 2));
+	for (size_t i = 0; i < page * 2; ++i) {
+		REQUIRE(mem[page * 4 + i] == 0);
+	}
+	memset(mem + page * 4, 0xAB, page * 2);
+
+	// decommitted pages come back zeroed when committed again
+	Memory_VirtualDecommit(mem + page * 4, page * 2);
+	REQUIRE(Memory_VirtualCommit(mem + page * 4, page * 2));
+	REQUIRE(mem[page * 4] == 0);
+	REQUIRE(mem[page * 6 - 1] == 0);
+
+	Memory_VirtualRelease(mem, size);
+}
+
+TEST_CASE("Virtual buffer", "[al2o3 Memory]") {
+	Memory_VirtualBuffer buffer;
+	REQUIRE(Memory_VirtualBufferInit(&buffer, 64 * 1024 * 1024));
+	uint8_t* const base = buffer.base;
+	REQUIRE(base);
+	REQUIRE(buffer.size == 0);
+
+	uint32_t* first = (uint32_t*) Memory_VirtualBufferPush(&buffer, sizeof(uint32_t));
+	REQUIRE(first == (uint32_t*) base);
+	*first = 0x12345678;
+
+	// grow a lot, nothing moves
+	for (uint32_t i = 1; i < 1024 * 1024; ++i) {
+		uint32_t* value = (uint32_t*) Memory_VirtualBufferPush(&buffer, sizeof(uint32_t));
+		REQUIRE(value == first + i);
+		*value = i;
+	}
+	REQUIRE(buffer.base == base);
+	REQUIRE(buffer.size == 1024 * 1024 * sizeof(uint32_t));
+	REQUIRE(buffer.committed >= buffer.size);
+	REQUIRE(*first == 0x12345678);
+	REQUIRE(first[1024 * 1024 - 1] == 1024 * 1024 - 1);
+
+	// can't go past the reservation
+	REQUIRE(!Memory_VirtualBufferResize(&buffer, buffer.reserved + 1));
+	REQUIRE(Memory_VirtualBufferPush(&buffer, buffer.reserved) == NULL);
+
+	REQUIRE(Memory_VirtualBufferResize(&buffer, 16));
+	Memory_VirtualBufferShrinkToFit(&buffer);
+	REQUIRE(buffer.committed == Memory_VirtualPageSize());
+	REQUIRE(*first == 0x12345678);
+
+	REQUIRE(Memory_VirtualBufferResize(&buffer, 8 * 1024 * 1024));
+	REQUIRE(buffer.base == base);
+	REQUIRE(first[1024 * 1024 - 1] == 0);
+
+	Memory_VirtualBufferDestroy(&buffer);
+	REQUIRE(buffer.base == NULL);
+}
@@ -0,0 +1,451 @@
+// License Summary: MIT see LICENSE file
+#include "al2o3_platform/platform.h"
+#include "al2o3_memory/memory.h"
+
+// Microbenchmarks for malloc, calloc, aalloc and realloc (each paired with
+// free) over size ranges from a few bytes to many MB, thread counts from 1 to
+// every core and, in a tracking build, each tracking level. Every thread fills
+// a working set of blocks then frees them in a shuffled order, each call is
+// timed on its own. Results are written as JSON so runs can be compared.
+//
+// usage: al2o3_memory_bench [--allocator global|platform|small]
+//                           [--max-threads n] [--quick] [--out file]
+
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+#include <windows.h>
+typedef HANDLE BenchThread;
+#else
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+typedef pthread_t BenchThread;
+#endif
+
+// the most a run holds live across all its threads
+#define benchWorkingSetBudget (256u * 1024u * 1024u)
+#define benchMaxSlots 1024u
+// ops per thread each run aims for
+#define benchTargetOps (128u * 1024u)
+#define benchQuickTargetOps (16u * 1024u)
+#define benchAlign 64u
+
+typedef enum BenchOp {
+	BENCH_MALLOC,
+	BENCH_CALLOC,
+	BENCH_AALLOC,
+	BENCH_REALLOC,
+	BENCH_OP_COUNT
+} BenchOp;
+
+static char const *const g_opNames[BENCH_OP_COUNT] = { "malloc", "calloc", "aalloc", "realloc" };
+
+typedef struct BenchSizes {
+	char const *name;
+	size_t minSize;
+	size_t maxSize;
+} BenchSizes;
+
+static BenchSizes const g_sizes[] = {
+		{ "tiny", 8, 64 },
+		{ "small", 64, 1024 },
+		{ "medium", 1024, 64 * 1024 },
+		{ "large", 64 * 1024, 1024 * 1024 },
+		{ "huge", 1024 * 1024, 16 * 1024 * 1024 },
+};
+#define benchSizesCount (sizeof(g_sizes) / sizeof(g_sizes[0]))
+
+static char const *const g_levelNames[] = { "off", "stats", "sampled", "full" };
+
+typedef struct BenchRun {
+	Memory_Allocator const *allocator;
+	BenchOp op;
+	BenchSizes const *sizes;
+	uint32_t slots;
+	uint32_t rounds;
+	uint64_t overhead;
+} BenchRun;
+
+typedef struct BenchThreadData {
+	BenchRun const *run;
+	uint32_t seed;
+	uint32_t *allocNs; // slots * rounds of each
+	uint32_t *freeNs;
+	uint64_t count;
+	uint64_t startNs;
+	uint64_t endNs;
+	bool failed;
+} BenchThreadData;
+
+// one side (the allocs or the frees) of a run
+typedef struct BenchResult {
+	uint64_t ops;
+	double opsPerSec;
+	double meanNs;
+	uint32_t p50, p90, p99, p999, max;
+} BenchResult;
+
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+static uint64_t nowNs() {
+	static LARGE_INTEGER frequency;
+	if (frequency.QuadPart == 0) {
+		QueryPerformanceFrequency(&frequency);
+	}
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (uint64_t) ((double) counter.QuadPart * 1e9 / (double) frequency.QuadPart);
+}
+
+static uint32_t coreCount() {
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (uint32_t) info.dwNumberOfProcessors;
+}
+#else
+static uint64_t nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static uint32_t coreCount() {
+	long const count = sysconf(_SC_NPROCESSORS_ONLN);
+	return (count > 0) ? (uint32_t) count : 1;
+}
+#endif
+
+// the cheapest back to back reading, taken off every sample
+static uint64_t timerOverhead() {
+	uint64_t best = ~0ull;
+	for (int i = 0; i < 1000; ++i) {
+		uint64_t const start = nowNs();
+		uint64_t const elapsed = nowNs() - start;
+		best = (elapsed < best) ? elapsed : best;
+	}
+	return best;
+}
+
+AL2O3_FORCE_INLINE uint32_t nextRandom(uint32_t *state) {
+	// xorshift32, plenty for picking sizes
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+// each power of 2 in the range gets about the same number of blocks, as real
+// programs have many more small blocks than big ones
+static size_t randomSize(uint32_t *state, BenchSizes const *sizes) {
+	uint32_t octaves = 0;
+	while ((sizes->minSize << octaves) < sizes->maxSize) {
+		octaves++;
+	}
+	size_t const low = sizes->minSize << (nextRandom(state) % octaves);
+	return low + (nextRandom(state) % low);
+}
+
+AL2O3_FORCE_INLINE uint32_t elapsedNs(BenchRun const *run, uint64_t start, uint64_t end) {
+	uint64_t elapsed = end - start;
+	elapsed = (elapsed > run->overhead) ? elapsed - run->overhead : 0;
+	return (elapsed > 0xFFFFFFFFull) ? 0xFFFFFFFFu : (uint32_t) elapsed;
+}
+
+static void benchWork(BenchThreadData *data) {
+	BenchRun const *run = data->run;
+	Memory_Allocator const *allocator = run->allocator;
+	uint32_t const slots = run->slots;
+	void **ptrs = (void **) Memory_PlatformAllocator.calloc(slots, sizeof(void *));
+	size_t *sizes = (size_t *) Memory_PlatformAllocator.calloc(slots, sizeof(size_t));
+	uint32_t *order = (uint32_t *) Memory_PlatformAllocator.calloc(slots, sizeof(uint32_t));
+	if (ptrs == NULL || sizes == NULL || order == NULL) {
+		data->failed = true;
+		Memory_PlatformAllocator.free(ptrs);
+		Memory_PlatformAllocator.free(sizes);
+		Memory_PlatformAllocator.free(order);
+		return;
+	}
+	uint32_t state = data->seed;
+
+	data->startNs = nowNs();
+	for (uint32_t round = 0; round < run->rounds; ++round) {
+		for (uint32_t i = 0; i < slots; ++i) {
+			sizes[i] = randomSize(&state, run->sizes);
+			order[i] = i;
+		}
+		// free in a different order to the allocs, as real code does
+		for (uint32_t i = slots - 1; i > 0; --i) {
+			uint32_t const j = nextRandom(&state) % (i + 1);
+			uint32_t const swap = order[i];
+			order[i] = order[j];
+			order[j] = swap;
+		}
+
+		for (uint32_t i = 0; i < slots; ++i) {
+			void *ptr;
+			uint64_t start, end;
+			switch (run->op) {
+				case BENCH_CALLOC: start = nowNs();
+					ptr = MEMORY_ALLOCATOR_CALLOC(allocator, 1, sizes[i]);
+					end = nowNs();
+					break;
+				case BENCH_AALLOC: start = nowNs();
+					ptr = MEMORY_ALLOCATOR_AALLOC(allocator, sizes[i], benchAlign);
+					end = nowNs();
+					break;
+				case BENCH_REALLOC:
+					// from half size, so about half the reallocs can grow in place
+					ptr = MEMORY_ALLOCATOR_MALLOC(allocator, sizes[i] / 2);
+					start = nowNs();
+					ptr = ptr ? MEMORY_ALLOCATOR_REALLOC(allocator, ptr, sizes[i]) : NULL;
+					end = nowNs();
+					break;
+				default: start = nowNs();
+					ptr = MEMORY_ALLOCATOR_MALLOC(allocator, sizes[i]);
+					end = nowNs();
+					break;
+			}
+			if (ptr == NULL) {
+				data->failed = true;
+			} else {
+				// just the first byte, page faults aren't the allocators cost
+				*(uint8_t volatile *) ptr = (uint8_t) i;
+			}
+			ptrs[i] = ptr;
+			data->allocNs[data->count + i] = elapsedNs(run, start, end);
+		}
+		for (uint32_t i = 0; i < slots; ++i) {
+			uint32_t const slot = order[i];
+			uint64_t const start = nowNs();
+			MEMORY_ALLOCATOR_FREE(allocator, ptrs[slot]);
+			uint64_t const end = nowNs();
+			data->freeNs[data->count + i] = elapsedNs(run, start, end);
+		}
+		data->count += slots;
+	}
+	data->endNs = nowNs();
+
+	Memory_PlatformAllocator.free(ptrs);
+	Memory_PlatformAllocator.free(sizes);
+	Memory_PlatformAllocator.free(order);
+}
+
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+static DWORD WINAPI benchThread(LPVOID param) {
+	benchWork((BenchThreadData *) param);
+	return 0;
+}
+#else
+static void *benchThread(void *param) {
+	benchWork((BenchThreadData *) param);
+	return NULL;
+}
+#endif
+
+static int compareLatency(void const *a, void const *b) {
+	uint32_t const latencyA = *(uint32_t const *) a;
+	uint32_t const latencyB = *(uint32_t const *) b;
+	return (latencyA > latencyB) - (latencyA < latencyB);
+}
+
+AL2O3_FORCE_INLINE uint32_t percentile(uint32_t const *sorted, uint64_t count, double fraction) {
+	uint64_t const index = (uint64_t) (fraction * (double) count);
+	return sorted[(index < count) ? index : count - 1];
+}
+
+static void summarise(uint32_t *latencies, uint64_t count, uint64_t wallNs, BenchResult *result) {
+	qsort(latencies, (size_t) count, sizeof(uint32_t), &compareLatency);
+	uint64_t total = 0;
+	for (uint64_t i = 0; i < count; ++i) {
+		total += latencies[i];
+	}
+	result->ops = count;
+	result->opsPerSec = wallNs ? (double) count * 1e9 / (double) wallNs : 0.0;
+	result->meanNs = count ? (double) total / (double) count : 0.0;
+	result->p50 = percentile(latencies, count, 0.5);
+	result->p90 = percentile(latencies, count, 0.9);
+	result->p99 = percentile(latencies, count, 0.99);
+	result->p999 = percentile(latencies, count, 0.999);
+	result->max = latencies[count - 1];
+}
+
+static void writeResult(FILE *out, BenchResult const *result) {
+	fprintf(out, "{\"ops\": %llu, \"ops_per_sec\": %.0f, \"mean_ns\": %.1f, \"p50_ns\": %u, \"p90_ns\": %u, "
+							 "\"p99_ns\": %u, \"p999_ns\": %u, \"max_ns\": %u}",
+					(unsigned long long) result->ops, result->opsPerSec, result->meanNs,
+					result->p50, result->p90, result->p99, result->p999, result->max);
+}
+
+// one op, size range and thread count, false if anything failed
+static bool benchRun(FILE *out, bool first, BenchRun *run, char const *level, uint32_t threads, uint32_t targetOps) {
+	// keep the working set in budget, big blocks get fewer slots (but always one)
+	size_t const perThread = benchWorkingSetBudget / threads;
+	size_t slots = perThread / run->sizes->maxSize;
+	slots = (slots < 1) ? 1 : ((slots > benchMaxSlots) ? benchMaxSlots : slots);
+	run->slots = (uint32_t) slots;
+	run->rounds = (targetOps / run->slots) ? targetOps / run->slots : 1;
+	// huge blocks are mapped and unmapped each time, a few rounds is plenty
+	if (run->sizes->minSize >= 1024 * 1024 && run->rounds > 8) {
+		run->rounds = 8;
+	}
+
+	uint64_t const perThreadOps = (uint64_t) run->slots * run->rounds;
+	BenchThreadData *data = (BenchThreadData *) Memory_PlatformAllocator.calloc(threads, sizeof(BenchThreadData));
+	uint32_t *allocNs = (uint32_t *) Memory_PlatformAllocator.malloc(perThreadOps * threads * sizeof(uint32_t));
+	uint32_t *freeNs = (uint32_t *) Memory_PlatformAllocator.malloc(perThreadOps * threads * sizeof(uint32_t));
+	BenchThread *handles = (BenchThread *) Memory_PlatformAllocator.calloc(threads, sizeof(BenchThread));
+	bool ok = data && allocNs && freeNs && handles;
+	for (uint32_t i = 0; ok && i < threads; ++i) {
+		data[i].run = run;
+		data[i].seed = 0x9E3779B9u * (i + 1);
+		data[i].allocNs = allocNs + perThreadOps * i;
+		data[i].freeNs = freeNs + perThreadOps * i;
+	}
+
+	if (ok && threads == 1) {
+		benchWork(&data[0]);
+	} else if (ok) {
+		uint32_t started = 0;
+		for (; started < threads; ++started) {
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+			handles[started] = CreateThread(NULL, 0, &benchThread, &data[started], 0, NULL);
+			if (handles[started] == NULL) {
+				break;
+			}
+#else
+			if (pthread_create(&handles[started], NULL, &benchThread, &data[started]) != 0) {
+				break;
+			}
+#endif
+		}
+		for (uint32_t i = 0; i < started; ++i) {
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+			WaitForSingleObject(handles[i], INFINITE);
+			CloseHandle(handles[i]);
+#else
+			pthread_join(handles[i], NULL);
+#endif
+		}
+		ok = started == threads;
+	}
+
+	uint64_t startNs = ~0ull;
+	uint64_t endNs = 0;
+	for (uint32_t i = 0; ok && i < threads; ++i) {
+		ok = !data[i].failed;
+		startNs = (data[i].startNs < startNs) ? data[i].startNs : startNs;
+		endNs = (data[i].endNs > endNs) ? data[i].endNs : endNs;
+	}
+	if (ok) {
+		BenchResult allocResult, freeResult;
+		summarise(allocNs, perThreadOps * threads, endNs - startNs, &allocResult);
+		summarise(freeNs, perThreadOps * threads, endNs - startNs, &freeResult);
+		fprintf(out, "%s\n    {\"level\": \"%s\", \"op\": \"%s\", \"sizes\": \"%s\", \"min_size\": %zu, \"max_size\": %zu, "
+								 "\"threads\": %u, \"working_set\": %u, \"wall_ns\": %llu,\n     \"alloc\": ",
+						first ? "" : ",", level, g_opNames[run->op], run->sizes->name, run->sizes->minSize, run->sizes->maxSize,
+						threads, run->slots, (unsigned long long) (endNs - startNs));
+		writeResult(out, &allocResult);
+		fprintf(out, ",\n     \"free\": ");
+		writeResult(out, &freeResult);
+		fprintf(out, "}");
+		fflush(out);
+	} else {
+		LOGERROR("%s %s with %u threads failed", g_opNames[run->op], run->sizes->name, threads);
+	}
+
+	Memory_PlatformAllocator.free(data);
+	Memory_PlatformAllocator.free(allocNs);
+	Memory_PlatformAllocator.free(freeNs);
+	Memory_PlatformAllocator.free(handles);
+	return ok;
+}
+
+static void usage() {
+	printf("usage: al2o3_memory_bench [--allocator global|platform|small] [--max-threads n] [--quick] [--out file]\n");
+}
+
+int main(int argc, char const *argv[]) {
+	char const *allocatorName = "global";
+	Memory_Allocator const *allocator = &Memory_GlobalAllocator;
+	uint32_t maxThreads = coreCount();
+	uint32_t targetOps = benchTargetOps;
+	char const *outPath = NULL;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--allocator") == 0 && i + 1 < argc) {
+			allocatorName = argv[++i];
+			if (strcmp(allocatorName, "global") == 0) {
+				allocator = &Memory_GlobalAllocator;
+			} else if (strcmp(allocatorName, "platform") == 0) {
+				allocator = &Memory_PlatformAllocator;
+			} else if (strcmp(allocatorName, "small") == 0) {
+				allocator = &Memory_SmallObjectAllocator;
+			} else {
+				usage();
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--max-threads") == 0 && i + 1 < argc) {
+			int const count = atoi(argv[++i]);
+			maxThreads = (count > 0) ? (uint32_t) count : 1;
+		} else if (strcmp(argv[i], "--quick") == 0) {
+			targetOps = benchQuickTargetOps;
+		} else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+			outPath = argv[++i];
+		} else {
+			usage();
+			return 1;
+		}
+	}
+	FILE *out = outPath ? fopen(outPath, "w") : stdout;
+	if (out == NULL) {
+		LOGERROR("Unable to open %s", outPath);
+		return 1;
+	}
+
+	// only the global allocator is tracked, and only a tracking build can change level
+	bool const tracking = Memory_TrackerGetSampleRate() != 0;
+	Memory_TrackingLevel const startLevel = Memory_TrackerGetLevel();
+	Memory_TrackingLevel firstLevel = startLevel;
+	Memory_TrackingLevel lastLevel = startLevel;
+	if (tracking && allocator == &Memory_GlobalAllocator) {
+		firstLevel = Memory_TrackingLevel_Off;
+		lastLevel = Memory_TrackingLevel_Full;
+	}
+
+	BenchRun run;
+	memset(&run, 0, sizeof(BenchRun));
+	run.allocator = allocator;
+	run.overhead = timerOverhead();
+
+	fprintf(out, "{\"allocator\": \"%s\", \"tracking_build\": %s, \"cores\": %u, \"timer_overhead_ns\": %llu,\n  \"results\": [",
+					allocatorName, tracking ? "true" : "false", coreCount(), (unsigned long long) run.overhead);
+	bool first = true;
+	bool ok = true;
+	for (uint32_t level = firstLevel; level <= lastLevel; ++level) {
+		Memory_TrackerSetLevel((Memory_TrackingLevel) level);
+		char const *levelName = (allocator == &Memory_GlobalAllocator) ? g_levelNames[level] : "untracked";
+		for (uint32_t op = 0; op < BENCH_OP_COUNT; ++op) {
+			run.op = (BenchOp) op;
+			for (uint32_t sizes = 0; sizes < benchSizesCount; ++sizes) {
+				run.sizes = &g_sizes[sizes];
+				// powers of 2 then all the cores
+				for (uint32_t threads = 1;; threads *= 2) {
+					threads = (threads > maxThreads) ? maxThreads : threads;
+					if (benchRun(out, first, &run, levelName, threads, targetOps)) {
+						first = false;
+					} else {
+						ok = false;
+					}
+					if (threads == maxThreads) {
+						break;
+					}
+				}
+			}
+		}
+	}
+	Memory_TrackerSetLevel(startLevel);
+	fprintf(out, "\n  ]\n}\n");
+	if (outPath) {
+		fclose(out);
+	}
+	return ok ? 0 : 1;
+}
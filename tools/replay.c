@@ -0,0 +1,809 @@
+// License Summary: MIT see LICENSE file
+#include "al2o3_platform/platform.h"
+#include "al2o3_memory/memory.h"
+
+// Replays a trace recorded by Memory_TraceStart against one of the library
+// allocators and reports how it did. Events from every thread are replayed in
+// time order on a single thread, with frees first when times tie so a reused
+// address is free before it's allocated again. Frees, reallocs and expands of
+// addresses the trace never allocated (made before it started) are skipped.
+// Each allocation is made from the source location it had in the trace, so a
+// tracking build sees the same callsites. Run one allocator per process, RSS
+// can't be separated otherwise.
+//
+// usage: al2o3_memory_replay [--allocator global|platform|small]
+//                            [--level off|stats|sampled|full] [--no-touch] trace
+
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#if AL2O3_PLATFORM_OS == AL2O3_OS_OSX
+#include <mach/mach.h>
+#endif
+#endif
+
+// must match the format written by src/trace.c
+#define TRACE_FILE_END 0
+#define TRACE_ALLOC 1
+#define TRACE_AALLOC 2
+#define TRACE_CALLOC 3
+#define TRACE_REALLOC 4
+#define TRACE_EXPAND 5
+#define TRACE_FREE 6
+#define TRACE_FILE_SRCLOC 16
+#define TRACE_FILE_THREAD 17
+#define TRACE_FILE_VERSION 1
+#define TRACE_TYPE_COUNT 7
+
+// how often (in ops) the resident set is sampled, as well as at each new peak of live bytes
+#define rssSampleInterval 256u
+
+static char const *const g_typeNames[TRACE_TYPE_COUNT] = {
+		"", "malloc", "aalloc", "calloc", "realloc", "expand", "free"
+};
+
+typedef struct ReplayOp {
+	uint64_t ns;
+	uint64_t address;
+	uint64_t oldAddress;
+	uint64_t size;
+	uint32_t align;
+	uint32_t type;
+	uint32_t thread;
+	uint32_t srcLoc; // index into the traces source locations, 0 is unknown
+	uint32_t order; // position in the file, keeps the sort stable
+} ReplayOp;
+
+typedef struct Trace {
+	ReplayOp *ops;
+	uint64_t opCount;
+	Memory_SrcLoc *srcLocs; // never freed, the tracker keeps pointers to them
+	uint32_t srcLocCount;
+	char *strings; // for the source locations
+	size_t stringsUsed;
+} Trace;
+
+typedef struct LiveBlock {
+	uint64_t address; // the traced address, 0 is an empty slot
+	void *ptr;
+	size_t size;
+	size_t usable;
+} LiveBlock;
+
+typedef struct LiveMap {
+	LiveBlock *slots;
+	uint32_t capacity; // always a power of 2
+	uint32_t count;
+} LiveMap;
+
+typedef struct Latencies {
+	uint32_t *ns;
+	uint64_t count;
+	uint64_t total;
+} Latencies;
+
+// the tools own bookkeeping is mapped straight from the OS, so it never leaves
+// holes in the heap for the allocator being measured to reuse
+#define toolHeaderSize 64u
+
+static void *toolAlloc(size_t size) {
+	uint8_t *mem = (uint8_t *) Memory_VirtualReserve(size + toolHeaderSize);
+	if (mem == NULL || !Memory_VirtualCommit(mem, size + toolHeaderSize)) {
+		LOGERROR("Out of memory");
+		exit(1);
+	}
+	*(size_t *) mem = size;
+	return mem + toolHeaderSize;
+}
+
+static void toolFree(void *ptr) {
+	if (ptr) {
+		uint8_t *mem = (uint8_t *) ptr - toolHeaderSize;
+		Memory_VirtualRelease(mem, *(size_t *) mem + toolHeaderSize);
+	}
+}
+
+static void *toolRealloc(void *ptr, size_t size) {
+	void *mem = toolAlloc(size);
+	if (ptr) {
+		size_t const oldSize = *(size_t *) ((uint8_t *) ptr - toolHeaderSize);
+		memcpy(mem, ptr, (oldSize < size) ? oldSize : size);
+		toolFree(ptr);
+	}
+	return mem;
+}
+
+#if AL2O3_PLATFORM == AL2O3_PLATFORM_WINDOWS
+static uint64_t nowNs() {
+	static LARGE_INTEGER frequency;
+	if (frequency.QuadPart == 0) {
+		QueryPerformanceFrequency(&frequency);
+	}
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (uint64_t) ((double) counter.QuadPart * 1e9 / (double) frequency.QuadPart);
+}
+
+static uint64_t currentRss() {
+	PROCESS_MEMORY_COUNTERS counters;
+	return GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) ? counters.WorkingSetSize : 0;
+}
+
+static uint64_t peakRss() {
+	PROCESS_MEMORY_COUNTERS counters;
+	return GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) ? counters.PeakWorkingSetSize : 0;
+}
+#else
+static uint64_t nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t currentRss() {
+#if AL2O3_PLATFORM_OS == AL2O3_OS_OSX
+	mach_task_basic_info_data_t info;
+	mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+	if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t) &info, &count) != KERN_SUCCESS) {
+		return 0;
+	}
+	return info.resident_size;
+#else
+	FILE *file = fopen("/proc/self/statm", "r");
+	if (file == NULL) {
+		return 0;
+	}
+	unsigned long long size = 0, resident = 0;
+	int const got = fscanf(file, "%llu %llu", &size, &resident);
+	fclose(file);
+	return (got == 2) ? resident * (uint64_t) sysconf(_SC_PAGESIZE) : 0;
+#endif
+}
+
+static uint64_t peakRss() {
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) {
+		return 0;
+	}
+#if AL2O3_PLATFORM_OS == AL2O3_OS_OSX
+	return (uint64_t) usage.ru_maxrss;
+#else
+	return (uint64_t) usage.ru_maxrss * 1024u;
+#endif
+}
+#endif
+
+static bool readVarint(uint8_t const *data, size_t size, size_t *pos, uint64_t *value) {
+	uint64_t result = 0;
+	for (uint32_t shift = 0; shift < 64; shift += 7) {
+		if (*pos >= size) {
+			return false;
+		}
+		uint8_t const byte = data[(*pos)++];
+		result |= (uint64_t) (byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0) {
+			*value = result;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool readDelta(uint8_t const *data, size_t size, size_t *pos, uint64_t from, uint64_t *value) {
+	uint64_t zigzag;
+	if (!readVarint(data, size, pos, &zigzag)) {
+		return false;
+	}
+	*value = from + (uint64_t) ((int64_t) (zigzag >> 1) ^ -(int64_t) (zigzag & 1));
+	return true;
+}
+
+static uint8_t *loadFile(char const *path, size_t *size) {
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		LOGERROR("Unable to open %s", path);
+		return NULL;
+	}
+	fseek(file, 0, SEEK_END);
+	long const length = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	if (length <= 0) {
+		fclose(file);
+		LOGERROR("Unable to read %s", path);
+		return NULL;
+	}
+	uint8_t *data = (uint8_t *) toolAlloc((size_t) length);
+	*size = fread(data, 1, (size_t) length, file);
+	fclose(file);
+	return data;
+}
+
+// the strings can't be longer than the file, so they all fit in one block that size
+static char *copyString(Trace *trace, uint8_t const *data, uint64_t length) {
+	char *str = trace->strings + trace->stringsUsed;
+	memcpy(str, data, (size_t) length);
+	str[length] = 0;
+	trace->stringsUsed += (size_t) length + 1;
+	return str;
+}
+
+// ids are handed out in order, but anything else is still handled
+static bool addSrcLoc(Trace *trace, uint64_t id, uint64_t line, char *file, char *func) {
+	if (id == 0 || id > 0xFFFFFFull) {
+		return false;
+	}
+	if (id >= trace->srcLocCount) {
+		uint32_t const count = (uint32_t) id + 1 + trace->srcLocCount;
+		trace->srcLocs = (Memory_SrcLoc *) toolRealloc(trace->srcLocs, count * sizeof(Memory_SrcLoc));
+		trace->srcLocCount = count;
+	}
+	Memory_SrcLoc *loc = &trace->srcLocs[id];
+	loc->sourceFile = file;
+	loc->sourceFunc = func;
+	loc->sourceLine = (uint32_t) line;
+	loc->id = 0;
+	return true;
+}
+
+// decodes every event in the file, false if it isn't a trace
+static bool decodeTrace(uint8_t const *data, size_t size, Trace *trace) {
+	size_t pos = 8;
+	uint64_t version;
+	memset(trace, 0, sizeof(Trace));
+	if (size < 9 || memcmp(data, "AL2OMTRC", 8) != 0 || !readVarint(data, size, &pos, &version)) {
+		LOGERROR("Not an allocation trace");
+		return false;
+	}
+	if (version != TRACE_FILE_VERSION) {
+		LOGERROR("Trace version %llu isn't supported", (unsigned long long) version);
+		return false;
+	}
+	trace->strings = (char *) toolAlloc(size);
+
+	uint64_t capacity = 1024;
+	uint64_t count = 0;
+	ReplayOp *ops = (ReplayOp *) toolAlloc(capacity * sizeof(ReplayOp));
+	uint64_t lastNs = 0;
+	uint64_t lastAddress = 0;
+	uint64_t thread = 0;
+	bool ended = false;
+	bool ok = true;
+	while (ok && !ended && pos < size) {
+		uint8_t const type = data[pos++];
+		switch (type) {
+			case TRACE_FILE_END: ended = true;
+				continue;
+			case TRACE_FILE_THREAD: ok = readVarint(data, size, &pos, &thread);
+				continue;
+			case TRACE_FILE_SRCLOC: {
+				uint64_t id, line, fileLength, funcLength;
+				ok = readVarint(data, size, &pos, &id) && readVarint(data, size, &pos, &line) &&
+						readVarint(data, size, &pos, &fileLength) && fileLength <= size - pos;
+				if (ok) {
+					char *file = copyString(trace, data + pos, fileLength);
+					pos += fileLength;
+					ok = readVarint(data, size, &pos, &funcLength) && funcLength <= size - pos;
+					if (ok) {
+						ok = addSrcLoc(trace, id, line, file, copyString(trace, data + pos, funcLength));
+						pos += funcLength;
+					}
+				}
+				continue;
+			}
+			case TRACE_ALLOC:
+			case TRACE_AALLOC:
+			case TRACE_CALLOC:
+			case TRACE_REALLOC:
+			case TRACE_EXPAND:
+			case TRACE_FREE:
+				break;
+			default: LOGERROR("Unknown trace record %u at offset %zu", type, pos - 1);
+				ok = false;
+				continue;
+		}
+
+		if (count == capacity) {
+			capacity *= 2;
+			ops = (ReplayOp *) toolRealloc(ops, capacity * sizeof(ReplayOp));
+		}
+		ReplayOp *op = &ops[count];
+		memset(op, 0, sizeof(ReplayOp));
+		op->type = type;
+		op->thread = (uint32_t) thread;
+		op->order = (uint32_t) count;
+		ok = readDelta(data, size, &pos, lastNs, &op->ns) && readDelta(data, size, &pos, lastAddress, &op->address);
+		lastNs = op->ns;
+		lastAddress = op->address;
+		uint64_t align = 0;
+		uint64_t srcLoc = 0;
+		switch (type) {
+			case TRACE_ALLOC:
+			case TRACE_CALLOC: ok = ok && readVarint(data, size, &pos, &op->size) && readVarint(data, size, &pos, &srcLoc);
+				break;
+			case TRACE_AALLOC:
+				ok = ok && readVarint(data, size, &pos, &op->size) && readVarint(data, size, &pos, &align) &&
+						readVarint(data, size, &pos, &srcLoc);
+				break;
+			case TRACE_REALLOC:
+				ok = ok && readDelta(data, size, &pos, op->address, &op->oldAddress) && readVarint(data, size, &pos, &op->size) &&
+						readVarint(data, size, &pos, &align) && readVarint(data, size, &pos, &srcLoc);
+				break;
+			case TRACE_EXPAND: ok = ok && readVarint(data, size, &pos, &op->size);
+				break;
+			default: break;
+		}
+		op->align = (uint32_t) align;
+		// a srcloc is always defined before it's used
+		ok = ok && (srcLoc == 0 || (srcLoc < trace->srcLocCount && trace->srcLocs[srcLoc].sourceFile));
+		op->srcLoc = (uint32_t) srcLoc;
+		count++;
+	}
+	if (!ok) {
+		LOGERROR("Trace is corrupt at offset %zu", pos);
+		toolFree(ops);
+		return false;
+	}
+	if (!ended) {
+		LOGWARNING("Trace has no end record, it may be truncated");
+	}
+	trace->ops = ops;
+	trace->opCount = count;
+	return true;
+}
+
+static int compareOps(void const *a, void const *b) {
+	ReplayOp const *opA = (ReplayOp const *) a;
+	ReplayOp const *opB = (ReplayOp const *) b;
+	if (opA->ns != opB->ns) {
+		return (opA->ns < opB->ns) ? -1 : 1;
+	}
+	// on a tie the free goes first, the address may be about to be reused
+	bool const freeA = opA->type == TRACE_FREE;
+	bool const freeB = opB->type == TRACE_FREE;
+	if (freeA != freeB) {
+		return freeA ? -1 : 1;
+	}
+	return (opA->order < opB->order) ? -1 : (opA->order > opB->order);
+}
+
+AL2O3_FORCE_INLINE uint32_t hashAddress(uint64_t address) {
+	return (uint32_t) ((address >> 4) * 0x9E3779B97F4A7C15ull >> 32);
+}
+
+static LiveBlock *findLive(LiveMap *map, uint64_t address) {
+	if (map->capacity == 0) {
+		return NULL;
+	}
+	uint32_t const mask = map->capacity - 1;
+	uint32_t slot = hashAddress(address) & mask;
+	while (map->slots[slot].address) {
+		if (map->slots[slot].address == address) {
+			return &map->slots[slot];
+		}
+		slot = (slot + 1) & mask;
+	}
+	return NULL;
+}
+
+static void insertLive(LiveMap *map, LiveBlock const *block) {
+	if ((map->count + 1) * 2 > map->capacity) {
+		uint32_t const capacity = map->capacity ? map->capacity * 2 : 4096;
+		LiveBlock *slots = (LiveBlock *) toolAlloc(capacity * sizeof(LiveBlock));
+		for (uint32_t i = 0; i < map->capacity; ++i) {
+			if (map->slots[i].address) {
+				uint32_t slot = hashAddress(map->slots[i].address) & (capacity - 1);
+				while (slots[slot].address) {
+					slot = (slot + 1) & (capacity - 1);
+				}
+				slots[slot] = map->slots[i];
+			}
+		}
+		toolFree(map->slots);
+		map->slots = slots;
+		map->capacity = capacity;
+	}
+	uint32_t const mask = map->capacity - 1;
+	uint32_t slot = hashAddress(block->address) & mask;
+	while (map->slots[slot].address) {
+		slot = (slot + 1) & mask;
+	}
+	map->slots[slot] = *block;
+	map->count++;
+}
+
+// shifts the rest of the run back so lookups never need tombstones
+static void removeLive(LiveMap *map, LiveBlock *block) {
+	uint32_t const mask = map->capacity - 1;
+	uint32_t hole = (uint32_t) (block - map->slots);
+	uint32_t slot = hole;
+	map->slots[hole].address = 0;
+	for (;;) {
+		slot = (slot + 1) & mask;
+		if (map->slots[slot].address == 0) {
+			break;
+		}
+		uint32_t const home = hashAddress(map->slots[slot].address) & mask;
+		if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+			map->slots[hole] = map->slots[slot];
+			map->slots[slot].address = 0;
+			hole = slot;
+		}
+	}
+	map->count--;
+}
+
+static int compareLatency(void const *a, void const *b) {
+	uint32_t const latencyA = *(uint32_t const *) a;
+	uint32_t const latencyB = *(uint32_t const *) b;
+	return (latencyA > latencyB) - (latencyA < latencyB);
+}
+
+static uint32_t percentile(Latencies const *latencies, double fraction) {
+	uint64_t index = (uint64_t) (fraction * (double) latencies->count);
+	return latencies->ns[(index < latencies->count) ? index : latencies->count - 1];
+}
+
+// the cheapest back to back reading, taken off every sample
+static uint64_t timerOverhead() {
+	uint64_t best = ~0ull;
+	for (int i = 0; i < 1000; ++i) {
+		uint64_t const start = nowNs();
+		uint64_t const elapsed = nowNs() - start;
+		best = (elapsed < best) ? elapsed : best;
+	}
+	return best;
+}
+
+typedef struct Replay {
+	Memory_Allocator const *allocator;
+	Memory_SrcLoc *srcLocs;
+	bool touch;
+	uint64_t overhead;
+	LiveMap live;
+	Latencies latencies[TRACE_TYPE_COUNT];
+	uint64_t liveBytes;
+	uint64_t liveUsable;
+	uint64_t peakLiveBytes;
+	uint64_t peakLiveUsable; // at the same moment as peakLiveBytes
+	uint64_t baselineRss;
+	uint64_t peakRssGrowth;
+	uint64_t unknown; // ops on addresses the trace never allocated
+	uint64_t reused; // allocs of an address that was never freed
+	uint64_t failed;
+	uint64_t expandFallbacks;
+} Replay;
+
+// for allocations the trace has no location for
+static Memory_SrcLoc g_replaySrcLoc = { __FILE__, "replayOp", __LINE__, 0 };
+
+AL2O3_FORCE_INLINE void pushSrcLoc(Replay *replay, uint32_t srcLoc) {
+	Memory_TrackerPushSrcLoc(srcLoc ? &replay->srcLocs[srcLoc] : &g_replaySrcLoc);
+}
+
+AL2O3_FORCE_INLINE void recordLatency(Replay *replay, uint32_t type, uint64_t start, uint64_t end) {
+	uint64_t elapsed = end - start;
+	elapsed = (elapsed > replay->overhead) ? elapsed - replay->overhead : 0;
+	Latencies *latencies = &replay->latencies[type];
+	latencies->ns[latencies->count++] = (elapsed > 0xFFFFFFFFull) ? 0xFFFFFFFFu : (uint32_t) elapsed;
+	latencies->total += elapsed;
+}
+
+static void sampleRss(Replay *replay) {
+	uint64_t const rss = currentRss();
+	if (rss > replay->baselineRss && rss - replay->baselineRss > replay->peakRssGrowth) {
+		replay->peakRssGrowth = rss - replay->baselineRss;
+	}
+}
+
+static void addLive(Replay *replay, uint64_t address, void *ptr, size_t size) {
+	LiveBlock block;
+	block.address = address;
+	block.ptr = ptr;
+	block.size = size;
+	block.usable = Memory_AllocatorUsableSize(replay->allocator, ptr);
+	insertLive(&replay->live, &block);
+	replay->liveBytes += size;
+	replay->liveUsable += block.usable;
+	if (replay->liveBytes > replay->peakLiveBytes) {
+		replay->peakLiveBytes = replay->liveBytes;
+		replay->peakLiveUsable = replay->liveUsable;
+	}
+}
+
+static void dropLive(Replay *replay, LiveBlock *block) {
+	replay->liveBytes -= block->size;
+	replay->liveUsable -= block->usable;
+	removeLive(&replay->live, block);
+}
+
+static void freeLive(Replay *replay, LiveBlock *block) {
+	void *ptr = block->ptr;
+	dropLive(replay, block);
+	replay->allocator->free(ptr);
+}
+
+// writing the block is what makes the pages resident, as the real program would have
+static void touch(Replay *replay, void *ptr, size_t from, size_t to) {
+	if (replay->touch && ptr && to > from) {
+		memset((uint8_t *) ptr + from, 0xA5, to - from);
+	}
+}
+
+static void replayOp(Replay *replay, ReplayOp const *op) {
+	Memory_Allocator const *allocator = replay->allocator;
+	size_t const size = (size_t) op->size;
+	uint64_t start, end;
+	void *ptr = NULL;
+
+	switch (op->type) {
+		case TRACE_ALLOC:
+		case TRACE_AALLOC:
+		case TRACE_CALLOC: {
+			LiveBlock *old = findLive(&replay->live, op->address);
+			if (old) {
+				replay->reused++;
+				freeLive(replay, old);
+			}
+			pushSrcLoc(replay, op->srcLoc);
+			start = nowNs();
+			if (op->type == TRACE_ALLOC) {
+				ptr = allocator->malloc(size);
+			} else if (op->type == TRACE_AALLOC) {
+				ptr = allocator->aalloc(size, op->align);
+			} else {
+				ptr = allocator->calloc(1, size);
+			}
+			end = nowNs();
+			recordLatency(replay, op->type, start, end);
+			if (ptr == NULL) {
+				replay->failed++;
+				return;
+			}
+			touch(replay, ptr, 0, size);
+			addLive(replay, op->address, ptr, size);
+			return;
+		}
+		case TRACE_REALLOC: {
+			LiveBlock *old = op->oldAddress ? findLive(&replay->live, op->oldAddress) : NULL;
+			if (op->oldAddress && old == NULL) {
+				replay->unknown++;
+			}
+			void *oldPtr = old ? old->ptr : NULL;
+			size_t const oldSize = old ? old->size : 0;
+			pushSrcLoc(replay, op->srcLoc);
+			start = nowNs();
+			if (op->align > 16) {
+				ptr = Memory_AllocatorArealloc(allocator, oldPtr, size, op->align);
+			} else {
+				ptr = allocator->realloc(oldPtr, size);
+			}
+			end = nowNs();
+			recordLatency(replay, op->type, start, end);
+			if (ptr == NULL) {
+				replay->failed++;
+				return;
+			}
+			if (old) {
+				dropLive(replay, old);
+			}
+			LiveBlock *clash = findLive(&replay->live, op->address);
+			if (clash) {
+				replay->reused++;
+				freeLive(replay, clash);
+			}
+			touch(replay, ptr, oldSize, size);
+			addLive(replay, op->address, ptr, size);
+			return;
+		}
+		case TRACE_EXPAND: {
+			LiveBlock *block = findLive(&replay->live, op->address);
+			if (block == NULL) {
+				replay->unknown++;
+				return;
+			}
+			ptr = block->ptr;
+			size_t const oldSize = block->size;
+			start = nowNs();
+			bool const expanded = Memory_AllocatorTryExpandInPlace(allocator, ptr, size);
+			end = nowNs();
+			recordLatency(replay, op->type, start, end);
+			dropLive(replay, block);
+			if (!expanded) {
+				// this allocator can't, so pay what moving costs instead
+				replay->expandFallbacks++;
+				pushSrcLoc(replay, 0);
+				void *moved = allocator->realloc(ptr, size);
+				if (moved == NULL) {
+					replay->failed++;
+					allocator->free(ptr);
+					return;
+				}
+				ptr = moved;
+			}
+			touch(replay, ptr, oldSize, size);
+			addLive(replay, op->address, ptr, size);
+			return;
+		}
+		case TRACE_FREE: {
+			LiveBlock *block = findLive(&replay->live, op->address);
+			if (block == NULL) {
+				replay->unknown++;
+				return;
+			}
+			ptr = block->ptr;
+			dropLive(replay, block);
+			start = nowNs();
+			allocator->free(ptr);
+			end = nowNs();
+			recordLatency(replay, op->type, start, end);
+			return;
+		}
+		default: return;
+	}
+}
+
+static void usage() {
+	printf("usage: al2o3_memory_replay [--allocator global|platform|small] [--level off|stats|sampled|full] [--no-touch] trace\n");
+}
+
+int main(int argc, char const *argv[]) {
+	char const *path = NULL;
+	char const *allocatorName = "global";
+	Memory_Allocator const *allocator = &Memory_GlobalAllocator;
+	bool touchBlocks = true;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--allocator") == 0 && i + 1 < argc) {
+			allocatorName = argv[++i];
+			if (strcmp(allocatorName, "global") == 0) {
+				allocator = &Memory_GlobalAllocator;
+			} else if (strcmp(allocatorName, "platform") == 0) {
+				allocator = &Memory_PlatformAllocator;
+			} else if (strcmp(allocatorName, "small") == 0) {
+				allocator = &Memory_SmallObjectAllocator;
+			} else {
+				usage();
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--level") == 0 && i + 1 < argc) {
+			char const *level = argv[++i];
+			if (strcmp(level, "off") == 0) {
+				Memory_TrackerSetLevel(Memory_TrackingLevel_Off);
+			} else if (strcmp(level, "stats") == 0) {
+				Memory_TrackerSetLevel(Memory_TrackingLevel_Stats);
+			} else if (strcmp(level, "sampled") == 0) {
+				Memory_TrackerSetLevel(Memory_TrackingLevel_Sampled);
+			} else if (strcmp(level, "full") == 0) {
+				Memory_TrackerSetLevel(Memory_TrackingLevel_Full);
+			} else {
+				usage();
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--no-touch") == 0) {
+			touchBlocks = false;
+		} else if (argv[i][0] != '-' && path == NULL) {
+			path = argv[i];
+		} else {
+			usage();
+			return 1;
+		}
+	}
+	if (path == NULL) {
+		usage();
+		return 1;
+	}
+
+	size_t fileSize;
+	uint8_t *data = loadFile(path, &fileSize);
+	if (data == NULL) {
+		return 1;
+	}
+	Trace trace;
+	bool const decoded = decodeTrace(data, fileSize, &trace);
+	toolFree(data);
+	if (!decoded) {
+		return 1;
+	}
+	ReplayOp *ops = trace.ops;
+	uint64_t const opCount = trace.opCount;
+	qsort(ops, (size_t) opCount, sizeof(ReplayOp), &compareOps);
+
+	Replay replay;
+	memset(&replay, 0, sizeof(Replay));
+	replay.allocator = allocator;
+	replay.srcLocs = trace.srcLocs;
+	replay.touch = touchBlocks;
+	replay.overhead = timerOverhead();
+	uint64_t typeCounts[TRACE_TYPE_COUNT] = { 0 };
+	for (uint64_t i = 0; i < opCount; ++i) {
+		typeCounts[ops[i].type]++;
+	}
+	// written now so filling them in doesn't count as RSS growth
+	for (uint32_t i = 0; i < TRACE_TYPE_COUNT; ++i) {
+		size_t const size = (size_t) (typeCounts[i] ? typeCounts[i] : 1) * sizeof(uint32_t);
+		replay.latencies[i].ns = (uint32_t *) toolAlloc(size);
+		memset(replay.latencies[i].ns, 0, size);
+	}
+	replay.baselineRss = currentRss();
+
+	uint64_t const replayStart = nowNs();
+	uint64_t sampledPeak = 0;
+	for (uint64_t i = 0; i < opCount; ++i) {
+		replayOp(&replay, &ops[i]);
+		if ((i % rssSampleInterval) == 0 || replay.peakLiveBytes != sampledPeak) {
+			sampleRss(&replay);
+			sampledPeak = replay.peakLiveBytes;
+		}
+	}
+	uint64_t const replayNs = nowNs() - replayStart;
+	uint64_t const liveAtEnd = replay.live.count;
+	sampleRss(&replay);
+
+	printf("trace %s, %llu ops replayed with the %s allocator\n", path, (unsigned long long) opCount, allocatorName);
+	printf("%-8s %10s %10s %8s %8s %8s %8s %10s %12s\n", "op", "count", "mean ns", "p50", "p90", "p99", "p99.9", "max", "ops/s");
+	uint64_t totalOps = 0;
+	uint64_t totalNs = 0;
+	for (uint32_t type = TRACE_ALLOC; type < TRACE_TYPE_COUNT; ++type) {
+		Latencies *latencies = &replay.latencies[type];
+		if (latencies->count == 0) {
+			continue;
+		}
+		qsort(latencies->ns, (size_t) latencies->count, sizeof(uint32_t), &compareLatency);
+		double const seconds = (double) latencies->total / 1e9;
+		printf("%-8s %10llu %10.1f %8u %8u %8u %8u %10u %12.0f\n",
+					 g_typeNames[type],
+					 (unsigned long long) latencies->count,
+					 (double) latencies->total / (double) latencies->count,
+					 percentile(latencies, 0.5),
+					 percentile(latencies, 0.9),
+					 percentile(latencies, 0.99),
+					 percentile(latencies, 0.999),
+					 latencies->ns[latencies->count - 1],
+					 (seconds > 0.0) ? (double) latencies->count / seconds : 0.0);
+		totalOps += latencies->count;
+		totalNs += latencies->total;
+	}
+	printf("throughput %.0f ops/s in the allocator, %.0f ops/s including replay overhead\n",
+				 totalNs ? (double) totalOps * 1e9 / (double) totalNs : 0.0,
+				 replayNs ? (double) totalOps * 1e9 / (double) replayNs : 0.0);
+
+	printf("peak live %llu bytes requested, %llu usable\n",
+				 (unsigned long long) replay.peakLiveBytes,
+				 (unsigned long long) replay.peakLiveUsable);
+	printf("peak RSS %llu bytes, grew by %llu during the replay\n",
+				 (unsigned long long) peakRss(),
+				 (unsigned long long) replay.peakRssGrowth);
+	// internal is rounding inside blocks, overall is everything the process
+	// holds on to that the program didn't ask for
+	if (replay.peakLiveUsable) {
+		printf("fragmentation internal %.1f%%", 100.0 * (1.0 - (double) replay.peakLiveBytes / (double) replay.peakLiveUsable));
+	} else {
+		printf("fragmentation internal unknown");
+	}
+	if (replay.touch && replay.peakRssGrowth > replay.peakLiveBytes) {
+		printf(", overall %.1f%%\n", 100.0 * (1.0 - (double) replay.peakLiveBytes / (double) replay.peakRssGrowth));
+	} else {
+		printf(", overall unknown\n");
+	}
+	printf("%llu live at the end, %llu unknown addresses skipped, %llu reused without a free, %llu failed, %llu expands moved\n",
+				 (unsigned long long) liveAtEnd,
+				 (unsigned long long) replay.unknown,
+				 (unsigned long long) replay.reused,
+				 (unsigned long long) replay.failed,
+				 (unsigned long long) replay.expandFallbacks);
+
+	for (uint32_t i = 0; i < replay.live.capacity; ++i) {
+		if (replay.live.slots[i].address) {
+			allocator->free(replay.live.slots[i].ptr);
+		}
+	}
+	toolFree(replay.live.slots);
+	for (uint32_t i = 0; i < TRACE_TYPE_COUNT; ++i) {
+		toolFree(replay.latencies[i].ns);
+	}
+	toolFree(ops);
+	return 0;
+}